@@ -0,0 +1,58 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_INTERNAL_CHUNKCACHE_H
+#define KYLA_CORE_INTERNAL_CHUNKCACHE_H
+
+#include "ArrayRef.h"
+#include "FileIO.h"
+#include "Hash.h"
+#include "sql/Database.h"
+
+#include <mutex>
+
+namespace kyla {
+/**
+Persistent cache for chunks fetched from remote repositories.
+
+Chunks are stored as individual files named after their storage hash, and an
+SQLite index tracks their size and last use. Once the cache exceeds its
+maximum size, the least recently used chunks are evicted. Several processes
+can share one cache directory.
+*/
+class ChunkCache final
+{
+public:
+	static constexpr int64 DefaultMaxSize = 4ll << 30;
+
+	ChunkCache (const Path& directory, const int64 maxSize);
+	~ChunkCache ();
+
+	ChunkCache (const ChunkCache&) = delete;
+	ChunkCache& operator= (const ChunkCache&) = delete;
+
+	bool Contains (const SHA256Digest& hash);
+	bool Get (const SHA256Digest& hash, const MutableArrayRef<>& buffer);
+	void Put (const SHA256Digest& hash, const ArrayRef<>& data);
+
+	int64 GetSize ();
+
+private:
+	Path GetChunkPath (const SHA256Digest& hash) const;
+	void Remove (const SHA256Digest& hash);
+	void Evict ();
+
+	std::mutex mutex_;
+	Sql::Database db_;
+	Path directory_;
+	int64 maxSize_;
+};
+}
+
+#endif
@@ -0,0 +1,68 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_INTERNAL_COMPOSITE_REPOSITORY_H
+#define KYLA_CORE_INTERNAL_COMPOSITE_REPOSITORY_H
+
+#include "DeployedRepository.h"
+
+#include <vector>
+
+namespace kyla {
+/**
+A source repository which reads content objects from deployed repositories
+on this machine where possible, and fetches only the remaining ones from the
+primary source.
+
+Everything except the content objects - features, the database and the
+encryption - comes from the primary source. Local copies are checked against
+their hash before they are used, so a modified file in a local repository
+only means the object is fetched from the primary source instead.
+*/
+class CompositeRepository final : public Repository
+{
+public:
+	CompositeRepository (Repository& primary,
+		std::vector<std::unique_ptr<DeployedRepository>>&& localRepositories);
+	~CompositeRepository ();
+
+private:
+	void GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
+		const GetContentObjectsOptions& options,
+		const GetContentObjectCallback& getCallback,
+		ExecutionContext& context) override;
+	void RepairImpl (Repository& source,
+		ExecutionContext& context,
+		RepairCallback repairCallback,
+		bool restore) override;
+	std::vector<Uuid> GetFeaturesImpl () override;
+	int64_t GetFeatureSizeImpl (const Uuid& featureId) override;
+	std::string GetFeatureTitleImpl (const Uuid& featureId) override;
+	std::string GetFeatureDescriptionImpl (const Uuid& featureId) override;
+	void ConfigureImpl (Repository& other,
+		const ArrayRef<Uuid>& features,
+		ExecutionContext& context) override;
+	bool IsEncryptedImpl () override;
+	Sql::Database& GetDatabaseImpl () override;
+	std::vector<Uuid> GetSubfeaturesImpl (const Uuid& featureId) override;
+
+	Repository& primary_;
+	std::vector<std::unique_ptr<DeployedRepository>> localRepositories_;
+};
+
+/**
+Open the deployed repositories listed in the LocalRepositories variable, and
+combine them with source. Returns nullptr if the variable is not set or none
+of the repositories can be opened.
+*/
+std::unique_ptr<Repository> CreateCompositeRepository (Repository& source,
+	Repository::ExecutionContext& context);
+} // namespace kyla
+
+#endif
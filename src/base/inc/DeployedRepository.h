@@ -25,8 +25,16 @@ public:
 		const Path& targetDirectory,
 		ExecutionContext& context);
 
+	/**
+	Deliver a content object from the files deployed in this repository.
+	Returns false if no intact copy is present.
+	*/
+	bool GetLocalContentObject (const SHA256Digest& hash,
+		const GetContentObjectCallback& getCallback);
+
 private:
 	void GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
+		const GetContentObjectsOptions& options,
 		const GetContentObjectCallback& getCallback,
 		ExecutionContext& context) override;
 	void RepairImpl (Repository& source,
@@ -41,6 +49,7 @@ private:
 
 	Sql::Database db_;
 	Path path_;
+	Sql::OpenMode openMode_;
 };
 } // namespace kyla
 
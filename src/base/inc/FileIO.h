@@ -12,6 +12,7 @@ details.
 
 #include <cstdint>
 #include <memory>
+#include <vector>
 
 #include <filesystem>
 
@@ -34,6 +35,14 @@ struct File
 		WriteImpl (data);
 	}
 
+	/**
+	Write data at offset, independent of the current position.
+	*/
+	void WriteAt (const std::int64_t offset, const ArrayRef<>& data)
+	{
+		WriteAtImpl (offset, data);
+	}
+
 	std::int64_t Read (const MutableArrayRef<>& buffer)
 	{
 		return ReadImpl (buffer);
@@ -69,6 +78,15 @@ struct File
 		SetSizeImpl (size);
 	}
 
+	/**
+	Set the size and reserve the disk space for the whole file, so writing
+	it in pieces doesn't fragment it.
+	*/
+	void Preallocate (const std::int64_t size)
+	{
+		PreallocateImpl (size);
+	}
+
 	std::int64_t GetSize () const
 	{
 		return GetSizeImpl ();
@@ -81,6 +99,7 @@ struct File
 
 private:
 	virtual void WriteImpl (const ArrayRef<>& data) = 0;
+	virtual void WriteAtImpl (const std::int64_t offset, const ArrayRef<>& data) = 0;
 	virtual std::int64_t ReadImpl (const MutableArrayRef<>& buffer) = 0;
 
 	virtual void SeekImpl (const std::int64_t offset) = 0;
@@ -89,6 +108,7 @@ private:
 	virtual void UnmapImpl (void* p) = 0;
 
 	virtual void SetSizeImpl (const std::int64_t size) = 0;
+	virtual void PreallocateImpl (const std::int64_t size) = 0;
 	virtual std::int64_t GetSizeImpl () const = 0;
 
 	virtual void CloseImpl () = 0;
@@ -97,6 +117,12 @@ private:
 struct FileStat
 {
 	std::size_t size;
+	// Nanoseconds since the epoch
+	std::int64_t modificationTime = 0;
+	// Last change of the contents or the metadata, only set on Linux
+	std::int64_t changeTime = 0;
+	// Only set on Linux
+	std::uint64_t inode = 0;
 };
 
 FileStat Stat (const Path& path);
@@ -128,6 +154,80 @@ std::unique_ptr<File> CreateFile (const char* path, FileAccess access);
 std::unique_ptr<File> CreateFile (const Path& path);
 std::unique_ptr<File> CreateFile (const Path& path, FileAccess access);
 
+/**
+How DuplicateFile should create the copy.
+*/
+enum class DuplicateMode
+{
+	Copy,
+	/**
+	Create a hard link if possible. Changes to one file affect all links, so
+	this is only safe if the files are never modified in place.
+	*/
+	HardLink
+};
+
+/**
+How DuplicateFile actually created the copy.
+*/
+enum class DuplicateMethod
+{
+	// The copy shares the data blocks of the source
+	Reflink,
+	// The data was copied within the kernel
+	CopyRange,
+	Copy,
+	HardLink
+};
+
+/**
+Copy source to target, overwriting the target. This avoids copying the data
+where the file system allows it.
+*/
+DuplicateMethod DuplicateFile (const Path& source, const Path& target,
+	const DuplicateMode mode = DuplicateMode::Copy);
+
+/**
+Creates and removes many files below a root directory.
+
+On Linux, directories are opened once and files are created and removed
+relative to them, so the kernel doesn't resolve the full path of every file
+again. All functions may be called from several threads at once.
+*/
+class DirectoryTree final
+{
+public:
+	explicit DirectoryTree (const Path& root);
+	~DirectoryTree ();
+
+	DirectoryTree (const DirectoryTree&) = delete;
+	DirectoryTree& operator= (const DirectoryTree&) = delete;
+
+	/**
+	Create a directory relative to the root, including its parents. Every
+	directory is created only once, so this is cheap for directories which
+	were created before.
+	*/
+	void CreateDirectories (const Path& directory);
+
+	/**
+	Create a file relative to the root. Its directory must exist.
+	*/
+	std::unique_ptr<File> CreateFile (const Path& path, FileAccess access);
+
+	/**
+	Remove files relative to the root, on up to threadCount threads. Files
+	which don't exist are skipped.
+	*/
+	void RemoveFiles (const std::vector<Path>& paths, const int threadCount);
+
+private:
+	void RemoveFile (const Path& path);
+
+	struct Impl;
+	std::unique_ptr<Impl> impl_;
+};
+
 Path GetTemporaryFilename ();
 }
 
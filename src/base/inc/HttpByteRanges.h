@@ -0,0 +1,68 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_INTERNAL_HTTPBYTERANGES_H
+#define KYLA_CORE_INTERNAL_HTTPBYTERANGES_H
+
+#include "ArrayRef.h"
+#include "Types.h"
+
+#include <functional>
+#include <string>
+
+namespace kyla {
+bool ParseHttpContentRange (const std::string& value, int64& first, int64& last);
+bool ParseHttpContentRange (const std::string& value, int64& first, int64& last,
+	int64& total);
+bool ParseMultipartBoundary (const std::string& contentType, std::string& boundary);
+
+/**
+Streaming parser for multipart/byteranges response bodies.
+
+The body of each part is passed to the callback together with its offset in
+the remote file, as soon as it has been received. A part can be split into
+several callbacks.
+*/
+class MultipartByteRangesParser final
+{
+public:
+	using PartDataCallback = std::function<void (const int64 offset,
+		const ArrayRef<>& data)>;
+
+	MultipartByteRangesParser (const std::string& boundary,
+		PartDataCallback callback);
+
+	bool Feed (const ArrayRef<>& data);
+
+	bool IsComplete () const;
+
+private:
+	bool Process ();
+
+	enum class State
+	{
+		Boundary,
+		AfterBoundary,
+		Headers,
+		Body,
+		Done,
+		Error
+	};
+
+	State state_ = State::Boundary;
+	std::string delimiter_;
+	std::string pending_;
+	PartDataCallback callback_;
+
+	int64 offset_ = 0;
+	int64 remaining_ = 0;
+};
+}
+
+#endif
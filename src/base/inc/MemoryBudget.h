@@ -0,0 +1,96 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_INTERNAL_MEMORYBUDGET_H
+#define KYLA_CORE_INTERNAL_MEMORYBUDGET_H
+
+#include "Types.h"
+
+#include <condition_variable>
+#include <mutex>
+
+namespace kyla {
+/**
+Tracks the memory used by buffers in flight and blocks when the limit is
+exceeded.
+
+Every stage which allocates a large buffer reserves the size against the
+budget first. Reserve blocks until enough memory has been released by other
+stages, which throttles producers automatically.
+*/
+class MemoryBudget final
+{
+public:
+	static constexpr int64 DefaultLimit = 160 << 20;
+
+	explicit MemoryBudget (const int64 limit = DefaultLimit);
+
+	MemoryBudget (const MemoryBudget&) = delete;
+	MemoryBudget& operator= (const MemoryBudget&) = delete;
+
+	bool Reserve (const int64 size);
+	bool TryReserve (const int64 size);
+	void Release (const int64 size);
+
+	void Cancel ();
+	void Reset ();
+
+	int64 GetLimit () const;
+	int64 GetUsage () const;
+	int64 GetPeakUsage () const;
+
+private:
+	mutable std::mutex mutex_;
+	std::condition_variable conditionVariable_;
+
+	int64 limit_;
+	int64 usage_ = 0;
+	int64 peakUsage_ = 0;
+	bool cancelled_ = false;
+};
+
+/**
+Owns a reservation on a MemoryBudget and releases it on destruction.
+*/
+class MemoryReservation final
+{
+public:
+	MemoryReservation () = default;
+	MemoryReservation (MemoryBudget& budget, const int64 size);
+	~MemoryReservation ();
+
+	static MemoryReservation TryCreate (MemoryBudget& budget, const int64 size);
+
+	MemoryReservation (MemoryReservation&& other) noexcept;
+	MemoryReservation& operator= (MemoryReservation&& other) noexcept;
+
+	MemoryReservation (const MemoryReservation&) = delete;
+	MemoryReservation& operator= (const MemoryReservation&) = delete;
+
+	bool IsValid () const
+	{
+		return budget_ != nullptr;
+	}
+
+	int64 GetSize () const
+	{
+		return size_;
+	}
+
+	MemoryReservation Split (const int64 size);
+	void Shrink (const int64 size);
+	void Release ();
+
+private:
+	MemoryBudget* budget_ = nullptr;
+	int64 size_ = 0;
+};
+}
+
+#endif
@@ -0,0 +1,115 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_INTERNAL_MIRRORED_REPOSITORY_H
+#define KYLA_CORE_INTERNAL_MIRRORED_REPOSITORY_H
+
+#include "PackedRepositoryBase.h"
+#include "sql/Database.h"
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace kyla {
+/**
+Throughput and failures of a set of mirrors, shared by all package files of
+a repository.
+*/
+class MirrorStatistics final
+{
+public:
+	/**
+	A mirror which failed this many times in a row is no longer used, unless
+	all mirrors have failed.
+	*/
+	static constexpr int MaxFailures = 3;
+
+	MirrorStatistics (const int mirrorCount);
+
+	int GetMirrorCount () const;
+
+	/**
+	Estimated throughput in bytes per second, or 0 if the mirror hasn't been
+	used yet.
+	*/
+	double GetThroughput (const int mirror) const;
+	int GetFailureCount (const int mirror) const;
+
+	void RecordTransfer (const int mirror, const int64 size, const double seconds);
+	void RecordFailure (const int mirror);
+
+private:
+	struct Mirror
+	{
+		double throughput = 0;
+		int failures = 0;
+	};
+
+	mutable std::mutex mutex_;
+	std::vector<Mirror> mirrors_;
+};
+
+/**
+A package file which is available from several mirrors.
+
+Ranges are spread across the mirrors according to their measured throughput
+and read concurrently, so the bandwidth adds up. Ranges which fail on one
+mirror are read from the next one. This includes ranges whose chunks don't
+match their hashes, so a mirror which serves corrupted or stale data is
+treated like one which fails.
+*/
+class MirroredPackageFile final : public PackedRepositoryBase::PackageFile
+{
+public:
+	using OpenCallback = std::function<std::unique_ptr<PackageFile> ()>;
+
+	MirroredPackageFile (std::vector<OpenCallback>&& mirrors,
+		MirrorStatistics& statistics);
+	~MirroredPackageFile ();
+
+	bool Read (const int64 offset, const MutableArrayRef<>& buffer) override;
+	void ReadRanges (const MutableArrayRef<ReadRange>& ranges) override;
+	int GetPreferredRangeCount () const override;
+
+private:
+	PackageFile* GetFile (const int mirror) const;
+	std::vector<int> GetUsableMirrors (const std::vector<bool>& excluded) const;
+
+	std::vector<OpenCallback> openCallbacks_;
+	mutable std::vector<std::unique_ptr<PackageFile>> files_;
+	// Not a vector<bool>, as the mirrors are opened on separate threads
+	mutable std::vector<char> openFailed_;
+	MirrorStatistics& statistics_;
+};
+
+/**
+A repository which is available from several equivalent locations, which
+must be packed or web repositories. The database is read from the first
+location, and chunks are read from all of them. All locations must contain
+the same database, which is checked on construction, and unencrypted chunks
+are verified per mirror, see MirroredPackageFile.
+*/
+class MirroredRepository final : public PackedRepositoryBase
+{
+public:
+	MirroredRepository (std::vector<std::unique_ptr<PackedRepositoryBase>>&& mirrors);
+	~MirroredRepository ();
+
+private:
+	Sql::Database& GetDatabaseImpl () override;
+	std::unique_ptr<PackageFile> OpenPackage (const std::string& packageName) const override;
+	bool IsRemote () const override;
+
+	std::vector<std::unique_ptr<PackedRepositoryBase>> mirrors_;
+	mutable MirrorStatistics statistics_;
+};
+} // namespace kyla
+
+#endif
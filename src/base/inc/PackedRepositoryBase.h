@@ -22,21 +22,77 @@ public:
 
 	struct PackageFile
 	{
+		/**
+		The expected hash of the chunk stored at offset in the package.
+		*/
+		struct ChunkHash
+		{
+			int64 offset;
+			int64 size;
+			SHA256Digest hash;
+		};
+
+		struct ReadRange
+		{
+			int64 offset;
+			MutableArrayRef<> buffer;
+			bool succeeded;
+			// The chunks inside the range which can be checked as soon as
+			// they've been read, that is, which are not encrypted. Package
+			// files which read from several sources use them to reject bad
+			// data from one source while the others can still be asked
+			ArrayRef<ChunkHash> chunkHashes;
+		};
+
 		virtual ~PackageFile ()
 		{
 		}
 
 		virtual bool Read (const int64 offset, const MutableArrayRef<>& buffer) = 0;
+
+		/**
+		Read several ranges, and mark each range which has been read
+		completely as succeeded.
+
+		The default implementation reads one range after the other. Remote
+		package files override this to keep several requests in flight.
+		*/
+		virtual void ReadRanges (const MutableArrayRef<ReadRange>& ranges)
+		{
+			for (auto& range : ranges) {
+				range.succeeded = Read (range.offset, range.buffer);
+			}
+		}
+
+		/**
+		The number of ranges which should be passed to ReadRanges at once.
+		*/
+		virtual int GetPreferredRangeCount () const
+		{
+			return 1;
+		}
 	};
 
 	struct Decryptor;
 
 private:
+	// Mirrors open the packages of the repositories they combine
+	friend class MirroredRepository;
+
 	void GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
+		const GetContentObjectsOptions& options,
 		const GetContentObjectCallback& getCallback,
 		ExecutionContext& context) override;
 
 	virtual std::unique_ptr<PackageFile> OpenPackage (const std::string& packageName) const = 0;
+
+	/**
+	Remote repositories use the chunk cache, if one has been configured.
+	*/
+	virtual bool IsRemote () const
+	{
+		return false;
+	}
 	
 	void RepairImpl (Repository& source,
 		ExecutionContext& context,
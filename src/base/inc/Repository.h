@@ -10,6 +10,7 @@ details.
 #ifndef KYLA_CORE_INTERNAL_REPOSITORY_H
 #define KYLA_CORE_INTERNAL_REPOSITORY_H
 
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <unordered_map>
@@ -17,6 +18,7 @@ details.
 #include "ArrayRef.h"
 #include "FileIO.h"
 #include "Hash.h"
+#include "MemoryBudget.h"
 #include "Uuid.h"
 
 #include <cassert>
@@ -41,9 +43,13 @@ public:
 		assert (progressCallback_);
 	}
 
+	/**
+	Advance by amount. The target may be an estimate, so the progress stops
+	at the target instead of overshooting it.
+	*/
 	void Advance (const std::string& action, const int64 amount)
 	{
-		current_ += amount;
+		current_ = std::min (current_ + amount, target_);
 
 		progressCallback_ (GetProgress (), what_.c_str (), action.c_str ());
 	}
@@ -98,6 +104,16 @@ public:
 		return Get<int> ();
 	}
 
+	int64 GetInt64 () const
+	{
+		return Get<int64> ();
+	}
+
+	size_t GetSize () const
+	{
+		return value_.size ();
+	}
+
 	void Set (const size_t length, const void* v)
 	{
 		if (readOnly_) {
@@ -151,6 +167,7 @@ public:
 	struct ExecutionContext
 	{
 		using ProgressCallback = std::function<void (const float p, const char* s, const char* a)>;
+		using FileDeployedCallback = std::function<void (const char* path, const int64 size)>;
 
 		ExecutionContext (Log& log) : log (log)
 		{
@@ -158,9 +175,29 @@ public:
 
 		Log& log;
 		ProgressCallback progress = [](const float, const char*, const char*) {};
+		// Called once a file is completely written to its final location.
+		// This may happen on an internal thread, but never concurrently
+		FileDeployedCallback fileDeployed;
 		std::unordered_map<std::string, Variable> variables;
 
+		MemoryBudget& GetMemoryBudget ();
+
 		static constexpr auto EncryptionKey = "Encryption.Key";
+		static constexpr auto MemoryLimit = "Memory.Limit";
+		static constexpr auto PeakMemoryUsage = "Memory.PeakUsage";
+		static constexpr auto DeliveryOrder = "Delivery.Order";
+		static constexpr auto DeliveryFeaturePriority = "Delivery.FeaturePriority";
+		static constexpr auto ScrubSamplePercentage = "Scrub.SamplePercentage";
+		static constexpr auto CachePath = "Cache.Path";
+		static constexpr auto CacheMaxSize = "Cache.MaxSize";
+		static constexpr auto LocalRepositories = "Source.LocalRepositories";
+		static constexpr auto DeployHardLinks = "Deploy.HardLinks";
+		static constexpr auto VerifyMode = "Verify.Mode";
+		static constexpr auto VerifySamplePercentage = "Verify.SamplePercentage";
+		static constexpr auto ConfigureMode = "Configure.Mode";
+
+	private:
+		std::unique_ptr<MemoryBudget> memoryBudget_;
 	};
 
 	using RepairCallback = std::function<void (
@@ -172,7 +209,34 @@ public:
 		const int64 offset,
 		const int64 totalSize)>;
 
+	/**
+	Additional settings for GetContentObjects.
+	*/
+	struct GetContentObjectsOptions
+	{
+		/**
+		One priority per requested object. Objects with a lower value are
+		delivered first, objects with the same priority are delivered in
+		storage order. If empty, everything is delivered in storage order.
+		*/
+		ArrayRef<int64> priorities;
+
+		/**
+		Called with the content hash, source offset and source size of every
+		chunk. Chunks for which this returns true are not delivered, which
+		allows resuming partially received content objects. Repositories
+		which deliver content objects as a whole may ignore this.
+		*/
+		std::function<bool (const SHA256Digest& contentHash,
+			const int64 sourceOffset, const int64 sourceSize)> skipChunk;
+	};
+
+	void GetContentObjects (const ArrayRef<SHA256Digest>& requestedObjects,
+		const GetContentObjectCallback& getCallback,
+		ExecutionContext& context);
+
 	void GetContentObjects (const ArrayRef<SHA256Digest>& requestedObjects,
+		const GetContentObjectsOptions& options,
 		const GetContentObjectCallback& getCallback,
 		ExecutionContext& context);
 
@@ -198,6 +262,7 @@ public:
 
 private:
 	virtual void GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
+		const GetContentObjectsOptions& options,
 		const GetContentObjectCallback& getCallback,
 		ExecutionContext& context) = 0;
 	virtual void RepairImpl (Repository& source,
@@ -216,6 +281,12 @@ private:
 	virtual std::vector<Uuid> GetSubfeaturesImpl (const Uuid& featureId) = 0;
 };
 
+/**
+Separates the locations of a repository which is available from several
+mirrors.
+*/
+constexpr char MirrorSeparator = '|';
+
 std::unique_ptr<Repository> OpenRepository (const char* path,
 	const bool allowWriteAccess);
 
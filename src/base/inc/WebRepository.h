@@ -23,6 +23,7 @@ public:
 private:
 	Sql::Database& GetDatabaseImpl () override;
 	std::unique_ptr<PackageFile> OpenPackage (const std::string& packageName) const override;
+	bool IsRemote () const override;
 
 	Sql::Database db_;
 	Path dbPath_;
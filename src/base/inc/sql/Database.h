@@ -17,11 +17,21 @@ details.
 #include "../FileIO.h"
 
 namespace kyla {
+class Log;
+
 namespace Sql {
+class RemoteFile;
+
 enum class OpenMode
 {
 	Read,
-	ReadWrite
+	ReadWrite,
+	/**
+	Read-only, and the file is guaranteed not to change while it is open,
+	as for packed repositories. Attaching such a database skips locking and
+	change detection.
+	*/
+	Immutable
 };
 
 class Statement;
@@ -51,6 +61,8 @@ public:
 	static Database Open (const Path& path);
 	static Database Open (const Path& path, const OpenMode openMode);
 
+	static Database OpenRemote (std::unique_ptr<RemoteFile>&& file);
+
 	static Database Create (const char* name);
 	static Database Create ();
 
@@ -70,6 +82,16 @@ public:
 	std::int64_t GetLastRowId ();
 
 	void AttachTemporaryCopy (const char* name, Database& source);
+	/**
+	Attach source as name without copying it, if it is a local file. The
+	file is opened a second time in read-only mode, and as immutable if
+	source was opened with OpenMode::Immutable. Other databases are attached
+	as a temporary copy.
+
+	If the file can't be opened a second time, a warning is logged and the
+	source is attached as a temporary copy. All other errors are thrown.
+	*/
+	void Attach (const char* name, Database& source, Log& log);
 	void Detach (const char* name);
 
 	TemporaryTable CreateTemporaryTable (const char* name,
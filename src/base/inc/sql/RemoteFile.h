@@ -0,0 +1,40 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_INTERNAL_SQL_REMOTEFILE_H
+#define KYLA_CORE_INTERNAL_SQL_REMOTEFILE_H
+
+#include "../ArrayRef.h"
+#include "../Types.h"
+
+#include <memory>
+#include <string>
+
+namespace kyla {
+namespace Sql {
+/**
+A read-only file which can be opened as a database using
+Database::OpenRemote. Only the pages SQLite actually needs are read.
+*/
+class RemoteFile
+{
+public:
+	virtual ~RemoteFile () = default;
+
+	virtual int64 GetSize () = 0;
+	virtual bool Read (const int64 offset, const MutableArrayRef<>& buffer) = 0;
+};
+
+const char* GetRemoteVfsName ();
+std::string RegisterRemoteFile (std::unique_ptr<RemoteFile>&& file);
+void UnregisterRemoteFile (const std::string& name);
+}
+}
+
+#endif
@@ -0,0 +1,284 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "ChunkCache.h"
+
+#include "Exception.h"
+
+#include <fmt/core.h>
+
+#include <chrono>
+#include <random>
+#include <system_error>
+#include <vector>
+
+namespace kyla {
+namespace {
+///////////////////////////////////////////////////////////////////////////////
+int64 GetTimestamp ()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds> (
+		std::chrono::system_clock::now ().time_since_epoch ()).count ();
+}
+
+// The cache size is maintained by triggers, so it's always consistent with
+// the index, no matter which process modified it
+const char* CacheStructure =
+	"CREATE TABLE IF NOT EXISTS chunks ("
+	"    Hash BLOB PRIMARY KEY, "
+	"    Size INTEGER NOT NULL, "
+	"    LastAccess INTEGER NOT NULL) WITHOUT ROWID;"
+	"CREATE INDEX IF NOT EXISTS chunks_last_access ON chunks (LastAccess);"
+	"CREATE TABLE IF NOT EXISTS cache_size (Size INTEGER NOT NULL);"
+	"INSERT INTO cache_size SELECT 0 WHERE NOT EXISTS (SELECT * FROM cache_size);"
+	"CREATE TRIGGER IF NOT EXISTS chunks_insert AFTER INSERT ON chunks BEGIN "
+	"    UPDATE cache_size SET Size = Size + NEW.Size; END;"
+	"CREATE TRIGGER IF NOT EXISTS chunks_delete AFTER DELETE ON chunks BEGIN "
+	"    UPDATE cache_size SET Size = Size - OLD.Size; END;";
+
+// Accesses within the same millisecond must still be ordered, so the access
+// time is always later than the last recorded one
+const char* NextAccessTime =
+	"MAX (?, IFNULL ((SELECT MAX (LastAccess) FROM chunks), 0) + 1)";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+ChunkCache::ChunkCache (const Path& directory, const int64 maxSize)
+	: directory_ (directory)
+	, maxSize_ (maxSize)
+{
+	std::error_code error;
+	std::filesystem::create_directories (directory_, error);
+
+	if (error) {
+		throw RuntimeException ("ChunkCache",
+			fmt::format ("Could not create cache directory '{0}'", directory_),
+			KYLA_FILE_LINE);
+	}
+
+	db_ = Sql::Database::Create ((directory_ / "index.db").string ().c_str ());
+
+	// Other processes may hold the lock for a short while. WAL allows
+	// readers and one writer at the same time, and the index doesn't need
+	// to survive a power loss - a lost entry only means a cache miss
+	db_.Execute ("PRAGMA busy_timeout = 30000;");
+	db_.Execute ("PRAGMA journal_mode = WAL;");
+	db_.Execute ("PRAGMA synchronous = NORMAL;");
+
+	auto transaction = db_.BeginTransaction ();
+	db_.Execute (CacheStructure);
+	transaction.Commit ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+ChunkCache::~ChunkCache ()
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool ChunkCache::Contains (const SHA256Digest& hash)
+{
+	std::lock_guard<std::mutex> lock{ mutex_ };
+
+	auto query = db_.Prepare ("SELECT 1 FROM chunks WHERE Hash = ?");
+	query.BindArguments (hash);
+
+	return query.Step ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Read a chunk into buffer, which must have the size of the chunk. The contents
+are checked against the hash. Entries which are missing or corrupted are
+removed, and false is returned.
+*/
+bool ChunkCache::Get (const SHA256Digest& hash, const MutableArrayRef<>& buffer)
+{
+	const auto path = GetChunkPath (hash);
+	bool valid = false;
+
+	try {
+		auto file = OpenFile (path, FileAccess::Read);
+
+		valid = file->GetSize () == buffer.GetSize ()
+			&& file->Read (buffer) == buffer.GetSize ()
+			&& ComputeSHA256 (buffer) == hash;
+	} catch (const std::exception&) {
+		valid = false;
+	}
+
+	if (!valid) {
+		Remove (hash);
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock{ mutex_ };
+
+	auto touch = db_.Prepare (fmt::format (
+		"UPDATE chunks SET LastAccess = {0} WHERE Hash = ?", NextAccessTime));
+	touch.BindArguments (GetTimestamp (), hash);
+	touch.Step ();
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Store a chunk. The data must have been verified against the hash already.
+
+The chunk is written to a temporary file first and then renamed, so other
+processes never see partial chunks.
+*/
+void ChunkCache::Put (const SHA256Digest& hash, const ArrayRef<>& data)
+{
+	if (data.GetSize () > maxSize_) {
+		return;
+	}
+
+	const auto path = GetChunkPath (hash);
+
+	{
+		std::lock_guard<std::mutex> lock{ mutex_ };
+
+		auto query = db_.Prepare ("SELECT 1 FROM chunks WHERE Hash = ?");
+		query.BindArguments (hash);
+
+		if (query.Step ()) {
+			return;
+		}
+	}
+
+	std::error_code error;
+	std::filesystem::create_directories (path.parent_path (), error);
+
+	static thread_local std::mt19937_64 random{ std::random_device{}() };
+	auto temporaryPath = path;
+	temporaryPath += fmt::format (".{0:016x}.tmp", random ());
+
+	{
+		auto file = CreateFile (temporaryPath);
+		file->Write (data);
+	}
+
+	std::filesystem::rename (temporaryPath, path, error);
+
+	if (error) {
+		std::filesystem::remove (temporaryPath, error);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock{ mutex_ };
+
+		auto insert = db_.Prepare (fmt::format ("INSERT OR IGNORE INTO chunks "
+			"(Hash, Size, LastAccess) VALUES (?, ?, {0})", NextAccessTime));
+		insert.BindArguments (hash, data.GetSize (), GetTimestamp ());
+		insert.Step ();
+	}
+
+	Evict ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int64 ChunkCache::GetSize ()
+{
+	std::lock_guard<std::mutex> lock{ mutex_ };
+
+	auto query = db_.Prepare ("SELECT Size FROM cache_size");
+	query.Step ();
+
+	return query.GetInt64 (0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+Path ChunkCache::GetChunkPath (const SHA256Digest& hash) const
+{
+	const auto name = ToString (hash);
+
+	// Spread the chunks over subdirectories to keep directories small
+	return directory_ / name.substr (0, 2) / name;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ChunkCache::Remove (const SHA256Digest& hash)
+{
+	{
+		std::lock_guard<std::mutex> lock{ mutex_ };
+
+		auto remove = db_.Prepare ("DELETE FROM chunks WHERE Hash = ?");
+		remove.BindArguments (hash);
+		remove.Step ();
+	}
+
+	std::error_code error;
+	std::filesystem::remove (GetChunkPath (hash), error);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Remove the least recently used chunks until the cache is below 90% of its
+maximum size, so we don't have to evict on every insertion.
+*/
+void ChunkCache::Evict ()
+{
+	std::vector<SHA256Digest> evicted;
+
+	{
+		std::lock_guard<std::mutex> lock{ mutex_ };
+
+		auto sizeQuery = db_.Prepare ("SELECT Size FROM cache_size");
+		sizeQuery.Step ();
+		auto size = sizeQuery.GetInt64 (0);
+		sizeQuery.Reset ();
+
+		if (size <= maxSize_) {
+			return;
+		}
+
+		const auto targetSize = maxSize_ - maxSize_ / 10;
+
+		auto transaction = db_.BeginTransaction ();
+
+		auto oldestQuery = db_.Prepare (
+			"SELECT Hash, Size FROM chunks ORDER BY LastAccess ASC");
+		auto remove = db_.Prepare ("DELETE FROM chunks WHERE Hash = ?");
+
+		// Another process may have evicted already, so we check again
+		// inside the transaction
+		sizeQuery.Step ();
+		size = sizeQuery.GetInt64 (0);
+		sizeQuery.Reset ();
+
+		while (size > targetSize && oldestQuery.Step ()) {
+			SHA256Digest hash;
+			oldestQuery.GetBlob (0, hash);
+			size -= oldestQuery.GetInt64 (1);
+
+			evicted.push_back (hash);
+		}
+
+		oldestQuery.Reset ();
+
+		for (const auto& hash : evicted) {
+			remove.BindArguments (hash);
+			remove.Step ();
+			remove.Reset ();
+		}
+
+		transaction.Commit ();
+	}
+
+	// Files are removed once the index no longer refers to them, readers
+	// which still find a file verify its contents anyway
+	for (const auto& hash : evicted) {
+		std::error_code error;
+		std::filesystem::remove (GetChunkPath (hash), error);
+	}
+}
+}
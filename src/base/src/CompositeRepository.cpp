@@ -0,0 +1,220 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "CompositeRepository.h"
+
+#include "Exception.h"
+#include "Log.h"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <numeric>
+
+namespace kyla {
+///////////////////////////////////////////////////////////////////////////////
+CompositeRepository::CompositeRepository (Repository& primary,
+	std::vector<std::unique_ptr<DeployedRepository>>&& localRepositories)
+	: primary_ (primary)
+	, localRepositories_ (std::move (localRepositories))
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+CompositeRepository::~CompositeRepository ()
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Deliver everything we can find locally first, as reading local files is much
+cheaper than fetching from the primary source. Local objects are delivered
+in priority order, the remaining ones are passed on with their priorities.
+*/
+void CompositeRepository::GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
+	const GetContentObjectsOptions& options,
+	const GetContentObjectCallback& getCallback,
+	ExecutionContext& context)
+{
+	std::vector<int64> order (requestedObjects.GetCount ());
+	std::iota (order.begin (), order.end (), 0);
+
+	if (!options.priorities.IsEmpty ()) {
+		std::stable_sort (order.begin (), order.end (),
+			[&options](const int64 a, const int64 b) -> bool {
+			return options.priorities [a] < options.priorities [b];
+		});
+	}
+
+	std::vector<int64> missing;
+	int64 localCount = 0;
+	int64 localSize = 0;
+
+	for (const auto index : order) {
+		const auto& hash = requestedObjects [index];
+		bool found = false;
+
+		for (auto& localRepository : localRepositories_) {
+			found = localRepository->GetLocalContentObject (hash,
+				[&](const SHA256Digest& objectHash, const ArrayRef<>& contents,
+					const int64 offset, const int64 totalSize) -> void {
+				localSize += totalSize;
+				getCallback (objectHash, contents, offset, totalSize);
+			});
+
+			if (found) {
+				++localCount;
+				break;
+			}
+		}
+
+		if (!found) {
+			missing.push_back (index);
+		}
+	}
+
+	context.log.Info ("CompositeRepository",
+		fmt::format ("Read {0} content objects ({1} bytes) from local repositories, "
+			"fetching {2} from the source", localCount, localSize, missing.size ()));
+
+	if (missing.empty ()) {
+		return;
+	}
+
+	// Keep the original order, so the primary source can read in storage
+	// order where the priorities allow it
+	std::sort (missing.begin (), missing.end ());
+
+	std::vector<SHA256Digest> missingObjects;
+	std::vector<int64> missingPriorities;
+
+	for (const auto index : missing) {
+		missingObjects.push_back (requestedObjects [index]);
+
+		if (!options.priorities.IsEmpty ()) {
+			missingPriorities.push_back (options.priorities [index]);
+		}
+	}
+
+	auto missingOptions = options;
+	missingOptions.priorities = missingPriorities;
+
+	primary_.GetContentObjects (missingObjects, missingOptions,
+		getCallback, context);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void CompositeRepository::RepairImpl (Repository& /*source*/,
+	ExecutionContext& /*context*/,
+	RepairCallback /*repairCallback*/,
+	bool /*restore*/)
+{
+	throw RuntimeException ("CompositeRepository",
+		"A composite repository can only be used as a source", KYLA_FILE_LINE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void CompositeRepository::ConfigureImpl (Repository& /*other*/,
+	const ArrayRef<Uuid>& /*features*/,
+	ExecutionContext& /*context*/)
+{
+	throw RuntimeException ("CompositeRepository",
+		"A composite repository can only be used as a source", KYLA_FILE_LINE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::vector<Uuid> CompositeRepository::GetFeaturesImpl ()
+{
+	return primary_.GetFeatures ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int64_t CompositeRepository::GetFeatureSizeImpl (const Uuid& featureId)
+{
+	return primary_.GetFeatureSize (featureId);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::string CompositeRepository::GetFeatureTitleImpl (const Uuid& featureId)
+{
+	return primary_.GetFeatureTitle (featureId);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::string CompositeRepository::GetFeatureDescriptionImpl (const Uuid& featureId)
+{
+	return primary_.GetFeatureDescription (featureId);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool CompositeRepository::IsEncryptedImpl ()
+{
+	return primary_.IsEncrypted ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+Sql::Database& CompositeRepository::GetDatabaseImpl ()
+{
+	return primary_.GetDatabase ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::vector<Uuid> CompositeRepository::GetSubfeaturesImpl (const Uuid& featureId)
+{
+	return primary_.GetSubfeatures (featureId);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::unique_ptr<Repository> CreateCompositeRepository (Repository& source,
+	Repository::ExecutionContext& context)
+{
+	using EC = Repository::ExecutionContext;
+
+	auto it = context.variables.find (EC::LocalRepositories);
+
+	if (it == context.variables.end () || it->second.GetSize () == 0) {
+		return nullptr;
+	}
+
+	const std::string paths = it->second.GetString ();
+	std::vector<std::unique_ptr<DeployedRepository>> localRepositories;
+
+	std::string::size_type start = 0;
+	for (;;) {
+		const auto end = paths.find (MirrorSeparator, start);
+		const auto path = paths.substr (start,
+			end == std::string::npos ? std::string::npos : end - start);
+
+		if (!path.empty ()) {
+			// A local repository which can't be used only means we fetch
+			// more from the source, so this is not an error
+			try {
+				localRepositories.push_back (std::make_unique<DeployedRepository> (
+					path.c_str (), Sql::OpenMode::Read));
+			} catch (const std::exception&) {
+				context.log.Warning ("CompositeRepository",
+					fmt::format ("Could not open local repository '{0}'", path));
+			}
+		}
+
+		if (end == std::string::npos) {
+			break;
+		}
+
+		start = end + 1;
+	}
+
+	if (localRepositories.empty ()) {
+		return nullptr;
+	}
+
+	return std::make_unique<CompositeRepository> (source,
+		std::move (localRepositories));
+}
+} // namespace kyla
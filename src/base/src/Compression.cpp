@@ -96,7 +96,7 @@ void BlockCompressor::Decompress (const ArrayRef<>& input,
 ///////////////////////////////////////////////////////////////////////////////
 int64 ZipBlockCompressor::GetCompressionBoundImpl (const int64 inputSize) const
 {
-	if (inputSize > std::numeric_limits<uLong>::max ()) {
+	if (static_cast<uint64_t> (inputSize) > std::numeric_limits<uLong>::max ()) {
 		throw RuntimeException ("Invalid buffer size",
 			KYLA_FILE_LINE);
 	}
@@ -108,7 +108,7 @@ int64 ZipBlockCompressor::GetCompressionBoundImpl (const int64 inputSize) const
 int64 ZipBlockCompressor::CompressImpl (const ArrayRef<>& input,
 	const MutableArrayRef<>& output) const
 {
-	if (input.GetSize () > std::numeric_limits<uLong>::max ()) {
+	if (static_cast<uint64_t> (input.GetSize ()) > std::numeric_limits<uLong>::max ()) {
 		throw RuntimeException ("Invalid buffer size",
 			KYLA_FILE_LINE);
 	}
@@ -126,7 +126,7 @@ int64 ZipBlockCompressor::CompressImpl (const ArrayRef<>& input,
 void ZipBlockCompressor::DecompressImpl (const ArrayRef<>& input,
 	const MutableArrayRef<>& output) const
 {
-	if (output.GetSize () > std::numeric_limits<uLong>::max ()) {
+	if (static_cast<uint64_t> (output.GetSize ()) > std::numeric_limits<uLong>::max ()) {
 		throw RuntimeException ("Invalid buffer size",
 			KYLA_FILE_LINE);
 	}
@@ -197,7 +197,7 @@ void BrotliBlockCompressor::DecompressImpl (const ArrayRef<>& input,
 	BrotliDecoderDecompress (input.GetSize (),
 		static_cast<const uint8_t*> (input.GetData ()),
 		&decodedSize, static_cast<uint8_t*> (output.GetData ()));
-	assert (decodedSize == output.GetSize ());
+	assert (decodedSize == static_cast<size_t> (output.GetSize ()));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -220,7 +220,7 @@ void ZstdBlockCompressor::DecompressImpl (const ArrayRef<>& input,
 {
 	const auto decompressedSize = ZSTD_decompress (output.GetData (), 
 		output.GetSize (), input.GetData (), input.GetSize ());
-	assert (decompressedSize == output.GetSize ());
+	assert (decompressedSize == static_cast<size_t> (output.GetSize ()));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -22,15 +22,164 @@ details.
 #include "install-db-structure.h"
 
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
 #include <set>
 #include <numeric>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <random>
+#include <thread>
 
 namespace kyla {
+namespace {
+// The fingerprint of every deployed file, taken right after it was written.
+// Deployments created by older versions don't have this table yet, so it
+// gets added when they are opened for writing
+const char* FingerprintStructure =
+	"CREATE TABLE IF NOT EXISTS fs_file_fingerprints ("
+	"    Path TEXT PRIMARY KEY NOT NULL, "
+	"    Size INTEGER NOT NULL, "
+	"    ModificationTime INTEGER NOT NULL, "
+	"    ChangeTime INTEGER NOT NULL, "
+	"    Inode INTEGER NOT NULL);"
+	"CREATE TRIGGER IF NOT EXISTS fs_files_delete_fingerprint "
+	"    AFTER DELETE ON fs_files BEGIN "
+	"    DELETE FROM fs_file_fingerprints WHERE Path = OLD.Path; END;";
+
+// Content objects which were staged completely, with the fingerprint of their
+// staging file, so applying them doesn't need to hash them again
+const char* StagedContentsStructure =
+	"CREATE TABLE IF NOT EXISTS staged_contents ("
+	"    Hash BLOB PRIMARY KEY NOT NULL, "
+	"    Size INTEGER NOT NULL, "
+	"    ModificationTime INTEGER NOT NULL, "
+	"    ChangeTime INTEGER NOT NULL, "
+	"    Inode INTEGER NOT NULL);";
+
+///////////////////////////////////////////////////////////////////////////////
+Sql::Statement PrepareRecordFingerprintQuery (Sql::Database& db)
+{
+	return db.Prepare (
+		"INSERT OR REPLACE INTO fs_file_fingerprints "
+		"(Path, Size, ModificationTime, ChangeTime, Inode) "
+		"VALUES (?, ?, ?, ?, ?)");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void RecordFingerprint (Sql::Statement& query, const Path& path,
+	const FileStat& fingerprint)
+{
+	query.BindArguments (path.string (),
+		static_cast<int64> (fingerprint.size),
+		fingerprint.modificationTime,
+		fingerprint.changeTime,
+		static_cast<int64> (fingerprint.inode));
+	query.Step ();
+	query.Reset ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Check if the current fingerprint matches the recorded one. A recorded change
+time of 0 is ignored, see GetFingerprint.
+*/
+bool IsSameFingerprint (const FileStat& recorded, const FileStat& current)
+{
+	return recorded.size == current.size
+		&& recorded.modificationTime == current.modificationTime
+		&& (recorded.changeTime == 0 || recorded.changeTime == current.changeTime)
+		&& recorded.inode == current.inode;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Get the fingerprint of a file which was just deployed. Creating or removing a
+hard link changes the change time of every other link to the same file, so
+it's left out of the fingerprint of files deployed as hard links.
+*/
+FileStat GetFingerprint (const Path& path, const DuplicateMode duplicateMode)
+{
+	auto result = Stat (path);
+
+	if (duplicateMode == DuplicateMode::HardLink) {
+		result.changeTime = 0;
+	}
+
+	return result;
+}
+
+struct VerifyOptions
+{
+	// Only hash files whose fingerprint changed
+	bool quick = false;
+	// Percentage of the unchanged files to hash anyway in quick mode
+	int samplePercentage = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Get the verify mode and sample percentage. By default, every file is hashed.
+*/
+VerifyOptions GetVerifyOptions (const Repository::ExecutionContext& context)
+{
+	using EC = Repository::ExecutionContext;
+
+	VerifyOptions result;
+
+	if (auto it = context.variables.find (EC::VerifyMode);
+		it != context.variables.end ()) {
+		const std::string mode = it->second.GetString ();
+
+		if (mode == "quick") {
+			result.quick = true;
+		} else if (mode != "full") {
+			throw RuntimeException ("Repair",
+				fmt::format ("Invalid verify mode '{0}', must be one of "
+					"'full' or 'quick'", mode),
+				KYLA_FILE_LINE);
+		}
+	}
+
+	if (auto it = context.variables.find (EC::VerifySamplePercentage);
+		it != context.variables.end ()) {
+		if (it->second.GetSize () != sizeof (int)) {
+			throw RuntimeException ("Repair",
+				fmt::format ("Variable '{}' must be an integer",
+					EC::VerifySamplePercentage),
+				KYLA_FILE_LINE);
+		}
+
+		result.samplePercentage = it->second.GetInt ();
+
+		if (result.samplePercentage < 0 || result.samplePercentage > 100) {
+			throw RuntimeException ("Repair",
+				fmt::format ("Variable '{}' must be between 0 and 100",
+					EC::VerifySamplePercentage),
+				KYLA_FILE_LINE);
+		}
+	}
+
+	return result;
+}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 DeployedRepository::DeployedRepository (const char* path, Sql::OpenMode openMode)
 	: db_ (Sql::Database::Open (Path (path) / "k.db", openMode))
 	, path_ (path)
+	, openMode_ (openMode)
 {
+	if (openMode == Sql::OpenMode::ReadWrite) {
+		db_.Execute (FingerprintStructure);
+		db_.Execute (StagedContentsStructure);
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -44,6 +193,369 @@ Sql::Database& DeployedRepository::GetDatabaseImpl ()
 	return db_;
 }
 
+namespace {
+/**
+A file to verify, and the result once it has been checked.
+*/
+struct VerifyEntry
+{
+	Path path;
+	std::string relativePath;
+	SHA256Digest hash;
+	int64 size = 0;
+
+	// If set, the file is only hashed if it doesn't match the fingerprint
+	bool quick = false;
+	bool hasFingerprint = false;
+	FileStat fingerprint;
+
+	RepairResult result = RepairResult::Ok;
+	// Whether the contents were hashed, and the fingerprint before that
+	bool hashed = false;
+	FileStat currentFingerprint;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+RepairResult VerifyFile (VerifyEntry& entry, const MutableArrayRef<>& buffer)
+{
+	std::error_code error;
+	const auto fileSize = std::filesystem::file_size (entry.path, error);
+
+	if (error) {
+		return RepairResult::Missing;
+	}
+
+	if (static_cast<int64> (fileSize) != entry.size) {
+		return RepairResult::Corrupted;
+	}
+
+	// Taken before hashing, so changes made while hashing show up the next
+	// time
+	entry.currentFingerprint = Stat (entry.path);
+
+	if (entry.quick && entry.hasFingerprint &&
+		IsSameFingerprint (entry.fingerprint, entry.currentFingerprint)) {
+		return RepairResult::Ok;
+	}
+
+	entry.hashed = true;
+
+	// For size 0 files, don't bother checking the hash
+	///@TODO(minor) Assert hash is the null hash
+	if (entry.size != 0 && ComputeSHA256 (entry.path, buffer) != entry.hash) {
+		return RepairResult::Corrupted;
+	}
+
+	return RepairResult::Ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Check all entries on a pool of threads.
+
+The largest files are checked first, so they don't end up being hashed at
+the very end while all other threads are idle. Every thread reads through
+its own buffer, which is reserved from the memory budget, so the data in
+flight is bounded no matter how large the files are.
+
+onChecked is called for every entry once it has been checked, in any order,
+and onResult is called for every entry in the order of entries. Both are
+called on the calling thread.
+*/
+void VerifyFiles (std::vector<VerifyEntry>& entries,
+	MemoryBudget& memoryBudget,
+	const std::function<void (const VerifyEntry&)>& onChecked,
+	const std::function<void (const VerifyEntry&)>& onResult)
+{
+	if (entries.empty ()) {
+		return;
+	}
+
+	std::vector<size_t> schedule (entries.size ());
+	std::iota (schedule.begin (), schedule.end (), 0);
+	std::stable_sort (schedule.begin (), schedule.end (),
+		[&entries](const size_t a, const size_t b) -> bool {
+		return entries [a].size > entries [b].size;
+	});
+
+	const auto threadCount = static_cast<int> (std::min<size_t> (
+		std::max (1u, std::thread::hardware_concurrency ()), entries.size ()));
+
+	// Half of the budget is enough to keep the disks busy
+	const auto bufferSize = std::clamp<int64> (
+		memoryBudget.GetLimit () / 2 / threadCount, 64 << 10, 4 << 20);
+
+	std::mutex mutex;
+	std::condition_variable checkedCondition;
+	std::vector<size_t> checked;
+	std::atomic<size_t> next{ 0 };
+
+	auto verify = [&]() -> void {
+		MemoryReservation reservation{ memoryBudget, bufferSize };
+		std::vector<byte> buffer (static_cast<size_t> (bufferSize));
+
+		for (;;) {
+			const auto index = next++;
+
+			if (index >= schedule.size ()) {
+				break;
+			}
+
+			auto& entry = entries [schedule [index]];
+
+			try {
+				entry.result = VerifyFile (entry, buffer);
+			} catch (const std::exception&) {
+				// The file can't be read, or was removed while checking it
+				entry.result = RepairResult::Corrupted;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock{ mutex };
+				checked.push_back (schedule [index]);
+			}
+
+			checkedCondition.notify_one ();
+		}
+	};
+
+	std::vector<std::thread> threads;
+
+	// If a callback throws, the remaining entries are skipped, but the
+	// threads must still be joined
+	struct ThreadJoiner
+	{
+		~ThreadJoiner ()
+		{
+			next = count;
+
+			for (auto& thread : threads) {
+				thread.join ();
+			}
+		}
+
+		std::vector<std::thread>& threads;
+		std::atomic<size_t>& next;
+		const size_t count;
+	} threadJoiner{ threads, next, schedule.size () };
+
+	for (int i = 0; i < threadCount; ++i) {
+		threads.emplace_back (verify);
+	}
+
+	std::vector<char> isChecked (entries.size (), false);
+	std::vector<size_t> newlyChecked;
+	size_t reportedCount = 0;
+
+	while (reportedCount < entries.size ()) {
+		{
+			std::unique_lock<std::mutex> lock{ mutex };
+			checkedCondition.wait (lock, [&checked]() -> bool {
+				return !checked.empty ();
+			});
+
+			newlyChecked.swap (checked);
+		}
+
+		for (const auto index : newlyChecked) {
+			isChecked [index] = true;
+			onChecked (entries [index]);
+		}
+
+		newlyChecked.clear ();
+
+		while (reportedCount < entries.size () && isChecked [reportedCount]) {
+			onResult (entries [reportedCount]);
+			++reportedCount;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Record the fingerprints of files which were hashed and found intact, but
+whose fingerprint was missing or outdated, so the next quick verify can skip
+them.
+*/
+void UpdateFingerprints (Sql::Database& db, const std::vector<VerifyEntry>& entries,
+	Log& log)
+{
+	try {
+		auto transaction = db.BeginTransaction ();
+		auto recordFingerprintQuery = PrepareRecordFingerprintQuery (db);
+
+		for (const auto& entry : entries) {
+			if (entry.result != RepairResult::Ok || !entry.hashed) {
+				continue;
+			}
+
+			if (entry.hasFingerprint &&
+				IsSameFingerprint (entry.fingerprint, entry.currentFingerprint)) {
+				continue;
+			}
+
+			// Files which may be hard linked keep ignoring the change time
+			auto fingerprint = entry.currentFingerprint;
+			if (entry.hasFingerprint && entry.fingerprint.changeTime == 0) {
+				fingerprint.changeTime = 0;
+			}
+
+			RecordFingerprint (recordFingerprintQuery, entry.relativePath,
+				fingerprint);
+		}
+
+		transaction.Commit ();
+	} catch (const std::exception& e) {
+		// This only makes the next quick verify slower
+		log.Debug ("Repair", fmt::format ("Could not update fingerprints: {0}",
+			e.what ()));
+	}
+}
+
+struct RestoreTarget
+{
+	Path path;
+	// If set, only the damaged chunks are written, the rest of the file is
+	// intact
+	bool patch = false;
+	// Source offsets of the chunks which don't match their hash
+	std::set<int64> damagedChunks;
+	bool restored = false;
+};
+
+using RestoreTargets = std::unordered_multimap<SHA256Digest, RestoreTarget,
+	ArrayRefHash, ArrayRefEqual>;
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Check a file chunk by chunk against the uncompressed chunk hashes of the
+source. Returns false if the file can't be patched, because there are chunks
+without a hash or the file doesn't have the size of the content object.
+*/
+bool FindDamagedChunks (Sql::Statement& chunksQuery, const SHA256Digest& hash,
+	const Path& path, std::vector<byte>& buffer,
+	std::set<int64>& damagedChunks)
+{
+	struct Chunk
+	{
+		int64 offset;
+		int64 size;
+		bool hasHash;
+		SHA256Digest hash;
+	};
+
+	std::vector<Chunk> chunks;
+
+	chunksQuery.BindArguments (hash);
+	while (chunksQuery.Step ()) {
+		Chunk chunk;
+		chunk.offset = chunksQuery.GetInt64 (0);
+		chunk.size = chunksQuery.GetInt64 (1);
+		chunk.hasHash = chunksQuery.GetColumnType (2) != Sql::Type::Null;
+
+		if (chunk.hasHash) {
+			chunksQuery.GetBlob (2, chunk.hash);
+		}
+
+		chunks.push_back (chunk);
+	}
+	chunksQuery.Reset ();
+
+	if (chunks.empty ()) {
+		return false;
+	}
+
+	for (const auto& chunk : chunks) {
+		if (!chunk.hasHash) {
+			return false;
+		}
+	}
+
+	auto file = OpenFile (path, FileAccess::Read);
+
+	// Truncated or extended files can't be patched
+	if (file->GetSize () != chunks.back ().offset + chunks.back ().size) {
+		return false;
+	}
+
+	SHA256StreamHasher hasher;
+
+	for (const auto& chunk : chunks) {
+		file->Seek (chunk.offset);
+		hasher.Initialize ();
+
+		int64 remaining = chunk.size;
+		while (remaining > 0) {
+			const auto bytesRead = file->Read (MutableArrayRef<> { buffer.data (),
+				std::min<int64> (remaining, buffer.size ()) });
+
+			if (bytesRead <= 0) {
+				break;
+			}
+
+			hasher.Update (ArrayRef<> { buffer.data (), bytesRead });
+			remaining -= bytesRead;
+		}
+
+		if (remaining > 0 || hasher.Finalize () != chunk.hash) {
+			damagedChunks.insert (chunk.offset);
+		}
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Decide which corrupted files can be patched. This requires the source to
+have hashes for the uncompressed chunks, and the file to have the right size.
+Everything else gets restored as a whole.
+*/
+void FindPatchableFiles (Sql::Database& sourceDb, RestoreTargets& targets,
+	MemoryBudget& memoryBudget)
+{
+	if (!sourceDb.HasTable ("fs_chunk_source_hashes")) {
+		for (auto& target : targets) {
+			target.second.patch = false;
+		}
+
+		return;
+	}
+
+	auto chunksQuery = sourceDb.Prepare (
+		"SELECT DISTINCT fs_chunks.SourceOffset, fs_chunks.SourceSize, "
+		"    fs_chunk_source_hashes.Hash "
+		"FROM fs_chunks "
+		"INNER JOIN fs_contents ON fs_contents.Id = fs_chunks.ContentId "
+		"LEFT JOIN fs_chunk_source_hashes ON fs_chunk_source_hashes.ChunkId = fs_chunks.Id "
+		"WHERE fs_contents.Hash = ? "
+		"ORDER BY fs_chunks.SourceOffset");
+
+	static const int64 BufferSize = 1 << 20;
+	MemoryReservation reservation{ memoryBudget, BufferSize };
+	std::vector<byte> buffer (BufferSize);
+
+	for (auto& target : targets) {
+		if (!target.second.patch) {
+			continue;
+		}
+
+		try {
+			target.second.patch = FindDamagedChunks (chunksQuery, target.first,
+				target.second.path, buffer, target.second.damagedChunks);
+		} catch (const std::exception&) {
+			target.second.patch = false;
+		}
+
+		// Should the whole file fail the hash, but every chunk match, we
+		// can't tell what's wrong, so it's restored completely
+		if (target.second.damagedChunks.empty ()) {
+			target.second.patch = false;
+		}
+	}
+}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void DeployedRepository::RepairImpl (Repository& source,
 	ExecutionContext& context,
@@ -56,125 +568,217 @@ void DeployedRepository::RepairImpl (Repository& source,
 	/// In this case, we should probably prompt and ask what file sets need
 	/// to be recovered.
 
-	std::unordered_multimap<SHA256Digest, Path,
-		ArrayRefHash, ArrayRefEqual> requiredEntries;
+	RestoreTargets requiredEntries;
 
 	// Extract keys
 	std::vector<SHA256Digest> requiredContentObjects;
 
-	///@TODO(minor) Handle progress reporting - should call an internal validate
 	// Get a list of (file, hash, size)
-	// We sort by size first so we get small objects out of the way first
-	// (slower progress, but more things getting processed) and speed up
-	// towards the end (larger files, higher throughput)
-	static const char* queryFilesContentSql =
-		"SELECT fs_files.path, fs_contents.Hash, fs_contents.Size "
+	// We sort by size first, so results are reported with small objects
+	// first. The files are checked in a different order, see VerifyFiles
+	// Deployments which were never opened for writing by this version have
+	// no fingerprints, those are always hashed
+	const bool hasFingerprints = db_.HasTable ("fs_file_fingerprints");
+
+	const char* queryFilesContentSql = hasFingerprints
+		? "SELECT fs_files.Path, fs_contents.Hash, fs_contents.Size, "
+		"    fs_file_fingerprints.Size, fs_file_fingerprints.ModificationTime, "
+		"    fs_file_fingerprints.ChangeTime, fs_file_fingerprints.Inode "
+		"FROM fs_files "
+		"LEFT JOIN fs_contents ON fs_contents.Id = fs_files.ContentId "
+		"LEFT JOIN fs_file_fingerprints ON fs_file_fingerprints.Path = fs_files.Path "
+		"ORDER BY fs_contents.Size"
+		: "SELECT fs_files.Path, fs_contents.Hash, fs_contents.Size, "
+		"    NULL, NULL, NULL, NULL "
 		"FROM fs_files "
 		"LEFT JOIN fs_contents ON fs_contents.Id = fs_files.ContentId "
-		"ORDER BY size";
+		"ORDER BY fs_contents.Size";
 
 	auto query = db_.Prepare (queryFilesContentSql);
 
-	const int64 objectCount = [=]() -> int64
-	{
-		static const char* queryObjectCountSql =
-			"SELECT COUNT(*) FROM fs_contents";
-		auto countQuery = db_.Prepare (queryObjectCountSql);
-		countQuery.Step ();
-		return countQuery.GetInt64 (0);
-	} ();
+	const auto verifyOptions = GetVerifyOptions (context);
+	std::mt19937 random{ std::random_device{}() };
+	std::uniform_int_distribution<int> percentile (0, 99);
 
-	ProgressHelper progress (context.progress, "Repair", objectCount);
+	std::vector<VerifyEntry> entries;
+	int64 totalSize = 0;
 
 	while (query.Step ()) {
-		const Path path = query.GetText (0);
-		SHA256Digest hash;
-		query.GetBlob (1, hash);
-		const auto size = query.GetInt64 (2);
+		VerifyEntry entry;
+		entry.relativePath = query.GetText (0);
+		entry.path = path_ / Path{ entry.relativePath };
+		query.GetBlob (1, entry.hash);
+		entry.size = query.GetInt64 (2);
+
+		if (query.GetColumnType (3) != Sql::Type::Null) {
+			entry.hasFingerprint = true;
+			entry.fingerprint.size = query.GetInt64 (3);
+			entry.fingerprint.modificationTime = query.GetInt64 (4);
+			entry.fingerprint.changeTime = query.GetInt64 (5);
+			entry.fingerprint.inode = static_cast<std::uint64_t> (query.GetInt64 (6));
+		}
 
-		const auto filePath = path_ / path;
-		if (!std::filesystem::exists (filePath)) {
-			if (restore) {
-				requiredContentObjects.push_back (hash);
-			} else {
-				repairCallback (filePath.string ().c_str (),
-					RepairResult::Missing);
-			}
+		// The sample catches changes which leave the fingerprint intact
+		entry.quick = verifyOptions.quick &&
+			percentile (random) >= verifyOptions.samplePercentage;
 
-			progress.Advance (filePath.string (), 1);
-			continue;
+		totalSize += entry.size;
+		entries.push_back (std::move (entry));
+	}
+
+	// Every file counts once, and once for each of its bytes, so both empty
+	// and large files move the progress
+	ProgressHelper progress (context.progress, "Repair",
+		totalSize + static_cast<int64> (entries.size ()));
+
+	auto requireRestore = [&](const VerifyEntry& entry) -> void {
+		// Files with the same contents only need the object once
+		if (requiredEntries.find (entry.hash) == requiredEntries.end ()) {
+			requiredContentObjects.push_back (entry.hash);
 		}
 
-		const auto statResult = Stat (filePath);
+		RestoreTarget target;
+		target.path = entry.path;
+		// Missing files have no intact chunks
+		target.patch = entry.result == RepairResult::Corrupted;
 
-		///@TODO(minor) Try/catch here and report corrupted if something goes wrong?
-		/// This would indicate the file got deleted or is read-protected
-		/// while the validation is running
+		requiredEntries.emplace (entry.hash, std::move (target));
+	};
 
-		if (statResult.size != size && !restore) {
-			if (restore) {
-				requiredContentObjects.push_back (hash);
-			} else {
-				repairCallback (filePath.string ().c_str (),
-					RepairResult::Corrupted);
+	int64 errorCount = 0;
+	int64 skippedCount = 0;
+	const auto startTime = std::chrono::steady_clock::now ();
+
+	VerifyFiles (entries, context.GetMemoryBudget (),
+		[&](const VerifyEntry& entry) -> void {
+			progress.Advance (entry.path.string (), entry.size + 1);
+		},
+		[&](const VerifyEntry& entry) -> void {
+			if (entry.result != RepairResult::Ok) {
+				++errorCount;
 			}
 
-			progress.Advance (filePath.string (), 1);
-			continue;
-		}
+			if (entry.result == RepairResult::Ok && !entry.hashed) {
+				++skippedCount;
+			}
 
-		// For size 0 files, don't bother checking the hash
-		///@TODO(minor) Assert hash is the null hash
-		if (size != 0 && ComputeSHA256 (filePath) != hash) {
-			if (restore) {
-				requiredContentObjects.push_back (hash);
+			if (restore && entry.result != RepairResult::Ok) {
+				requireRestore (entry);
 			} else {
-				repairCallback (filePath.string ().c_str (),
-					RepairResult::Corrupted);
+				repairCallback (entry.path.string ().c_str (), entry.result);
 			}
+		});
 
-			progress.Advance (filePath.string (), 1);
-			continue;
+	const std::chrono::duration<double> duration =
+		std::chrono::steady_clock::now () - startTime;
+	const double megabytes = static_cast<double> (totalSize) / (1 << 20);
+
+	context.log.Info ("Repair", fmt::format (
+		"Checked {0} files ({1:.1f} MiB) in {2:.2f} s, {3:.1f} MiB/s, "
+		"{4} corrupted or missing, {5} unchanged files skipped",
+		entries.size (), megabytes, duration.count (),
+		duration.count () > 0 ? megabytes / duration.count () : 0.0,
+		errorCount, skippedCount));
+
+	if (restore) {
+		// Corrupted files often have only a few damaged chunks. Those files
+		// are patched in place, and only the damaged chunks are fetched
+		FindPatchableFiles (source.GetDatabase (), requiredEntries,
+			context.GetMemoryBudget ());
+
+		int64 patchedFileCount = 0;
+		int64 damagedChunkCount = 0;
+		for (const auto& target : requiredEntries) {
+			if (target.second.patch) {
+				++patchedFileCount;
+				damagedChunkCount += target.second.damagedChunks.size ();
+			}
 		}
 
-		repairCallback (filePath.string ().c_str (),
-			RepairResult::Ok);
+		context.log.Info ("Repair", fmt::format (
+			"Restoring {0} files, {1} of them by patching {2} damaged chunks",
+			requiredEntries.size (), patchedFileCount, damagedChunkCount));
 
-		progress.Advance (filePath.string (), 1);
-	}
+		GetContentObjectsOptions options;
+		options.skipChunk = [&requiredEntries](const SHA256Digest& hash,
+			const int64 sourceOffset, const int64) -> bool {
+			auto range = requiredEntries.equal_range (hash);
+			for (auto it = range.first; it != range.second; ++it) {
+				if (!it->second.patch ||
+					it->second.damagedChunks.count (sourceOffset)) {
+					return false;
+				}
+			}
 
-	if (restore) {
-		source.GetContentObjects (requiredContentObjects, [&](const SHA256Digest& hash,
+			return true;
+		};
+
+		std::unordered_set<SHA256Digest, ArrayRefHash, ArrayRefEqual> restoredObjects;
+
+		source.GetContentObjects (requiredContentObjects, options, [&](const SHA256Digest& hash,
 			const ArrayRef<>& contents,
 			const int64 offset,
 			const int64 totalSize) -> void {
 			// We lookup all paths from the map here - could do a query as well
 			// but as we built it anyway during validation, we reuse that
+			restoredObjects.insert (hash);
 
 			auto range = requiredEntries.equal_range (hash);
 			for (auto it = range.first; it != range.second; ++it) {
+				auto& target = it->second;
 				std::unique_ptr<File> file;
 
-				if (offset == 0) {
-					file = CreateFile (it->second);
-					file->SetSize (contents.GetSize ());
+				if (target.patch) {
+					// The chunk may have been fetched for another file, or
+					// the source may deliver more than the damaged chunks
+					auto damaged = target.damagedChunks.lower_bound (offset);
+					if (damaged == target.damagedChunks.end () ||
+						*damaged >= offset + contents.GetSize ()) {
+						continue;
+					}
+
+					file = OpenFile (target.path, FileAccess::Write);
+				} else if (!target.restored) {
+					// Chunks may arrive in any order, so the files are
+					// created with their final size on the first one, and
+					// every chunk is written at its offset
+					file = CreateFile (target.path);
+					file->Preallocate (totalSize);
 				} else {
-					file = OpenFile (it->second, FileAccess::Write);
+					file = OpenFile (target.path, FileAccess::Write);
 				}
 
-				byte* pointer = static_cast<byte*> (file->Map ());
-				::memcpy (pointer + offset, contents.GetData (), contents.GetSize ());
-				file->Unmap (pointer);
+				file->WriteAt (offset, contents);
 
-				repairCallback (it->second.string ().c_str (), 
-					RepairResult::Restored);
+				if (!target.restored) {
+					target.restored = true;
+					repairCallback (target.path.string ().c_str (),
+						RepairResult::Restored);
+				}
 			}
 		}, context);
+
+		// Restored files are intact now, so their new fingerprint gets
+		// recorded as well
+		for (auto& entry : entries) {
+			if (entry.result != RepairResult::Ok &&
+				restoredObjects.find (entry.hash) != restoredObjects.end ()) {
+				entry.result = RepairResult::Ok;
+				entry.hashed = true;
+				entry.hasFingerprint = false;
+				entry.currentFingerprint = Stat (entry.path);
+			}
+		}
+	}
+
+	if (openMode_ == Sql::OpenMode::ReadWrite) {
+		UpdateFingerprints (db_, entries, context.log);
 	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 void DeployedRepository::GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
+	const GetContentObjectsOptions& options,
 	const Repository::GetContentObjectCallback& getCallback,
 	ExecutionContext& context)
 {
@@ -183,7 +787,20 @@ void DeployedRepository::GetContentObjectsImpl (const ArrayRef<SHA256Digest>& re
 		WHERE ContentId=(SELECT Id FROM fs_contents WHERE Hash=?)
 		LIMIT 1)_");
 
-	for (const auto& hash : requestedObjects) {
+	// Every object is a single file here, so we can simply deliver them in
+	// priority order
+	std::vector<int64> order (requestedObjects.GetCount ());
+	std::iota (order.begin (), order.end (), 0);
+
+	if (!options.priorities.IsEmpty ()) {
+		std::stable_sort (order.begin (), order.end (),
+			[&options](const int64 a, const int64 b) -> bool {
+			return options.priorities [a] < options.priorities [b];
+		});
+	}
+
+	for (const auto index : order) {
+		const auto& hash = requestedObjects [index];
 		query.BindArguments (hash);
 		query.Step ();
 
@@ -202,86 +819,528 @@ void DeployedRepository::GetContentObjectsImpl (const ArrayRef<SHA256Digest>& re
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-class ConfigurePhase
+bool DeployedRepository::GetLocalContentObject (const SHA256Digest& hash,
+	const GetContentObjectCallback& getCallback)
 {
-public:
-	using UpdateProgress = std::function<void (const std::string& action, const int64_t cost)>;
+	auto query = db_.Prepare (
+		R"_(SELECT fs_files.Path, fs_contents.Size FROM fs_files
+		INNER JOIN fs_contents ON fs_contents.Id = fs_files.ContentId
+		WHERE fs_contents.Hash = ?)_");
+	query.BindArguments (hash);
 
-	virtual ~ConfigurePhase () = default;
+	// The files may have been modified since they were deployed, so every
+	// copy is checked against the hash until we find an intact one
+	while (query.Step ()) {
+		const auto filePath = path_ / Path{ query.GetText (0) };
+		const auto size = query.GetInt64 (1);
 
-	void Simulate (int64_t* cost)
-	{
-		return SimulateImpl (cost);
-	}
+		std::unique_ptr<File> file;
 
-	void Execute (Log& log, UpdateProgress progress,
-		Repository::ExecutionContext& context)
-	{
-		ExecuteImpl (log, progress, context);
-	}
+		try {
+			file = OpenFile (filePath, FileAccess::Read);
+		} catch (const std::exception&) {
+			continue;
+		}
 
-private:
-	virtual void SimulateImpl (int64_t* cost) = 0;
-	virtual void ExecuteImpl (Log& log, UpdateProgress progress,
-		Repository::ExecutionContext& context) = 0;
-};
+		if (file->GetSize () != size) {
+			continue;
+		}
 
-///////////////////////////////////////////////////////////////////////////////
-class PreparePendingFeaturesPhase : public ConfigurePhase
-{
-public:
-	PreparePendingFeaturesPhase (Sql::Database& db, const ArrayRef<Uuid>& features)
-		: db_ (db)
-		, features_ (features)
-	{
-	}
+		if (size == 0) {
+			getCallback (hash, ArrayRef<> {}, 0, 0);
+			return true;
+		}
 
-private:
-	void SimulateImpl (int64_t* cost)
+		auto pointer = file->Map ();
+		const ArrayRef<> fileContents{ pointer, size };
+
+		const bool intact = ComputeSHA256 (fileContents) == hash;
+
+		if (intact) {
+			getCallback (hash, fileContents, 0, size);
+		}
+
+		file->Unmap (pointer);
+
+		if (intact) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int64 QueryCost (Sql::Database& db, const std::string& query)
+{
+	auto costQuery = db.Prepare (query);
+	costQuery.Step ();
+
+	return costQuery.GetInt64 (0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Intent journal of a configure run, so an interrupted run can be resumed.
+
+The database is only committed every few megabytes, while files are written
+and removed all the time. The journal records every file before the database
+forgets it, and every file which was written before the database records it.
+It's written without syncing, so it covers the process dying, but not the
+machine going down.
+
+When configure starts, the journal of an interrupted run is replayed:
+removals are completed, and written files whose fingerprint didn't change
+are offered to the plan through the journal_files table, so they are
+neither fetched nor hashed again. Those the plan doesn't resume are removed.
+*/
+class ConfigureJournal final
+{
+public:
+	ConfigureJournal (Sql::Database& db, const Path& path, Log& log)
+		: db_ (db)
+		, journalPath_ (path / "k.kyjournal")
+		, files_ (db.CreateTemporaryTable ("journal_files",
+			"Path TEXT PRIMARY KEY NOT NULL, "
+			"Hash BLOB NOT NULL, "
+			"Size INTEGER NOT NULL, "
+			"ModificationTime INTEGER NOT NULL, "
+			"ChangeTime INTEGER NOT NULL, "
+			"Inode INTEGER NOT NULL"))
 	{
-		auto insertPendingFeatureQuery = GetInsertPendingFeatureQuery ();
+		auto recovered = Recover (path, log);
+		hasRecoveredRecords_ = !recovered.empty ();
+
+		// Recovered files stay in the journal until the database records
+		// them, in case this run gets interrupted as well
+		std::error_code error;
+		std::filesystem::remove (journalPath_, error);
+		file_ = CreateFile (journalPath_);
+
+		std::vector<byte> buffer;
+		for (const auto& record : recovered) {
+			Append (record, buffer);
+		}
 
-		for (const auto& feature : features_) {
-			insertPendingFeatureQuery.BindArguments (feature);
-			insertPendingFeatureQuery.Step ();
-			insertPendingFeatureQuery.Reset ();
+		Write (buffer);
+	}
+
+	ConfigureJournal (const ConfigureJournal&) = delete;
+	ConfigureJournal& operator= (const ConfigureJournal&) = delete;
+
+	/**
+	Record files which are going away. This must be called before they are
+	removed from either the database or the disk.
+	*/
+	void RecordRemovals (const std::vector<Path>& paths)
+	{
+		std::vector<byte> buffer;
+
+		for (const auto& path : paths) {
+			Record record;
+			record.header.type = RecordType::Removal;
+			record.path = path.string ();
+
+			Append (record, buffer);
+		}
+
+		Write (buffer);
+	}
+
+	/**
+	Record a file which was written completely, before it's recorded in the
+	database. This may be called from any thread.
+	*/
+	void RecordDeployment (const Path& path, const SHA256Digest& hash,
+		const int64 size, const FileStat& fingerprint)
+	{
+		Record record;
+		record.header.type = RecordType::Deployment;
+		record.header.size = size;
+		record.header.modificationTime = fingerprint.modificationTime;
+		record.header.changeTime = fingerprint.changeTime;
+		record.header.inode = static_cast<int64> (fingerprint.inode);
+		record.header.hash = hash;
+		record.path = path.string ();
+
+		std::vector<byte> buffer;
+		Append (record, buffer);
+		Write (buffer);
+	}
+
+	/**
+	Remove the recovered files which the plan doesn't resume, because their
+	feature is no longer selected, or they're no longer part of the source.
+	Nothing else knows about them, so they would be left behind otherwise.
+	This must be called once the plan has been computed.
+	*/
+	void RemoveUnplannedFiles (const Path& path, Log& log)
+	{
+		std::vector<Path> unplannedFiles;
+
+		{
+			auto unplannedFilesQuery = db_.Prepare (
+				R"_(SELECT Path FROM journal_files WHERE NOT EXISTS (
+					SELECT 1 FROM plan_files WHERE plan_files.Path = journal_files.Path
+					AND plan_files.Action = 'resume'
+				))_");
+
+			while (unplannedFilesQuery.Step ()) {
+				unplannedFiles.emplace_back (unplannedFilesQuery.GetText (0));
+			}
 		}
 
-		if (cost) {
-			*cost = features_.GetCount ();
+		if (unplannedFiles.empty ()) {
+			return;
 		}
+
+		RecordRemovals (unplannedFiles);
+
+		std::error_code error;
+		for (const auto& unplannedFile : unplannedFiles) {
+			std::filesystem::remove (path / unplannedFile, error);
+
+			log.Debug ("Configure", fmt::format ("Deleted file '{0}' written "
+				"by an interrupted configure", unplannedFile));
+		}
+
+		db_.Execute (
+			R"_(DELETE FROM journal_files WHERE NOT EXISTS (
+				SELECT 1 FROM plan_files WHERE plan_files.Path = journal_files.Path
+				AND plan_files.Action = 'resume'
+			))_");
+
+		auto countQuery = db_.Prepare ("SELECT COUNT(*) FROM journal_files");
+		countQuery.Step ();
+		hasRecoveredRecords_ = countQuery.GetInt64 (0) > 0;
+
+		log.Info ("Configure", fmt::format ("Deleted {0} files written by an "
+			"interrupted configure which are no longer needed",
+			unplannedFiles.size ()));
 	}
 
-	void ExecuteImpl (Log& log, UpdateProgress progress,
-		Repository::ExecutionContext&)
+	/**
+	Check if an interrupted run left records which are still needed.
+	*/
+	bool HasRecoveredRecords () const
+	{
+		return hasRecoveredRecords_;
+	}
+
+	/**
+	Remove the journal once configure has committed everything.
+	*/
+	void Complete ()
+	{
+		std::lock_guard<std::mutex> lock{ mutex_ };
+		file_.reset ();
+
+		std::filesystem::remove (journalPath_);
+	}
+
+private:
+	enum RecordType : int64
+	{
+		Removal = 1,
+		Deployment = 2
+	};
+
+	/**
+	On-disk header of a journal record, followed by PathSize bytes of the
+	path.
+	*/
+	struct RecordHeader
+	{
+		int64 type = 0;
+		int64 pathSize = 0;
+		int64 size = 0;
+		int64 modificationTime = 0;
+		int64 changeTime = 0;
+		int64 inode = 0;
+		SHA256Digest hash;
+	};
+
+	static_assert (sizeof (RecordHeader) == 80,
+		"Journal records must not contain padding");
+
+	struct Record
+	{
+		RecordHeader header;
+		std::string path;
+	};
+
+	static void Append (Record record, std::vector<byte>& buffer)
+	{
+		record.header.pathSize = static_cast<int64> (record.path.size ());
+
+		const auto header = reinterpret_cast<const byte*> (&record.header);
+		buffer.insert (buffer.end (), header, header + sizeof (RecordHeader));
+		buffer.insert (buffer.end (), record.path.begin (), record.path.end ());
+	}
+
+	/**
+	Records are written right away without buffering, so they survive the
+	process dying.
+	*/
+	void Write (const std::vector<byte>& buffer)
+	{
+		std::lock_guard<std::mutex> lock{ mutex_ };
+
+		if (file_ && !buffer.empty ()) {
+			file_->Write (buffer);
+		}
+	}
+
+	/**
+	Replay the journal of an interrupted run. Only the last record of every
+	path counts, as a file may have been removed and written again. Returns
+	the written files which could be recovered.
+	*/
+	std::vector<Record> Recover (const Path& path, Log& log)
 	{
+		std::vector<Record> result;
+
+		if (!std::filesystem::exists (journalPath_)) {
+			return result;
+		}
+
+		std::vector<byte> contents;
+
+		{
+			auto file = OpenFile (journalPath_, FileAccess::Read);
+			contents.resize (static_cast<size_t> (file->GetSize ()));
+			file->Read (contents);
+		}
+
+		std::map<std::string, Record> records;
+
+		// A record which was only partially written is ignored
+		for (size_t offset = 0; offset + sizeof (RecordHeader) <= contents.size (); ) {
+			Record record;
+			::memcpy (&record.header, contents.data () + offset, sizeof (RecordHeader));
+			offset += sizeof (RecordHeader);
+
+			if (record.header.pathSize <= 0 ||
+				record.header.pathSize > static_cast<int64> (contents.size () - offset)) {
+				break;
+			}
+
+			record.path.assign (reinterpret_cast<const char*> (contents.data () + offset),
+				static_cast<size_t> (record.header.pathSize));
+			offset += static_cast<size_t> (record.header.pathSize);
+
+			auto key = record.path;
+			records [key] = std::move (record);
+		}
+
 		auto transaction = db_.BeginTransaction ();
-		auto insertPendingFeatureQuery = GetInsertPendingFeatureQuery ();
 
-		log.Debug ("Configure", "Selecting features for configure");
+		auto isRecordedQuery = db_.Prepare (
+			"SELECT 1 FROM main.fs_files WHERE Path = ?");
+		auto deleteFileQuery = db_.Prepare (
+			"DELETE FROM main.fs_files WHERE Path = ?");
+		auto insertFileQuery = db_.Prepare (
+			"INSERT INTO journal_files (Path, Hash, Size, ModificationTime, ChangeTime, Inode) "
+			"VALUES (?, ?, ?, ?, ?, ?)");
 
-		for (const auto& feature : features_) {
-			insertPendingFeatureQuery.BindArguments (feature);
-			insertPendingFeatureQuery.Step ();
-			insertPendingFeatureQuery.Reset ();
+		int64 removedCount = 0;
+		std::error_code error;
 
-			progress ("Selected feature", 1);
+		for (auto& entry : records) {
+			auto& record = entry.second;
+			const auto filePath = path / record.path;
 
-			log.Debug ("Configure", 
-				fmt::format ("Selected feature: '{0}'", ToString (feature)));
+			if (record.header.type == RecordType::Removal) {
+				deleteFileQuery.BindArguments (record.path);
+				deleteFileQuery.Step ();
+				deleteFileQuery.Reset ();
+
+				std::filesystem::remove (filePath, error);
+				++removedCount;
+
+				continue;
+			} else if (record.header.type != RecordType::Deployment) {
+				continue;
+			}
+
+			isRecordedQuery.BindArguments (record.path);
+			const auto isRecorded = isRecordedQuery.Step ();
+			isRecordedQuery.Reset ();
+
+			if (isRecorded) {
+				continue;
+			}
+
+			// Files which changed since they were written can't be trusted,
+			// and nothing else knows about them
+			if (!std::filesystem::is_regular_file (filePath, error)) {
+				continue;
+			}
+
+			const auto fingerprint = Stat (filePath);
+
+			if (static_cast<int64> (fingerprint.size) != record.header.size
+				|| fingerprint.modificationTime != record.header.modificationTime
+				|| (record.header.changeTime != 0
+					&& fingerprint.changeTime != record.header.changeTime)
+				|| static_cast<int64> (fingerprint.inode) != record.header.inode) {
+				std::filesystem::remove (filePath, error);
+				continue;
+			}
+
+			insertFileQuery.BindArguments (record.path, record.header.hash,
+				record.header.size, record.header.modificationTime,
+				record.header.changeTime, record.header.inode);
+			insertFileQuery.Step ();
+			insertFileQuery.Reset ();
+
+			result.push_back (std::move (record));
 		}
 
 		transaction.Commit ();
+
+		log.Info ("Configure",
+			fmt::format ("Resuming interrupted configure, completed {0} removals, "
+				"recovered {1} written files", removedCount, result.size ()));
+
+		return result;
+	}
+
+	Sql::Database& db_;
+	Path journalPath_;
+	Sql::TemporaryTable files_;
+	std::mutex mutex_;
+	std::unique_ptr<File> file_;
+	bool hasRecoveredRecords_ = false;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+The difference between the deployment and the pending features, computed
+once before anything gets changed.
+
+The plan is the temporary table plan_files, which holds every file of the
+pending features with its contents and feature, and what to do with it:
+
+- 'keep' if the file is deployed with the right contents already. Only its
+  feature may need to be updated.
+- 'copy' if the contents are deployed at another location which remains.
+- 'fetch' if the contents must be fetched from the source.
+- 'resume' if an interrupted run wrote the file already, see
+  ConfigureJournal. It only needs to be recorded.
+
+Deployed files which are not kept are removed first, and deployed files
+which are not in the plan at all are removed at the end. Everything is
+computed with joins on indexed columns, so the phases which execute the plan
+only need index lookups, and the cost grows with n log n in the number of
+files.
+*/
+class ConfigurePlan final
+{
+public:
+	ConfigurePlan (Sql::Database& db)
+		: files_ (db.CreateTemporaryTable ("plan_files",
+			"Path TEXT PRIMARY KEY NOT NULL, "
+			"Hash BLOB NOT NULL, "
+			"Size INTEGER NOT NULL, "
+			"FeatureUuid BLOB NOT NULL, "
+			"Deployed INTEGER NOT NULL, "
+			"Action TEXT"))
+		, remainingContents_ (db.CreateTemporaryTable ("plan_remaining_contents",
+			"Hash BLOB PRIMARY KEY NOT NULL"))
+	{
+		auto transaction = db.BeginTransaction ();
+
+		db.Execute (
+			R"_(INSERT INTO plan_files (Path, Hash, Size, FeatureUuid, Deployed, Action)
+			SELECT 
+				source.fs_files.Path,
+				source.fs_contents.Hash,
+				source.fs_contents.Size,
+				source.features.Uuid,
+				main.fs_files.Path IS NOT NULL,
+				CASE WHEN main.fs_contents.Hash = source.fs_contents.Hash 
+					THEN 'keep'
+				WHEN EXISTS (SELECT 1 FROM journal_files
+					WHERE journal_files.Path = source.fs_files.Path
+					AND journal_files.Hash = source.fs_contents.Hash)
+					THEN 'resume' END
+			FROM pending_features
+			INNER JOIN source.features ON source.features.Uuid = pending_features.Uuid
+			INNER JOIN source.fs_files ON source.fs_files.FeatureId = source.features.Id
+			INNER JOIN source.fs_contents ON source.fs_contents.Id = source.fs_files.ContentId
+			LEFT JOIN main.fs_files ON main.fs_files.Path = source.fs_files.Path
+			LEFT JOIN main.fs_contents ON main.fs_contents.Id = main.fs_files.ContentId)_");
+
+		// Files which are not part of the pending features are only removed
+		// at the end, so they can still be copied. Resumed files are
+		// recorded before anything is copied
+		db.Execute (
+			R"_(INSERT INTO plan_remaining_contents (Hash)
+			SELECT DISTINCT main.fs_contents.Hash
+			FROM main.fs_files
+			INNER JOIN main.fs_contents ON main.fs_contents.Id = main.fs_files.ContentId
+			LEFT JOIN plan_files ON plan_files.Path = main.fs_files.Path
+			WHERE plan_files.Path IS NULL OR plan_files.Action = 'keep'
+			UNION
+			SELECT Hash FROM plan_files WHERE Action = 'resume')_");
+
+		db.Execute (
+			R"_(UPDATE plan_files SET Action = 
+				CASE WHEN Hash IN (SELECT Hash FROM plan_remaining_contents) 
+				THEN 'copy' ELSE 'fetch' END
+			WHERE Action IS NULL)_");
+
+		db.Execute ("CREATE INDEX plan_files_action_hash_idx ON plan_files (Action, Hash)");
+
+		transaction.Commit ();
 	}
 
-	Sql::Statement GetInsertPendingFeatureQuery ()
+private:
+	Sql::TemporaryTable files_;
+	Sql::TemporaryTable remainingContents_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+Sql::Statement PrepareInsertPlannedFileQuery (Sql::Database& db)
+{
+	return db.Prepare (
+		R"_(INSERT INTO main.fs_files (Path, ContentId, FeatureId)
+		SELECT ?1, ?2, main.features.Id FROM plan_files
+		INNER JOIN main.features ON main.features.Uuid = plan_files.FeatureUuid
+		WHERE plan_files.Path = ?1)_");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+class ConfigurePhase
+{
+public:
+	using UpdateProgress = std::function<void (const std::string& action, const int64_t cost)>;
+
+	virtual ~ConfigurePhase () = default;
+
+	/**
+	Estimate the cost of this phase, in the units it reports progress in.
+
+	All estimates are computed up-front from the ConfigurePlan, before any
+	phase is executed. This has to be cheap - a few aggregate queries at
+	most - and doesn't have to be exact, as the progress is clamped.
+	*/
+	int64 EstimateCost ()
 	{
-		return db_.Prepare (
-			"INSERT INTO pending_features (Uuid) VALUES (?);");;
+		return EstimateCostImpl ();
 	}
 
-	Sql::Database& db_;
-	const ArrayRef<Uuid>& features_;
+	void Execute (Log& log, UpdateProgress progress,
+		Repository::ExecutionContext& context)
+	{
+		ExecuteImpl (log, progress, context);
+	}
+
+private:
+	virtual int64 EstimateCostImpl () = 0;
+	virtual void ExecuteImpl (Log& log, UpdateProgress progress,
+		Repository::ExecutionContext& context) = 0;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -294,13 +1353,9 @@ public:
 	}
 
 private:
-	void SimulateImpl (int64_t* cost)
+	int64 EstimateCostImpl ()
 	{
-		ExecuteQuery ();
-
-		if (cost) {
-			*cost = 1;
-		}
+		return 1;
 	}
 
 	void ExecuteImpl (Log&, UpdateProgress progress,
@@ -368,13 +1423,9 @@ public:
 	}
 
 private:
-	void SimulateImpl (int64_t* cost)
+	int64 EstimateCostImpl ()
 	{
-		ExecuteQuery ();
-
-		if (cost) {
-			*cost = 1;
-		}
+		return 1;
 	}
 
 	void ExecuteImpl (Log&, UpdateProgress progress,
@@ -387,616 +1438,1690 @@ private:
 
 	void ExecuteQuery ()
 	{
-		auto tempTable = db_.CreateTemporaryTable ("temp_file_path_to_new_id",
-			"Path VARCHAR NOT NULL UNIQUE, Id INTEGER NOT NULL");
-
-		db_.Execute (
-			R"_(INSERT INTO temp_file_path_to_new_id (Path, Id)
-			-- We'll index using Path, FeatureId below
-			-- main.features.Id has been updated already
-			SELECT main.fs_files.Path AS Path, main.features.Id AS Id
-			FROM main.fs_files
-			-- Current files <-> contents are linked through the ContentId
-			INNER JOIN main.fs_contents ON main.fs_files.ContentId = main.fs_contents.Id
-			-- Current files <-> source files are linked through the unique Path
-			INNER JOIN source.fs_files ON source.fs_files.Path = main.fs_files.Path
-			-- We only want the files which didn't change content, that is, with the
-			-- same hash
-			INNER JOIN source.fs_contents ON main.fs_contents.Hash = source.fs_contents.Hash
-			-- We need to link the features on the source side to their UUID
-			INNER JOIN source.features ON source.features.Id = source.fs_files.FeatureId
-			-- We need to link our (new) feeature Id to the source feature Id through the UUID
-			INNER JOIN main.features ON main.features.Uuid = source.features.Uuid;)_"
-		);
-
-		// For files which have the same location and hash as before, update
-		// the feature id
-		// This long query will find every file where the hash and the path
-		// remained the same, and update it to use the new file set id we just
-		// inserted above
+		// Files which remain with the same contents may have moved to
+		// another feature. main.features has been updated already
 		db_.Execute (
-			R"_(
-		UPDATE fs_files 
-		SET FeatureId = (
-			SELECT Id 
-			FROM temp_file_path_to_new_id 
-			WHERE Path=temp_file_path_to_new_id.Path)
-		WHERE Path = (
-			SELECT Path 
-			FROM temp_file_path_to_new_id);
-		)_");
+			R"_(UPDATE main.fs_files SET FeatureId = main.features.Id
+			FROM plan_files
+			INNER JOIN main.features ON main.features.Uuid = plan_files.FeatureUuid
+			WHERE plan_files.Path = main.fs_files.Path
+			AND plan_files.Action = 'keep'
+			AND main.fs_files.FeatureId IS NOT main.features.Id)_");
 	}
 
 	Sql::Database& db_;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
-class RemoveChangedFilesPhase : public ConfigurePhase
+/**
+Record the files an interrupted run wrote already. The journal checked
+their fingerprints, so they are recorded as they are.
+*/
+class RecordResumedFilesPhase : public ConfigurePhase
 {
 public:
-	RemoveChangedFilesPhase (Sql::Database& database, Path& path)
-		: db_ (database)
-		, path_ (path)
+	RecordResumedFilesPhase (Sql::Database& db)
+		: db_ (db)
 	{
 	}
 
 private:
-	virtual void SimulateImpl (int64_t* cost) override
+	virtual int64 EstimateCostImpl () override
 	{
-		auto changedFilesTable = CreateChangedFileTable ();
+		return QueryCost (db_,
+			"SELECT IFNULL (SUM (Size), 0) FROM plan_files WHERE Action = 'resume'");
+	}
 
-		auto countChangedFilesQuery = db_.Prepare ("SELECT COUNT(*) from pending_changed_files");
-		countChangedFilesQuery.Step ();
+	virtual void ExecuteImpl (Log& log, UpdateProgress progress,
+		Repository::ExecutionContext& context) override
+	{
+		auto transaction = db_.BeginTransaction ();
 
-		if (cost) {
-			*cost = countChangedFilesQuery.GetInt64 (0);
-		}
+		db_.Execute (
+			R"_(INSERT INTO main.fs_contents (Hash, Size)
+			SELECT DISTINCT Hash, Size FROM plan_files
+			WHERE Action = 'resume'
+			AND NOT EXISTS (SELECT 1 FROM main.fs_contents
+				WHERE main.fs_contents.Hash = plan_files.Hash))_");
 
-		auto deleteChangedFilesQuery = db_.Prepare (
-			"DELETE FROM fs_files WHERE Path=(SELECT Path FROM pending_changed_files)");
-		deleteChangedFilesQuery.Step ();
+		db_.Execute (
+			R"_(INSERT INTO main.fs_files (Path, ContentId, FeatureId)
+			SELECT plan_files.Path, main.fs_contents.Id, main.features.Id
+			FROM plan_files
+			INNER JOIN main.fs_contents ON main.fs_contents.Hash = plan_files.Hash
+			INNER JOIN main.features ON main.features.Uuid = plan_files.FeatureUuid
+			WHERE plan_files.Action = 'resume')_");
 
 		db_.Execute (
-			R"_(DELETE FROM fs_contents
-			WHERE Id IN
-			(SELECT Id FROM fs_contents_with_reference_count WHERE ReferenceCount = 0))_");
+			R"_(INSERT OR REPLACE INTO fs_file_fingerprints
+				(Path, Size, ModificationTime, ChangeTime, Inode)
+			SELECT journal_files.Path, journal_files.Size,
+				journal_files.ModificationTime, journal_files.ChangeTime,
+				journal_files.Inode
+			FROM journal_files
+			INNER JOIN plan_files ON plan_files.Path = journal_files.Path
+			WHERE plan_files.Action = 'resume')_");
+
+		auto resumedFilesQuery = db_.Prepare (
+			"SELECT Path, Size FROM plan_files WHERE Action = 'resume'");
+
+		while (resumedFilesQuery.Step ()) {
+			const auto path = resumedFilesQuery.GetText (0);
+			const auto size = resumedFilesQuery.GetInt64 (1);
+
+			if (context.fileDeployed) {
+				context.fileDeployed (path, size);
+			}
+
+			progress (path, size);
+
+			log.Debug ("Configure", fmt::format ("Resumed file '{0}'", path));
+		}
+
+		transaction.Commit ();
 	}
 
-	virtual void ExecuteImpl (Log& log, UpdateProgress progress,
-		Repository::ExecutionContext&) override
-	{
-		auto changedFilesTable = CreateChangedFileTable ();
+	Sql::Database& db_;
+};
 
-		// First, get rid of all files that are changing
-		// That is, if a file is referencing a different content_object,
-		// we have to remove it (those files will get replaced)
-		auto changedFilesQuery = db_.Prepare ("SELECT Path FROM pending_changed_files;");
+///////////////////////////////////////////////////////////////////////////////
+/**
+Get how files with the same content should be duplicated. If DeployHardLinks
+is set to a non-zero value, they are hard linked, otherwise they are copied.
+*/
+DuplicateMode GetDuplicateMode (const Repository::ExecutionContext& context)
+{
+	using EC = Repository::ExecutionContext;
 
-		// files
-		{
-			auto deleteFileQuery = db_.Prepare (
-				"DELETE FROM fs_files WHERE Path=?");
+	auto it = context.variables.find (EC::DeployHardLinks);
 
-			while (changedFilesQuery.Step ()) {
-				deleteFileQuery.BindArguments (changedFilesQuery.GetText (0));
-				deleteFileQuery.Step ();
-				deleteFileQuery.Reset ();
+	if (it == context.variables.end ()) {
+		return DuplicateMode::Copy;
+	}
 
-				std::filesystem::remove (path_ / Path{ changedFilesQuery.GetText (0) });
+	if (it->second.GetSize () != sizeof (int)) {
+		throw RuntimeException ("Configure",
+			fmt::format ("Variable '{}' must be an integer",
+				EC::DeployHardLinks),
+			KYLA_FILE_LINE);
+	}
 
-				const auto actionDescription = fmt::format ("Deleted file '{0}'", 
-					changedFilesQuery.GetText (0));
+	return it->second.GetInt () ? DuplicateMode::HardLink : DuplicateMode::Copy;
+}
 
-				progress (actionDescription, 1);
-				log.Debug ("Configure", actionDescription);
-			}
+///////////////////////////////////////////////////////////////////////////////
+/**
+Check if the configure mode is "stage". By default, a configure is "full".
+*/
+bool IsStageOnly (const Repository::ExecutionContext& context)
+{
+	using EC = Repository::ExecutionContext;
 
-			log.Debug ("Configure", "Deleted changed files from repository");
-		}
+	auto it = context.variables.find (EC::ConfigureMode);
 
-		// content objects
-		db_.Execute ("DELETE FROM fs_contents "
-			"WHERE Id IN "
-			"(SELECT Id FROM fs_contents_with_reference_count WHERE ReferenceCount = 0)");
+	if (it == context.variables.end ()) {
+		return false;
 	}
 
-	Sql::TemporaryTable CreateChangedFileTable ()
-	{
-		auto table = db_.CreateTemporaryTable ("pending_changed_files", "Path VARCHAR NOT NULL UNIQUE");
+	const std::string mode = it->second.GetString ();
 
-		auto insertPendingFeatureQuery = db_.Prepare (
-			R"_(INSERT INTO pending_changed_files (Path)
-			SELECT Path FROM (
-				SELECT 
-					main.fs_files.Path AS Path, 
-					main.fs_contents.Hash AS CurrentHash, 
-					source.fs_contents.Hash AS NewHash 
-				FROM main.fs_files
-				INNER JOIN main.fs_contents ON main.fs_files.ContentId = main.fs_contents.Id
-				INNER JOIN source.fs_files ON source.fs_files.Path = main.fs_files.Path
-				INNER JOIN source.fs_contents ON source.fs_files.ContentId = source.fs_contents.Id
-				WHERE CurrentHash IS NOT NewHash
-				AND source.fs_files.FeatureId IN
-				(SELECT Id FROM source.features
-				WHERE Uuid IN (SELECT Uuid FROM pending_features))
-				) AS t)_");
-
-		insertPendingFeatureQuery.Step ();
-		return table;
+	if (mode != "full" && mode != "stage") {
+		throw RuntimeException ("Configure",
+			fmt::format ("Invalid configure mode '{0}', must be one of "
+				"'full' or 'stage'", mode),
+			KYLA_FILE_LINE);
 	}
 
-	Sql::Database& db_;
-	Path path_;
-};
+	return mode == "stage";
+}
 
 ///////////////////////////////////////////////////////////////////////////////
-class GetContentPhase : public ConfigurePhase
+/**
+Writes files on several threads.
+
+All jobs submitted for the same content object run on the same worker, in
+the order they were submitted, so the chunks of an object are written in
+order. Workers never touch the database. Instead, a job returns a commit
+function, which is run by the thread calling Commit or Wait, so all
+bookkeeping happens on a single thread. Commit functions run in the order
+their jobs were submitted, regardless of which worker finishes first, so
+content objects are recorded in the order they were delivered.
+*/
+class FileWriterPool final
 {
 public:
-	GetContentPhase (Sql::Database& database, Path& path, Repository& sourceRepository)
-		: db_ (database)
-		, path_ (path)
-		, source_ (sourceRepository)
+	using CommitFunction = std::function<void ()>;
+	using Job = std::function<CommitFunction ()>;
+
+	explicit FileWriterPool (const int workerCount)
 	{
+		assert (workerCount > 0);
+
+		for (int i = 0; i < workerCount; ++i) {
+			workers_.emplace_back (std::make_unique<Worker> ());
+		}
+
+		for (auto& worker : workers_) {
+			worker->thread = std::thread{ [this, w = worker.get ()]() -> void {
+				Run (*w);
+			} };
+		}
 	}
 
-private:
-	virtual void SimulateImpl (int64_t* cost) override
+	/**
+	Waits for all queued jobs, but doesn't run their commit functions.
+	*/
+	~FileWriterPool ()
 	{
-		int64_t totalCost = 0;
-		
-		auto requestedContentObjectTable = CreateRequestedContentObjectTable ();
+		{
+			std::lock_guard<std::mutex> lock{ mutex_ };
+			stop_ = true;
+		}
 
-		auto insertFileQuery = PrepareInsertFileQuery ();
+		jobAvailable_.notify_all ();
 
-		auto insertContentObjectQuery = db_.Prepare (
-			"INSERT INTO fs_contents (Hash, Size) "
-			"VALUES (?, ?);");
+		for (auto& worker : workers_) {
+			worker->thread.join ();
+		}
+	}
 
-		auto getTargetFilesQuery = db_.Prepare (
-			"SELECT Path FROM source.fs_files "
-			"WHERE source.fs_files.ContentId = (SELECT Id FROM source.fs_contents WHERE source.fs_contents.Hash = ?)");
-
-		auto selectRequestedContentObjectsQuery = db_.Prepare (
-			R"_(SELECT requested_content_objects.Hash AS Hash,
-			       	   source.fs_contents.Size AS Size
-				FROM requested_content_objects
-				INNER JOIN source.fs_contents ON
-					source.fs_contents.Hash = requested_content_objects.Hash;
-			)_"
-		);
-
-		int64_t totalSize = 0;
-		while (selectRequestedContentObjectsQuery.Step ()) {
-			SHA256Digest hash;
-			selectRequestedContentObjectsQuery.GetBlob (0, hash);
-			int64_t objectSize = selectRequestedContentObjectsQuery.GetInt64 (1);
+	FileWriterPool (const FileWriterPool&) = delete;
+	FileWriterPool& operator= (const FileWriterPool&) = delete;
+
+	static int GetDefaultWorkerCount ()
+	{
+		// Writing is mostly waiting for the file system, so we use a few
+		// workers even on small machines
+		return static_cast<int> (std::clamp (
+			std::thread::hardware_concurrency (), 2u, 8u));
+	}
+
+	void Submit (const SHA256Digest& hash, Job&& job)
+	{
+		{
+			std::lock_guard<std::mutex> lock{ mutex_ };
+
+			auto& worker = *workers_ [ArrayRefHash{}(hash) % workers_.size ()];
+			worker.jobs.push_back ({ nextSequence_++, std::move (job) });
+			++pendingJobs_;
+		}
+
+		jobAvailable_.notify_all ();
+	}
+
+	/**
+	Run the commit functions of all finished jobs which were submitted
+	before any job which is still running. If a job failed, its exception is
+	rethrown here.
+	*/
+	void Commit ()
+	{
+		std::vector<CommitFunction> commits;
+		std::exception_ptr error;
+
+		{
+			std::lock_guard<std::mutex> lock{ mutex_ };
+
+			while (!finished_.empty () &&
+				finished_.begin ()->first == nextCommit_) {
+				auto& commit = finished_.begin ()->second;
+
+				if (commit) {
+					commits.emplace_back (std::move (commit));
+				}
+
+				finished_.erase (finished_.begin ());
+				++nextCommit_;
+			}
+
+			error = error_;
+		}
+
+		if (error) {
+			std::rethrow_exception (error);
+		}
+
+		for (auto& commit : commits) {
+			commit ();
+		}
+	}
+
+	/**
+	Wait until at least one more job has finished. Returns false if there
+	are no pending jobs.
+	*/
+	bool WaitForJob ()
+	{
+		std::unique_lock<std::mutex> lock{ mutex_ };
+
+		if (pendingJobs_ == 0) {
+			return false;
+		}
+
+		const auto finishedJobs = finishedJobs_;
+		jobDone_.wait (lock, [&]() -> bool {
+			return finishedJobs_ != finishedJobs;
+		});
+
+		return true;
+	}
+
+	/**
+	Wait for all pending jobs and commit them.
+	*/
+	void Wait ()
+	{
+		{
+			std::unique_lock<std::mutex> lock{ mutex_ };
+			jobDone_.wait (lock, [&]() -> bool {
+				return pendingJobs_ == 0;
+			});
+		}
+
+		Commit ();
+	}
+
+private:
+	struct QueuedJob
+	{
+		int64 sequence;
+		Job job;
+	};
+
+	struct Worker
+	{
+		std::deque<QueuedJob> jobs;
+		std::thread thread;
+	};
+
+	void Run (Worker& worker)
+	{
+		for (;;) {
+			QueuedJob job;
+
+			{
+				std::unique_lock<std::mutex> lock{ mutex_ };
+				jobAvailable_.wait (lock, [&]() -> bool {
+					return stop_ || !worker.jobs.empty ();
+				});
+
+				if (worker.jobs.empty ()) {
+					return;
+				}
+
+				job = std::move (worker.jobs.front ());
+				worker.jobs.pop_front ();
+			}
+
+			CommitFunction commit;
+			std::exception_ptr error;
+
+			try {
+				commit = job.job ();
+			} catch (const std::exception&) {
+				error = std::current_exception ();
+			}
+
+			// This releases the buffers held by the job
+			job.job = Job{};
+
+			{
+				std::lock_guard<std::mutex> lock{ mutex_ };
+
+				// Jobs without a commit function are kept as well, as they
+				// hold back the commits of jobs submitted after them
+				finished_.emplace (job.sequence, std::move (commit));
+
+				if (error && !error_) {
+					error_ = error;
+				}
+
+				--pendingJobs_;
+				++finishedJobs_;
+			}
+
+			jobDone_.notify_all ();
+		}
+	}
+
+	std::mutex mutex_;
+	std::condition_variable jobAvailable_;
+	std::condition_variable jobDone_;
+	std::vector<std::unique_ptr<Worker>> workers_;
+	// Commit functions of finished jobs by the sequence number of their job
+	std::map<int64, CommitFunction> finished_;
+	std::exception_ptr error_;
+	int64 nextSequence_ = 0;
+	int64 nextCommit_ = 0;
+	int64 pendingJobs_ = 0;
+	int64 finishedJobs_ = 0;
+	bool stop_ = false;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+On-disk record of a chunk written into a staging file. The progress file
+is a sequence of these.
+*/
+struct StagedChunkRecord
+{
+	int64 offset;
+	int64 size;
+	SHA256Digest hash;
+};
+
+static_assert (sizeof (StagedChunkRecord) == 48,
+	"Staged chunk records must not contain padding");
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+The chunks of a content object which are present in its staging file.
+*/
+struct StagedObject
+{
+	int64 totalSize = 0;
+	int64 receivedSize = 0;
+	// Offset to size of the chunks present in the staging file
+	std::map<int64, int64> chunks;
+
+	/**
+	Mark a chunk as present. Chunks it overlaps are overwritten, which
+	can only happen if the source uses a different chunking.
+	*/
+	void AddChunk (const int64 offset, const int64 size)
+	{
+		auto it = chunks.lower_bound (offset);
+
+		if (it != chunks.begin ()) {
+			auto previous = std::prev (it);
+			if (previous->first + previous->second > offset) {
+				it = previous;
+			}
+		}
+
+		while (it != chunks.end () && it->first < offset + size) {
+			receivedSize -= it->second;
+			it = chunks.erase (it);
+		}
+
+		chunks [offset] = size;
+		receivedSize += size;
+	}
+};
+
+using StagedObjects = std::unordered_map<SHA256Digest, StagedObject,
+	ArrayRefHash, ArrayRefEqual>;
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Staging files live next to the deployed files, so they can be renamed into
+place.
+*/
+Path GetStagingFilePath (const Path& path, const SHA256Digest& hash)
+{
+	return path / (ToString (hash) + ".kytmp");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+Path GetStagingProgressPath (const Path& path, const SHA256Digest& hash)
+{
+	return path / (ToString (hash) + ".kyprogress");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Work the configure phases hand over to each other, so the local file system
+work overlaps with fetching content.
+
+The local worker runs its jobs in the order they were submitted: first the
+changed files are removed, then files are copied from deployed ones, and
+then the unused files are removed, which may have been needed as copy
+sources. None of these touch the files written while fetching content, except
+for the changed files, which can only be written once they are gone.
+*/
+struct ConfigurePipeline
+{
+	ConfigurePipeline (const Path& path, ConfigureJournal& journal)
+		: tree (path)
+		, journal (journal)
+	{
+	}
+
+	// Creates and removes the files of the deployment. This must outlive
+	// the local worker, which uses it
+	DirectoryTree tree;
+	ConfigureJournal& journal;
+	FileWriterPool localWork{ 1 };
+	std::shared_future<void> changedFilesRemoved;
+	// Chunks of changed files which were copied into staging files before
+	// the files were removed
+	StagedObjects reusedChunks;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Copy the chunks of changed files which are still the same in the new content
+into staging files, before the changed files are removed. Only the other
+chunks are fetched then.
+
+The local file is compared at the chunk offsets the source uses for the new
+content, using the hashes of the uncompressed chunks. This finds edits which
+keep the rest of the file in place, and appended data.
+*/
+class ReuseLocalChunksPhase : public ConfigurePhase
+{
+public:
+	ReuseLocalChunksPhase (Sql::Database& database, Path& path,
+		Repository& sourceRepository, ConfigurePipeline& pipeline)
+		: db_ (database)
+		, path_ (path)
+		, source_ (sourceRepository)
+		, pipeline_ (pipeline)
+	{
+	}
+
+private:
+	virtual int64 EstimateCostImpl () override
+	{
+		// The reused chunks are reported with the fetched content
+		return 0;
+	}
+
+	virtual void ExecuteImpl (Log& log, UpdateProgress,
+		Repository::ExecutionContext& context) override
+	{
+		if (!source_.GetDatabase ().HasTable ("fs_chunk_source_hashes")) {
+			return;
+		}
+
+		// One local file is enough for every content object
+		auto changedFilesQuery = db_.Prepare (
+			"SELECT Hash, Size, MIN (Path) FROM plan_files "
+			"WHERE Action = 'fetch' AND Deployed "
+			"GROUP BY Hash");
+
+		auto chunksQuery = db_.Prepare (
+			"SELECT DISTINCT source.fs_chunks.SourceOffset, source.fs_chunks.SourceSize, "
+			"    source.fs_chunk_source_hashes.Hash "
+			"FROM source.fs_chunks "
+			"INNER JOIN source.fs_contents ON source.fs_contents.Id = source.fs_chunks.ContentId "
+			"INNER JOIN source.fs_chunk_source_hashes "
+			"    ON source.fs_chunk_source_hashes.ChunkId = source.fs_chunks.Id "
+			"WHERE source.fs_contents.Hash = ? "
+			"ORDER BY source.fs_chunks.SourceOffset");
+
+		std::vector<StagedChunkRecord> chunks;
+		int64 reusedSize = 0;
+
+		while (changedFilesQuery.Step ()) {
+			SHA256Digest hash;
+			changedFilesQuery.GetBlob (0, hash);
+			const auto totalSize = changedFilesQuery.GetInt64 (1);
+			const Path localPath = path_ / Path{ changedFilesQuery.GetText (2) };
+
+			// Staging files of an interrupted run are resumed instead
+			if (std::filesystem::exists (GetStagingFilePath (path_, hash))) {
+				continue;
+			}
+
+			chunks.clear ();
+			int64 maxChunkSize = 0;
+
+			chunksQuery.BindArguments (hash);
+			while (chunksQuery.Step ()) {
+				StagedChunkRecord chunk;
+				chunk.offset = chunksQuery.GetInt64 (0);
+				chunk.size = chunksQuery.GetInt64 (1);
+				chunksQuery.GetBlob (2, chunk.hash);
+
+				maxChunkSize = std::max (maxChunkSize, chunk.size);
+				chunks.push_back (chunk);
+			}
+			chunksQuery.Reset ();
+
+			// A single chunk is the whole content, which has changed
+			if (chunks.size () < 2) {
+				continue;
+			}
+
+			try {
+				auto staged = ReuseChunks (hash, totalSize, localPath, chunks,
+					MemoryReservation{ context.GetMemoryBudget (), maxChunkSize });
+
+				if (!staged.chunks.empty ()) {
+					log.Debug ("Configure", fmt::format ("Reused {0} bytes of '{1}' for "
+						"content object '{2}'", staged.receivedSize, localPath,
+						ToString (hash)));
+
+					reusedSize += staged.receivedSize;
+					pipeline_.reusedChunks.emplace (hash, std::move (staged));
+				}
+			} catch (const std::exception& e) {
+				// The whole object gets fetched then, which covers whatever
+				// was staged
+				log.Debug ("Configure", fmt::format ("Could not reuse chunks of "
+					"'{0}': {1}", localPath, e.what ()));
+			}
+		}
+
+		if (!pipeline_.reusedChunks.empty ()) {
+			log.Info ("Configure", fmt::format ("Reusing {0} bytes of {1} changed "
+				"files", reusedSize, pipeline_.reusedChunks.size ()));
+		}
+	}
+
+	/**
+	Copy the chunks of the local file which match the new content into the
+	staging file. The staging file is only created once a chunk matches.
+	*/
+	StagedObject ReuseChunks (const SHA256Digest& hash, const int64 totalSize,
+		const Path& localPath, const std::vector<StagedChunkRecord>& chunks,
+		MemoryReservation reservation)
+	{
+		StagedObject result;
+		result.totalSize = totalSize;
+
+		auto localFile = OpenFile (localPath, FileAccess::Read);
+		const auto localSize = localFile->GetSize ();
+
+		std::unique_ptr<File> stagingFile;
+		std::unique_ptr<File> progressFile;
+
+		// The buffer never grows past the reservation, which covers the
+		// largest chunk
+		std::vector<byte> buffer;
+		buffer.reserve (static_cast<size_t> (reservation.GetSize ()));
+
+		for (const auto& chunk : chunks) {
+			if (chunk.offset + chunk.size > localSize) {
+				break;
+			}
+
+			if (chunk.size > reservation.GetSize ()) {
+				continue;
+			}
+
+			buffer.resize (chunk.size);
+			localFile->Seek (chunk.offset);
+
+			if (localFile->Read (buffer) != chunk.size ||
+				ComputeSHA256 (buffer) != chunk.hash) {
+				continue;
+			}
+
+			if (!stagingFile) {
+				stagingFile = CreateFile (GetStagingFilePath (path_, hash));
+				stagingFile->Preallocate (totalSize);
+				progressFile = CreateFile (GetStagingProgressPath (path_, hash));
+			}
+
+			stagingFile->WriteAt (chunk.offset, buffer);
+			progressFile->Write (ArrayRef<>{ &chunk, sizeof (chunk) });
+
+			result.AddChunk (chunk.offset, chunk.size);
+		}
+
+		return result;
+	}
+
+	Sql::Database& db_;
+	Path path_;
+	Repository& source_;
+	ConfigurePipeline& pipeline_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+class RemoveChangedFilesPhase : public ConfigurePhase
+{
+public:
+	RemoveChangedFilesPhase (Sql::Database& database, Path& path,
+		ConfigurePipeline& pipeline)
+		: db_ (database)
+		, path_ (path)
+		, pipeline_ (pipeline)
+	{
+	}
+
+private:
+	virtual int64 EstimateCostImpl () override
+	{
+		return QueryCost (db_,
+			"SELECT COUNT(*) FROM plan_files WHERE Deployed AND Action <> 'keep'");
+	}
+
+	virtual void ExecuteImpl (Log& log, UpdateProgress progress,
+		Repository::ExecutionContext&) override
+	{
+		// First, get rid of all files that are changing
+		// That is, if a file is referencing a different content_object,
+		// we have to remove it (those files will get replaced)
+		// The database is updated right away, while the files are removed
+		// on the local worker
+		std::vector<Path> changedFiles;
+
+		{
+			auto transaction = db_.BeginTransaction ();
+
+			auto changedFilesQuery = db_.Prepare (
+				"SELECT Path FROM plan_files WHERE Deployed AND Action <> 'keep'");
+			auto deleteFileQuery = db_.Prepare (
+				"DELETE FROM fs_files WHERE Path=?");
+
+			while (changedFilesQuery.Step ()) {
+				deleteFileQuery.BindArguments (changedFilesQuery.GetText (0));
+				deleteFileQuery.Step ();
+				deleteFileQuery.Reset ();
+
+				changedFiles.emplace_back (changedFilesQuery.GetText (0));
+			}
+
+			pipeline_.journal.RecordRemovals (changedFiles);
+
+			// content objects
+			db_.Execute ("DELETE FROM fs_contents "
+				"WHERE Id IN "
+				"(SELECT Id FROM fs_contents_with_reference_count WHERE ReferenceCount = 0)");
+
+			transaction.Commit ();
+		}
+
+		auto removed = std::make_shared<std::promise<void>> ();
+		pipeline_.changedFilesRemoved = removed->get_future ().share ();
+
+		pipeline_.localWork.Submit (SHA256Digest{},
+			[&tree = pipeline_.tree, changedFiles, removed, progress, &log]() -> FileWriterPool::CommitFunction {
+			try {
+				tree.RemoveFiles (changedFiles, FileWriterPool::GetDefaultWorkerCount ());
+			} catch (const std::exception&) {
+				removed->set_exception (std::current_exception ());
+				throw;
+			}
+
+			removed->set_value ();
+
+			return [changedFiles, progress, &log]() -> void {
+				for (const auto& changedFile : changedFiles) {
+					const auto actionDescription = fmt::format ("Deleted file '{0}'",
+						changedFile);
+
+					progress (actionDescription, 1);
+					log.Debug ("Configure", actionDescription);
+				}
+
+				log.Debug ("Configure", "Deleted changed files from repository");
+			};
+		});
+	}
+
+	Sql::Database& db_;
+	Path path_;
+	ConfigurePipeline& pipeline_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+class GetContentPhase : public ConfigurePhase
+{
+public:
+	/**
+	If stageOnly is set, the content objects are only written to their
+	staging files, and the deployed files are left alone.
+	*/
+	GetContentPhase (Sql::Database& database, Path& path, Repository& sourceRepository,
+		ConfigurePipeline& pipeline, const bool stageOnly = false)
+		: db_ (database)
+		, path_ (path)
+		, source_ (sourceRepository)
+		, pipeline_ (pipeline)
+		, stageOnly_ (stageOnly)
+	{
+	}
+
+private:
+	virtual int64 EstimateCostImpl () override
+	{
+		if (stageOnly_) {
+			// Every requested content object is written once
+			return QueryCost (db_,
+				"SELECT IFNULL (SUM (Size), 0) FROM "
+				"(SELECT DISTINCT Hash, Size FROM plan_files WHERE Action = 'fetch')");
+		}
+
+		// Every requested content object is written to all its target files
+		return QueryCost (db_,
+			"SELECT IFNULL (SUM (Size), 0) FROM plan_files WHERE Action = 'fetch'");
+	}
+
+	virtual void ExecuteImpl (Log& log, UpdateProgress progress, 
+		Repository::ExecutionContext& context) override
+	{
+		// Find all missing content objects in this database
+		std::vector<SHA256Digest> requiredContentObjects;
+		std::vector<int64> requiredContentObjectPriorities;
+
+		{
+			auto requestedContentObjectQuery = db_.Prepare (
+				"SELECT DISTINCT Hash FROM plan_files WHERE Action = 'fetch'");
+
+			while (requestedContentObjectQuery.Step ()) {
+				SHA256Digest contentObjectHash;
+				requestedContentObjectQuery.GetBlob (0, contentObjectHash);
+
+				requiredContentObjects.push_back (contentObjectHash);
+
+				log.Debug ("Configure", fmt::format ("Discovered content '{0}'", ToString (contentObjectHash)));
+			}
+
+			requiredContentObjectPriorities = GetDeliveryPriorities (
+				requiredContentObjects, context);
+		}
+
+		// Create directories. This happens in the background, so fetching
+		// can start right away, and files are only written once the
+		// directories exist and the changed files are gone
+		std::shared_future<void> targetsReady;
+
+		if (!stageOnly_) {
+			std::set<Path> directories;
+
+			auto getTargetFilesQuery = db_.Prepare (
+				"SELECT Path FROM plan_files WHERE Action = 'fetch'");
+
+			while (getTargetFilesQuery.Step ()) {
+				directories.insert (Path{ getTargetFilesQuery.GetText (0) }.parent_path ());
+			}
+
+			// The set is ordered, so parents are created before their
+			// children
+			targetsReady = std::async (std::launch::async,
+				[&tree = pipeline_.tree, directories = std::move (directories),
+				changedFilesRemoved = pipeline_.changedFilesRemoved]() -> void {
+				for (const auto& directory : directories) {
+					tree.CreateDirectories (directory);
+				}
+
+				if (changedFilesRemoved.valid ()) {
+					changedFilesRemoved.get ();
+				}
+			}).share ();
+		}
+
+		static const int64 TransactionDataSize = 4 << 20;
+
+		const auto duplicateMode = GetDuplicateMode (context);
+
+		auto transaction = db_.BeginTransaction ();
+		int64 currentTransactionDeployedSize = 0;
+		int64 currentTransactionSize = 0;
+
+		auto insertFileQuery = PrepareInsertPlannedFileQuery (db_);
+		auto recordFingerprintQuery = PrepareRecordFingerprintQuery (db_);
+
+		auto insertContentObjectQuery = db_.Prepare (
+			"INSERT INTO fs_contents (Hash, Size) "
+			"VALUES (?, ?);");
+
+		auto getTargetFilesQuery = db_.Prepare (
+			"SELECT Path FROM plan_files WHERE Action = 'fetch' AND Hash = ?");
+
+		auto fileDeployed = [&context](const Path& targetPath, const int64 size) -> void {
+			if (context.fileDeployed) {
+				context.fileDeployed (targetPath.string ().c_str (), size);
+			}
+		};
+
+		auto insertFile = [&](const Path& targetPath, const int64 ContentId) -> void {
+			insertFileQuery.BindArguments (targetPath.string (), ContentId);
+			insertFileQuery.Step ();
+			insertFileQuery.Reset ();
+		};
+
+		auto getTargetPaths = [&](const SHA256Digest& hash) -> std::vector<Path> {
+			std::vector<Path> result;
+
+			getTargetFilesQuery.BindArguments (hash);
+
+			while (getTargetFilesQuery.Step ()) {
+				result.emplace_back (getTargetFilesQuery.GetText (0));
+			}
+
+			getTargetFilesQuery.Reset ();
+
+			return result;
+		};
+
+		/**
+		Record a content object and its files in the database. This must only
+		be called once all files have been written.
+		*/
+		auto commitContentObject = [&](const SHA256Digest& hash,
+			const int64 totalSize, const std::vector<Path>& targetPaths) -> void {
+			int64 contentId = -1;
+			{
+				insertContentObjectQuery.BindArguments (hash, totalSize);
+				insertContentObjectQuery.Step ();
+				insertContentObjectQuery.Reset ();
+
+				contentId = db_.GetLastRowId ();
+
+				log.Debug ("Configure",
+					fmt::format ("Persisted content object '{0}', id {1}", ToString (hash), contentId));
+			}
+
+			for (const auto& targetPath : targetPaths) {
+				insertFile (targetPath, contentId);
+				RecordFingerprint (recordFingerprintQuery, targetPath,
+					GetFingerprint (path_ / targetPath, duplicateMode));
+				fileDeployed (targetPath, totalSize);
+
+				log.Debug ("Configure", fmt::format ("Wrote file {0}", targetPath));
+			}
+
+			currentTransactionDeployedSize += totalSize;
+			currentTransactionSize++;
+
+			if (currentTransactionDeployedSize > TransactionDataSize) {
+				log.Debug ("Configure", 
+					fmt::format ("Committing transaction with {0} operations", currentTransactionSize));
+				transaction.Commit ();
+				transaction = db_.BeginTransaction ();
+				currentTransactionDeployedSize = 0;
+				currentTransactionSize = 0;
+			}
+		};
+
+		auto recordStagedContentQuery = db_.Prepare (
+			"INSERT OR REPLACE INTO staged_contents "
+			"(Hash, Size, ModificationTime, ChangeTime, Inode) "
+			"VALUES (?, ?, ?, ?, ?)");
+
+		// Content objects which were staged before, either completely or
+		// partially by an interrupted run
+		auto stagedObjects = LoadStagingFiles (log, requiredContentObjects,
+			progress);
+
+		// Staging files which are currently open. They are only used by the
+		// writer of their content object
+		std::unordered_map<SHA256Digest, std::shared_ptr<StagingFiles>,
+			ArrayRefHash, ArrayRefEqual> openStagingFiles;
+
+		auto& memoryBudget = context.GetMemoryBudget ();
+
+		// A queued write keeps a copy of its data, so we only queue what fits
+		// into the budget several times over
+		const auto maxQueuedWriteSize = memoryBudget.GetLimit () / 8;
+
+		FileWriterPool writers{ FileWriterPool::GetDefaultWorkerCount () };
+
+		using WriteFunction = std::function<FileWriterPool::CommitFunction (const ArrayRef<>& data)>;
+
+		/**
+		Queue a write of contents to the writer of hash. The contents are
+		copied, as they are only valid during the callback. If they don't fit
+		into the memory budget, and there are no queued writes which would
+		free some memory, the write happens right here instead.
+		*/
+		auto queueWrite = [&](const SHA256Digest& hash, const ArrayRef<>& contents,
+			WriteFunction write) -> void {
+			MemoryReservation reservation;
+
+			if (contents.GetSize () <= maxQueuedWriteSize) {
+				for (;;) {
+					reservation = MemoryReservation::TryCreate (memoryBudget,
+						contents.GetSize ());
+
+					if (reservation.IsValid () || !writers.WaitForJob ()) {
+						break;
+					}
+
+					writers.Commit ();
+				}
+			}
+
+			if (reservation.IsValid ()) {
+				auto buffer = std::make_shared<QueuedWriteBuffer> ();
+				const auto bytes = contents.ToByteRef ();
+				buffer->data.assign (bytes.begin (), bytes.end ());
+				buffer->reservation = std::move (reservation);
+
+				writers.Submit (hash, [buffer, write]() -> FileWriterPool::CommitFunction {
+					return write (ArrayRef<>{ buffer->data });
+				});
+			} else {
+				// All queued writes must be done first, as they may write to
+				// the same content object
+				writers.Wait ();
+
+				if (auto commit = write (contents)) {
+					commit ();
+				}
+			}
+		};
+
+		/**
+		Store a content object in all its target locations.
+
+		If contents is null, the content object is in its staging file. We need to
+		rename the staging file, then copy it to all other files with the same
+		contents. Otherwise, we have the contents in memory. Just write them to
+		all destination files.
+		*/
+		auto deployContentObject = [&](const SHA256Digest& hash,
+			const int64 totalSize, const ArrayRef<>* contents) -> void {
+			log.Debug ("Configure", fmt::format ("Received content object '{0}'", ToString (hash)));
+
+			const auto targetPaths = getTargetPaths (hash);
+
+			if (!contents) {
+				std::shared_ptr<StagingFiles> stagingFiles;
+
+				if (auto it = openStagingFiles.find (hash); it != openStagingFiles.end ()) {
+					stagingFiles = std::move (it->second);
+					openStagingFiles.erase (it);
+				}
+
+				writers.Submit (hash, [this, hash, totalSize, targetPaths, stagingFiles, duplicateMode, targetsReady]() -> FileWriterPool::CommitFunction {
+					if (stagingFiles) {
+						stagingFiles->file.reset ();
+						stagingFiles->progressFile.reset ();
+					}
+
+					targetsReady.get ();
+					DeployStagingFile (hash, targetPaths, duplicateMode);
+					RecordDeployments (hash, totalSize, targetPaths, duplicateMode);
+
+					return {};
+				});
+
+				// The staging file was reported chunk by chunk, so only the
+				// copies are left
+				for (size_t i = 1; i < targetPaths.size (); ++i) {
+					progress (targetPaths [i].string (), totalSize);
+				}
+			} else {
+				queueWrite (hash, *contents, [this, hash, targetPaths, duplicateMode, targetsReady](const ArrayRef<>& data) -> FileWriterPool::CommitFunction {
+					targetsReady.get ();
+
+					{
+						auto file = pipeline_.tree.CreateFile (targetPaths [0], FileAccess::Write);
+						file->Write (data);
+					}
+
+					// Further copies are left to the file system, which may
+					// be able to share the data
+					for (size_t i = 1; i < targetPaths.size (); ++i) {
+						DuplicateFile (path_ / targetPaths [0],
+							path_ / targetPaths [i], duplicateMode);
+					}
+
+					RecordDeployments (hash, data.GetSize (), targetPaths, duplicateMode);
+
+					return {};
+				});
+
+				for (const auto& targetPath : targetPaths) {
+					progress (targetPath.string (), totalSize);
+				}
+			}
+
+			// The database is updated on this thread once the writer is done.
+			// As the writer of an object runs its jobs in order, this marker
+			// completes after the files have been written
+			writers.Submit (hash, [&commitContentObject, hash, totalSize, targetPaths]() -> FileWriterPool::CommitFunction {
+				return [&commitContentObject, hash, totalSize, targetPaths]() -> void {
+					commitContentObject (hash, totalSize, targetPaths);
+				};
+			});
+		};
+
+		/**
+		Close the staging file of a complete content object and record its
+		fingerprint, so it can be applied later without hashing it again.
+		*/
+		auto stageContentObject = [&](const SHA256Digest& hash) -> void {
+			log.Debug ("Configure", fmt::format ("Staged content object '{0}'", ToString (hash)));
+
+			std::shared_ptr<StagingFiles> stagingFiles;
+
+			if (auto it = openStagingFiles.find (hash); it != openStagingFiles.end ()) {
+				stagingFiles = std::move (it->second);
+				openStagingFiles.erase (it);
+			}
+
+			writers.Submit (hash, [this, hash, stagingFiles, &recordStagedContentQuery]() -> FileWriterPool::CommitFunction {
+				if (stagingFiles) {
+					stagingFiles->file.reset ();
+					stagingFiles->progressFile.reset ();
+				}
+
+				const auto fingerprint = Stat (GetStagingFilePath (path_, hash));
+
+				return [hash, fingerprint, &recordStagedContentQuery]() -> void {
+					recordStagedContentQuery.BindArguments (hash,
+						static_cast<int64> (fingerprint.size),
+						fingerprint.modificationTime,
+						fingerprint.changeTime,
+						static_cast<int64> (fingerprint.inode));
+					recordStagedContentQuery.Step ();
+					recordStagedContentQuery.Reset ();
+				};
+			});
+		};
+
+		Repository::GetContentObjectsOptions options;
+		options.priorities = requiredContentObjectPriorities;
+
+		if (!stagedObjects.empty ()) {
+			options.skipChunk = [&stagedObjects](const SHA256Digest& hash,
+				const int64 sourceOffset, const int64 sourceSize) -> bool {
+				auto it = stagedObjects.find (hash);
+				if (it == stagedObjects.end ()) {
+					return false;
+				}
+
+				// Staged objects are complete, regardless of how the
+				// source chunks them
+				if (it->second.receivedSize == it->second.totalSize) {
+					return true;
+				}
+
+				auto chunk = it->second.chunks.find (sourceOffset);
+				return chunk != it->second.chunks.end ()
+					&& chunk->second == sourceSize;
+			};
+		}
+
+		// Fetch the missing ones now and store in the right places
+		source_.GetContentObjects (requiredContentObjects, options, [&] (const SHA256Digest& hash,
+			const ArrayRef<>& contents,
+			const int64 offset,
+			const int64 totalSize) -> void {
+			// Record whatever the writers and the local worker finished so
+			// far, this also forwards their errors
+			writers.Commit ();
+			pipeline_.localWork.Commit ();
+
+			if ((offset == 0) && (contents.GetSize () == totalSize)) {
+				// The source delivered the whole object, so we don't need
+				// anything we staged for it previously
+				if (auto it = stagedObjects.find (hash); it != stagedObjects.end ()) {
+					stagedObjects.erase (it);
+
+					std::shared_ptr<StagingFiles> stagingFiles;
+
+					if (auto open = openStagingFiles.find (hash); open != openStagingFiles.end ()) {
+						stagingFiles = std::move (open->second);
+						openStagingFiles.erase (open);
+					}
+
+					writers.Submit (hash, [this, hash, stagingFiles]() -> FileWriterPool::CommitFunction {
+						if (stagingFiles) {
+							stagingFiles->file.reset ();
+							stagingFiles->progressFile.reset ();
+						}
+
+						std::filesystem::remove (GetStagingFilePath (path_, hash));
+						std::filesystem::remove (GetStagingProgressPath (path_, hash));
+
+						return {};
+					});
+				}
+
+				// When staging, the whole object is written to the staging
+				// file like any chunk
+				if (!stageOnly_) {
+					deployContentObject (hash, totalSize, &contents);
+					return;
+				}
+			}
+
+			auto& staged = stagedObjects [hash];
+			staged.totalSize = totalSize;
+
+			auto& stagingFiles = openStagingFiles [hash];
+
+			if (!stagingFiles) {
+				log.Debug ("Configure",
+					fmt::format ("Staging content object '{0}'", ToString (hash)));
+
+				// Every chunk written to the staging file is recorded in the
+				// progress file, so an interrupted install can resume here
+				stagingFiles = std::make_shared<StagingFiles> ();
+				stagingFiles->resume = !staged.chunks.empty ();
+			}
+
+			queueWrite (hash, contents, [this, hash, offset, totalSize, stagingFiles](const ArrayRef<>& data) -> FileWriterPool::CommitFunction {
+				if (!stagingFiles->file) {
+					OpenStagingFiles (hash, totalSize, *stagingFiles);
+				}
+
+				stagingFiles->file->WriteAt (offset, data);
+
+				StagedChunkRecord record;
+				record.offset = offset;
+				record.size = data.GetSize ();
+				record.hash = ComputeSHA256 (data);
+				stagingFiles->progressFile->Write (ArrayRef<>{ &record, sizeof (record) });
+
+				return {};
+			});
 
-			int64 contentId = -1;
-			{
-				insertContentObjectQuery.BindArguments (hash, objectSize);
-				insertContentObjectQuery.Step ();
-				insertContentObjectQuery.Reset ();
+			staged.AddChunk (offset, contents.GetSize ());
 
-				contentId = db_.GetLastRowId ();
+			progress (ToString (hash), contents.GetSize ());
+
+			if (staged.receivedSize != totalSize) {
+				return;
 			}
 
-			getTargetFilesQuery.BindArguments (hash);
+			stagedObjects.erase (hash);
 
-			auto insertFile = [&](const Path& targetPath, const int64 ContentId) -> void {
-				insertFileQuery.BindArguments (targetPath.string (), ContentId);
-				insertFileQuery.Step ();
-				insertFileQuery.Reset ();
-			};
-			
-			while (getTargetFilesQuery.Step ()) {
-				const Path targetPath{ getTargetFilesQuery.GetText (0) };
-					
-				insertFile (targetPath, contentId);
-				totalSize += objectSize;
+			if (stageOnly_) {
+				stageContentObject (hash);
+			} else {
+				deployContentObject (hash, totalSize, nullptr);
 			}
+		}, context);
 
-			getTargetFilesQuery.Reset ();
+		// Objects which were staged completely before don't get any chunks
+		// delivered
+		for (const auto& staged : stagedObjects) {
+			if (staged.second.receivedSize == staged.second.totalSize) {
+				if (stageOnly_) {
+					stageContentObject (staged.first);
+				} else {
+					deployContentObject (staged.first, staged.second.totalSize, nullptr);
+				}
+			} else {
+				log.Warning ("Configure",
+					fmt::format ("Content object '{0}' was not received completely",
+						ToString (staged.first)));
+			}
 		}
 
-		if (cost) {
-			*cost = totalSize;
+		writers.Wait ();
+		pipeline_.localWork.Commit ();
+
+		log.Debug ("Configure", 
+			fmt::format ("Committing transaction with {0} operations", currentTransactionSize));
+		transaction.Commit ();
+	}
+
+	/**
+	Open files of a content object which is being staged.
+	*/
+	struct StagingFiles
+	{
+		std::unique_ptr<File> file;
+		std::unique_ptr<File> progressFile;
+		// Continue the files of an interrupted run instead of creating them
+		bool resume = false;
+	};
+
+	/**
+	The copy of the data of a queued write, which keeps its memory reserved
+	until the write is done.
+	*/
+	struct QueuedWriteBuffer
+	{
+		std::vector<byte> data;
+		MemoryReservation reservation;
+	};
+
+	void OpenStagingFiles (const SHA256Digest& hash, const int64 totalSize,
+		StagingFiles& stagingFiles) const
+	{
+		if (stagingFiles.resume) {
+			stagingFiles.file = OpenFile (GetStagingFilePath (path_, hash),
+				FileAccess::ReadWrite);
+
+			stagingFiles.progressFile = OpenFile (
+				GetStagingProgressPath (path_, hash), FileAccess::ReadWrite);
+			stagingFiles.progressFile->Seek (stagingFiles.progressFile->GetSize ());
+		} else {
+			// Reserve the space up front, as the chunks may be written in
+			// any order
+			stagingFiles.file = CreateFile (GetStagingFilePath (path_, hash));
+			stagingFiles.file->Preallocate (totalSize);
+
+			stagingFiles.progressFile = CreateFile (
+				GetStagingProgressPath (path_, hash));
 		}
 	}
 
-	virtual void ExecuteImpl (Log& log, UpdateProgress progress, 
-		Repository::ExecutionContext& context) override
+	/**
+	Journal the files of a content object once they are written, so an
+	interrupted run doesn't fetch them again.
+	*/
+	void RecordDeployments (const SHA256Digest& hash, const int64 size,
+		const std::vector<Path>& targetPaths,
+		const DuplicateMode duplicateMode) const
 	{
-		// Find all missing content objects in this database
-		std::vector<SHA256Digest> requiredContentObjects;
+		for (const auto& targetPath : targetPaths) {
+			pipeline_.journal.RecordDeployment (targetPath, hash, size,
+				GetFingerprint (path_ / targetPath, duplicateMode));
+		}
+	}
 
-		auto requestedContentObjectTable = CreateRequestedContentObjectTable ();
+	/**
+	Move a complete staging file to the first target, and duplicate it to all
+	others.
+	*/
+	void DeployStagingFile (const SHA256Digest& hash,
+		const std::vector<Path>& targetPaths, const DuplicateMode mode) const
+	{
+		for (size_t i = 0; i < targetPaths.size (); ++i) {
+			if (i == 0) {
+				std::filesystem::rename (GetStagingFilePath (path_, hash),
+					path_ / targetPaths [0]);
+			} else {
+				DuplicateFile (path_ / targetPaths [0],
+					path_ / targetPaths [i], mode);
+			}
+		}
 
-		{
-			auto requestedContentObjectQuery = db_.Prepare (
-				"SELECT Hash FROM requested_content_objects");
+		// Only remove the progress once the staging file is gone, so
+		// the staged data is never lost
+		std::filesystem::remove (GetStagingProgressPath (path_, hash));
+	}
 
-			while (requestedContentObjectQuery.Step ()) {
-				SHA256Digest contentObjectHash;
-				requestedContentObjectQuery.GetBlob (0, contentObjectHash);
+	/**
+	Find staging files left behind by an interrupted run or a staging
+	configure.
+
+	Staging files which were recorded as complete and still have the same
+	fingerprint are used as they are. Otherwise, every chunk recorded in the
+	progress file is checked against its hash, and only chunks which are
+	intact are kept. Staging files for content objects which are no longer
+	requested are removed.
+	*/
+	StagedObjects LoadStagingFiles (Log& log,
+		const std::vector<SHA256Digest>& requiredContentObjects,
+		UpdateProgress progress)
+	{
+		std::set<std::string> stagingFileNames;
 
-				requiredContentObjects.push_back (contentObjectHash);
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator (path_, error)) {
+			const auto extension = entry.path ().extension ();
 
-				log.Debug ("Configure", fmt::format ("Discovered content '{0}'", ToString (contentObjectHash)));
+			if (extension == ".kytmp" || extension == ".kyprogress") {
+				stagingFileNames.insert (entry.path ().filename ().string ());
 			}
+		}
 
-			auto totalRequiredContentQuery = db_.Prepare ("SELECT SUM(Size) FROM source.fs_contents "
-				"INNER JOIN requested_content_objects ON "
-				"source.fs_contents.Hash = requested_content_objects.Hash");
+		StagedObjects result;
 
-			totalRequiredContentQuery.Step ();
-		}
+		// The records are consumed here, the objects are recorded again
+		// once they are staged completely
+		std::unordered_map<SHA256Digest, FileStat,
+			ArrayRefHash, ArrayRefEqual> completeObjects;
 
-		// Create directories
 		{
-			auto filePathTable = db_.CreateTemporaryTable ("requested_file_paths", "Path VARCHAR");
-			auto insertPathQuery = db_.Prepare ("INSERT INTO requested_file_paths VALUES (?)");
+			auto stagedContentsQuery = db_.Prepare (
+				"SELECT Hash, Size, ModificationTime, ChangeTime, Inode "
+				"FROM staged_contents");
 
-			auto getTargetFilesQuery = db_.Prepare (
-				R"_(SELECT Path FROM source.fs_files
-				INNER JOIN source.fs_contents ON
-				source.fs_files.ContentID = source.fs_contents.Id
-				INNER JOIN requested_content_objects ON
-				source.fs_contents.Hash = requested_content_objects.Hash)_"
-			);
+			while (stagedContentsQuery.Step ()) {
+				SHA256Digest hash;
+				stagedContentsQuery.GetBlob (0, hash);
 
-			while (getTargetFilesQuery.Step ()) {
-				const Path targetPath{ getTargetFilesQuery.GetText (0) };
+				FileStat fingerprint;
+				fingerprint.size = static_cast<std::size_t> (stagedContentsQuery.GetInt64 (1));
+				fingerprint.modificationTime = stagedContentsQuery.GetInt64 (2);
+				fingerprint.changeTime = stagedContentsQuery.GetInt64 (3);
+				fingerprint.inode = static_cast<uint64> (stagedContentsQuery.GetInt64 (4));
 
-				insertPathQuery.BindArguments (targetPath.parent_path ().string ().c_str ());
-				insertPathQuery.Step ();
-				insertPathQuery.Reset ();
+				completeObjects.emplace (hash, fingerprint);
 			}
 
-			getTargetFilesQuery.Reset ();
+			db_.Execute ("DELETE FROM staged_contents");
+		}
 
-			auto uniqueFilePathQuery = db_.Prepare ("SELECT DISTINCT Path "
-				"FROM requested_file_paths ORDER BY Path");
-			while (uniqueFilePathQuery.Step ()) {
-				std::filesystem::create_directories (path_ /
-					Path{ uniqueFilePathQuery.GetText (0) });
-			}
+		if (stagingFileNames.empty ()) {
+			return result;
 		}
 
-		static const int64 TransactionDataSize = 4 << 20;
+		auto contentSizeQuery = db_.Prepare (
+			"SELECT Size FROM source.fs_contents WHERE Hash = ?");
 
-		auto transaction = db_.BeginTransaction ();
-		int64 currentTransactionDeployedSize = 0;
-		int64 currentTransactionSize = 0;
+		std::vector<byte> buffer;
+		int64 resumedSize = 0;
+		int64 stagedSize = 0;
+		size_t resumedCount = 0;
+		size_t reusedCount = 0;
 
-		auto insertFileQuery = PrepareInsertFileQuery ();
+		for (const auto& hash : requiredContentObjects) {
+			const auto hashString = ToString (hash);
 
-		auto insertContentObjectQuery = db_.Prepare (
-			"INSERT INTO fs_contents (Hash, Size) "
-			"VALUES (?, ?);");
+			// Chunks reused by this run are known to be intact
+			if (auto it = pipeline_.reusedChunks.find (hash);
+				it != pipeline_.reusedChunks.end ()) {
+				stagingFileNames.erase (hashString + ".kytmp");
+				stagingFileNames.erase (hashString + ".kyprogress");
 
-		auto getTargetFilesQuery = db_.Prepare (
-			"SELECT Path FROM source.fs_files "
-			"WHERE source.fs_files.ContentId = (SELECT Id FROM source.fs_contents WHERE source.fs_contents.Hash = ?)");
+				progress (hashString, it->second.receivedSize);
 
-		std::unique_ptr<File> stagingFile;
-#ifndef NDEBUG
-		SHA256Digest stagingFileHash;
-#endif
+				result.emplace (hash, std::move (it->second));
+				pipeline_.reusedChunks.erase (it);
+				++reusedCount;
+				continue;
+			}
 
-		// Fetch the missing ones now and store in the right places
-		source_.GetContentObjects (requiredContentObjects, [&] (const SHA256Digest& hash,
-			const ArrayRef<>& contents,
-			const int64 offset,
-			const int64 totalSize) -> void {
-			const auto hashString = ToString (hash);
+			if (stagingFileNames.erase (hashString + ".kytmp") == 0) {
+				continue;
+			}
 
-			const auto stagingFilePath = path_ / (hashString + ".kytmp");
-			if ((offset != 0) || (contents.GetSize () != totalSize)) {
-				if (offset == 0) {
-					log.Debug ("Configure",
-						fmt::format ("Creating staging file {0}",
-							stagingFilePath));
+			auto discard = [&]() -> void {
+				std::filesystem::remove (GetStagingFilePath (path_, hash), error);
+				std::filesystem::remove (GetStagingProgressPath (path_, hash), error);
+			};
 
-					stagingFile = CreateFile (stagingFilePath);
-					stagingFile->SetSize (totalSize);
+			if (stagingFileNames.erase (hashString + ".kyprogress") == 0) {
+				discard ();
+				continue;
+			}
 
-#ifndef NDEBUG
-					stagingFileHash = hash;
-#endif
-				} else {
-					log.Debug ("Configure",
-						fmt::format ("Writing into staging file {0}",
-							stagingFilePath));
-
-#ifndef NDEBUG
-					// If we're staging a file, we have only one file handle
-					// open. So we need this to remain the same until we're done
-					assert (stagingFile);
-					assert (hash == stagingFileHash);
-#endif
-				}
+			contentSizeQuery.BindArguments (hash);
+			contentSizeQuery.Step ();
+			const auto totalSize = contentSizeQuery.GetInt64 (0);
+			contentSizeQuery.Reset ();
 
-				stagingFile->Seek (offset);
-				stagingFile->Write (contents);
+			if (auto it = completeObjects.find (hash); it != completeObjects.end () &&
+				static_cast<int64> (it->second.size) == totalSize &&
+				IsSameFingerprint (it->second, Stat (GetStagingFilePath (path_, hash)))) {
+				StagedObject staged;
+				staged.totalSize = totalSize;
+				staged.AddChunk (0, totalSize);
 
-				progress (ToString (hash), contents.GetSize ());
+				progress (hashString, totalSize);
+				stagedSize += totalSize;
 
-				if ((offset + contents.GetSize ()) != totalSize) {
-					return;
-				}
+				result.emplace (hash, std::move (staged));
+				continue;
 			}
 
-			log.Debug ("Configure", fmt::format ("Received content object '{0}'", hashString));
+			auto stagingFile = OpenFile (GetStagingFilePath (path_, hash), FileAccess::Read);
+			auto progressFile = OpenFile (GetStagingProgressPath (path_, hash), FileAccess::Read);
 
-			int64 contentId = -1;
-			{
-				insertContentObjectQuery.BindArguments (hash, totalSize);
-				insertContentObjectQuery.Step ();
-				insertContentObjectQuery.Reset ();
+			if (stagingFile->GetSize () != totalSize) {
+				stagingFile.reset ();
+				progressFile.reset ();
+				discard ();
+				continue;
+			}
 
-				contentId = db_.GetLastRowId ();
+			StagedObject staged;
+			staged.totalSize = totalSize;
 
-				log.Debug ("Configure",
-					fmt::format ("Persisted content object '{0}', id {1}", hashString, contentId));
-			}
+			// A record which was only partially written is ignored
+			const auto recordCount = progressFile->GetSize () / sizeof (StagedChunkRecord);
 
-			getTargetFilesQuery.BindArguments (hash);
+			for (size_t i = 0; i < recordCount; ++i) {
+				StagedChunkRecord record;
+				progressFile->Read (MutableArrayRef<>{ &record, sizeof (record) });
 
-			auto insertFile = [&](const Path& targetPath, const int64 ContentId) -> void {
-				insertFileQuery.BindArguments (targetPath.string (), ContentId);
-				insertFileQuery.Step ();
-				insertFileQuery.Reset ();
-			};
+				if (record.offset < 0 || record.size <= 0 ||
+					record.offset + record.size > totalSize) {
+					break;
+				}
 
-			/**
-			In the first case, we have the contents in a staging file. We need to rename
-			the staging file, then copy it to all other files with the same contents
+				buffer.resize (record.size);
+				stagingFile->Seek (record.offset);
 
-			In the second case, we have the contents in memory. Just write them to all
-			destination files.
-			*/
-			if (stagingFile) {
-				stagingFile.reset ();
+				if (stagingFile->Read (buffer) != record.size ||
+					ComputeSHA256 (buffer) != record.hash) {
+					continue;
+				}
 
-				bool isFirstFile = true;
-				Path lastFilePath;
+				staged.AddChunk (record.offset, record.size);
+			}
 
-				while (getTargetFilesQuery.Step ()) {
-					const Path targetPath{ getTargetFilesQuery.GetText (0) };
+			stagingFile.reset ();
+			progressFile.reset ();
 
-					if (isFirstFile) {
-						log.Debug ("Configure",
-							fmt::format ("Renaming staging file {0} to {1}",
-								stagingFilePath, targetPath));
+			if (staged.chunks.empty ()) {
+				discard ();
+				continue;
+			}
 
-						std::filesystem::rename (stagingFilePath,
-							path_ / targetPath);
-						isFirstFile = false;
-					} else {
-						progress (getTargetFilesQuery.GetText (0),
-							totalSize);
+			progress (hashString, staged.receivedSize);
+			resumedSize += staged.receivedSize;
+			++resumedCount;
 
-						log.Debug ("Configure",
-							fmt::format ("Copying file {0} to {1}",
-								lastFilePath, targetPath));
+			result.emplace (hash, std::move (staged));
+		}
 
-						assert (!lastFilePath.empty ());
-						std::filesystem::copy_file (lastFilePath,
-							path_ / targetPath);
-					}
+		// Whatever is left belongs to content we don't need any more
+		for (const auto& name : stagingFileNames) {
+			std::filesystem::remove (path_ / name, error);
+		}
 
-					insertFile (targetPath, contentId);
+		if (resumedCount > 0) {
+			log.Info ("Configure",
+				fmt::format ("Resuming {0} partially received content objects, "
+					"{1} bytes already present", resumedCount, resumedSize));
+		}
 
-					lastFilePath = path_ / targetPath;
-				}
-			} else {
-				while (getTargetFilesQuery.Step ()) {
-					const Path targetPath{ getTargetFilesQuery.GetText (0) };
+		if (result.size () > resumedCount + reusedCount) {
+			log.Info ("Configure",
+				fmt::format ("Using {0} staged content objects, {1} bytes",
+					result.size () - resumedCount - reusedCount, stagedSize));
+		}
 
-					progress (getTargetFilesQuery.GetText (0), contents.GetSize ());
+		return result;
+	}
 
-					log.Debug ("Configure",
-						fmt::format ("Creating file {0}", targetPath));
+	/**
+	Compute the delivery priority for every requested content object.
 
-					auto file = CreateFile (path_ / targetPath, FileAccess::Write);
-					file->Write (contents);
+	If DeliveryFeaturePriority is set, it must contain a tightly packed list of
+	feature Uuids. Content used by the first feature is delivered first, then
+	content used by the second one and so on. Content not used by any of
+	the listed features comes last.
 
-					insertFile (targetPath, contentId);
+	If DeliveryOrder is set to "size", content is additionally ordered by
+	size classes, so small files are delivered first. Inside a class, the
+	storage order is kept so reads remain mostly sequential.
 
-					log.Debug ("Configure", fmt::format ("Wrote file {0}", targetPath));
-				}
+	Returns an empty vector if the storage order should be used.
+	*/
+	std::vector<int64> GetDeliveryPriorities (
+		const std::vector<SHA256Digest>& requiredContentObjects,
+		const Repository::ExecutionContext& context)
+	{
+		using EC = Repository::ExecutionContext;
+
+		bool orderBySize = false;
+		if (auto it = context.variables.find (EC::DeliveryOrder);
+			it != context.variables.end ()) {
+			const std::string order = it->second.GetString ();
+
+			if (order == "size") {
+				orderBySize = true;
+			} else if (order != "storage") {
+				throw RuntimeException ("Configure",
+					fmt::format ("Invalid delivery order '{0}', must be one of "
+						"'storage' or 'size'", order),
+					KYLA_FILE_LINE);
 			}
+		}
 
-			getTargetFilesQuery.Reset ();
-
-			currentTransactionDeployedSize += contents.GetSize ();
-			currentTransactionSize++;
+		std::vector<Uuid> featurePriorities;
+		if (auto it = context.variables.find (EC::DeliveryFeaturePriority);
+			it != context.variables.end ()) {
+			const auto size = it->second.GetSize ();
 
-			if (currentTransactionDeployedSize > TransactionDataSize) {
-				log.Debug ("Configure", 
-					fmt::format ("Committing transaction with {0} operations", currentTransactionSize));
-				transaction.Commit ();
-				transaction = db_.BeginTransaction ();
-				currentTransactionDeployedSize = 0;
-				currentTransactionSize = 0;
+			if (size % sizeof (Uuid) != 0) {
+				throw RuntimeException ("Configure",
+					fmt::format ("Variable '{0}' must be a list of Uuids",
+						EC::DeliveryFeaturePriority),
+					KYLA_FILE_LINE);
 			}
-		}, context);
 
-		log.Debug ("Configure", 
-			fmt::format ("Committing transaction with {0} operations", currentTransactionSize));
-		transaction.Commit ();
-	}
+			featurePriorities.resize (size / sizeof (Uuid));
+			size_t resultSize = size;
+			it->second.Get (&resultSize, featurePriorities.data ());
+		}
 
-	Sql::TemporaryTable CreateRequestedContentObjectTable ()
-	{
-		auto requestedContentObjectTable = db_.CreateTemporaryTable (
-			"requested_content_objects",
-			"Hash BLOB UNIQUE NOT NULL");
+		std::vector<int64> result;
 
-		{
-			auto requestedContentObjectQuery = db_.Prepare (
-				R"_(INSERT INTO requested_content_objects
-					SELECT DISTINCT Hash 
-						FROM source.fs_contents
-					INNER JOIN source.fs_files ON source.fs_contents.Id = source.fs_files.ContentId
-					WHERE source.fs_files.FeatureId IN
-					(
-						SELECT Id FROM source.features
-						WHERE Uuid IN (SELECT Uuid FROM pending_features)
-					)
-					AND NOT Hash IN 
-					(
-						SELECT Hash FROM main.fs_contents
-					)
-				)_");
+		if (!orderBySize && featurePriorities.empty ()) {
+			return result;
+		}
 
-			requestedContentObjectQuery.Step ();
-			requestedContentObjectQuery.Reset ();
+		auto featurePriorityTable = db_.CreateTemporaryTable (
+			"delivery_feature_priorities",
+			"Uuid BLOB UNIQUE NOT NULL, Priority INTEGER NOT NULL");
+
+		{
+			auto insertFeaturePriorityQuery = db_.Prepare (
+				"INSERT OR IGNORE INTO delivery_feature_priorities "
+				"(Uuid, Priority) VALUES (?, ?)");
+
+			for (int64 i = 0; i < static_cast<int64> (featurePriorities.size ()); ++i) {
+				insertFeaturePriorityQuery.BindArguments (featurePriorities [i], i);
+				insertFeaturePriorityQuery.Step ();
+				insertFeaturePriorityQuery.Reset ();
+			}
 		}
 
-		return requestedContentObjectTable;
-	}
+		// Unlisted features get the lowest priority
+		auto contentPriorityQuery = db_.Prepare (
+			R"_(SELECT plan_files.Size,
+				MIN(IFNULL(delivery_feature_priorities.Priority, ?1))
+			FROM plan_files
+			LEFT JOIN delivery_feature_priorities
+				ON delivery_feature_priorities.Uuid = plan_files.FeatureUuid
+			WHERE plan_files.Action = 'fetch' AND plan_files.Hash = ?2)_");
+
+		result.reserve (requiredContentObjects.size ());
+
+		for (const auto& hash : requiredContentObjects) {
+			contentPriorityQuery.BindArguments (
+				static_cast<int64> (featurePriorities.size ()), hash);
+			contentPriorityQuery.Step ();
+
+			const auto size = contentPriorityQuery.GetInt64 (0);
+			const auto featurePriority = contentPriorityQuery.GetInt64 (1);
+
+			contentPriorityQuery.Reset ();
+
+			// Everything below 64 KiB is one class, then one class per
+			// power of two
+			int64 sizeClass = 0;
+			if (orderBySize) {
+				for (auto s = size >> 16; s > 0; s >>= 1) {
+					++sizeClass;
+				}
+			}
 
-	Sql::Statement PrepareInsertFileQuery ()
-	{
-		return db_.Prepare (
-			R"_(INSERT INTO main.fs_files (Path, ContentId, FeatureId)
-			SELECT ?1, ?2, main.features.Id FROM source.fs_files
-			INNER JOIN source.features ON source.features.Id = source.fs_files.FeatureId
-			INNER JOIN features ON source.features.Uuid = main.features.Uuid
-			WHERE source.fs_files.path = ?1)_"
-		);
+			result.push_back ((featurePriority << 8) | sizeClass);
+		}
+
+		return result;
 	}
 
 	Sql::Database& db_;
 	Path path_;
 	Repository& source_;
+	ConfigurePipeline& pipeline_;
+	bool stageOnly_;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 class CopyExistingFilesPhase : public ConfigurePhase
 {
 public:
-	CopyExistingFilesPhase (Sql::Database& database, Path& path, Repository& sourceRepository)
+	CopyExistingFilesPhase (Sql::Database& database, Path& path, Repository& sourceRepository,
+		ConfigurePipeline& pipeline)
 		: db_ (database)
 		, path_ (path)
 		, source_ (sourceRepository)
+		, pipeline_ (pipeline)
 	{
 	}
 
 private:
-	virtual void SimulateImpl (int64_t* cost) override
+	virtual int64 EstimateCostImpl () override
 	{
-		auto diffQuery = db_.Prepare (
-			R"_(
-				SELECT Path, Hash, Size 
-				FROM source.fs_contents
-				INNER JOIN source.fs_files ON
-					source.fs_contents.Id = source.fs_files.ContentId
-				WHERE source.fs_files.FeatureId IN
-				(
-					SELECT Id FROM source.features
-					WHERE Uuid IN 
-					(
-						SELECT Uuid FROM pending_features
-					)
-				)
-				AND NOT Path IN 
-				(
-					SELECT Path FROM main.fs_files
-				)
-			)_"
-		);
-
-		auto exemplarQuery = PrepareExemplarQuery ();
-
-		auto insertFileQuery = PrepareInsertFileQuery ();
-
-		int64_t totalCost = 0;
-
-		while (diffQuery.Step ()) {
-			SHA256Digest hash;
-			diffQuery.GetBlob (1, hash);
-
-			totalCost += diffQuery.GetInt64 (2);
-
-			const Path path{ diffQuery.GetText (0) };
-
-			exemplarQuery.BindArguments (hash);
-			exemplarQuery.Step ();
-
-			const Path exemplarPath{ exemplarQuery.GetText (0) };
-
-			insertFileQuery.BindArguments (path.string (),
-				exemplarQuery.GetInt64 (1));
-
-			exemplarQuery.Reset ();
-		}
-
-		if (cost) {
-			*cost = totalCost;
-		}
+		return QueryCost (db_,
+			"SELECT IFNULL (SUM (Size), 0) FROM plan_files WHERE Action = 'copy'");
 	}
 
 	virtual void ExecuteImpl (Log& log, UpdateProgress progress,
-		Repository::ExecutionContext&) override
+		Repository::ExecutionContext& context) override
 	{
-		// We may have files that only require local copies - find those
-		// and execute them now
-		// That is, we search for all files, that are in a pending_file_set,
-		// but not present in our local copy yet (those haven't been added in
-		// the loop above because we specifically excluded objects for which
-		// we already have the content.)
-		auto transaction = db_.BeginTransaction ();
+		// The files whose contents are deployed already at another location.
+		// The exemplars are looked up here, before any new file is recorded,
+		// and the copies are made by the local worker while content is
+		// fetched. The files get recorded once their copy is done
+		const auto duplicateMode = GetDuplicateMode (context);
 
 		auto diffQuery = db_.Prepare (
-			R"_(SELECT Path, Hash 
-				FROM source.fs_contents
-				INNER JOIN source.fs_files 
-					ON source.fs_contents.Id = source.fs_files.ContentId
-				WHERE source.fs_files.FeatureId IN
-				(
-					SELECT Id FROM source.features
-					WHERE Uuid IN 
-					(
-						SELECT Uuid FROM pending_features
-					)
-				)
-				AND NOT Path IN 
-				(
-					SELECT Path FROM main.fs_files
-				)
-		)_"
-		);
+			"SELECT Path, Hash, Size FROM plan_files WHERE Action = 'copy'");
 
 		auto exemplarQuery = PrepareExemplarQuery ();
 
-		auto insertFileQuery = PrepareInsertFileQuery ();
+		insertFileQuery_ = std::make_unique<Sql::Statement> (
+			PrepareInsertPlannedFileQuery (db_));
+		recordFingerprintQuery_ = std::make_unique<Sql::Statement> (
+			PrepareRecordFingerprintQuery (db_));
+		clearChangeTimeQuery_ = std::make_unique<Sql::Statement> (db_.Prepare (
+			"UPDATE fs_file_fingerprints SET ChangeTime = 0 WHERE Path = ?"));
 
 		while (diffQuery.Step ()) {
 			SHA256Digest hash;
 			diffQuery.GetBlob (1, hash);
 
 			const Path path{ diffQuery.GetText (0) };
-			std::filesystem::create_directories (path_ / path.parent_path ());
+			const auto size = diffQuery.GetInt64 (2);
 
 			exemplarQuery.BindArguments (hash);
 			exemplarQuery.Step ();
 
 			const Path exemplarPath{ exemplarQuery.GetText (0) };
-			std::filesystem::copy_file (path_ / exemplarPath, path_ / path);
-
-			insertFileQuery.BindArguments (path.string (),
-				exemplarQuery.GetInt64 (1));
+			const auto contentId = exemplarQuery.GetInt64 (1);
 
 			exemplarQuery.Reset ();
 
-			log.Debug ("Configure", 
-				fmt::format ("Copied file '{0}' to '{1}'", exemplarPath.string (), path.string ()));
-		}
+			// The job may outlive this phase if configure fails, so it must
+			// not use any of its members
+			pipeline_.localWork.Submit (hash, [this, root = path_, &tree = pipeline_.tree,
+				&journal = pipeline_.journal, path, exemplarPath, hash, contentId, size, duplicateMode, progress, &log, &context]() -> FileWriterPool::CommitFunction {
+				tree.CreateDirectories (path.parent_path ());
+				DuplicateFile (root / exemplarPath, root / path, duplicateMode);
+
+				const auto fingerprint = GetFingerprint (root / path, duplicateMode);
+				journal.RecordDeployment (path, hash, size, fingerprint);
+
+				return [this, path, exemplarPath, contentId, size, fingerprint,
+					duplicateMode, progress, &log, &context]() -> void {
+					if (context.fileDeployed) {
+						context.fileDeployed (path.string ().c_str (),
+							static_cast<int64> (fingerprint.size));
+					}
 
-		transaction.Commit ();
+					insertFileQuery_->BindArguments (path.string (), contentId);
+					insertFileQuery_->Step ();
+					insertFileQuery_->Reset ();
+
+					RecordFingerprint (*recordFingerprintQuery_, path, fingerprint);
+
+					// The exemplar got another link, which changed its change
+					// time as well
+					if (duplicateMode == DuplicateMode::HardLink) {
+						clearChangeTimeQuery_->BindArguments (exemplarPath.string ());
+						clearChangeTimeQuery_->Step ();
+						clearChangeTimeQuery_->Reset ();
+					}
+
+					progress (path.string (), size);
+
+					log.Debug ("Configure",
+						fmt::format ("Copied file '{0}' to '{1}'", exemplarPath.string (), path.string ()));
+				};
+			});
+		}
 	}
 
 	Sql::Statement PrepareExemplarQuery ()
@@ -1007,95 +3132,114 @@ private:
 			WHERE Hash=?)_");
 	}
 
-	Sql::Statement PrepareInsertFileQuery ()
-	{
-		return db_.Prepare (
-			R"_(INSERT INTO main.fs_files (Path, ContentId, FeatureId)
-			SELECT ?1, ?2, main.features.Id FROM source.fs_files
-			INNER JOIN source.features ON source.features.Id = source.fs_files.FeatureId
-			INNER JOIN features ON source.features.Uuid = main.features.Uuid
-			WHERE source.fs_files.path = ?1)_"
-		);
-	}
-
 	Sql::Database& db_;
 	Path path_;
 	Repository& source_;
+	ConfigurePipeline& pipeline_;
+	// Used by the commit functions of the copies
+	std::unique_ptr<Sql::Statement> insertFileQuery_;
+	std::unique_ptr<Sql::Statement> recordFingerprintQuery_;
+	std::unique_ptr<Sql::Statement> clearChangeTimeQuery_;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
-class CleanupPhase : public ConfigurePhase
+class RemoveUnusedFilesPhase : public ConfigurePhase
 {
 public:
-	CleanupPhase (Sql::Database& database, Path& path)
+	RemoveUnusedFilesPhase (Sql::Database& database, Path& path,
+		ConfigurePipeline& pipeline)
 		: db_ (database)
 		, path_ (path)
+		, pipeline_ (pipeline)
 	{
 	}
 
 private:
-	virtual void SimulateImpl (int64_t* cost) override
-	{			
-		// files
-		{
-			auto unusedFileCountQuery = db_.Prepare (
-				R"_(SELECT COUNT(*) FROM fs_files WHERE FeatureId NOT IN (
-				    SELECT Id FROM features WHERE features.Uuid IN 
-				        (SELECT Uuid FROM pending_features)
-				    ))_"
-			);
-
-			unusedFileCountQuery.Step ();
-			if (cost) {
-				*cost = unusedFileCountQuery.GetInt64 (0);
-			}
-
-			auto deleteFileQuery = db_.Prepare (
-				R"_(DELETE FROM fs_files WHERE Path IN (
-				SELECT Path FROM fs_files WHERE FeatureId NOT IN (
-				    SELECT Id FROM features WHERE features.Uuid IN 
-				        (SELECT Uuid FROM pending_features)
-				    )
-				))_");
-
-			deleteFileQuery.Step ();
-			deleteFileQuery.Reset ();
-		}
-
-		DeleteFeaturesContents ();
+	virtual int64 EstimateCostImpl () override
+	{
+		return QueryCost (db_,
+			R"_(SELECT COUNT(*) FROM main.fs_files WHERE NOT EXISTS (
+				SELECT 1 FROM plan_files WHERE plan_files.Path = main.fs_files.Path
+			))_");
 	}
 
 	virtual void ExecuteImpl (Log& log, UpdateProgress progress,
 		Repository::ExecutionContext&) override
 	{
-		// The order here is files, features, fs_contents, to keep
-		// referential integrity at all times
+		// Everything which is not in the plan, this includes files which
+		// were removed from a pending feature. They may be the exemplars of
+		// the copies queued before, so they are removed by the local worker
+		// after those, and forgotten once they are gone
+		std::vector<Path> unusedFiles;
 
-		// files
 		{
 			auto unusedFilesQuery = db_.Prepare (
-				R"_(SELECT Path FROM fs_files WHERE FeatureId NOT IN (
-				    SELECT Id FROM features WHERE features.Uuid IN
-				        (SELECT Uuid FROM pending_features)
+				R"_(SELECT Path FROM main.fs_files WHERE NOT EXISTS (
+				    SELECT 1 FROM plan_files WHERE plan_files.Path = main.fs_files.Path
 				))_");
 
-			auto deleteFileQuery = db_.Prepare (
-				"DELETE FROM fs_files WHERE Path=?");
-
 			while (unusedFilesQuery.Step ()) {
-				deleteFileQuery.BindArguments (unusedFilesQuery.GetText (0));
-				deleteFileQuery.Step ();
-				deleteFileQuery.Reset ();
+				unusedFiles.emplace_back (unusedFilesQuery.GetText (0));
+			}
 
-				std::filesystem::remove (path_ / Path{ unusedFilesQuery.GetText (0) });
+			pipeline_.journal.RecordRemovals (unusedFiles);
+		}
 
-				log.Debug ("Configure", fmt::format ("Deleted file '{0}'", unusedFilesQuery.GetText (0)));
+		deleteFileQuery_ = std::make_unique<Sql::Statement> (db_.Prepare (
+			"DELETE FROM fs_files WHERE Path=?"));
 
-				progress (unusedFilesQuery.GetText (0), 1);
-			}
+		pipeline_.localWork.Submit (SHA256Digest{},
+			[this, &tree = pipeline_.tree, unusedFiles, progress, &log]() -> FileWriterPool::CommitFunction {
+			tree.RemoveFiles (unusedFiles, FileWriterPool::GetDefaultWorkerCount ());
 
-			log.Debug ("Configure", "Deleted unused files from repository");
-		}
+			return [this, unusedFiles, progress, &log]() -> void {
+				for (const auto& unusedFile : unusedFiles) {
+					deleteFileQuery_->BindArguments (unusedFile.string ());
+					deleteFileQuery_->Step ();
+					deleteFileQuery_->Reset ();
+
+					log.Debug ("Configure", fmt::format ("Deleted file '{0}'", unusedFile));
+
+					progress (unusedFile.string (), 1);
+				}
+
+				log.Debug ("Configure", "Deleted unused files from repository");
+			};
+		});
+	}
+
+	Sql::Database& db_;
+	Path path_;
+	ConfigurePipeline& pipeline_;
+	std::unique_ptr<Sql::Statement> deleteFileQuery_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+class CleanupPhase : public ConfigurePhase
+{
+public:
+	CleanupPhase (Sql::Database& database, ConfigurePipeline& pipeline)
+		: db_ (database)
+		, pipeline_ (pipeline)
+	{
+	}
+
+private:
+	virtual int64 EstimateCostImpl () override
+	{
+		// The local work is accounted for by the phases which queued it
+		return 0;
+	}
+
+	virtual void ExecuteImpl (Log& log, UpdateProgress,
+		Repository::ExecutionContext&) override
+	{
+		// Record whatever the local worker did while content was fetched.
+		// The order here is files, features, fs_contents, to keep
+		// referential integrity at all times
+		auto transaction = db_.BeginTransaction ();
+		pipeline_.localWork.Wait ();
+		transaction.Commit ();
 
 		DeleteFeaturesContents ();
 
@@ -1115,7 +3259,7 @@ private:
 	}
 
 	Sql::Database& db_;
-	Path path_;
+	ConfigurePipeline& pipeline_;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1141,41 +3285,80 @@ void DeployedRepository::ConfigureImpl (Repository& source,
 			);
 		)_");
 
-	// This copies everything over, so we can do joins on source and target
-	// now. Assumes the source contains all file sets, content objects and
-	// files we're about to configure
-	db_.AttachTemporaryCopy ("source", source.GetDatabase ());
+	// This makes the source available for joins with the target. Local
+	// sources are attached in place, remote ones are copied. Assumes the
+	// source contains all file sets, content objects and files we're about
+	// to configure
+	db_.Attach ("source", source.GetDatabase (), context.log);
 
 	// Store the file sets we're going to install in a temporary table for
 	// joins, etc.
 	auto pendingFeaturesTable = db_.CreateTemporaryTable ("pending_features",
 		"Uuid BLOB NOT NULL UNIQUE");
 
-	std::array<std::unique_ptr<ConfigurePhase>, 7> configurePhases = {
-		std::make_unique<PreparePendingFeaturesPhase> (db_, features),
-		std::make_unique<UpdateFeaturesPhase> (db_),
-		std::make_unique<UpdateFeatureIdsForExistingFilesPhase> (db_),
-		std::make_unique<RemoveChangedFilesPhase> (db_, path_),
-		std::make_unique<GetContentPhase> (db_, path_, source),
-		std::make_unique<CopyExistingFilesPhase> (db_, path_, source),
-		std::make_unique<CleanupPhase> (db_, path_)
-	};
+	{
+		auto transaction = db_.BeginTransaction ();
+		auto insertPendingFeatureQuery = db_.Prepare (
+			"INSERT INTO pending_features (Uuid) VALUES (?);");
+
+		for (const auto& feature : features) {
+			insertPendingFeatureQuery.BindArguments (feature);
+			insertPendingFeatureQuery.Step ();
+			insertPendingFeatureQuery.Reset ();
 
-	std::array<int64_t, 7> stageCosts;
+			context.log.Debug ("Configure",
+				fmt::format ("Selected feature: '{0}'", ToString (feature)));
+		}
 
-	auto simulationTransaction = db_.BeginTransaction ();
+		transaction.Commit ();
+	}
 
-	for (int i = 0; i < configurePhases.size (); ++i) {
-		auto& phase = configurePhases [i];
-		phase->Simulate (&stageCosts [i]);
+	// Finish what an interrupted run left behind, before it's planned
+	ConfigureJournal journal{ db_, path_, context.log };
+
+	// Everything else is derived from the pending features and the current
+	// state once, and the phases execute the plan
+	ConfigurePlan plan{ db_ };
+
+	journal.RemoveUnplannedFiles (path_, context.log);
+
+	// The local file system work is queued by the phases and done while
+	// content is fetched
+	ConfigurePipeline pipeline{ path_, journal };
+
+	const bool stageOnly = IsStageOnly (context);
+
+	std::vector<std::unique_ptr<ConfigurePhase>> configurePhases;
+
+	if (stageOnly) {
+		// Only the missing content is fetched, the deployed files and
+		// features stay as they are until the next full configure
+		configurePhases.push_back (std::make_unique<ReuseLocalChunksPhase> (db_, path_, source, pipeline));
+		configurePhases.push_back (std::make_unique<GetContentPhase> (
+			db_, path_, source, pipeline, true));
+	} else {
+		configurePhases.push_back (std::make_unique<UpdateFeaturesPhase> (db_));
+		configurePhases.push_back (std::make_unique<UpdateFeatureIdsForExistingFilesPhase> (db_));
+		configurePhases.push_back (std::make_unique<RecordResumedFilesPhase> (db_));
+		configurePhases.push_back (std::make_unique<ReuseLocalChunksPhase> (db_, path_, source, pipeline));
+		configurePhases.push_back (std::make_unique<RemoveChangedFilesPhase> (db_, path_, pipeline));
+		configurePhases.push_back (std::make_unique<CopyExistingFilesPhase> (db_, path_, source, pipeline));
+		configurePhases.push_back (std::make_unique<RemoveUnusedFilesPhase> (db_, path_, pipeline));
+		configurePhases.push_back (std::make_unique<GetContentPhase> (db_, path_, source, pipeline));
+		configurePhases.push_back (std::make_unique<CleanupPhase> (db_, pipeline));
 	}
 
-	simulationTransaction.Rollback ();
+	// The costs are only used to size the progress, so we estimate them
+	// instead of running the phases twice
+	int64 totalCost = 0;
 
-	ProgressHelper progressHelper (context.progress, "Install",
-		std::accumulate (stageCosts.begin (), stageCosts.end (), 0LL));
+	for (auto& phase : configurePhases) {
+		totalCost += phase->EstimateCost ();
+	}
+
+	ProgressHelper progressHelper (context.progress, "Install", totalCost);
 
-	for (int i = 0; i < configurePhases.size (); ++i) {
+	for (size_t i = 0; i < configurePhases.size (); ++i) {
 		auto& phase = configurePhases [i];
 		phase->Execute (context.log, [&](const std::string& s, const int64_t cost) -> void {
 			progressHelper.Advance (s, cost);
@@ -1184,6 +3367,12 @@ void DeployedRepository::ConfigureImpl (Repository& source,
 
 	progressHelper.Done ();
 
+	// Files recovered from an interrupted run are only recorded by a full
+	// configure, so the journal is kept until then
+	if (!stageOnly || !journal.HasRecoveredRecords ()) {
+		journal.Complete ();
+	}
+
 	db_.Detach ("source");
 
 	db_.Execute ("PRAGMA journal_mode = DELETE");
@@ -9,12 +9,18 @@ details.
 
 #include "FileIO.h"
 
+#include "Exception.h"
+
 #if KYLA_PLATFORM_LINUX
 	#include <sys/mman.h>
 	#include <unistd.h>
+	#include <sys/ioctl.h>
 	#include <sys/types.h>
 	#include <sys/stat.h>
 	#include <fcntl.h>
+	#include <linux/fs.h>
+	#include <cerrno>
+	#include <cstring>
 #elif KYLA_PLATFORM_WINDOWS
 	#define WIN32_LEAN_AND_MEAN
 	#include <Windows.h>
@@ -26,7 +32,11 @@ details.
 #endif
 
 #include <algorithm>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 namespace kyla {
 ////////////////////////////////////////////////////////////////////////////////
@@ -52,6 +62,16 @@ FileStat Stat (const char* path)
 	FileStat result;
 	result.size = stats.st_size;
 
+#if KYLA_PLATFORM_LINUX
+	result.modificationTime = static_cast<std::int64_t> (stats.st_mtim.tv_sec) * 1000000000
+		+ stats.st_mtim.tv_nsec;
+	result.changeTime = static_cast<std::int64_t> (stats.st_ctim.tv_sec) * 1000000000
+		+ stats.st_ctim.tv_nsec;
+	result.inode = stats.st_ino;
+#else
+	result.modificationTime = static_cast<std::int64_t> (stats.st_mtime) * 1000000000;
+#endif
+
 	return result;
 }
 
@@ -82,6 +102,29 @@ struct LinuxFile final : public File
 		write (fd_, buffer.GetData (), buffer.GetSize ());
 	}
 
+	void WriteAtImpl (const std::int64_t offset, const ArrayRef<>& buffer) override
+	{
+		const auto data = static_cast<const std::uint8_t*> (buffer.GetData ());
+		std::int64_t bytesWritten = 0;
+
+		while (bytesWritten < buffer.GetSize ()) {
+			const auto result = ::pwrite (fd_, data + bytesWritten,
+				buffer.GetSize () - bytesWritten, offset + bytesWritten);
+
+			if (result < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				throw RuntimeException ("FileIO",
+					fmt::format ("Error while writing file: {0}",
+						std::strerror (errno)), KYLA_FILE_LINE);
+			}
+
+			bytesWritten += result;
+		}
+	}
+
 	std::int64_t ReadImpl (const MutableArrayRef<>& buffer) override
 	{
 		return read (fd_, buffer.GetData (), buffer.GetSize ());
@@ -118,6 +161,17 @@ struct LinuxFile final : public File
 		ftruncate (fd_, size);
 	}
 
+	void PreallocateImpl (const std::int64_t size) override
+	{
+		// Not every file system supports this, in which case the file is
+		// only resized. The truncate also shrinks files which were larger
+		if (size > 0) {
+			::fallocate (fd_, 0, 0, size);
+		}
+
+		ftruncate (fd_, size);
+	}
+
 	std::int64_t GetSizeImpl () const override
 	{
 		struct stat s;
@@ -180,6 +234,269 @@ std::unique_ptr<File> OpenFile (const Path& path, FileAccess openMode,
 {
 	return OpenFile (path.c_str (), openMode);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+/**
+Closes a file descriptor when it goes out of scope.
+*/
+struct FileDescriptor final
+{
+	explicit FileDescriptor (const int fd)
+		: fd (fd)
+	{
+	}
+
+	~FileDescriptor ()
+	{
+		if (fd != -1) {
+			close (fd);
+		}
+	}
+
+	FileDescriptor (const FileDescriptor&) = delete;
+	FileDescriptor& operator= (const FileDescriptor&) = delete;
+
+	const int fd;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+DuplicateMethod DuplicateFile (const Path& source, const Path& target,
+	const DuplicateMode mode)
+{
+	// The target may be a hard link to the source, which must not be
+	// truncated, so it gets replaced instead of overwritten
+	::unlink (target.c_str ());
+
+	if (mode == DuplicateMode::HardLink) {
+		if (::link (source.c_str (), target.c_str ()) == 0) {
+			return DuplicateMethod::HardLink;
+		}
+
+		// The target may be on a different file system, or the file system
+		// doesn't support hard links, so we fall back to a copy
+	}
+
+	FileDescriptor sourceFile{ ::open (source.c_str (), O_RDONLY) };
+
+	if (sourceFile.fd == -1) {
+		throw RuntimeException ("FileIO",
+			fmt::format ("Could not open file '{0}': {1}", source.string (),
+				std::strerror (errno)), KYLA_FILE_LINE);
+	}
+
+	struct stat sourceStat;
+	::fstat (sourceFile.fd, &sourceStat);
+
+	FileDescriptor targetFile{ ::open (target.c_str (),
+		O_WRONLY | O_CREAT | O_TRUNC, sourceStat.st_mode & 0777) };
+
+	if (targetFile.fd == -1) {
+		throw RuntimeException ("FileIO",
+			fmt::format ("Could not create file '{0}': {1}", target.string (),
+				std::strerror (errno)), KYLA_FILE_LINE);
+	}
+
+#ifdef FICLONE
+	// Copy-on-write file systems can share the data blocks
+	if (::ioctl (targetFile.fd, FICLONE, sourceFile.fd) == 0) {
+		return DuplicateMethod::Reflink;
+	}
+#endif
+
+	// Otherwise, let the kernel copy the data without passing it through
+	// user space. This continues where a failed copy_file_range stopped, as
+	// it advances the file offsets
+	auto result = DuplicateMethod::CopyRange;
+	std::int64_t remaining = sourceStat.st_size;
+
+	while (remaining > 0) {
+		const auto copied = ::copy_file_range (sourceFile.fd, nullptr,
+			targetFile.fd, nullptr, static_cast<size_t> (remaining), 0);
+
+		if (copied > 0) {
+			remaining -= copied;
+		} else if (copied == 0) {
+			break;
+		} else if (errno != EINTR) {
+			result = DuplicateMethod::Copy;
+			break;
+		}
+	}
+
+	if (result == DuplicateMethod::Copy) {
+		std::vector<char> buffer (1 << 20);
+
+		for (;;) {
+			const auto bytesRead = ::read (sourceFile.fd, buffer.data (), buffer.size ());
+
+			if (bytesRead == 0) {
+				break;
+			} else if (bytesRead < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				throw RuntimeException ("FileIO",
+					fmt::format ("Could not read file '{0}': {1}", source.string (),
+						std::strerror (errno)), KYLA_FILE_LINE);
+			}
+
+			for (ssize_t written = 0; written < bytesRead; ) {
+				const auto bytesWritten = ::write (targetFile.fd,
+					buffer.data () + written, bytesRead - written);
+
+				if (bytesWritten < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+
+					throw RuntimeException ("FileIO",
+						fmt::format ("Could not write file '{0}': {1}", target.string (),
+							std::strerror (errno)), KYLA_FILE_LINE);
+				}
+
+				written += bytesWritten;
+			}
+		}
+	}
+
+	return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+struct DirectoryTree::Impl
+{
+	// Directories are closed once they are neither cached nor in use
+	using Directory = std::shared_ptr<FileDescriptor>;
+
+	// The cache is dropped when it gets full, which keeps us well below the
+	// file descriptor limit
+	static constexpr size_t MaxOpenDirectories = 256;
+
+	/**
+	Open a directory relative to the root, optionally creating it. Returns
+	nullptr if it doesn't exist and create is false.
+	*/
+	Directory GetDirectory (const Path& directory, const bool create)
+	{
+		if (directory.empty ()) {
+			return root;
+		}
+
+		const auto key = directory.string ();
+
+		{
+			std::lock_guard<std::mutex> lock{ mutex };
+			auto it = directories.find (key);
+
+			if (it != directories.end ()) {
+				return it->second;
+			}
+		}
+
+		auto parent = GetDirectory (directory.parent_path (), create);
+
+		if (!parent) {
+			return nullptr;
+		}
+
+		const auto name = directory.filename ();
+
+		if (create && ::mkdirat (parent->fd, name.c_str (), 0777) != 0
+			&& errno != EEXIST) {
+			throw RuntimeException ("FileIO",
+				fmt::format ("Could not create directory '{0}': {1}", key,
+					std::strerror (errno)), KYLA_FILE_LINE);
+		}
+
+		auto result = std::make_shared<FileDescriptor> (::openat (parent->fd,
+			name.c_str (), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+
+		if (result->fd == -1) {
+			if (!create && errno == ENOENT) {
+				return nullptr;
+			}
+
+			throw RuntimeException ("FileIO",
+				fmt::format ("Could not open directory '{0}': {1}", key,
+					std::strerror (errno)), KYLA_FILE_LINE);
+		}
+
+		std::lock_guard<std::mutex> lock{ mutex };
+
+		if (directories.size () >= MaxOpenDirectories) {
+			directories.clear ();
+		}
+
+		// Another thread may have opened it in the meantime
+		return directories.emplace (key, result).first->second;
+	}
+
+	Path rootPath;
+	Directory root;
+	std::mutex mutex;
+	std::unordered_map<std::string, Directory> directories;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+DirectoryTree::DirectoryTree (const Path& root)
+	: impl_ (new Impl)
+{
+	impl_->rootPath = root;
+	impl_->root = std::make_shared<FileDescriptor> (::open (root.c_str (),
+		O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+
+	if (impl_->root->fd == -1) {
+		throw RuntimeException ("FileIO",
+			fmt::format ("Could not open directory '{0}': {1}", root.string (),
+				std::strerror (errno)), KYLA_FILE_LINE);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void DirectoryTree::CreateDirectories (const Path& directory)
+{
+	impl_->GetDirectory (directory, true);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+std::unique_ptr<File> DirectoryTree::CreateFile (const Path& path, FileAccess)
+{
+	auto directory = impl_->GetDirectory (path.parent_path (), false);
+
+	const auto fd = directory
+		? ::openat (directory->fd, path.filename ().c_str (),
+			O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR)
+		: -1;
+
+	if (fd == -1) {
+		throw RuntimeException ("FileIO",
+			fmt::format ("Could not create file '{0}': {1}",
+				(impl_->rootPath / path).string (),
+				directory ? std::strerror (errno) : "Directory does not exist"),
+			KYLA_FILE_LINE);
+	}
+
+	return std::unique_ptr<File> (new LinuxFile (fd, false /* read write */));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void DirectoryTree::RemoveFile (const Path& path)
+{
+	auto directory = impl_->GetDirectory (path.parent_path (), false);
+
+	if (!directory) {
+		return;
+	}
+
+	if (::unlinkat (directory->fd, path.filename ().c_str (), 0) != 0
+		&& errno != ENOENT) {
+		throw RuntimeException ("FileIO",
+			fmt::format ("Could not remove file '{0}': {1}",
+				(impl_->rootPath / path).string (), std::strerror (errno)),
+			KYLA_FILE_LINE);
+	}
+}
 #elif KYLA_PLATFORM_WINDOWS
 struct WindowsFile final : public File
 {
@@ -231,6 +548,39 @@ struct WindowsFile final : public File
 		}
 	}
 
+	void WriteAtImpl (const std::int64_t offset, const ArrayRef<>& buffer) override
+	{
+		std::int64_t bytesWritten = 0;
+
+		while (bytesWritten < buffer.GetSize ()) {
+			const DWORD bytesToWrite =
+				static_cast<DWORD> (
+					// This is in DWORD range
+					std::min<std::int64_t> (std::numeric_limits<::DWORD>::max (),
+						buffer.GetSize () - bytesWritten));
+
+			const std::int64_t position = offset + bytesWritten;
+
+			::OVERLAPPED overlapped = {};
+			overlapped.Offset = static_cast<::DWORD> (position & 0xFFFFFFFF);
+			overlapped.OffsetHigh = static_cast<::DWORD> (position >> 32);
+
+			::DWORD tmp = 0;
+
+			const auto result = ::WriteFile (fd_,
+				static_cast<const std::uint8_t*> (buffer.GetData ()) + bytesWritten,
+				bytesToWrite,
+				&tmp,
+				&overlapped);
+
+			if (result == 0) {
+				throw std::exception ("Error while writing file");
+			}
+
+			bytesWritten += tmp;
+		}
+	}
+
 	std::int64_t ReadImpl (const MutableArrayRef<>& buffer) override
 	{
 		std::int64_t bytesRead = 0;
@@ -326,6 +676,12 @@ struct WindowsFile final : public File
 		// http://msdn.microsoft.com/en-us/library/windows/desktop/aa365531(v=vs.85).aspx
 	}
 
+	void PreallocateImpl (const std::int64_t size) override
+	{
+		// SetEndOfFile allocates the space already
+		SetSizeImpl (size);
+	}
+
 	std::int64_t GetSizeImpl () const override
 	{
 		::LARGE_INTEGER size = { 0 };
@@ -449,10 +805,117 @@ std::unique_ptr<File> OpenFile (const Path& path, FileAccess openMode,
 
 	return std::unique_ptr<File> (new WindowsFile (fd, mode));
 }
+
+///////////////////////////////////////////////////////////////////////////////
+DuplicateMethod DuplicateFile (const Path& source, const Path& target,
+	const DuplicateMode mode)
+{
+	// The target may be a hard link to the source, which must not be
+	// truncated, so it gets replaced instead of overwritten
+	::DeleteFileW (target.c_str ());
+
+	if (mode == DuplicateMode::HardLink) {
+		if (::CreateHardLinkW (target.c_str (), source.c_str (), nullptr)) {
+			return DuplicateMethod::HardLink;
+		}
+	}
+
+	// CopyFile uses block cloning on file systems which support it
+	if (!::CopyFileW (source.c_str (), target.c_str (), FALSE)) {
+		throw RuntimeException ("FileIO",
+			fmt::format ("Could not copy file '{0}' to '{1}'",
+				source.string (), target.string ()), KYLA_FILE_LINE);
+	}
+
+	return DuplicateMethod::Copy;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+struct DirectoryTree::Impl
+{
+	Path rootPath;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+DirectoryTree::DirectoryTree (const Path& root)
+	: impl_ (new Impl)
+{
+	impl_->rootPath = root;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void DirectoryTree::CreateDirectories (const Path& directory)
+{
+	std::filesystem::create_directories (impl_->rootPath / directory);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::unique_ptr<File> DirectoryTree::CreateFile (const Path& path, FileAccess access)
+{
+	return kyla::CreateFile (impl_->rootPath / path, access);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void DirectoryTree::RemoveFile (const Path& path)
+{
+	std::filesystem::remove (impl_->rootPath / path);
+}
 #else
 #error Unsupported platform
 #endif
 
+///////////////////////////////////////////////////////////////////////////////
+DirectoryTree::~DirectoryTree ()
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Every thread removes a contiguous range of the paths, so files in the same
+directory mostly end up on the same thread.
+*/
+void DirectoryTree::RemoveFiles (const std::vector<Path>& paths, const int threadCount)
+{
+	// Starting a thread is not worth it for a few files
+	static const size_t MinFilesPerThread = 256;
+
+	const auto rangeCount = std::max<size_t> (1, std::min<size_t> (
+		static_cast<size_t> (std::max (threadCount, 1)),
+		paths.size () / MinFilesPerThread));
+	const auto rangeSize = (paths.size () + rangeCount - 1) / rangeCount;
+
+	std::vector<std::exception_ptr> errors (rangeCount);
+
+	auto removeRange = [&](const size_t range) -> void {
+		try {
+			const auto end = std::min (paths.size (), (range + 1) * rangeSize);
+
+			for (auto i = range * rangeSize; i < end; ++i) {
+				RemoveFile (paths [i]);
+			}
+		} catch (const std::exception&) {
+			errors [range] = std::current_exception ();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < rangeCount; ++i) {
+		threads.emplace_back (removeRange, i);
+	}
+
+	removeRange (0);
+
+	for (auto& thread : threads) {
+		thread.join ();
+	}
+
+	for (const auto& error : errors) {
+		if (error) {
+			std::rethrow_exception (error);
+		}
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 std::unique_ptr<File> CreateFile (const char* path)
 {
@@ -0,0 +1,296 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "HttpByteRanges.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+
+namespace kyla {
+namespace {
+///////////////////////////////////////////////////////////////////////////////
+std::string ToLower (std::string s)
+{
+	std::transform (s.begin (), s.end (), s.begin (),
+		[](const unsigned char c) { return static_cast<char> (std::tolower (c)); });
+
+	return s;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::string Trim (const std::string& s)
+{
+	const auto first = s.find_first_not_of (" \t\r\n");
+
+	if (first == std::string::npos) {
+		return std::string ();
+	}
+
+	const auto last = s.find_last_not_of (" \t\r\n");
+
+	return s.substr (first, last - first + 1);
+}
+
+// Headers of a single part are short, anything longer is garbage
+constexpr std::string::size_type MaxPartHeaderSize = 16 << 10;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Parse the value of a Content-Range header, for instance "bytes 0-499/1234".
+The total size may be unknown ("*").
+*/
+bool ParseHttpContentRange (const std::string& value, int64& first, int64& last)
+{
+	long long a = 0, b = 0;
+
+	if (std::sscanf (value.c_str (), " bytes %lld-%lld", &a, &b) != 2) {
+		return false;
+	}
+
+	if (a < 0 || b < a) {
+		return false;
+	}
+
+	first = a;
+	last = b;
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Like ParseHttpContentRange, but also return the total size. Returns false if
+the total size is unknown.
+*/
+bool ParseHttpContentRange (const std::string& value, int64& first, int64& last,
+	int64& total)
+{
+	if (!ParseHttpContentRange (value, first, last)) {
+		return false;
+	}
+
+	const auto separator = value.find ('/');
+
+	if (separator == std::string::npos) {
+		return false;
+	}
+
+	long long t = 0;
+	if (std::sscanf (value.c_str () + separator + 1, "%lld", &t) != 1 || t <= last) {
+		return false;
+	}
+
+	total = t;
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Get the boundary from a Content-Type header value. Returns false if the
+content type is not multipart/byteranges.
+*/
+bool ParseMultipartBoundary (const std::string& contentType, std::string& boundary)
+{
+	const auto lowerContentType = ToLower (contentType);
+
+	if (Trim (lowerContentType).compare (0, 20, "multipart/byteranges") != 0) {
+		return false;
+	}
+
+	const auto position = lowerContentType.find ("boundary=");
+
+	if (position == std::string::npos) {
+		return false;
+	}
+
+	// The boundary is case-sensitive, so we extract it from the original
+	auto result = contentType.substr (position + 9);
+	result = result.substr (0, result.find (';'));
+	result = Trim (result);
+
+	if (result.size () >= 2 && result.front () == '"' && result.back () == '"') {
+		result = result.substr (1, result.size () - 2);
+	}
+
+	if (result.empty ()) {
+		return false;
+	}
+
+	boundary = result;
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+MultipartByteRangesParser::MultipartByteRangesParser (const std::string& boundary,
+	PartDataCallback callback)
+	: delimiter_ ("--" + boundary)
+	, callback_ (callback)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Parse the next block of the response body. Returns false if the body is
+malformed, in which case all further calls fail as well.
+*/
+bool MultipartByteRangesParser::Feed (const ArrayRef<>& data)
+{
+	auto p = static_cast<const char*> (data.GetData ());
+	auto size = data.GetSize ();
+
+	// Part bodies are passed through directly, everything else is collected
+	// until it can be parsed
+	if (state_ == State::Body && pending_.empty ()) {
+		const auto count = std::min (size, remaining_);
+
+		callback_ (offset_, ArrayRef<> (p, count));
+
+		offset_ += count;
+		remaining_ -= count;
+		p += count;
+		size -= count;
+
+		if (remaining_ == 0) {
+			state_ = State::Boundary;
+		}
+	}
+
+	pending_.append (p, size);
+
+	return Process ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool MultipartByteRangesParser::IsComplete () const
+{
+	return state_ == State::Done;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool MultipartByteRangesParser::Process ()
+{
+	for (;;) {
+		switch (state_) {
+		case State::Boundary:
+		{
+			const auto position = pending_.find (delimiter_);
+
+			if (position == std::string::npos) {
+				// Keep enough to find a delimiter split across two blocks
+				if (pending_.size () > delimiter_.size ()) {
+					pending_.erase (0, pending_.size () - delimiter_.size ());
+				}
+
+				return true;
+			}
+
+			pending_.erase (0, position + delimiter_.size ());
+			state_ = State::AfterBoundary;
+			break;
+		}
+
+		case State::AfterBoundary:
+			if (pending_.size () < 2) {
+				return true;
+			}
+
+			if (pending_.compare (0, 2, "--") == 0) {
+				state_ = State::Done;
+			} else if (pending_.compare (0, 2, "\r\n") == 0) {
+				pending_.erase (0, 2);
+				state_ = State::Headers;
+			} else {
+				state_ = State::Error;
+			}
+			break;
+
+		case State::Headers:
+		{
+			const auto end = pending_.find ("\r\n\r\n");
+
+			if (end == std::string::npos) {
+				if (pending_.size () > MaxPartHeaderSize) {
+					state_ = State::Error;
+					break;
+				}
+
+				return true;
+			}
+
+			bool hasRange = false;
+			std::string::size_type lineStart = 0;
+
+			while (lineStart < end) {
+				auto lineEnd = pending_.find ("\r\n", lineStart);
+				const auto line = pending_.substr (lineStart, lineEnd - lineStart);
+				lineStart = lineEnd + 2;
+
+				const auto separator = line.find (':');
+				if (separator == std::string::npos) {
+					continue;
+				}
+
+				if (ToLower (Trim (line.substr (0, separator))) != "content-range") {
+					continue;
+				}
+
+				int64 first = 0, last = 0;
+				if (ParseHttpContentRange (line.substr (separator + 1), first, last)) {
+					offset_ = first;
+					remaining_ = last - first + 1;
+					hasRange = true;
+				}
+			}
+
+			if (!hasRange) {
+				state_ = State::Error;
+				break;
+			}
+
+			pending_.erase (0, end + 4);
+			state_ = State::Body;
+			break;
+		}
+
+		case State::Body:
+		{
+			if (pending_.empty ()) {
+				return true;
+			}
+
+			const auto count = std::min (
+				static_cast<int64> (pending_.size ()), remaining_);
+
+			callback_ (offset_, ArrayRef<> (pending_.data (), count));
+
+			offset_ += count;
+			remaining_ -= count;
+			pending_.erase (0, count);
+
+			if (remaining_ == 0) {
+				state_ = State::Boundary;
+			}
+			break;
+		}
+
+		case State::Done:
+			// Ignore the epilogue
+			pending_.clear ();
+			return true;
+
+		case State::Error:
+			return false;
+		}
+	}
+}
+}
@@ -0,0 +1,235 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "MemoryBudget.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace kyla {
+///////////////////////////////////////////////////////////////////////////////
+MemoryBudget::MemoryBudget (const int64 limit)
+	: limit_ (limit)
+{
+	assert (limit > 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Reserve size bytes, blocking until they are available.
+
+A reservation which is larger than the whole limit is granted as soon as
+nothing else is reserved. Otherwise, a single oversized chunk would block
+forever.
+
+Returns false if the budget has been cancelled while waiting.
+*/
+bool MemoryBudget::Reserve (const int64 size)
+{
+	assert (size >= 0);
+
+	std::unique_lock<std::mutex> lock{ mutex_ };
+
+	conditionVariable_.wait (lock, [this, size]() {
+		return cancelled_ || usage_ == 0 || usage_ + size <= limit_;
+	});
+
+	if (cancelled_) {
+		return false;
+	}
+
+	usage_ += size;
+	peakUsage_ = std::max (peakUsage_, usage_);
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Reserve size bytes if they are available right now.
+*/
+bool MemoryBudget::TryReserve (const int64 size)
+{
+	assert (size >= 0);
+
+	std::lock_guard<std::mutex> lock{ mutex_ };
+
+	if (cancelled_ || (usage_ != 0 && usage_ + size > limit_)) {
+		return false;
+	}
+
+	usage_ += size;
+	peakUsage_ = std::max (peakUsage_, usage_);
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void MemoryBudget::Release (const int64 size)
+{
+	std::unique_lock<std::mutex> lock{ mutex_ };
+
+	assert (size <= usage_);
+	usage_ -= size;
+
+	lock.unlock ();
+	conditionVariable_.notify_all ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Wake up all waiting threads and fail all further reservations. This is used
+to unblock producers when an error occurred.
+*/
+void MemoryBudget::Cancel ()
+{
+	std::unique_lock<std::mutex> lock{ mutex_ };
+
+	cancelled_ = true;
+
+	lock.unlock ();
+	conditionVariable_.notify_all ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Reset the cancellation flag and the peak usage, so the budget can be used for
+another run.
+*/
+void MemoryBudget::Reset ()
+{
+	std::lock_guard<std::mutex> lock{ mutex_ };
+
+	cancelled_ = false;
+	peakUsage_ = usage_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int64 MemoryBudget::GetLimit () const
+{
+	return limit_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int64 MemoryBudget::GetUsage () const
+{
+	std::lock_guard<std::mutex> lock{ mutex_ };
+
+	return usage_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int64 MemoryBudget::GetPeakUsage () const
+{
+	std::lock_guard<std::mutex> lock{ mutex_ };
+
+	return peakUsage_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+MemoryReservation::MemoryReservation (MemoryBudget& budget, const int64 size)
+{
+	if (budget.Reserve (size)) {
+		budget_ = &budget;
+		size_ = size;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Reserve size bytes without blocking. If the budget is exhausted, the result
+is not valid.
+*/
+MemoryReservation MemoryReservation::TryCreate (MemoryBudget& budget,
+	const int64 size)
+{
+	MemoryReservation result;
+
+	if (budget.TryReserve (size)) {
+		result.budget_ = &budget;
+		result.size_ = size;
+	}
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+MemoryReservation::~MemoryReservation ()
+{
+	Release ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+MemoryReservation::MemoryReservation (MemoryReservation&& other) noexcept
+	: budget_ (other.budget_)
+	, size_ (other.size_)
+{
+	other.budget_ = nullptr;
+	other.size_ = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+MemoryReservation& MemoryReservation::operator= (MemoryReservation&& other) noexcept
+{
+	if (this != &other) {
+		Release ();
+
+		budget_ = other.budget_;
+		size_ = other.size_;
+
+		other.budget_ = nullptr;
+		other.size_ = 0;
+	}
+
+	return *this;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Move size bytes of this reservation into a new reservation. This allows a
+stage to reserve for a whole batch at once, and hand out the parts to the
+individual requests.
+*/
+MemoryReservation MemoryReservation::Split (const int64 size)
+{
+	assert (size <= size_);
+
+	MemoryReservation result;
+
+	if (budget_) {
+		result.budget_ = budget_;
+		result.size_ = size;
+		size_ -= size;
+	}
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Return the part of the reservation exceeding size to the budget.
+*/
+void MemoryReservation::Shrink (const int64 size)
+{
+	if (budget_ && size < size_) {
+		budget_->Release (size_ - size);
+		size_ = size;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void MemoryReservation::Release ()
+{
+	if (budget_) {
+		budget_->Release (size_);
+		budget_ = nullptr;
+		size_ = 0;
+	}
+}
+}
@@ -0,0 +1,500 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "MirroredRepository.h"
+
+#include "Exception.h"
+#include "Hash.h"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <limits>
+#include <thread>
+
+namespace kyla {
+namespace {
+///////////////////////////////////////////////////////////////////////////////
+/**
+Check the chunks of a range which has been read against their hashes. A
+mirror may serve corrupted or stale data, which is only caught here while the
+range can still be read from another mirror.
+*/
+bool IsIntact (const PackedRepositoryBase::PackageFile::ReadRange& range)
+{
+	for (const auto& chunk : range.chunkHashes) {
+		const auto start = chunk.offset - range.offset;
+
+		assert (start >= 0 && start + chunk.size <= range.buffer.GetSize ());
+
+		const auto data = range.buffer.ToByteRef ().Slice (start, chunk.size);
+
+		if (ComputeSHA256 (data) != chunk.hash) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+struct DatabaseIdentity
+{
+	int64 size = 0;
+	SHA256Digest hash;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Identify a repository database by its size, and a hash over the location and
+the hash of every chunk in the packages, which is what the mirrors must agree
+on to be interchangeable.
+*/
+DatabaseIdentity GetDatabaseIdentity (Sql::Database& db)
+{
+	DatabaseIdentity result;
+
+	auto sizeQuery = db.Prepare (
+		"SELECT page_count * page_size FROM pragma_page_count, pragma_page_size");
+	sizeQuery.Step ();
+	result.size = sizeQuery.GetInt64 (0);
+
+	auto chunksQuery = db.Prepare (
+		"SELECT fs_packages.Filename, fs_chunks.PackageOffset, "
+		"    fs_chunks.PackageSize, IFNULL (fs_chunk_hashes.Hash, zeroblob (32)) "
+		"FROM fs_chunks "
+		"INNER JOIN fs_packages ON fs_packages.Id = fs_chunks.PackageId "
+		"LEFT JOIN fs_chunk_hashes ON fs_chunk_hashes.ChunkId = fs_chunks.Id "
+		"ORDER BY fs_chunks.Id");
+
+	SHA256StreamHasher hasher;
+	hasher.Initialize ();
+
+	while (chunksQuery.Step ()) {
+		const std::string filename = chunksQuery.GetText (0);
+		const int64 location [2] = { chunksQuery.GetInt64 (1),
+			chunksQuery.GetInt64 (2) };
+
+		hasher.Update (ArrayRef<> { filename.c_str (),
+			static_cast<int64> (filename.size () + 1) });
+		hasher.Update (ArrayRef<> { location, sizeof (location) });
+
+		SHA256Digest chunkHash;
+		chunksQuery.GetBlob (3, chunkHash);
+		hasher.Update (chunkHash);
+	}
+
+	result.hash = hasher.Finalize ();
+
+	return result;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+MirrorStatistics::MirrorStatistics (const int mirrorCount)
+	: mirrors_ (mirrorCount)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int MirrorStatistics::GetMirrorCount () const
+{
+	return static_cast<int> (mirrors_.size ());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+double MirrorStatistics::GetThroughput (const int mirror) const
+{
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	return mirrors_ [mirror].throughput;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int MirrorStatistics::GetFailureCount (const int mirror) const
+{
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	return mirrors_ [mirror].failures;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Update the throughput estimate of a mirror after a successful read. The
+estimate is a moving average, so it follows changing network conditions
+without jumping around on every read.
+*/
+void MirrorStatistics::RecordTransfer (const int mirror, const int64 size,
+	const double seconds)
+{
+	// Reads which complete faster than we can measure don't tell us much
+	const double throughput = static_cast<double> (size)
+		/ std::max (seconds, 1e-4);
+
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	auto& m = mirrors_ [mirror];
+
+	if (m.throughput == 0) {
+		m.throughput = throughput;
+	} else {
+		m.throughput = 0.7 * m.throughput + 0.3 * throughput;
+	}
+
+	m.failures = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void MirrorStatistics::RecordFailure (const int mirror)
+{
+	std::lock_guard<std::mutex> lock{ mutex_ };
+	++mirrors_ [mirror].failures;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+MirroredPackageFile::MirroredPackageFile (std::vector<OpenCallback>&& mirrors,
+	MirrorStatistics& statistics)
+	: openCallbacks_ (std::move (mirrors))
+	, files_ (openCallbacks_.size ())
+	, openFailed_ (openCallbacks_.size (), false)
+	, statistics_ (statistics)
+{
+	assert (static_cast<int> (openCallbacks_.size ()) == statistics.GetMirrorCount ());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+MirroredPackageFile::~MirroredPackageFile ()
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Read a range without chunk hashes, so the data can't be checked per mirror.
+Callers which know the chunks inside the range use ReadRanges instead.
+*/
+bool MirroredPackageFile::Read (const int64 offset, const MutableArrayRef<>& buffer)
+{
+	ReadRange range{ offset, buffer, false, {} };
+	ReadRanges (MutableArrayRef<ReadRange>{ &range, 1 });
+
+	return range.succeeded;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Read the ranges from all usable mirrors at once.
+
+Each mirror gets a contiguous run of ranges, sized by its share of the total
+throughput, so multi-range requests remain efficient. Mirrors which haven't
+been measured yet get the share of the fastest one, so they get measured
+quickly. Once a mirror fails, its ranges are spread across the remaining
+ones, until every mirror has been tried.
+*/
+void MirroredPackageFile::ReadRanges (const MutableArrayRef<ReadRange>& ranges)
+{
+	std::vector<int64> pending (ranges.GetCount ());
+	for (int64 i = 0; i < ranges.GetCount (); ++i) {
+		ranges [i].succeeded = false;
+		pending [i] = i;
+	}
+
+	std::sort (pending.begin (), pending.end (), [&ranges](const int64 a, const int64 b) {
+		return ranges [a].offset < ranges [b].offset;
+	});
+
+	std::vector<bool> excluded (openCallbacks_.size (), false);
+
+	while (!pending.empty ()) {
+		auto mirrors = GetUsableMirrors (excluded);
+
+		if (mirrors.empty ()) {
+			return;
+		}
+
+		// A single range is not worth splitting
+		if (pending.size () == 1) {
+			mirrors.resize (1);
+		}
+
+		std::vector<double> weights;
+		double fastest = 0;
+		for (const auto mirror : mirrors) {
+			weights.push_back (statistics_.GetThroughput (mirror));
+			fastest = std::max (fastest, weights.back ());
+		}
+
+		double totalWeight = 0;
+		for (auto& weight : weights) {
+			if (weight == 0) {
+				weight = fastest > 0 ? fastest : 1;
+			}
+
+			totalWeight += weight;
+		}
+
+		int64 totalSize = 0;
+		for (const auto index : pending) {
+			totalSize += ranges [index].buffer.GetSize ();
+		}
+
+		// Hand out contiguous runs of ranges in offset order, the last mirror
+		// takes whatever is left
+		std::vector<std::vector<ReadRange>> assignments (mirrors.size ());
+		std::vector<std::vector<int64>> assignedIndices (mirrors.size ());
+
+		{
+			size_t mirror = 0;
+			int64 assignedSize = 0;
+			double quota = totalSize * weights [0] / totalWeight;
+
+			for (const auto index : pending) {
+				while (mirror + 1 < mirrors.size () &&
+					!assignments [mirror].empty () &&
+					assignedSize >= quota) {
+					++mirror;
+					quota += totalSize * weights [mirror] / totalWeight;
+				}
+
+				assignments [mirror].push_back (ranges [index]);
+				assignedIndices [mirror].push_back (index);
+				assignedSize += ranges [index].buffer.GetSize ();
+			}
+		}
+
+		std::vector<double> durations (mirrors.size (), 0);
+
+		auto readFromMirror = [&](const size_t i) -> void {
+			auto& assignment = assignments [i];
+
+			if (assignment.empty ()) {
+				return;
+			}
+
+			const auto start = std::chrono::steady_clock::now ();
+
+			try {
+				auto file = GetFile (mirrors [i]);
+
+				if (file) {
+					file->ReadRanges (MutableArrayRef<ReadRange>{ assignment });
+				}
+
+				for (auto& range : assignment) {
+					if (range.succeeded && !IsIntact (range)) {
+						range.succeeded = false;
+					}
+				}
+			} catch (const std::exception&) {
+				for (auto& range : assignment) {
+					range.succeeded = false;
+				}
+			}
+
+			durations [i] = std::chrono::duration<double> (
+				std::chrono::steady_clock::now () - start).count ();
+		};
+
+		// The first mirror is read on this thread, so a single mirror
+		// doesn't need any extra threads
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < mirrors.size (); ++i) {
+			if (!assignments [i].empty ()) {
+				threads.emplace_back (readFromMirror, i);
+			}
+		}
+
+		readFromMirror (0);
+
+		for (auto& thread : threads) {
+			thread.join ();
+		}
+
+		std::vector<int64> failed;
+
+		for (size_t i = 0; i < mirrors.size (); ++i) {
+			if (assignments [i].empty ()) {
+				continue;
+			}
+
+			int64 readSize = 0;
+			bool mirrorFailed = false;
+
+			for (size_t j = 0; j < assignments [i].size (); ++j) {
+				const auto index = assignedIndices [i][j];
+
+				if (assignments [i][j].succeeded) {
+					ranges [index].succeeded = true;
+					readSize += assignments [i][j].buffer.GetSize ();
+				} else {
+					failed.push_back (index);
+					mirrorFailed = true;
+				}
+			}
+
+			if (mirrorFailed) {
+				statistics_.RecordFailure (mirrors [i]);
+				excluded [mirrors [i]] = true;
+			} else {
+				statistics_.RecordTransfer (mirrors [i], readSize, durations [i]);
+			}
+		}
+
+		std::sort (failed.begin (), failed.end (), [&ranges](const int64 a, const int64 b) {
+			return ranges [a].offset < ranges [b].offset;
+		});
+
+		pending = std::move (failed);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Enough ranges to keep every mirror busy.
+*/
+int MirroredPackageFile::GetPreferredRangeCount () const
+{
+	int result = 0;
+
+	for (size_t i = 0; i < openCallbacks_.size (); ++i) {
+		try {
+			if (auto file = GetFile (static_cast<int> (i))) {
+				result += file->GetPreferredRangeCount ();
+			}
+		} catch (const std::exception&) {
+		}
+	}
+
+	return std::max (result, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Open the package on a mirror on first use. Returns nullptr if the package
+can't be opened there.
+*/
+PackedRepositoryBase::PackageFile* MirroredPackageFile::GetFile (const int mirror) const
+{
+	if (!files_ [mirror] && !openFailed_ [mirror]) {
+		try {
+			files_ [mirror] = openCallbacks_ [mirror] ();
+		} catch (const std::exception&) {
+		}
+
+		openFailed_ [mirror] = !files_ [mirror];
+	}
+
+	return files_ [mirror].get ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+All mirrors which can still be used, fastest first. Mirrors which keep
+failing are skipped as long as there is any other mirror left.
+*/
+std::vector<int> MirroredPackageFile::GetUsableMirrors (const std::vector<bool>& excluded) const
+{
+	std::vector<int> candidates;
+	std::vector<int> failing;
+
+	for (int i = 0; i < static_cast<int> (openCallbacks_.size ()); ++i) {
+		if (excluded [i] || openFailed_ [i]) {
+			continue;
+		}
+
+		if (statistics_.GetFailureCount (i) >= MirrorStatistics::MaxFailures) {
+			failing.push_back (i);
+		} else {
+			candidates.push_back (i);
+		}
+	}
+
+	if (candidates.empty ()) {
+		candidates = std::move (failing);
+	}
+
+	// Unmeasured mirrors come first, so they get measured
+	auto getThroughput = [this](const int mirror) -> double {
+		const auto throughput = statistics_.GetThroughput (mirror);
+		return throughput == 0 ? std::numeric_limits<double>::infinity () : throughput;
+	};
+
+	std::stable_sort (candidates.begin (), candidates.end (),
+		[&getThroughput](const int a, const int b) -> bool {
+		return getThroughput (a) > getThroughput (b);
+	});
+
+	return candidates;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+MirroredRepository::MirroredRepository (std::vector<std::unique_ptr<PackedRepositoryBase>>&& mirrors)
+	: mirrors_ (std::move (mirrors))
+	, statistics_ (static_cast<int> (mirrors_.size ()))
+{
+	if (mirrors_.empty ()) {
+		throw RuntimeException ("MirroredRepository",
+			"At least one mirror is required", KYLA_FILE_LINE);
+	}
+
+	// Chunks are only verified if they're not encrypted, and the database
+	// is only read from the first mirror, so a mirror of another repository
+	// or an outdated one is rejected right away
+	if (mirrors_.size () > 1) {
+		const auto identity = GetDatabaseIdentity (mirrors_.front ()->GetDatabase ());
+
+		for (size_t i = 1; i < mirrors_.size (); ++i) {
+			const auto mirrorIdentity = GetDatabaseIdentity (mirrors_ [i]->GetDatabase ());
+
+			if (mirrorIdentity.size != identity.size ||
+				mirrorIdentity.hash != identity.hash) {
+				throw RuntimeException ("MirroredRepository",
+					fmt::format ("Mirror {0} contains a different repository than "
+						"the first mirror", i + 1),
+					KYLA_FILE_LINE);
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+MirroredRepository::~MirroredRepository ()
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+Sql::Database& MirroredRepository::GetDatabaseImpl ()
+{
+	return mirrors_.front ()->GetDatabase ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::unique_ptr<PackedRepositoryBase::PackageFile> MirroredRepository::OpenPackage (
+	const std::string& packageName) const
+{
+	std::vector<MirroredPackageFile::OpenCallback> openCallbacks;
+
+	for (const auto& mirror : mirrors_) {
+		const PackedRepositoryBase* repository = mirror.get ();
+
+		openCallbacks.push_back ([repository, packageName]() {
+			return repository->OpenPackage (packageName);
+		});
+	}
+
+	return std::make_unique<MirroredPackageFile> (std::move (openCallbacks),
+		statistics_);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool MirroredRepository::IsRemote () const
+{
+	return std::any_of (mirrors_.begin (), mirrors_.end (),
+		[](const std::unique_ptr<PackedRepositoryBase>& mirror) {
+		return mirror->IsRemote ();
+	});
+}
+} // namespace kyla
@@ -21,7 +21,8 @@ namespace kyla {
 PackedRepository::PackedRepository (const char* path)
 	: path_ (path)
 {
-	db_ = Sql::Database::Open (Path (path) / "repository.db");
+	db_ = Sql::Database::Open (Path (path) / "repository.db",
+		Sql::OpenMode::Immutable);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
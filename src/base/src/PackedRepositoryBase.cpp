@@ -10,10 +10,12 @@ details.
 #include "PackedRepositoryBase.h"
 
 #include "sql/Database.h"
+#include "ChunkCache.h"
 #include "Exception.h"
 #include "FileIO.h"
 #include "Hash.h"
 #include "Log.h"
+#include "MemoryBudget.h"
 
 #include "Compression.h"
 
@@ -21,10 +23,13 @@ details.
 
 #include "install-db-structure.h"
 
+#include <algorithm>
 #include <unordered_map>
 #include <set>
 
+#include <chrono>
 #include <deque>
+#include <iterator>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
@@ -120,7 +125,7 @@ struct PackedRepositoryBase::Decryptor final
 
 This class provides the basic implementation for a packed repository, that is,
 a repository which stores the data in one or more source packages indexed using
-the storage_mapping and fs_packages tables.
+the fs_chunks and fs_packages tables.
 
 The storage access itself is abstracted into the PackageFile class. This class
 is used instead of the generic File class as a package file only supports
@@ -159,14 +164,43 @@ struct ReadRequest
 	int64 compressionInputSize = 0;
 	int64 compressionOutputSize = 0;
 
-	PackedRepositoryBase::Decryptor* decryptor = nullptr;
+	// Each process thread has its own decryptor, as they are not thread-safe
+	bool isEncrypted = false;
 	AES256IvSalt ivSalt;
 	int64 encryptionInputSize = 0;
 	int64 encryptionOutputSize = 0;
 
 	SHA256Digest contentHash;
+	int64 priority = 0;
+	int64 packageId = -1;
+
+	// Only check the chunk hash without decompressing. Read errors and hash
+	// mismatches are reported in the output request instead of throwing
+	bool verifyOnly = false;
+
+	// Read from the chunk cache instead of the package
+	bool cached = false;
 
 	Repository::GetContentObjectCallback callback;
+
+	/**
+	The memory needed to process this request, that is, the raw package data,
+	the decrypted data and the final output.
+	*/
+	int64 GetProcessingMemoryCost () const
+	{
+		int64 result = packageSize;
+
+		if (!verifyOnly) {
+			result += sourceSize;
+		}
+
+		if (isEncrypted) {
+			result += encryptionOutputSize;
+		}
+
+		return result;
+	}
 };
 
 class PackageFileWrapper
@@ -211,6 +245,10 @@ struct BatchReadRequest
 	int64 packageOffset;
 	int64 readSize;
 
+	// A single cached request, which is only read from the package if the
+	// cache entry has gone missing
+	bool fromCache = false;
+
 	BatchReadRequest () = default;
 
 	BatchReadRequest (BatchReadRequest&& other) noexcept
@@ -218,6 +256,7 @@ struct BatchReadRequest
 		, packageFile (other.packageFile)
 		, packageOffset (other.packageOffset)
 		, readSize (other.readSize)
+		, fromCache (other.fromCache)
 	{
 	}
 
@@ -227,6 +266,7 @@ struct BatchReadRequest
 		packageFile = other.packageFile;
 		packageOffset = other.packageOffset;
 		readSize = other.readSize;
+		fromCache = other.fromCache;
 
 		return *this;
 	}
@@ -249,10 +289,20 @@ struct ProcessRequest
 	std::vector<byte> inputBuffer;
 	int64 size = 0;
 
+	// Only set for verify-only requests, otherwise a failed read throws
+	bool readFailed = false;
+
+	// Covers all memory needed until the output has been consumed
+	MemoryReservation reservation;
+
 	ProcessRequest (std::unique_ptr<ReadRequest>&& requestData,
-		std::vector<byte>&& inputBuffer)
+		std::vector<byte>&& inputBuffer,
+		MemoryReservation&& reservation,
+		const bool readFailed = false)
 		: requestData (std::move (requestData))
 		, inputBuffer (std::move (inputBuffer))
+		, readFailed (readFailed)
+		, reservation (std::move (reservation))
 	{
 		size = static_cast<int64> (this->inputBuffer.size ());
 	}
@@ -263,6 +313,8 @@ struct ProcessRequest
 		: requestData (std::move (other.requestData))
 		, inputBuffer (std::move (other.inputBuffer))
 		, size (other.size)
+		, readFailed (other.readFailed)
+		, reservation (std::move (other.reservation))
 	{
 	}
 
@@ -271,6 +323,8 @@ struct ProcessRequest
 		requestData = std::move (other.requestData);
 		inputBuffer = std::move (other.inputBuffer);
 		size = other.size;
+		readFailed = other.readFailed;
+		reservation = std::move (other.reservation);
 
 		return *this;
 	}
@@ -285,10 +339,19 @@ struct OutputRequest
 	std::vector<byte> data;
 	int64 size = 0;
 
+	// Result of the hash check for verify-only requests
+	RepairResult result = RepairResult::Ok;
+
+	MemoryReservation reservation;
+
 	OutputRequest (std::unique_ptr<ReadRequest>&& requestData,
-		std::vector<byte>&& data)
+		std::vector<byte>&& data,
+		MemoryReservation&& reservation,
+		const RepairResult result = RepairResult::Ok)
 		: requestData (std::move (requestData))
 		, data (std::move (data))
+		, result (result)
+		, reservation (std::move (reservation))
 	{
 		size = static_cast<int64> (this->data.size ());
 	}
@@ -299,6 +362,8 @@ struct OutputRequest
 		: requestData (std::move (other.requestData))
 		, data (std::move (other.data))
 		, size (other.size)
+		, result (other.result)
+		, reservation (std::move (other.reservation))
 	{
 	}
 
@@ -307,6 +372,8 @@ struct OutputRequest
 		requestData = std::move (other.requestData);
 		data = std::move (other.data);
 		size = other.size;
+		result = other.result;
+		reservation = std::move (other.reservation);
 
 		other.size = 0;
 
@@ -428,6 +495,7 @@ struct ErrorState
 	std::exception_ptr exception_;
 
 	std::vector<ProducerConsumerQueueBase*> queues_;
+	MemoryBudget* memoryBudget_ = nullptr;
 
 	ErrorState ()
 	{
@@ -439,6 +507,11 @@ struct ErrorState
 		queues_.push_back (queue);
 	}
 
+	void RegisterMemoryBudget (MemoryBudget* memoryBudget)
+	{
+		memoryBudget_ = memoryBudget;
+	}
+
 	bool IsSignaled () const
 	{
 		return static_cast<bool> (errorOccurred_);
@@ -453,28 +526,42 @@ struct ErrorState
 		for (auto& queue : queues_) {
 			queue->Poison ();
 		}
+
+		// Unblock all stages waiting for memory
+		if (memoryBudget_) {
+			memoryBudget_->Cancel ();
+		}
 	}
 
 	void RethrowException ()
 	{
-		if (!exception_) {
+		if (exception_) {
 			std::rethrow_exception (exception_);
 		}
 	}
 };
 
+
 ///////////////////////////////////////////////////////////////////////////////
 /**
 Reads data and produces read requests.
+
+Before a batch gets read, the memory for the batch and all processing of
+its requests is reserved. This throttles reading if the later stages can't
+keep up.
 */
 class ReadThread
 {
 public:
 	ReadThread (std::vector<BatchReadRequest>&& readRequests,
 		ProducerConsumerQueue<ProcessRequest>& processRequestQueue,
+		MemoryBudget& memoryBudget,
+		ChunkCache* chunkCache,
 		ErrorState* errorState)
 		: queue_ (processRequestQueue)
 		, batchReadRequests_ (std::move (readRequests))
+		, memoryBudget_ (memoryBudget)
+		, chunkCache_ (chunkCache)
 		, errorState_ (errorState)
 	{
 	}
@@ -482,28 +569,84 @@ public:
 	void Run ()
 	{
 		std::thread readThread{ [&] () -> void {
-			std::vector<byte> inputBuffer;
+			size_t first = 0;
 
-			for (auto& backReadRequest : batchReadRequests_) {
+			while (first < batchReadRequests_.size ()) {
 				if (errorState_->IsSignaled ()) {
 					break;
 				}
 
+				size_t last = first + 1;
+
 				try {
-					inputBuffer.resize (backReadRequest.readSize);
-					backReadRequest.packageFile->GetFile().Read (
-						backReadRequest.packageOffset,
-						inputBuffer);
-
-					// We slice the input buffer by creating copies
-					for (auto& rd : backReadRequest.requests) {
-						const auto first = inputBuffer.begin ()
-							// Start relative to batch request start
-							+ (rd->packageOffset - backReadRequest.packageOffset);
-						const auto last = first + rd->packageSize;
-
-						queue_.Insert ({ std::move (rd),
-							std::vector<byte> (first, last) });
+					if (batchReadRequests_ [first].fromCache) {
+						if (!ReadCached (batchReadRequests_ [first])) {
+							break;
+						}
+
+						batchReadRequests_ [first++].Destroy ();
+						continue;
+					}
+
+					auto& packageFile = batchReadRequests_ [first].packageFile->GetFile ();
+
+					// Remote package files prefer several ranges per read, so
+					// we group consecutive batches from the same package. The
+					// group must fit into the budget, as the whole group is
+					// reserved in one go - we never wait for memory while
+					// holding a partial reservation
+					const size_t maxRangeCount = std::max (1,
+						packageFile.GetPreferredRangeCount ());
+					int64 groupCost = GetBatchCost (batchReadRequests_ [first]);
+
+					while (last < batchReadRequests_.size () &&
+						(last - first) < maxRangeCount &&
+						batchReadRequests_ [last].packageFile == batchReadRequests_ [first].packageFile &&
+						!batchReadRequests_ [last].fromCache) {
+						const auto cost = GetBatchCost (batchReadRequests_ [last]);
+
+						if (groupCost + cost > memoryBudget_.GetLimit () / 2) {
+							break;
+						}
+
+						groupCost += cost;
+						++last;
+					}
+
+					MemoryReservation reservation{ memoryBudget_, groupCost };
+
+					if (!reservation.IsValid ()) {
+						break;
+					}
+
+					std::vector<std::vector<byte>> inputBuffers (last - first);
+					std::vector<std::vector<PackedRepositoryBase::PackageFile::ChunkHash>>
+						chunkHashes (last - first);
+					std::vector<PackedRepositoryBase::PackageFile::ReadRange> ranges;
+
+					for (size_t i = first; i < last; ++i) {
+						auto& buffer = inputBuffers [i - first];
+						buffer.resize (batchReadRequests_ [i].readSize);
+
+						chunkHashes [i - first] = GetChunkHashes (batchReadRequests_ [i]);
+
+						ranges.push_back ({ batchReadRequests_ [i].packageOffset,
+							buffer, false, chunkHashes [i - first] });
+					}
+
+					packageFile.ReadRanges (ranges);
+
+					for (size_t i = first; i < last; ++i) {
+						auto& batchReadRequest = batchReadRequests_ [i];
+						auto batchReservation = reservation.Split (
+							GetBatchCost (batchReadRequest));
+
+						SliceBatch (batchReadRequest, packageFile,
+							inputBuffers [i - first], ranges [i - first].succeeded,
+							batchReservation);
+
+						// The batch buffer is only needed for slicing
+						inputBuffers [i - first] = std::vector<byte> ();
 					}
 				} catch (const std::exception&) {
 					errorState_->RegisterException (std::current_exception ());
@@ -513,10 +656,10 @@ public:
 
 				// We don't want to modify the array while iterating, so we
 				// destroy the items as we go to release their memory
-				backReadRequest.Destroy ();
+				for (; first < last; ++first) {
+					batchReadRequests_ [first].Destroy ();
+				}
 			}
-
-			queue_.Insert (ProcessRequest{});
 		}
 		};
 
@@ -529,8 +672,158 @@ public:
 	}
 
 private:
+	/**
+	The memory needed for the read buffer of a batch, and the processing of
+	all of its requests.
+	*/
+	static int64 GetBatchCost (const BatchReadRequest& batchReadRequest)
+	{
+		int64 result = batchReadRequest.readSize;
+
+		for (const auto& rd : batchReadRequest.requests) {
+			result += rd->GetProcessingMemoryCost ();
+		}
+
+		return result;
+	}
+
+	/**
+	The hash of the chunk of a request, if it can be checked right after
+	reading.
+	*/
+	static std::vector<PackedRepositoryBase::PackageFile::ChunkHash> GetChunkHashes (
+		const ReadRequest& rd)
+	{
+		if (rd.hasChunkHash && !rd.isEncrypted) {
+			return { { rd.packageOffset, rd.packageSize, rd.chunkHash } };
+		}
+
+		return {};
+	}
+
+	/**
+	The hashes of the chunks of a batch which can be checked right after
+	reading.
+	*/
+	static std::vector<PackedRepositoryBase::PackageFile::ChunkHash> GetChunkHashes (
+		const BatchReadRequest& batchReadRequest)
+	{
+		std::vector<PackedRepositoryBase::PackageFile::ChunkHash> result;
+
+		for (const auto& rd : batchReadRequest.requests) {
+			const auto chunkHashes = GetChunkHashes (*rd);
+			result.insert (result.end (), chunkHashes.begin (), chunkHashes.end ());
+		}
+
+		return result;
+	}
+
+	/**
+	Read a single range along with the hashes of its chunks, so package files
+	which read from several sources can check the data from each of them.
+	*/
+	static bool ReadSingleRange (PackedRepositoryBase::PackageFile& packageFile,
+		const int64 offset, const MutableArrayRef<>& buffer,
+		const std::vector<PackedRepositoryBase::PackageFile::ChunkHash>& chunkHashes)
+	{
+		PackedRepositoryBase::PackageFile::ReadRange range{
+			offset, buffer, false, chunkHashes };
+		packageFile.ReadRanges (
+			MutableArrayRef<PackedRepositoryBase::PackageFile::ReadRange>{ &range, 1 });
+
+		return range.succeeded;
+	}
+
+	/**
+	Read a single request from the chunk cache. If the chunk is no longer in
+	the cache, it is read from the package instead, and will be added to the
+	cache again once it has been verified.
+
+	Returns false if no memory could be reserved.
+	*/
+	bool ReadCached (BatchReadRequest& batchReadRequest)
+	{
+		MemoryReservation reservation{ memoryBudget_,
+			GetBatchCost (batchReadRequest) };
+
+		if (!reservation.IsValid ()) {
+			return false;
+		}
+
+		auto& rd = batchReadRequest.requests.front ();
+		std::vector<byte> buffer (rd->packageSize);
+
+		if (!chunkCache_ || !chunkCache_->Get (rd->chunkHash, buffer)) {
+			rd->cached = false;
+
+			auto& packageFile = batchReadRequest.packageFile->GetFile ();
+
+			if (!ReadSingleRange (packageFile, rd->packageOffset, buffer,
+				GetChunkHashes (batchReadRequest))) {
+				throw RuntimeException ("PackedRepository",
+					fmt::format ("Could not read {0} bytes at offset {1} "
+						"from package", rd->packageSize, rd->packageOffset),
+					KYLA_FILE_LINE);
+			}
+		}
+
+		// The process thread shrinks the reservation once it's done with
+		// the read buffer
+		queue_.Insert ({ std::move (rd), std::move (buffer),
+			std::move (reservation) });
+
+		return true;
+	}
+
+	/**
+	Split a batch which has been read into inputBuffer into the individual
+	requests, and pass them on to the process threads.
+	*/
+	void SliceBatch (BatchReadRequest& batchReadRequest,
+		PackedRepositoryBase::PackageFile& packageFile,
+		const std::vector<byte>& inputBuffer,
+		const bool batchRead,
+		MemoryReservation& reservation)
+	{
+		// We slice the input buffer by creating copies
+		for (auto& rd : batchReadRequest.requests) {
+			auto requestReservation = reservation.Split (
+				rd->GetProcessingMemoryCost ());
+
+			if (batchRead) {
+				const auto first = inputBuffer.begin ()
+					// Start relative to batch request start
+					+ (rd->packageOffset - batchReadRequest.packageOffset);
+				const auto last = first + rd->packageSize;
+
+				queue_.Insert ({ std::move (rd),
+					std::vector<byte> (first, last),
+					std::move (requestReservation) });
+			} else if (rd->verifyOnly) {
+				// Find out which chunks are affected, instead
+				// of reporting the whole batch as missing
+				std::vector<byte> buffer (rd->packageSize);
+				const bool readFailed = !ReadSingleRange (packageFile,
+					rd->packageOffset, buffer, GetChunkHashes (*rd));
+
+				queue_.Insert ({ std::move (rd),
+					std::move (buffer),
+					std::move (requestReservation),
+					readFailed });
+			} else {
+				throw RuntimeException ("PackedRepository",
+					fmt::format ("Could not read {0} bytes at offset {1} "
+						"from package", batchReadRequest.readSize,
+						batchReadRequest.packageOffset),
+					KYLA_FILE_LINE);
+			}
+		}
+	}
+
 	ProducerConsumerQueue<ProcessRequest>& queue_;
 	std::vector<BatchReadRequest> batchReadRequests_;
+	MemoryBudget& memoryBudget_;
+	ChunkCache* chunkCache_ = nullptr;
 	std::thread thread_;
 	ErrorState* errorState_ = nullptr;
 };
@@ -546,9 +839,13 @@ class ProcessThread
 public:
 	ProcessThread (ProducerConsumerQueue<ProcessRequest>& processRequestQueue,
 		ProducerConsumerQueue<OutputRequest>& outputRequestQueue,
+		std::unique_ptr<PackedRepositoryBase::Decryptor>&& decryptor,
+		ChunkCache* chunkCache,
 		ErrorState* errorState)
 	: inputQueue_ (processRequestQueue)
 	, outputQueue_ (outputRequestQueue)
+	, decryptor_ (std::move (decryptor))
+	, chunkCache_ (chunkCache)
 	, errorState_ (errorState)
 	{
 	}
@@ -570,13 +867,29 @@ public:
 
 					auto& rd = processRequest.requestData;
 
+					if (processRequest.readFailed) {
+						outputQueue_.Insert ({
+							std::move (processRequest.requestData),
+							std::vector<byte> (),
+							MemoryReservation (),
+							RepairResult::Missing });
+
+						continue;
+					}
+
 					auto& inputBuffer = processRequest.inputBuffer;
 					std::vector<byte> outputBuffer;
 
 					// Encryption
-					if (rd->decryptor) {
+					if (rd->isEncrypted) {
+						if (!decryptor_) {
+							throw RuntimeException ("PackedRepository",
+								"Repository is encrypted but no key has been set",
+								KYLA_FILE_LINE);
+						}
+
 						outputBuffer.resize (rd->encryptionOutputSize);
-						rd->decryptor->Decrypt (inputBuffer, outputBuffer,
+						decryptor_->Decrypt (inputBuffer, outputBuffer,
 							rd->ivSalt);
 						std::swap (inputBuffer, outputBuffer);
 					}
@@ -584,11 +897,42 @@ public:
 					// Hash check
 					if (rd->hasChunkHash) {
 						if (ComputeSHA256 (inputBuffer) != rd->chunkHash) {
+							if (rd->verifyOnly) {
+								outputQueue_.Insert ({
+									std::move (processRequest.requestData),
+									std::vector<byte> (),
+									MemoryReservation (),
+									RepairResult::Corrupted });
+
+								continue;
+							}
+
 							throw RuntimeException ("PackedRepository",
 								fmt::format ("Source data for chunk '{0}' is corrupted",
 									ToString (rd->chunkHash)),
 								KYLA_FILE_LINE);
 						}
+
+						// Encrypted chunks are never cached, as we'd have to
+						// store them decrypted
+						if (chunkCache_ && !rd->cached && !rd->isEncrypted &&
+							!rd->verifyOnly) {
+							try {
+								chunkCache_->Put (rd->chunkHash, inputBuffer);
+							} catch (const std::exception&) {
+								// The cache is only an optimization, so we
+								// ignore a full disk or a locked index
+							}
+						}
+					}
+
+					if (rd->verifyOnly) {
+						outputQueue_.Insert ({
+							std::move (processRequest.requestData),
+							std::vector<byte> (),
+							MemoryReservation () });
+
+						continue;
 					}
 
 					// Decompression
@@ -604,17 +948,21 @@ public:
 						std::swap (inputBuffer, outputBuffer);
 					}
 
-					outputQueue_.Insert ({ 
-						std::move (processRequest.requestData), 
-						std::move (outputBuffer) });
+					// Only the output stays alive until it has been consumed
+					inputBuffer = std::vector<byte> ();
+					processRequest.reservation.Shrink (
+						static_cast<int64> (outputBuffer.size ()));
+
+					outputQueue_.Insert ({
+						std::move (processRequest.requestData),
+						std::move (outputBuffer),
+						std::move (processRequest.reservation) });
 				} catch (const std::exception&) {
 					errorState_->RegisterException (std::current_exception ());
 
 					break;
 				}
 			}
-
-			outputQueue_.Insert (OutputRequest{});
 		}
 		};
 
@@ -629,16 +977,27 @@ public:
 private:
 	ProducerConsumerQueue<ProcessRequest>& inputQueue_;
 	ProducerConsumerQueue<OutputRequest>& outputQueue_;
+	std::unique_ptr<PackedRepositoryBase::Decryptor> decryptor_;
+	ChunkCache* chunkCache_ = nullptr;
 	std::thread thread_;
 	ErrorState* errorState_;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+/**
+Passes the processed data to the output handler. There is only ever one
+output thread, so the handler doesn't need to be thread-safe.
+*/
 class OutputThread
 {
 public:
+	using OutputHandler = std::function<void (OutputRequest&)>;
+
 	OutputThread (ProducerConsumerQueue<OutputRequest>& outputRequestQueue,
+		OutputHandler outputHandler,
 		ErrorState* errorState)
 		: queue_ (outputRequestQueue)
+		, outputHandler_ (outputHandler)
 		, errorState_ (errorState)
 	{
 	}
@@ -658,13 +1017,10 @@ public:
 						break;
 					}
 
-					auto& rd = outputRequest.requestData;
-
-					outputRequest.requestData->callback (rd->contentHash, outputRequest.data,
-						rd->sourceOffset, rd->totalSize);
+					outputHandler_ (outputRequest);
 				} catch (const std::exception&) {
 					errorState_->RegisterException (std::current_exception ());
-				
+
 					break;
 				}
 			}
@@ -681,30 +1037,290 @@ public:
 
 private:
 	ProducerConsumerQueue<OutputRequest>& queue_;
+	OutputHandler outputHandler_;
 	std::thread thread_;
 	ErrorState* errorState_;
 };
+
+/**
+A read request which hasn't been assigned to a batch yet.
+*/
+struct PendingRead
+{
+	std::unique_ptr<ReadRequest> request;
+	std::shared_ptr<PackageFileWrapper> packageFile;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Merge the pending reads into batches. The reads must be sorted by package and
+offset within a priority.
+
+A batch never spans packages or priorities. Cached reads get a batch of their
+own.
+*/
+std::vector<BatchReadRequest> CreateBatchReadRequests (
+	std::vector<PendingRead>& readRequests,
+	const int64 maxBatchSize)
+{
+	std::vector<BatchReadRequest> batchReadRequests;
+
+	size_t index = 0;
+	size_t lastIndex = readRequests.size ();
+
+	while (index < lastIndex) {
+		BatchReadRequest batchReadRequest;
+		batchReadRequest.packageFile = readRequests [index].packageFile;
+
+		std::vector<std::unique_ptr<ReadRequest>> batch;
+
+		auto& firstRequest = readRequests [index].request;
+		const auto batchPriority = firstRequest->priority;
+		batchReadRequest.packageOffset = firstRequest->packageOffset;
+		batchReadRequest.readSize = firstRequest->packageSize;
+		batchReadRequest.fromCache = firstRequest->cached;
+
+		batch.emplace_back (std::move (firstRequest));
+
+		++index;
+
+		// Cached chunks are read one by one
+		if (batchReadRequest.fromCache) {
+			batchReadRequest.requests = std::move (batch);
+			batchReadRequests.emplace_back (std::move (batchReadRequest));
+
+			continue;
+		}
+
+		int64 remainingSlack = BatchReadRequest::MaxSlack;
+		int64 remainingSize = maxBatchSize - batchReadRequest.readSize;
+
+		// We try to form batches here
+		// The requests are all sorted by index, so what we do is walk
+		// through the list, and try to merge consecutive reads into one
+		// large batch read request. We allow for some slack between
+		// the reads, i.e. we're ok reading some more data if that means
+		// fewer requests
+		while (index < lastIndex) {
+			auto& request = readRequests [index].request;
+
+			if (readRequests [index].packageFile != batchReadRequest.packageFile ||
+				request->priority != batchPriority || request->cached) {
+				break;
+			}
+
+			const auto slack = request->packageOffset - (
+				// This is the current end of the read range
+				batchReadRequest.packageOffset + batchReadRequest.readSize);
+
+			// Negative slack means we're moving backwards in the package
+			if (slack < 0 || slack > remainingSlack) {
+				break;
+			}
+
+			const auto size = request->packageSize;
+
+			if (size > remainingSize) {
+				break;
+			}
+
+			remainingSlack -= slack;
+			remainingSize -= size;
+
+			batchReadRequest.readSize += slack + size;
+			batch.emplace_back (std::move (request));
+
+			++index;
+		}
+
+		batchReadRequest.requests = std::move (batch);
+
+		batchReadRequests.emplace_back (std::move (batchReadRequest));
+	}
+
+	return batchReadRequests;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Run the read, process and output stages until all batches have been handled.
+
+Each entry of readerBatches is handled by its own read thread, and
+processThreadCount threads process the data. If the order of the output
+matters, use a single reader and processor.
+
+The queues are not limited on their own. Instead, the read threads reserve
+all memory against the budget, and every stage releases its part once done.
+The budget is thus the upper bound for all buffers in flight.
+
+If chunkCache is set, cached reads are served from it, and all other chunks
+are added to it once they have been verified.
+*/
+void RunPipeline (std::vector<std::vector<BatchReadRequest>>&& readerBatches,
+	const int processThreadCount,
+	OutputThread::OutputHandler outputHandler,
+	const Repository::ExecutionContext& context,
+	MemoryBudget& memoryBudget,
+	ChunkCache* chunkCache = nullptr)
+{
+	assert (processThreadCount > 0);
+
+	ProducerConsumerQueue<ProcessRequest> processRequestQueue;
+	ProducerConsumerQueue<OutputRequest> outputRequestQueue;
+
+	ErrorState errorState;
+
+	errorState.RegisterQueue (&processRequestQueue);
+	errorState.RegisterQueue (&outputRequestQueue);
+	errorState.RegisterMemoryBudget (&memoryBudget);
+
+	std::vector<std::unique_ptr<ReadThread>> readThreads;
+	for (auto& batches : readerBatches) {
+		readThreads.emplace_back (std::make_unique<ReadThread> (
+			std::move (batches), processRequestQueue, memoryBudget,
+			chunkCache, &errorState));
+	}
+
+	std::vector<std::unique_ptr<ProcessThread>> processThreads;
+	for (int i = 0; i < processThreadCount; ++i) {
+		processThreads.emplace_back (std::make_unique<ProcessThread> (
+			processRequestQueue, outputRequestQueue,
+			CreateDecryptor (context), chunkCache, &errorState));
+	}
+
+	OutputThread outputThread{ outputRequestQueue, outputHandler, &errorState };
+
+	for (auto& readThread : readThreads) {
+		readThread->Run ();
+	}
+
+	for (auto& processThread : processThreads) {
+		processThread->Run ();
+	}
+
+	outputThread.Run ();
+
+	// Once all readers are done, every process thread gets an end marker,
+	// and once those are done, the output thread gets one
+	for (auto& readThread : readThreads) {
+		readThread->Join ();
+	}
+
+	for (int i = 0; i < processThreadCount; ++i) {
+		processRequestQueue.Insert (ProcessRequest{});
+	}
+
+	for (auto& processThread : processThreads) {
+		processThread->Join ();
+	}
+
+	outputRequestQueue.Insert (OutputRequest{});
+	outputThread.Join ();
+
+	if (errorState.IsSignaled ()) {
+		errorState.RethrowException ();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Get the percentage of chunks to check during a scrub. Defaults to 100, that
+is, every chunk gets checked.
+*/
+int GetScrubSamplePercentage (const Repository::ExecutionContext& context)
+{
+	using EC = Repository::ExecutionContext;
+
+	auto it = context.variables.find (EC::ScrubSamplePercentage);
+
+	if (it == context.variables.end ()) {
+		return 100;
+	}
+
+	if (it->second.GetSize () != sizeof (int)) {
+		throw RuntimeException ("PackedRepository",
+			fmt::format ("Variable '{}' must be an integer",
+				EC::ScrubSamplePercentage),
+			KYLA_FILE_LINE);
+	}
+
+	const auto percentage = it->second.GetInt ();
+
+	if (percentage < 1 || percentage > 100) {
+		throw RuntimeException ("PackedRepository",
+			fmt::format ("Variable '{}' must be between 1 and 100",
+				EC::ScrubSamplePercentage),
+			KYLA_FILE_LINE);
+	}
+
+	return percentage;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Open the chunk cache if the CachePath variable is set. The maximum size is
+taken from CacheMaxSize, and defaults to ChunkCache::DefaultMaxSize.
+*/
+std::unique_ptr<ChunkCache> CreateChunkCache (const Repository::ExecutionContext& context)
+{
+	using EC = Repository::ExecutionContext;
+
+	auto pathIt = context.variables.find (EC::CachePath);
+
+	if (pathIt == context.variables.end ()) {
+		return std::unique_ptr<ChunkCache> ();
+	}
+
+	int64 maxSize = ChunkCache::DefaultMaxSize;
+
+	if (auto it = context.variables.find (EC::CacheMaxSize); it != context.variables.end ()) {
+		if (it->second.GetSize () != sizeof (int64)) {
+			throw RuntimeException ("PackedRepository",
+				fmt::format ("Variable '{}' must be a 64-bit integer",
+					EC::CacheMaxSize),
+				KYLA_FILE_LINE);
+		}
+
+		maxSize = it->second.GetInt64 ();
+
+		if (maxSize <= 0) {
+			throw RuntimeException ("PackedRepository",
+				fmt::format ("Variable '{}' must be greater than zero",
+					EC::CacheMaxSize),
+				KYLA_FILE_LINE);
+		}
+	}
+
+	return std::make_unique<ChunkCache> (Path{ pathIt->second.GetString () },
+		maxSize);
+}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 void PackedRepositoryBase::GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
+	const GetContentObjectsOptions& options,
 	const Repository::GetContentObjectCallback& getCallback,
 	ExecutionContext& context)
 {
 	auto& db = GetDatabase ();
 
-	std::unique_ptr<Decryptor> decryptor = CreateDecryptor (context);
+	const bool hasEncryptionKey = context.variables.find (
+		ExecutionContext::EncryptionKey) != context.variables.end ();
 
 	// We need to join the requested objects on our existing data, so
 	// store them in a temporary table
 	auto requestedContentObjects = db.CreateTemporaryTable (
-		"requested_fs_contents", "Hash BLOB NOT NULL UNIQUE");
+		"requested_fs_contents", "Hash BLOB NOT NULL UNIQUE, "
+		"Priority INTEGER NOT NULL");
 
 	auto tempObjectInsert = db.Prepare ("INSERT INTO requested_fs_contents "
-		"(Hash) VALUES (?)");
+		"(Hash, Priority) VALUES (?, ?)");
 
-	for (const auto& obj : requestedObjects) {
-		tempObjectInsert.BindArguments (obj);
+	for (int64 i = 0; i < requestedObjects.GetCount (); ++i) {
+		const int64 priority = options.priorities.IsEmpty ()
+			? 0 : options.priorities [i];
+
+		tempObjectInsert.BindArguments (requestedObjects [i], priority);
 		tempObjectInsert.Step ();
 		tempObjectInsert.Reset ();
 	}
@@ -736,30 +1352,24 @@ void PackedRepositoryBase::GetContentObjectsImpl (const ArrayRef<SHA256Digest>&
 		"	EncryptionData, "			// = 10
 		"	EncryptionInputSize, "		// = 11
 		"	EncryptionOutputSize, "		// = 12
-		"	StorageHash "				// = 13
+		"	StorageHash, "				// = 13
+		"	requested_fs_contents.Priority "	// = 14
 		"FROM fs_content_view "
-		"WHERE ContentHash IN (SELECT Hash FROM requested_fs_contents) "
-		"    AND PackageId = ? "
+		"    INNER JOIN requested_fs_contents "
+		"        ON fs_content_view.ContentHash = requested_fs_contents.Hash "
+		"WHERE PackageId = ? "
 		"ORDER BY PackageOffset ASC");
 
-	static constexpr auto MaxPendingProcessSize = 64 << 20;
-	static constexpr auto MaxPendingOutputSize = 64 << 20;
+	auto& memoryBudget = context.GetMemoryBudget ();
 
-	ProducerConsumerQueue<ProcessRequest> processRequestQueue{
-		[] (const ProcessRequest& processRequest) {
-			return static_cast<int64> (processRequest.size);
-	},
-		MaxPendingProcessSize
-	};
-	ProducerConsumerQueue<OutputRequest> outputRequestQueue{
-		[] (const OutputRequest& outputRequest) {
-		return static_cast<int64> (outputRequest.size);
-	},
-		MaxPendingOutputSize
-	};
+	// A batch needs memory for the read buffer, the slices and the output,
+	// so we keep batches small enough to have several in flight
+	const auto maxBatchSize = std::min (BatchReadRequest::MaxSize,
+		memoryBudget.GetLimit () / 8);
+
+	// All reads in storage order, that is, sorted by package and offset
+	std::vector<PendingRead> readRequests;
 
-	std::vector<BatchReadRequest> batchReadRequests;
-	
 	while (findSourcePackagesQuery.Step ()) {
 		const std::string filename = findSourcePackagesQuery.GetText (0);
 		const auto id = findSourcePackagesQuery.GetInt64 (1);
@@ -769,29 +1379,34 @@ void PackedRepositoryBase::GetContentObjectsImpl (const ArrayRef<SHA256Digest>&
 
 		contentObjectsInPackageQuery.BindArguments (id);
 
-		std::vector<std::unique_ptr<ReadRequest>> readRequests;
-
 		while (contentObjectsInPackageQuery.Step ()) {
 			std::unique_ptr<ReadRequest> readRequest{ new ReadRequest };
 
+			readRequest->packageId = id;
 			readRequest->packageOffset = contentObjectsInPackageQuery.GetInt64 (0);
 			readRequest->packageSize = contentObjectsInPackageQuery.GetInt64 (1);
 			readRequest->sourceOffset = contentObjectsInPackageQuery.GetInt64 (2);
 			contentObjectsInPackageQuery.GetBlob (3, readRequest->contentHash);
 			readRequest->totalSize = contentObjectsInPackageQuery.GetInt64 (4);
 			readRequest->sourceSize = contentObjectsInPackageQuery.GetInt64 (5);
+			readRequest->priority = contentObjectsInPackageQuery.GetInt64 (14);
+
+			if (options.skipChunk && options.skipChunk (readRequest->contentHash,
+				readRequest->sourceOffset, readRequest->sourceSize)) {
+				continue;
+			}
 
 			readRequest->callback = getCallback;
 
 			// Encryption handling
 			if (contentObjectsInPackageQuery.GetText (10)) {
-				if (!decryptor) {
+				if (!hasEncryptionKey) {
 					throw RuntimeException ("PackedRepository",
 						"Repository is encrypted but no key has been set",
 						KYLA_FILE_LINE);
 				}
 
-				readRequest->decryptor = decryptor.get ();
+				readRequest->isEncrypted = true;
 				readRequest->encryptionOutputSize = contentObjectsInPackageQuery.GetInt64 (12);
 				readRequest->ivSalt = UnpackAES256IvSalt (contentObjectsInPackageQuery.GetBlob (10));
 			}
@@ -811,93 +1426,83 @@ void PackedRepositoryBase::GetContentObjectsImpl (const ArrayRef<SHA256Digest>&
 				readRequest->compressionInputSize = contentObjectsInPackageQuery.GetInt64 (8);
 			}
 
-			readRequests.emplace_back (std::move (readRequest));
+			readRequests.push_back ({ std::move (readRequest), packageFileWrapper });
 		}
 
 		contentObjectsInPackageQuery.Reset ();
+	}
 
-		size_t index = 0;
-		size_t lastIndex = readRequests.size ();
-
-		while (index < lastIndex) {
-			BatchReadRequest batchReadRequest;
-			batchReadRequest.packageFile = packageFileWrapper;
-
-			std::vector<std::unique_ptr<ReadRequest>> batch;
-			
-			auto& firstRequest = readRequests[index];
-			batchReadRequest.packageOffset = firstRequest->packageOffset;
-			batchReadRequest.readSize = firstRequest->packageSize;
-
-			batch.emplace_back (std::move (firstRequest));
-
-			int64 remainingSlack = BatchReadRequest::MaxSlack;
-			int64 remainingSize = BatchReadRequest::MaxSize - batchReadRequest.readSize;
-
-			++index;
-
-			// We try to form batches here
-			// The requests are all sorted by index, so what we do is walk
-			// through the list, and try to merge consecutive reads into one
-			// large batch read request. We allow for some slack between
-			// the reads, i.e. we're ok reading some more data if that means
-			// fewer requests
-			while (index < lastIndex) {
-				auto& request = readRequests[index];
-
-				const auto slack = request->packageOffset - (
-					// This is the current end of the read range
-					batchReadRequest.packageOffset + batchReadRequest.readSize);
-
-				if (slack > remainingSlack) {
-					break;
-				}
-
-				const auto size = request->packageSize;
+	// Remote repositories consult the chunk cache first. Encrypted chunks
+	// are never cached
+	std::unique_ptr<ChunkCache> chunkCache;
+	int64 cachedChunkCount = 0;
+	int64 cachedSize = 0;
 
-				if (size > remainingSize) {
-					break;
-				}
-
-				remainingSlack -= slack;
-				remainingSize -= size;
+	if (IsRemote ()) {
+		chunkCache = CreateChunkCache (context);
+	}
 
-				batchReadRequest.readSize += slack + size;
-				batch.emplace_back (std::move (request));
+	if (chunkCache) {
+		for (auto& pendingRead : readRequests) {
+			auto& rd = pendingRead.request;
 
-				++index;
+			if (rd->hasChunkHash && !rd->isEncrypted &&
+				chunkCache->Contains (rd->chunkHash)) {
+				rd->cached = true;
 			}
-
-			batchReadRequest.requests = std::move (batch);
-
-			batchReadRequests.emplace_back (std::move (batchReadRequest));
 		}
 	}
 
-	ErrorState errorState;
+	// Deliver by priority. As the sort is stable, requests with the same
+	// priority remain in storage order, so reads stay mostly sequential
+	if (!options.priorities.IsEmpty ()) {
+		std::stable_sort (readRequests.begin (), readRequests.end (),
+			[](const PendingRead& a, const PendingRead& b) -> bool {
+			return a.request->priority < b.request->priority;
+		});
+	}
 
-	errorState.RegisterQueue (&processRequestQueue);
-	errorState.RegisterQueue (&outputRequestQueue);
+	std::vector<std::vector<BatchReadRequest>> readerBatches;
+	readerBatches.emplace_back (CreateBatchReadRequests (readRequests,
+		maxBatchSize));
 
-	ReadThread readThread{ std::move (batchReadRequests), processRequestQueue, &errorState };
-	ProcessThread processThread{ processRequestQueue, outputRequestQueue, &errorState };
-	OutputThread outputThread{ outputRequestQueue, &errorState };
+	// The content is delivered in order, so there is only one reader and
+	// one processor here
+	const auto chunkCount = readRequests.size ();
 
-	readThread.Run ();
-	processThread.Run ();
-	outputThread.Run ();
+	RunPipeline (std::move (readerBatches), 1,
+		[&](OutputRequest& outputRequest) -> void {
+			auto& rd = outputRequest.requestData;
 
-	readThread.Join ();
-	processThread.Join ();
-	outputThread.Join ();
+			if (rd->cached) {
+				++cachedChunkCount;
+				cachedSize += rd->packageSize;
+			}
 
-	if (errorState.IsSignaled ()) {
-		errorState.RethrowException ();
+			rd->callback (rd->contentHash, outputRequest.data,
+				rd->sourceOffset, rd->totalSize);
+		}, context, memoryBudget, chunkCache.get ());
+
+	if (chunkCache) {
+		context.log.Info ("Cache", fmt::format (
+			"{0} of {1} chunks ({2} MiB) read from the chunk cache",
+			cachedChunkCount, chunkCount, cachedSize >> 20));
 	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-void PackedRepositoryBase::RepairImpl (Repository& source,
+/**
+Scrub the repository, that is, read every chunk and check its hash.
+
+The packages are distributed over several read threads, and the chunks are
+hashed by a pool of process threads. Chunks are neither decompressed nor
+written anywhere. Corrupted chunks are reported by their storage hash, and
+chunks which can't be read are reported as missing.
+
+If the ScrubSamplePercentage variable is set, only a random sample of the
+chunks is checked.
+*/
+void PackedRepositoryBase::RepairImpl (Repository& /* source */,
 	ExecutionContext& context,
 	RepairCallback repairCallback,
 	bool restore)
@@ -907,84 +1512,162 @@ void PackedRepositoryBase::RepairImpl (Repository& source,
 
 	auto& db = GetDatabase ();
 
-	std::unique_ptr<Decryptor> decryptor = CreateDecryptor (context);
+	const bool hasEncryptionKey = context.variables.find (
+		ExecutionContext::EncryptionKey) != context.variables.end ();
+	const auto samplePercentage = GetScrubSamplePercentage (context);
 
-	// Queries as above
 	auto findSourcePackagesQuery = db.Prepare (
-		"SELECT DISTINCT "
-		"   fs_packages.Filename AS Filename, "
-		"   fs_packages.Id AS Id "
-		"FROM storage_mapping "
-		"    INNER JOIN fs_contents ON fs_chunks.ContentId = fs_contents.Id "
-		"    INNER JOIN fs_packages ON fs_chunks.PackageId = fs_packages.Id"
-	);
+		"SELECT Filename, Id FROM fs_packages ORDER BY Id");
 
-	auto contentObjectsInPackageQuery = db.Prepare (
+	// Chunks without a hash have no data, so there is nothing to check.
+	// Sampling happens per chunk
+	auto chunksInPackageQuery = db.Prepare (
 		"SELECT "
-		"	PackageOffset,  "				// = 0
+		"	PackageOffset, "				// = 0
 		"	PackageSize, "					// = 1
-		"	SourceOffset,  "				// = 2
-		"	SourceSize, "					// = 3
-		"	EncryptionAlgorithm, "			// = 4
-		"	EncryptionData, "				// = 5
-		"	EncryptionInputSize, "			// = 6
-		"	EncryptionOutputSize, "			// = 7
-		"	StorageHash, "					// = 8
-		"	ContentHash "					// = 9
+		"	EncryptionData, "				// = 2
+		"	EncryptionOutputSize, "			// = 3
+		"	StorageHash "					// = 4
 		"FROM fs_content_view "
-		"WHERE PackageId = ? ");
+		"WHERE PackageId = ? AND StorageHash IS NOT NULL "
+		"    AND (? >= 100 OR ABS (RANDOM ()) % 100 < ?) "
+		"ORDER BY PackageOffset ASC");
 
-	std::vector<byte> compressionOutputBuffer;
-	std::vector<byte> readBuffer, writeBuffer;
+	auto& memoryBudget = context.GetMemoryBudget ();
+
+	const auto maxBatchSize = std::min (BatchReadRequest::MaxSize,
+		memoryBudget.GetLimit () / 8);
+
+	struct PackageStatistics
+	{
+		std::string filename;
+		int64 chunkCount = 0;
+		int64 size = 0;
+		int64 checkedChunkCount = 0;
+		int64 errorCount = 0;
+	};
+
+	std::unordered_map<int64, PackageStatistics> packageStatistics;
+	std::vector<std::vector<BatchReadRequest>> packageBatches;
+	int64 totalSize = 0;
 
 	while (findSourcePackagesQuery.Step ()) {
-		auto packageFile = OpenPackage (findSourcePackagesQuery.GetText (0));
+		const std::string filename = findSourcePackagesQuery.GetText (0);
+		const auto id = findSourcePackagesQuery.GetInt64 (1);
 
-		contentObjectsInPackageQuery.BindArguments (
-			findSourcePackagesQuery.GetInt64 (0));
+		auto packageFileWrapper = std::make_shared<PackageFileWrapper> (
+			[this, filename]() { return OpenPackage (filename); });
 
-		std::string currentCompressorId;
-		std::unique_ptr<BlockCompressor> compressor;
+		auto& statistics = packageStatistics [id];
+		statistics.filename = filename;
 
-		while (contentObjectsInPackageQuery.Step ()) {
-			const auto packageOffset = contentObjectsInPackageQuery.GetInt64 (0);
-			const auto packageSize = contentObjectsInPackageQuery.GetInt64 (1);
+		std::vector<PendingRead> readRequests;
 
-			readBuffer.resize (packageSize);
-			packageFile->Read (packageOffset, readBuffer);
+		chunksInPackageQuery.BindArguments (id,
+			samplePercentage, samplePercentage);
 
-			// Decrypt if needed
-			if (contentObjectsInPackageQuery.GetText (4)) {
-				if (!decryptor) {
+		while (chunksInPackageQuery.Step ()) {
+			std::unique_ptr<ReadRequest> readRequest{ new ReadRequest };
+
+			readRequest->packageId = id;
+			readRequest->packageOffset = chunksInPackageQuery.GetInt64 (0);
+			readRequest->packageSize = chunksInPackageQuery.GetInt64 (1);
+			readRequest->verifyOnly = true;
+
+			if (chunksInPackageQuery.GetText (2)) {
+				if (!hasEncryptionKey) {
 					throw RuntimeException ("PackedRepository",
 						"Repository is encrypted but no key has been set",
 						KYLA_FILE_LINE);
 				}
 
-				//@TODO(minor) Check algorithm
-				writeBuffer.resize (contentObjectsInPackageQuery.GetInt64 (7));
+				readRequest->isEncrypted = true;
+				readRequest->encryptionOutputSize = chunksInPackageQuery.GetInt64 (3);
+				readRequest->ivSalt = UnpackAES256IvSalt (chunksInPackageQuery.GetBlob (2));
+			}
 
-				decryptor->Decrypt (readBuffer, writeBuffer,
-					UnpackAES256IvSalt (contentObjectsInPackageQuery.GetBlob (5)));
+			readRequest->hasChunkHash = true;
+			chunksInPackageQuery.GetBlob (4, readRequest->chunkHash);
 
-				std::swap (readBuffer, writeBuffer);
-			}
+			++statistics.chunkCount;
+			statistics.size += readRequest->packageSize;
 
-			SHA256Digest contentDigest, storageDigest;
-			contentObjectsInPackageQuery.GetBlob (8, storageDigest);
-			contentObjectsInPackageQuery.GetBlob (9, contentDigest);
+			readRequests.push_back ({ std::move (readRequest), packageFileWrapper });
+		}
 
-			auto actualHash = ComputeSHA256 (readBuffer);
-			auto hashString = ToString (actualHash);
+		chunksInPackageQuery.Reset ();
 
-			if (actualHash != storageDigest) {
-				repairCallback (hashString.c_str (), RepairResult::Corrupted);
-			} else {
-				repairCallback (hashString.c_str (), RepairResult::Ok);
-			}
+		totalSize += statistics.size;
+
+		if (!readRequests.empty ()) {
+			packageBatches.emplace_back (CreateBatchReadRequests (readRequests,
+				maxBatchSize));
 		}
+	}
 
-		contentObjectsInPackageQuery.Reset ();
+	// Reading is I/O bound, so a few readers are enough to keep the hashing
+	// threads busy. Whole packages are assigned to readers, so each reader
+	// still reads sequentially
+	const int readThreadCount = static_cast<int> (std::min<size_t> (
+		packageBatches.size (), 4));
+	const int processThreadCount = static_cast<int> (std::max (1u,
+		std::thread::hardware_concurrency ()));
+
+	std::vector<std::vector<BatchReadRequest>> readerBatches (
+		std::max (readThreadCount, 1));
+
+	for (size_t i = 0; i < packageBatches.size (); ++i) {
+		auto& batches = readerBatches [i % readerBatches.size ()];
+
+		std::move (packageBatches [i].begin (), packageBatches [i].end (),
+			std::back_inserter (batches));
 	}
+
+	packageBatches.clear ();
+
+	ProgressHelper progress{ context.progress, "Scrub", totalSize };
+	int64 chunkCount = 0;
+	int64 errorCount = 0;
+
+	const auto startTime = std::chrono::steady_clock::now ();
+
+	RunPipeline (std::move (readerBatches), processThreadCount,
+		[&](OutputRequest& outputRequest) -> void {
+			const auto& rd = outputRequest.requestData;
+			auto& statistics = packageStatistics [rd->packageId];
+
+			++statistics.checkedChunkCount;
+			++chunkCount;
+
+			if (outputRequest.result != RepairResult::Ok) {
+				++statistics.errorCount;
+				++errorCount;
+			}
+
+			const auto hashString = ToString (rd->chunkHash);
+			repairCallback (hashString.c_str (), outputRequest.result);
+
+			progress.Advance (statistics.filename, rd->packageSize);
+
+			if (statistics.checkedChunkCount == statistics.chunkCount) {
+				context.log.Info ("Scrub", fmt::format (
+					"Package '{0}': {1} chunks, {2} MiB, {3} corrupted or missing",
+					statistics.filename, statistics.chunkCount,
+					statistics.size >> 20, statistics.errorCount));
+			}
+		}, context, memoryBudget);
+
+	progress.Done ();
+
+	const std::chrono::duration<double> duration =
+		std::chrono::steady_clock::now () - startTime;
+	const double megabytes = static_cast<double> (totalSize) / (1 << 20);
+
+	context.log.Info ("Scrub", fmt::format (
+		"Checked {0} chunks ({1:.1f} MiB) in {2:.2f} s, {3:.1f} MiB/s, "
+		"{4} corrupted or missing",
+		chunkCount, megabytes, duration.count (),
+		duration.count () > 0 ? megabytes / duration.count () : 0.0,
+		errorCount));
 }
 } // namespace kyla
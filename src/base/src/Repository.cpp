@@ -10,10 +10,50 @@ details.
 #include "Repository.h"
 
 #include "DeployedRepository.h"
+#include "Exception.h"
+#include "MirroredRepository.h"
 #include "PackedRepository.h"
 #include "WebRepository.h"
 
+#include <fmt/core.h>
+
 namespace kyla {
+///////////////////////////////////////////////////////////////////////////////
+/**
+Get the memory budget all stages of an operation reserve their buffers
+against.
+
+The limit is taken from the MemoryLimit variable, which must be an int64 with
+the limit in bytes. If it's not set, MemoryBudget::DefaultLimit is used. The
+budget is recreated if the limit changes between operations.
+*/
+MemoryBudget& Repository::ExecutionContext::GetMemoryBudget ()
+{
+	int64 limit = MemoryBudget::DefaultLimit;
+
+	if (auto it = variables.find (MemoryLimit); it != variables.end ()) {
+		if (it->second.GetSize () != sizeof (int64)) {
+			throw RuntimeException ("ExecutionContext",
+				fmt::format ("Variable '{}' must be a 64-bit integer", MemoryLimit),
+				KYLA_FILE_LINE);
+		}
+
+		limit = it->second.GetInt64 ();
+
+		if (limit <= 0) {
+			throw RuntimeException ("ExecutionContext",
+				fmt::format ("Variable '{}' must be greater than zero", MemoryLimit),
+				KYLA_FILE_LINE);
+		}
+	}
+
+	if (!memoryBudget_ || memoryBudget_->GetLimit () != limit) {
+		memoryBudget_ = std::make_unique<MemoryBudget> (limit);
+	}
+
+	return *memoryBudget_;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void Repository::Repair (Repository& source, ExecutionContext& context,
 	RepairCallback repairCallback, bool restore)
@@ -33,7 +73,20 @@ void Repository::GetContentObjects (const ArrayRef<SHA256Digest>& requestedObjec
 	const GetContentObjectCallback& getCallback,
 	ExecutionContext& context)
 {
-	GetContentObjectsImpl (requestedObjects, getCallback, context);
+	GetContentObjectsImpl (requestedObjects, GetContentObjectsOptions{},
+		getCallback, context);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void Repository::GetContentObjects (const ArrayRef<SHA256Digest>& requestedObjects,
+	const GetContentObjectsOptions& options,
+	const GetContentObjectCallback& getCallback,
+	ExecutionContext& context)
+{
+	assert (options.priorities.IsEmpty () ||
+		options.priorities.GetCount () == requestedObjects.GetCount ());
+
+	GetContentObjectsImpl (requestedObjects, options, getCallback, context);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -79,12 +132,75 @@ std::vector<Uuid> Repository::GetSubfeatures (const Uuid& featureId)
 }
 
 ///////////////////////////////////////////////////////////////////////////////
+namespace {
+/**
+Open a repository which is available from several locations, separated by
+'|'. Locations which can't be opened are skipped.
+*/
+std::unique_ptr<Repository> OpenMirroredRepository (const std::string& path)
+{
+	std::vector<std::unique_ptr<PackedRepositoryBase>> mirrors;
+	std::exception_ptr lastError;
+
+	std::string::size_type start = 0;
+	for (;;) {
+		const auto end = path.find (MirrorSeparator, start);
+		const auto location = path.substr (start,
+			end == std::string::npos ? std::string::npos : end - start);
+
+		if (!location.empty ()) {
+			try {
+				auto repository = OpenRepository (location.c_str (), false);
+
+				if (!dynamic_cast<PackedRepositoryBase*> (repository.get ())) {
+					throw RuntimeException ("Repository",
+						fmt::format ("Mirror '{0}' must be a packed or web repository",
+							location),
+						KYLA_FILE_LINE);
+				}
+
+				mirrors.emplace_back (static_cast<PackedRepositoryBase*> (
+					repository.release ()));
+			} catch (const std::exception&) {
+				lastError = std::current_exception ();
+			}
+		}
+
+		if (end == std::string::npos) {
+			break;
+		}
+
+		start = end + 1;
+	}
+
+	if (mirrors.empty ()) {
+		if (lastError) {
+			std::rethrow_exception (lastError);
+		}
+
+		throw RuntimeException ("Repository",
+			fmt::format ("No mirror locations in '{0}'", path),
+			KYLA_FILE_LINE);
+	}
+
+	return std::make_unique<MirroredRepository> (std::move (mirrors));
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Open the repository at path, which may be a directory or an URL. Several
+equivalent locations can be given separated by MirrorSeparator, in which
+case content is read from all of them.
+*/
 std::unique_ptr<Repository> OpenRepository (const char* path,
 	const bool allowWrite)
 {
 	///@TODO(minor) Move this logic into a static member function of the
 	/// various repository types
-	if (strncmp (path, "http", 4) == 0) {
+	if (strchr (path, MirrorSeparator)) {
+		return OpenMirroredRepository (path);
+	} else if (strncmp (path, "http", 4) == 0) {
 		return std::unique_ptr<Repository> (new WebRepository{ path });
 	} else if (std::filesystem::exists (Path{ path } / "repository.db")) {
 		return std::unique_ptr<Repository> (new PackedRepository{ path });
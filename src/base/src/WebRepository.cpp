@@ -10,7 +10,9 @@ details.
 #include "WebRepository.h"
 
 #include "sql/Database.h"
+#include "sql/RemoteFile.h"
 #include "Exception.h"
+#include "HttpByteRanges.h"
 #include "Log.h"
 
 #include <fmt/core.h>
@@ -26,7 +28,7 @@ details.
 #undef CreateFile
 #elif KYLA_PLATFORM_LINUX
 
-#include <iostream>
+#include <algorithm>
 #include <cassert>
 #include <curl/curl.h>
 
@@ -34,23 +36,227 @@ details.
 
 namespace kyla {
 #if KYLA_PLATFORM_LINUX
-struct BufferStream
+namespace {
+/**
+A range of the remote file which should be read into a buffer.
+*/
+struct RangeTarget
 {
 	byte* buffer = nullptr;
 	int64 offset = 0;
 	int64 size = 0;
+	int64 received = 0;
+
+	bool IsComplete () const
+	{
+		return received == size;
+	}
+};
+
+/**
+A single request for one or more ranges. The data is written directly into
+the target buffers.
+
+A request for several ranges results in a multipart/byteranges response,
+but the server may also send a single range covering all of them, or the
+whole file. The data is routed to the targets by offset in all cases.
+*/
+struct Transfer
+{
+	// Sorted by offset
+	std::vector<RangeTarget*> targets;
+
+	long statusCode = 0;
+	std::string contentType;
+	std::string contentRange;
+	std::string contentLength;
+	// Size of the remote file, if the response told us
+	int64 totalSize = -1;
+
+	bool started = false;
+	// Offset of the next byte for responses with a single part
+	int64 responseOffset = 0;
+	std::unique_ptr<MultipartByteRangesParser> parser;
+
+	// The server sent the whole file, and we stopped once we had the
+	// requested ranges
+	bool stopped = false;
+	// The response doesn't match the request, so none of it can be used
+	bool rejected = false;
+	CURLcode result = CURLE_OK;
+
+	std::string GetRangeHeader () const
+	{
+		std::string result;
+
+		for (const auto target : targets) {
+			if (!result.empty ()) {
+				result += ",";
+			}
+
+			result += std::to_string (target->offset) + "-"
+				+ std::to_string (target->offset + target->size - 1 /* ranges are inclusive */);
+		}
+
+		return result;
+	}
+
+	int64 GetEnd () const
+	{
+		return targets.back ()->offset + targets.back ()->size;
+	}
+
+	void Deliver (const int64 offset, const byte* data, const int64 size)
+	{
+		for (auto target : targets) {
+			const auto first = std::max (offset, target->offset);
+			const auto last = std::min (offset + size, target->offset + target->size);
+
+			if (first >= last) {
+				continue;
+			}
+
+			::memcpy (target->buffer + (first - target->offset),
+				data + (first - offset), last - first);
+			target->received += last - first;
+		}
+	}
+
+	bool IsComplete () const
+	{
+		return std::all_of (targets.begin (), targets.end (),
+			[](const RangeTarget* target) { return target->IsComplete (); });
+	}
+
+	/**
+	Check if the transfer failed. Whatever arrived for a failed transfer
+	may be cut short or wrong.
+	*/
+	bool IsFailed () const
+	{
+		return rejected || (result != CURLE_OK && !stopped);
+	}
+
+	/**
+	Check if the server answered a request for several ranges with a single
+	part, which shows it doesn't support multipart responses.
+	*/
+	bool IsSinglePartResponse () const
+	{
+		return started && targets.size () > 1 &&
+			(statusCode == 200 || (statusCode == 206 && !parser));
+	}
 };
 
+///////////////////////////////////////////////////////////////////////////////
+size_t HeaderCallback (char* buffer, size_t /* size is always 1 */, size_t nmeb, void* userptr)
+{
+	Transfer* transfer = static_cast<Transfer*> (userptr);
+	const std::string line (buffer, nmeb);
+
+	// Every response starts with the status line, and we only care about
+	// the last one in case of redirects
+	if (line.compare (0, 5, "HTTP/") == 0) {
+		transfer->statusCode = 0;
+		transfer->contentType.clear ();
+		transfer->contentRange.clear ();
+		transfer->contentLength.clear ();
+
+		const auto separator = line.find (' ');
+		if (separator != std::string::npos) {
+			transfer->statusCode = std::strtol (line.c_str () + separator, nullptr, 10);
+		}
+
+		return nmeb;
+	}
+
+	const auto separator = line.find (':');
+	if (separator == std::string::npos) {
+		return nmeb;
+	}
+
+	std::string name = line.substr (0, separator);
+	std::transform (name.begin (), name.end (), name.begin (),
+		[](const unsigned char c) { return static_cast<char> (std::tolower (c)); });
+
+	if (name == "content-type") {
+		transfer->contentType = line.substr (separator + 1);
+	} else if (name == "content-range") {
+		transfer->contentRange = line.substr (separator + 1);
+	} else if (name == "content-length") {
+		transfer->contentLength = line.substr (separator + 1);
+	}
+
+	return nmeb;
+}
+
+///////////////////////////////////////////////////////////////////////////////
 size_t WriteToBufferCallback (void* buffer, size_t /* size is always 1 */, size_t nmeb, void* userptr)
 {
-	BufferStream* stream = static_cast<BufferStream*> (userptr);
-	std::cout << stream->offset << " " << nmeb << " " << stream->size << " ! " << (stream->offset + nmeb) << std::endl;
-	assert ((stream->offset + nmeb) <= stream->size);
-	::memcpy (stream->buffer + stream->offset, buffer, nmeb);
-	stream->offset += nmeb;
+	Transfer* transfer = static_cast<Transfer*> (userptr);
+
+	// Returning a different size aborts the transfer
+	if (!transfer->started) {
+		transfer->started = true;
+
+		std::string boundary;
+		int64 first = 0, last = 0, total = 0;
+
+		if (transfer->statusCode == 206 &&
+			ParseMultipartBoundary (transfer->contentType, boundary)) {
+			transfer->parser = std::make_unique<MultipartByteRangesParser> (boundary,
+				[transfer](const int64 offset, const ArrayRef<>& data) -> void {
+					transfer->Deliver (offset,
+						static_cast<const byte*> (data.GetData ()), data.GetSize ());
+			});
+		} else if (transfer->statusCode == 206 &&
+			ParseHttpContentRange (transfer->contentRange, first, last)) {
+			transfer->responseOffset = first;
+
+			if (ParseHttpContentRange (transfer->contentRange, first, last, total)) {
+				transfer->totalSize = total;
+			}
+		} else if (transfer->statusCode == 200) {
+			// The server ignores ranges and sends the whole file
+			transfer->responseOffset = 0;
+
+			if (!transfer->contentLength.empty ()) {
+				transfer->totalSize = std::strtoll (transfer->contentLength.c_str (),
+					nullptr, 10);
+			}
+		} else {
+			transfer->rejected = true;
+			return 0;
+		}
+	}
+
+	if (transfer->parser) {
+		if (!transfer->parser->Feed (ArrayRef<> (buffer, nmeb))) {
+			transfer->rejected = true;
+			return 0;
+		}
+	} else {
+		transfer->Deliver (transfer->responseOffset,
+			static_cast<const byte*> (buffer), nmeb);
+		transfer->responseOffset += nmeb;
+
+		if (transfer->responseOffset > transfer->GetEnd ()) {
+			if (transfer->statusCode == 206) {
+				// The server sent more than the requested range
+				transfer->rejected = true;
+			} else {
+				// Don't download the rest of the file if the server ignored
+				// the range
+				transfer->stopped = true;
+			}
+
+			return 0;
+		}
+	}
 
 	return nmeb;
 }
+}
 #endif
 
 struct WebRepository::Impl
@@ -139,48 +345,242 @@ struct WebRepository::Impl
 
 	HINTERNET internet_;
 #elif KYLA_PLATFORM_LINUX
+	/**
+	A remote file which is read using HTTP range requests.
+
+	All requests for a file go through one multi handle, so connections are
+	kept alive between requests, and HTTP/2 connections get multiplexed. Up
+	to MaxRequestsInFlight requests are issued concurrently, which hides the
+	latency of high-latency links.
+
+	Disjoint ranges are combined into multipart/byteranges requests of up to
+	MaxRangesPerRequest ranges. If the server doesn't answer those properly,
+	the file falls back to one request per range.
+	*/
 	struct File
 	{
+		static constexpr int MaxRequestsInFlight = 8;
+		static constexpr int MaxRangesPerRequest = 32;
+
 		File (const File&) = delete;
 		File& operator= (const File&) = delete;
 
 		File (const std::string& url)
+			: url_ (url)
 		{
-			curl_ = curl_easy_init ();
-			curl_easy_setopt (curl_, CURLOPT_URL, url.c_str ());
-			curl_easy_setopt (curl_, CURLOPT_FOLLOWLOCATION, 1L);
+			multi_ = curl_multi_init ();
+			curl_multi_setopt (multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+			curl_multi_setopt (multi_, CURLMOPT_MAX_HOST_CONNECTIONS,
+				static_cast<long> (MaxRequestsInFlight));
 		}
 
 		~File ()
 		{
-			curl_easy_cleanup (curl_);
+			for (auto handle : handles_) {
+				curl_easy_cleanup (handle);
+			}
+
+			curl_multi_cleanup (multi_);
 		}
 
+		/**
+		Read a single range. Returns the number of bytes read, which is less
+		than requested if the range extends past the end of the file.
+		*/
 		int64 Read (const int64 offset, const MutableArrayRef<>& buffer)
 		{
-			std::string range;
-			range += std::to_string (offset);
-			range += "-";
-			range += std::to_string (offset + buffer.GetSize () - 1 /* ranges are inclusive */);
+			RangeTarget target;
+			target.buffer = static_cast<byte*> (buffer.GetData ());
+			target.offset = offset;
+			target.size = buffer.GetSize ();
+
+			std::vector<std::unique_ptr<Transfer>> transfers;
+			transfers.emplace_back (new Transfer);
+			transfers.back ()->targets.push_back (&target);
+
+			Perform (transfers);
+
+			return target.received;
+		}
+
+		/**
+		Get the size of the remote file by requesting its first byte. Returns
+		-1 if the server doesn't tell.
+		*/
+		int64 GetSize ()
+		{
+			byte firstByte = 0;
+
+			RangeTarget target;
+			target.buffer = &firstByte;
+			target.offset = 0;
+			target.size = 1;
+
+			std::vector<std::unique_ptr<Transfer>> transfers;
+			transfers.emplace_back (new Transfer);
+			transfers.back ()->targets.push_back (&target);
+
+			Perform (transfers);
+
+			return transfers.front ()->totalSize;
+		}
+
+		void ReadRanges (const MutableArrayRef<PackedRepositoryBase::PackageFile::ReadRange>& ranges)
+		{
+			std::vector<RangeTarget> targets (ranges.GetCount ());
+
+			for (int64 i = 0; i < ranges.GetCount (); ++i) {
+				targets [i].buffer = static_cast<byte*> (ranges [i].buffer.GetData ());
+				targets [i].offset = ranges [i].offset;
+				targets [i].size = ranges [i].buffer.GetSize ();
+			}
+
+			std::vector<RangeTarget*> sortedTargets;
+			for (auto& target : targets) {
+				sortedTargets.push_back (&target);
+			}
+
+			std::sort (sortedTargets.begin (), sortedTargets.end (),
+				[](const RangeTarget* a, const RangeTarget* b) -> bool {
+				return a->offset < b->offset;
+			});
+
+			const size_t rangesPerRequest = multipartSupported_
+				? MaxRangesPerRequest : 1;
+
+			std::vector<std::unique_ptr<Transfer>> transfers;
+			for (size_t i = 0; i < sortedTargets.size (); i += rangesPerRequest) {
+				transfers.emplace_back (new Transfer);
+
+				const auto last = std::min (i + rangesPerRequest, sortedTargets.size ());
+				transfers.back ()->targets.assign (sortedTargets.begin () + i,
+					sortedTargets.begin () + last);
+			}
+
+			Perform (transfers);
+
+			for (int64 i = 0; i < ranges.GetCount (); ++i) {
+				ranges [i].succeeded = targets [i].IsComplete ();
+			}
+		}
+
+	private:
+		CURL* CreateHandle ()
+		{
+			auto handle = curl_easy_init ();
+
+			curl_easy_setopt (handle, CURLOPT_URL, url_.c_str ());
+			curl_easy_setopt (handle, CURLOPT_FOLLOWLOCATION, 1L);
+			curl_easy_setopt (handle, CURLOPT_USERAGENT, "libcurl-kyla/1.0");
+			curl_easy_setopt (handle, CURLOPT_HEADERFUNCTION, HeaderCallback);
+			curl_easy_setopt (handle, CURLOPT_WRITEFUNCTION, WriteToBufferCallback);
+			curl_easy_setopt (handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+			// Prefer waiting for a multiplexed connection over opening a new one
+			curl_easy_setopt (handle, CURLOPT_PIPEWAIT, 1L);
+
+			return handle;
+		}
+
+		void Start (CURL* handle, Transfer& transfer)
+		{
+			const auto range = transfer.GetRangeHeader ();
 
-			curl_easy_setopt (curl_, CURLOPT_RANGE, range.c_str ());
-			curl_easy_setopt (curl_, CURLOPT_WRITEFUNCTION, WriteToBufferCallback);
-  			curl_easy_setopt (curl_, CURLOPT_USERAGENT, "libcurl-kyla/1.0");
+			curl_easy_setopt (handle, CURLOPT_RANGE, range.c_str ());
+			curl_easy_setopt (handle, CURLOPT_HEADERDATA, &transfer);
+			curl_easy_setopt (handle, CURLOPT_WRITEDATA, &transfer);
+			curl_easy_setopt (handle, CURLOPT_PRIVATE, &transfer);
 
-			BufferStream stream = {
-				static_cast<byte*> (buffer.GetData ()),
-				0,
-				buffer.GetSize ()
-			};
-			curl_easy_setopt (curl_, CURLOPT_WRITEDATA, &stream);
+			curl_multi_add_handle (multi_, handle);
+		}
+
+		/**
+		Run all transfers, keeping up to MaxRequestsInFlight requests active.
+		The easy handles are reused, so their connections stay alive.
+
+		Ranges of failed transfers are discarded, unless they arrived
+		completely before the failure. If a request for several ranges comes
+		back incomplete, the missing ranges are requested one by one.
+		Multipart requests are only disabled for this file if the server
+		answered with a single part.
+		*/
+		void Perform (std::vector<std::unique_ptr<Transfer>>& transfers)
+		{
+			while (handles_.size () < std::min<size_t> (transfers.size (), MaxRequestsInFlight)) {
+				handles_.push_back (CreateHandle ());
+			}
+
+			std::vector<CURL*> idleHandles = handles_;
+			size_t next = 0;
+			int active = 0;
+
+			while (next < transfers.size () && !idleHandles.empty ()) {
+				Start (idleHandles.back (), *transfers [next++]);
+				idleHandles.pop_back ();
+				++active;
+			}
+
+			while (active > 0) {
+				int running = 0;
+				curl_multi_perform (multi_, &running);
+
+				int queued = 0;
+				while (CURLMsg* message = curl_multi_info_read (multi_, &queued)) {
+					if (message->msg != CURLMSG_DONE) {
+						continue;
+					}
+
+					CURL* handle = message->easy_handle;
 
-			auto res = curl_easy_perform (curl_);
+					Transfer* transfer = nullptr;
+					curl_easy_getinfo (handle, CURLINFO_PRIVATE, &transfer);
 
-			return stream.offset;
+					curl_multi_remove_handle (multi_, handle);
+					--active;
+
+					transfer->result = message->data.result;
+
+					if (transfer->IsFailed ()) {
+						for (auto target : transfer->targets) {
+							if (transfer->rejected || !target->IsComplete ()) {
+								target->received = 0;
+							}
+						}
+					}
+
+					if (transfer->IsSinglePartResponse ()) {
+						multipartSupported_ = false;
+					}
+
+					if (transfer->targets.size () > 1 && !transfer->IsComplete ()) {
+						for (auto target : transfer->targets) {
+							if (target->IsComplete ()) {
+								continue;
+							}
+
+							// Partially delivered ranges are requested again
+							target->received = 0;
+
+							transfers.emplace_back (new Transfer);
+							transfers.back ()->targets.push_back (target);
+						}
+					}
+
+					if (next < transfers.size ()) {
+						Start (handle, *transfers [next++]);
+						++active;
+					}
+				}
+
+				if (active > 0) {
+					curl_multi_poll (multi_, nullptr, 0, 1000, nullptr);
+				}
+			}
 		}
 
-		private:
-		CURL* curl_;
+		std::string url_;
+		CURLM* multi_ = nullptr;
+		std::vector<CURL*> handles_;
+		bool multipartSupported_ = true;
 	};
 
 	std::unique_ptr<File> Open (const std::string& file)
@@ -201,6 +601,47 @@ struct WebRepository::Impl
 #endif
 };
 
+#if KYLA_PLATFORM_LINUX
+namespace {
+/**
+The repository database, read on demand. Queries only fetch the pages they
+need, so opening a large repository doesn't require downloading it first.
+*/
+struct WebDatabaseFile final : public Sql::RemoteFile
+{
+public:
+	WebDatabaseFile (std::unique_ptr<WebRepository::Impl::File>&& file,
+		const std::string& url)
+		: file_ (std::move (file))
+		, url_ (url)
+	{
+	}
+
+	int64 GetSize () override
+	{
+		const auto size = file_->GetSize ();
+
+		if (size <= 0) {
+			throw RuntimeException ("WebRepository",
+				fmt::format ("Could not get size of '{0}'", url_),
+				KYLA_FILE_LINE);
+		}
+
+		return size;
+	}
+
+	bool Read (const int64 offset, const MutableArrayRef<>& buffer) override
+	{
+		return file_->Read (offset, buffer) == buffer.GetSize ();
+	}
+
+private:
+	std::unique_ptr<WebRepository::Impl::File> file_;
+	std::string url_;
+};
+}
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 WebRepository::WebRepository (const std::string& path)
 	: impl_ (new Impl)
@@ -211,8 +652,14 @@ WebRepository::WebRepository (const std::string& path)
 			fmt::format ("Web repository url must end with '/' (got: '{0}')", path),
 			KYLA_FILE_LINE);
 	}
-	const auto dbWebFile = impl_->Open (std::string (path) + "repository.db");
+	const auto dbUrl = std::string (path) + "repository.db";
 	url_ = path;
+
+#if KYLA_PLATFORM_LINUX
+	db_ = Sql::Database::OpenRemote (std::make_unique<WebDatabaseFile> (
+		impl_->Open (dbUrl), dbUrl));
+#else
+	const auto dbWebFile = impl_->Open (dbUrl);
 	dbPath_ = GetTemporaryFilename ();
 
 	// Extra scope so it's closed by the time we try to open
@@ -235,13 +682,17 @@ WebRepository::WebRepository (const std::string& path)
 	}
 
 	db_ = Sql::Database::Open (dbPath_);
+#endif
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 WebRepository::~WebRepository ()
 {
 	db_.Close ();
-	std::filesystem::remove (dbPath_);
+
+	if (!dbPath_.empty ()) {
+		std::filesystem::remove (dbPath_);
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -264,6 +715,19 @@ namespace {
 			return file_->Read (offset, buffer) == buffer.GetSize ();
 		}
 
+#if KYLA_PLATFORM_LINUX
+		void ReadRanges (const MutableArrayRef<ReadRange>& ranges) override
+		{
+			file_->ReadRanges (ranges);
+		}
+
+		int GetPreferredRangeCount () const override
+		{
+			return WebRepository::Impl::File::MaxRequestsInFlight
+				* WebRepository::Impl::File::MaxRangesPerRequest;
+		}
+#endif
+
 	private:
 		std::unique_ptr<WebRepository::Impl::File> file_;
 	};
@@ -276,4 +740,10 @@ std::unique_ptr<PackedRepositoryBase::PackageFile> WebRepository::OpenPackage (c
 		impl_->Open (url_ + packageName)
 	}};
 }
+
+///////////////////////////////////////////////////////////////////////////////
+bool WebRepository::IsRemote () const
+{
+	return true;
+}
 } // namespace kyla
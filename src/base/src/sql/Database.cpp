@@ -8,11 +8,13 @@ details.
 */
 
 #include "sql/Database.h"
+#include "sql/RemoteFile.h"
 
 #include <sqlite3.h>
 
 #include <fmt/core.h>
 #include "Exception.h"
+#include "Log.h"
 
 namespace {
 class SQLException : public kyla::RuntimeException
@@ -34,6 +36,37 @@ public:
 
 #define SAFE_SQLITE(expr) SAFE_SQLITE_INTERNAL(expr, __FILE__, __LINE__)
 
+namespace {
+///////////////////////////////////////////////////////////////////////////////
+/**
+Turn a path into an SQLite URI filename. Characters which have a special
+meaning in URIs are escaped.
+*/
+std::string ToUriFilename (const char* path)
+{
+	std::string result = "file:";
+
+#if KYLA_PLATFORM_WINDOWS
+	// Drive letters need a leading slash, i.e. file:/C:/...
+	result += '/';
+#endif
+
+	for (const char* c = path; *c; ++c) {
+		switch (*c) {
+		case '%': result += "%25"; break;
+		case '?': result += "%3f"; break;
+		case '#': result += "%23"; break;
+#if KYLA_PLATFORM_WINDOWS
+		case '\\': result += '/'; break;
+#endif
+		default: result += *c;
+		}
+	}
+
+	return result;
+}
+}
+
 namespace kyla {
 namespace Sql {
 struct Database::Impl
@@ -46,6 +79,8 @@ public:
 
 	Impl (Impl&& other)
 		: db_ (other.db_)
+		, isRemote_ (other.isRemote_)
+		, isImmutable_ (other.isImmutable_)
 	{
 		other.db_ = nullptr;
 	}
@@ -53,6 +88,8 @@ public:
 	Impl& operator= (Impl&& other)
 	{
 		db_ = other.db_;
+		isRemote_ = other.isRemote_;
+		isImmutable_ = other.isImmutable_;
 		other.db_ = nullptr;
 
 		return *this;
@@ -71,20 +108,43 @@ public:
 		case OpenMode::ReadWrite:
 			sqliteOpenMode = SQLITE_OPEN_READWRITE;
 			break;
+
+		case OpenMode::Immutable:
+			sqliteOpenMode = SQLITE_OPEN_READONLY;
+			isImmutable_ = true;
+			break;
 		}
 
-		SAFE_SQLITE (sqlite3_open_v2(name, &db_, sqliteOpenMode, nullptr));
+		// URI filenames are needed to attach other databases read-only
+		SAFE_SQLITE (sqlite3_open_v2(name, &db_,
+			sqliteOpenMode | SQLITE_OPEN_URI, nullptr));
+	}
+
+	void OpenRemote (std::unique_ptr<RemoteFile>&& file)
+	{
+		const auto name = RegisterRemoteFile (std::move (file));
+
+		const auto r = sqlite3_open_v2 (name.c_str (), &db_,
+			SQLITE_OPEN_READONLY, GetRemoteVfsName ());
+
+		// If open failed early, the file may still be registered
+		UnregisterRemoteFile (name);
+
+		SAFE_SQLITE (r);
+
+		isRemote_ = true;
 	}
 
 	void Create (const char* name)
 	{
 		SAFE_SQLITE(sqlite3_open_v2 (name, &db_,
-			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr));
+			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, nullptr));
 	}
 
 	void Create ()
 	{
-		SAFE_SQLITE(sqlite3_open (":memory:", &db_));
+		SAFE_SQLITE(sqlite3_open_v2 (":memory:", &db_,
+			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, nullptr));
 	}
 
 	void Close ()
@@ -279,6 +339,52 @@ public:
 		sqlite3_backup_finish (backup);
 	}
 
+	void Attach (Impl* other, const char* name, Log& log)
+	{
+		const char* filename = sqlite3_db_filename (other->db_, "main");
+
+		// Remote and in-memory databases have no file we could open
+		if (other->isRemote_ || filename == nullptr || *filename == '\0') {
+			AttachTemporaryCopy (other, name);
+			return;
+		}
+
+		// Packed repositories are not modified once they're built, so SQLite
+		// doesn't need to lock them or check for changes. Other read-only
+		// databases, like a deployed repository which is being configured,
+		// can still change through another connection
+		auto uri = ToUriFilename (filename);
+		uri += other->isImmutable_ ? "?mode=ro&immutable=1" : "?mode=ro";
+
+		sqlite3_stmt* statement;
+		SAFE_SQLITE (sqlite3_prepare_v2 (db_,
+			fmt::format ("ATTACH DATABASE ? AS {0}", name).c_str (),
+			-1, &statement, nullptr));
+		SAFE_SQLITE (sqlite3_bind_text (statement, 1, uri.c_str (), -1,
+			SQLITE_TRANSIENT));
+		const auto r = sqlite3_step (statement);
+		const std::string error = sqlite3_errmsg (db_);
+		sqlite3_finalize (statement);
+
+		if (r == SQLITE_DONE) {
+			return;
+		}
+
+		// All connections are opened with URI filenames enabled, so the only
+		// expected failure is a file which can't be opened a second time, for
+		// instance because it has been removed since. A locked or corrupt
+		// file must not turn silently into a full copy
+		if ((r & 0xFF) != SQLITE_CANTOPEN) {
+			throw SQLException (std::string (sqlite3_errstr (r)) + ":" + error,
+				KYLA_FILE_LINE);
+		}
+
+		log.Warning ("Database", fmt::format ("Could not attach '{0}' in "
+			"place, attaching a copy instead: {1}", filename, error));
+
+		AttachTemporaryCopy (other, name);
+	}
+
 	void Detach (const char* name)
 	{
 		std::string sql = "DETACH DATABASE ";
@@ -325,6 +431,8 @@ private:
 	}
 
 	sqlite3* db_ = nullptr;
+	bool isRemote_ = false;
+	bool isImmutable_ = false;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -380,6 +488,17 @@ Database Database::Open (const Path& path, const OpenMode openMode)
 	return db;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+/**
+Open a read-only database which is read on demand from file.
+*/
+Database Database::OpenRemote (std::unique_ptr<RemoteFile>&& file)
+{
+	Database db;
+	db.impl_->OpenRemote (std::move (file));
+	return db;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 Database Database::Create (const char* name)
 {
@@ -661,6 +780,12 @@ void Database::AttachTemporaryCopy (const char* name, Database & source)
 	impl_->AttachTemporaryCopy (source.impl_.get (), name);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+void Database::Attach (const char* name, Database& source, Log& log)
+{
+	impl_->Attach (source.impl_.get (), name, log);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 TemporaryTable Database::CreateTemporaryTable (const char* name,
 	const char* columnDefinition)
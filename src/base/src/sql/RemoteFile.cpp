@@ -0,0 +1,513 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "sql/RemoteFile.h"
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/**
+@file
+A read-only SQLite VFS for remote files.
+
+A remote file is registered under a unique name, and ownership passes to
+SQLite once the database is opened with this VFS. Reads are served from a
+block cache, and missing blocks are fetched on demand, so opening a database
+and running a few queries only needs a few requests.
+*/
+
+namespace kyla {
+namespace Sql {
+namespace {
+constexpr auto RemoteVfsName = "kyla-remote";
+
+/**
+Caches the remote file in blocks. Adjacent missing blocks are fetched with a
+single read, and sequential access reads ahead. The least recently used blocks
+are dropped once the cache is full.
+*/
+class BlockCache final
+{
+public:
+	static constexpr int64 BlockSize = 64 << 10;
+	static constexpr size_t MaxBlockCount = 512;
+	static constexpr int64 MaxReadAhead = 64;
+
+	BlockCache (std::unique_ptr<RemoteFile>&& file)
+		: file_ (std::move (file))
+	{
+		size_ = file_->GetSize ();
+	}
+
+	int64 GetSize () const
+	{
+		return size_;
+	}
+
+	bool Read (const int64 offset, byte* output, const int64 size)
+	{
+		std::lock_guard<std::mutex> lock{ mutex_ };
+
+		const auto firstBlock = offset / BlockSize;
+		const auto lastBlock = (offset + size - 1) / BlockSize;
+
+		if (!Fetch (firstBlock, lastBlock)) {
+			return false;
+		}
+
+		int64 written = 0;
+		for (auto block = firstBlock; block <= lastBlock; ++block) {
+			const auto& data = Touch (block);
+
+			const auto blockOffset = block * BlockSize;
+			const auto first = std::max (offset, blockOffset);
+			const auto last = std::min (offset + size,
+				blockOffset + static_cast<int64> (data.size ()));
+
+			if (first >= last) {
+				break;
+			}
+
+			::memcpy (output + (first - offset), data.data () + (first - blockOffset),
+				last - first);
+			written += last - first;
+		}
+
+		return written == size;
+	}
+
+private:
+	/**
+	Make sure all blocks in [firstBlock, lastBlock] are cached.
+	*/
+	bool Fetch (const int64 firstBlock, const int64 lastBlock)
+	{
+		auto block = firstBlock;
+
+		while (block <= lastBlock) {
+			if (blocks_.find (block) != blocks_.end ()) {
+				++block;
+				continue;
+			}
+
+			// Sequential reads, for instance when copying the whole database,
+			// fetch exponentially larger runs
+			if (block == nextSequentialBlock_) {
+				readAhead_ = std::min (readAhead_ * 2, MaxReadAhead);
+			} else {
+				readAhead_ = 1;
+			}
+
+			const auto blockCount = (size_ + BlockSize - 1) / BlockSize;
+			const auto runLimit = std::min (std::max (lastBlock, block + readAhead_ - 1),
+				blockCount - 1);
+
+			auto runEnd = block;
+			while (runEnd + 1 <= runLimit && blocks_.find (runEnd + 1) == blocks_.end ()) {
+				++runEnd;
+			}
+
+			nextSequentialBlock_ = runEnd + 1;
+
+			const auto offset = block * BlockSize;
+			const auto size = std::min ((runEnd + 1) * BlockSize, size_) - offset;
+
+			if (size <= 0) {
+				return false;
+			}
+
+			std::vector<byte> buffer (size);
+			if (!file_->Read (offset, buffer)) {
+				return false;
+			}
+
+			for (auto b = block; b <= runEnd; ++b) {
+				const auto first = (b - block) * BlockSize;
+				const auto last = std::min (first + BlockSize, size);
+
+				Insert (b, std::vector<byte> (buffer.begin () + first,
+					buffer.begin () + last));
+			}
+
+			block = runEnd + 1;
+		}
+
+		return true;
+	}
+
+	void Insert (const int64 block, std::vector<byte>&& data)
+	{
+		lru_.push_front (block);
+		blocks_ [block] = { std::move (data), lru_.begin () };
+
+		// Never evict blocks needed by the read in progress, which are the
+		// most recently inserted ones
+		while (blocks_.size () > MaxBlockCount) {
+			blocks_.erase (lru_.back ());
+			lru_.pop_back ();
+		}
+	}
+
+	const std::vector<byte>& Touch (const int64 block)
+	{
+		auto& entry = blocks_.at (block);
+		lru_.splice (lru_.begin (), lru_, entry.lruPosition);
+
+		return entry.data;
+	}
+
+	struct Entry
+	{
+		std::vector<byte> data;
+		std::list<int64>::iterator lruPosition;
+	};
+
+	std::unique_ptr<RemoteFile> file_;
+	int64 size_ = 0;
+
+	int64 nextSequentialBlock_ = -1;
+	int64 readAhead_ = 1;
+
+	std::mutex mutex_;
+	std::unordered_map<int64, Entry> blocks_;
+	std::list<int64> lru_;
+};
+
+struct RemoteVfsFile
+{
+	// Must be the first member, SQLite treats this as a sqlite3_file
+	sqlite3_file base;
+	BlockCache* cache;
+};
+
+std::mutex registryMutex;
+std::unordered_map<std::string, std::unique_ptr<RemoteFile>> registry;
+std::atomic<int64> nextRegistrationId{ 0 };
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteClose (sqlite3_file* file)
+{
+	auto remoteFile = reinterpret_cast<RemoteVfsFile*> (file);
+	delete remoteFile->cache;
+	remoteFile->cache = nullptr;
+
+	return SQLITE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteRead (sqlite3_file* file, void* buffer, int amount, sqlite3_int64 offset)
+{
+	auto cache = reinterpret_cast<RemoteVfsFile*> (file)->cache;
+
+	if (offset >= cache->GetSize ()) {
+		::memset (buffer, 0, amount);
+		return SQLITE_IOERR_SHORT_READ;
+	}
+
+	const auto available = std::min<int64> (amount, cache->GetSize () - offset);
+
+	try {
+		if (!cache->Read (offset, static_cast<byte*> (buffer), available)) {
+			return SQLITE_IOERR_READ;
+		}
+	} catch (...) {
+		return SQLITE_IOERR_READ;
+	}
+
+	if (available < amount) {
+		::memset (static_cast<byte*> (buffer) + available, 0, amount - available);
+		return SQLITE_IOERR_SHORT_READ;
+	}
+
+	return SQLITE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteWrite (sqlite3_file*, const void*, int, sqlite3_int64)
+{
+	return SQLITE_READONLY;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteTruncate (sqlite3_file*, sqlite3_int64)
+{
+	return SQLITE_READONLY;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteSync (sqlite3_file*, int)
+{
+	return SQLITE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteFileSize (sqlite3_file* file, sqlite3_int64* size)
+{
+	*size = reinterpret_cast<RemoteVfsFile*> (file)->cache->GetSize ();
+	return SQLITE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteLock (sqlite3_file*, int)
+{
+	return SQLITE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteCheckReservedLock (sqlite3_file*, int* result)
+{
+	*result = 0;
+	return SQLITE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteFileControl (sqlite3_file*, int, void*)
+{
+	return SQLITE_NOTFOUND;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteSectorSize (sqlite3_file*)
+{
+	return 4096;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteDeviceCharacteristics (sqlite3_file*)
+{
+	// Nobody can change the file while we read it, so SQLite can skip
+	// locking and change detection
+	return SQLITE_IOCAP_IMMUTABLE;
+}
+
+const sqlite3_io_methods remoteIoMethods = {
+	1,
+	RemoteClose,
+	RemoteRead,
+	RemoteWrite,
+	RemoteTruncate,
+	RemoteSync,
+	RemoteFileSize,
+	RemoteLock,
+	RemoteLock,
+	RemoteCheckReservedLock,
+	RemoteFileControl,
+	RemoteSectorSize,
+	RemoteDeviceCharacteristics,
+	nullptr,	// xShmMap
+	nullptr,	// xShmLock
+	nullptr,	// xShmBarrier
+	nullptr,	// xShmUnmap
+	nullptr,	// xFetch
+	nullptr		// xUnfetch
+};
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteOpen (sqlite3_vfs* vfs, const char* name, sqlite3_file* file,
+	int flags, int* outFlags)
+{
+	// Temporary files (for instance, when a sort spills) are local, so they
+	// are served by the default VFS, which also owns the io methods for them
+	if (name == nullptr || (flags & SQLITE_OPEN_MAIN_DB) == 0) {
+		auto defaultVfs = static_cast<sqlite3_vfs*> (vfs->pAppData);
+		return defaultVfs->xOpen (defaultVfs, name, file, flags, outFlags);
+	}
+
+	auto remoteFile = reinterpret_cast<RemoteVfsFile*> (file);
+	remoteFile->base.pMethods = nullptr;
+	remoteFile->cache = nullptr;
+
+	if (flags & (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)) {
+		return SQLITE_CANTOPEN;
+	}
+
+	std::unique_ptr<RemoteFile> source;
+
+	{
+		std::lock_guard<std::mutex> lock{ registryMutex };
+		auto it = registry.find (name);
+
+		if (it == registry.end ()) {
+			return SQLITE_CANTOPEN;
+		}
+
+		source = std::move (it->second);
+		registry.erase (it);
+	}
+
+	try {
+		remoteFile->cache = new BlockCache{ std::move (source) };
+	} catch (...) {
+		return SQLITE_CANTOPEN;
+	}
+
+	remoteFile->base.pMethods = &remoteIoMethods;
+
+	if (outFlags) {
+		*outFlags = SQLITE_OPEN_READONLY;
+	}
+
+	return SQLITE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteDelete (sqlite3_vfs*, const char*, int)
+{
+	// Temporary files are deleted on close by the default VFS
+	return SQLITE_IOERR_DELETE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteAccess (sqlite3_vfs*, const char*, int, int* result)
+{
+	// There are never any journals
+	*result = 0;
+	return SQLITE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteFullPathname (sqlite3_vfs*, const char* name, int outputSize, char* output)
+{
+	sqlite3_snprintf (outputSize, output, "%s", name);
+	return SQLITE_OK;
+}
+
+// Everything which doesn't touch files is forwarded to the default VFS
+#define KYLA_FORWARD_TO_DEFAULT_VFS(function, ...) \
+	static_cast<sqlite3_vfs*> (vfs->pAppData)->function ( \
+		static_cast<sqlite3_vfs*> (vfs->pAppData), __VA_ARGS__)
+
+///////////////////////////////////////////////////////////////////////////////
+void* RemoteDlOpen (sqlite3_vfs* vfs, const char* filename)
+{
+	return KYLA_FORWARD_TO_DEFAULT_VFS (xDlOpen, filename);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void RemoteDlError (sqlite3_vfs* vfs, int size, char* message)
+{
+	KYLA_FORWARD_TO_DEFAULT_VFS (xDlError, size, message);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void (*RemoteDlSym (sqlite3_vfs* vfs, void* handle, const char* symbol))(void)
+{
+	return KYLA_FORWARD_TO_DEFAULT_VFS (xDlSym, handle, symbol);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void RemoteDlClose (sqlite3_vfs* vfs, void* handle)
+{
+	KYLA_FORWARD_TO_DEFAULT_VFS (xDlClose, handle);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteRandomness (sqlite3_vfs* vfs, int size, char* output)
+{
+	return KYLA_FORWARD_TO_DEFAULT_VFS (xRandomness, size, output);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteSleep (sqlite3_vfs* vfs, int microseconds)
+{
+	return KYLA_FORWARD_TO_DEFAULT_VFS (xSleep, microseconds);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteCurrentTime (sqlite3_vfs* vfs, double* time)
+{
+	return KYLA_FORWARD_TO_DEFAULT_VFS (xCurrentTime, time);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int RemoteGetLastError (sqlite3_vfs* vfs, int size, char* message)
+{
+	return KYLA_FORWARD_TO_DEFAULT_VFS (xGetLastError, size, message);
+}
+
+#undef KYLA_FORWARD_TO_DEFAULT_VFS
+
+///////////////////////////////////////////////////////////////////////////////
+void RegisterRemoteVfs ()
+{
+	static std::once_flag registered;
+
+	std::call_once (registered, []() -> void {
+		static sqlite3_vfs vfs = {};
+
+		auto defaultVfs = sqlite3_vfs_find (nullptr);
+
+		vfs.iVersion = 1;
+		// Temporary files are opened by the default VFS, so each file must
+		// be large enough for either
+		vfs.szOsFile = std::max (static_cast<int> (sizeof (RemoteVfsFile)),
+			defaultVfs->szOsFile);
+		vfs.mxPathname = 512;
+		vfs.zName = RemoteVfsName;
+		vfs.pAppData = defaultVfs;
+		vfs.xOpen = RemoteOpen;
+		vfs.xDelete = RemoteDelete;
+		vfs.xAccess = RemoteAccess;
+		vfs.xFullPathname = RemoteFullPathname;
+		vfs.xDlOpen = RemoteDlOpen;
+		vfs.xDlError = RemoteDlError;
+		vfs.xDlSym = RemoteDlSym;
+		vfs.xDlClose = RemoteDlClose;
+		vfs.xRandomness = RemoteRandomness;
+		vfs.xSleep = RemoteSleep;
+		vfs.xCurrentTime = RemoteCurrentTime;
+		vfs.xGetLastError = RemoteGetLastError;
+
+		sqlite3_vfs_register (&vfs, 0);
+	});
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const char* GetRemoteVfsName ()
+{
+	RegisterRemoteVfs ();
+
+	return RemoteVfsName;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Register a remote file and return the name to open it with. The remote VFS
+takes ownership when the database gets opened.
+*/
+std::string RegisterRemoteFile (std::unique_ptr<RemoteFile>&& file)
+{
+	const auto name = "remote-" + std::to_string (nextRegistrationId++);
+
+	std::lock_guard<std::mutex> lock{ registryMutex };
+	registry [name] = std::move (file);
+
+	return name;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Remove a remote file which has not been opened. This is a no-op if the file
+has been opened already.
+*/
+void UnregisterRemoteFile (const std::string& name)
+{
+	std::lock_guard<std::mutex> lock{ registryMutex };
+	registry.erase (name);
+}
+}
+}
@@ -0,0 +1,78 @@
+#include "ChunkCache.h"
+#include "TestHelpers.h"
+
+#include <Catch2/catch.hpp>
+
+#include <fstream>
+#include <vector>
+
+TEST_CASE ("ChunkCachePutGet", "[cache]")
+{
+	TemporaryDirectory directory;
+	kyla::ChunkCache cache{ directory.path, 1 << 20 };
+
+	const auto chunk = CreateContents (1000, 1);
+	const auto hash = kyla::ComputeSHA256 (chunk);
+
+	REQUIRE (!cache.Contains (hash));
+
+	cache.Put (hash, chunk);
+
+	REQUIRE (cache.Contains (hash));
+	REQUIRE (cache.GetSize () == 1000);
+
+	std::vector<kyla::byte> buffer (chunk.size ());
+	REQUIRE (cache.Get (hash, buffer));
+	REQUIRE (buffer == chunk);
+
+	// A second instance sees the same contents
+	kyla::ChunkCache other{ directory.path, 1 << 20 };
+	REQUIRE (other.Contains (hash));
+}
+
+TEST_CASE ("ChunkCacheEvictsLeastRecentlyUsed", "[cache]")
+{
+	TemporaryDirectory directory;
+	kyla::ChunkCache cache{ directory.path, 3000 };
+
+	std::vector<kyla::SHA256Digest> hashes;
+	std::vector<kyla::byte> buffer (1000);
+
+	for (int i = 0; i < 4; ++i) {
+		const auto chunk = CreateContents (1000, i);
+		hashes.push_back (kyla::ComputeSHA256 (chunk));
+		cache.Put (hashes.back (), chunk);
+
+		// Keep the first chunk in use
+		REQUIRE (cache.Get (hashes [0], buffer));
+	}
+
+	REQUIRE (cache.GetSize () <= 3000);
+	REQUIRE (cache.Contains (hashes [0]));
+	REQUIRE (!cache.Contains (hashes [1]));
+	REQUIRE (cache.Contains (hashes [3]));
+}
+
+TEST_CASE ("ChunkCacheRejectsCorruptedEntries", "[cache]")
+{
+	TemporaryDirectory directory;
+	kyla::ChunkCache cache{ directory.path, 1 << 20 };
+
+	const auto chunk = CreateContents (1000, 7);
+	const auto hash = kyla::ComputeSHA256 (chunk);
+	cache.Put (hash, chunk);
+
+	const auto name = kyla::ToString (hash);
+
+	{
+		std::fstream file (directory.path / name.substr (0, 2) / name,
+			std::ios::binary | std::ios::in | std::ios::out);
+		file.seekp (10);
+		file.put ('x');
+	}
+
+	std::vector<kyla::byte> buffer (chunk.size ());
+	REQUIRE (!cache.Get (hash, buffer));
+	REQUIRE (!cache.Contains (hash));
+	REQUIRE (cache.GetSize () == 0);
+}
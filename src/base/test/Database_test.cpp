@@ -0,0 +1,182 @@
+#include "sql/Database.h"
+#include "Log.h"
+#include "TestHelpers.h"
+
+#include <Catch2/catch.hpp>
+
+#include <fstream>
+#include <string>
+
+namespace {
+// Characters with a special meaning in URIs must work as well
+const char* const DirectorySuffix = " 100% #1?";
+
+void CreateDatabase (const kyla::Path& path, const int rowCount)
+{
+	auto db = kyla::Sql::Database::Create (path.string ().c_str ());
+	db.Execute ("CREATE TABLE numbers (Value INTEGER);");
+
+	auto transaction = db.BeginTransaction ();
+	auto insert = db.Prepare ("INSERT INTO numbers (Value) VALUES (?)");
+	for (int i = 0; i < rowCount; ++i) {
+		insert.BindArguments (i);
+		insert.Step ();
+		insert.Reset ();
+	}
+	transaction.Commit ();
+}
+
+std::string GetAttachedFilename (kyla::Sql::Database& db, const char* name)
+{
+	auto query = db.Prepare ("PRAGMA database_list");
+
+	while (query.Step ()) {
+		if (std::string (query.GetText (1)) == name) {
+			return query.GetText (2);
+		}
+	}
+
+	return {};
+}
+}
+
+TEST_CASE ("DatabaseAttachInPlace", "[sql]")
+{
+	TemporaryDirectory directory{ DirectorySuffix };
+	const auto sourcePath = directory.path / "source.db";
+	CreateDatabase (sourcePath, 1000);
+
+	auto source = kyla::Sql::Database::Open (sourcePath, kyla::Sql::OpenMode::Read);
+	auto target = kyla::Sql::Database::Create ((directory.path / "target.db").string ().c_str ());
+	kyla::Log log{ kyla::Log::LogCallback () };
+	target.Attach ("source", source, log);
+
+	// The source is not copied, but opened from its file
+	REQUIRE (kyla::Path{ GetAttachedFilename (target, "source") } == sourcePath);
+
+	auto count = target.Prepare ("SELECT COUNT(*) FROM source.numbers");
+	REQUIRE (count.Step ());
+	REQUIRE (count.GetInt64 (0) == 1000);
+	count.Reset ();
+
+	REQUIRE_THROWS (target.Execute ("INSERT INTO source.numbers (Value) VALUES (1)"));
+
+	target.Detach ("source");
+
+	// Nothing else was created next to the databases
+	int fileCount = 0;
+	for (const auto& entry : std::filesystem::directory_iterator (directory.path)) {
+		(void) entry;
+		++fileCount;
+	}
+	REQUIRE (fileCount == 2);
+}
+
+TEST_CASE ("DatabaseAttachSeesChanges", "[sql]")
+{
+	TemporaryDirectory directory{ DirectorySuffix };
+	const auto sourcePath = directory.path / "source.db";
+	CreateDatabase (sourcePath, 10);
+
+	// Like a deployed repository which is being configured, the source is
+	// written through another connection while it is attached
+	auto writer = kyla::Sql::Database::Open (sourcePath, kyla::Sql::OpenMode::ReadWrite);
+	writer.Execute ("PRAGMA journal_mode=WAL");
+
+	auto source = kyla::Sql::Database::Open (sourcePath, kyla::Sql::OpenMode::Read);
+	auto target = kyla::Sql::Database::Create ();
+	kyla::Log log{ kyla::Log::LogCallback () };
+	target.Attach ("source", source, log);
+
+	auto count = target.Prepare ("SELECT COUNT(*) FROM source.numbers");
+	REQUIRE (count.Step ());
+	REQUIRE (count.GetInt64 (0) == 10);
+	count.Reset ();
+
+	writer.Execute ("INSERT INTO numbers (Value) VALUES (10), (11)");
+
+	REQUIRE (count.Step ());
+	REQUIRE (count.GetInt64 (0) == 12);
+}
+
+TEST_CASE ("DatabaseAttachImmutable", "[sql]")
+{
+	TemporaryDirectory directory{ DirectorySuffix };
+	const auto sourcePath = directory.path / "source.db";
+	CreateDatabase (sourcePath, 100);
+
+	auto source = kyla::Sql::Database::Open (sourcePath, kyla::Sql::OpenMode::Immutable);
+	auto target = kyla::Sql::Database::Create ();
+	kyla::Log log{ kyla::Log::LogCallback () };
+	target.Attach ("source", source, log);
+
+	REQUIRE (kyla::Path{ GetAttachedFilename (target, "source") } == sourcePath);
+
+	auto count = target.Prepare ("SELECT COUNT(*) FROM source.numbers");
+	REQUIRE (count.Step ());
+	REQUIRE (count.GetInt64 (0) == 100);
+}
+
+TEST_CASE ("DatabaseAttachRemovedFile", "[sql]")
+{
+	TemporaryDirectory directory{ DirectorySuffix };
+	const auto sourcePath = directory.path / "source.db";
+	CreateDatabase (sourcePath, 100);
+
+	auto source = kyla::Sql::Database::Open (sourcePath, kyla::Sql::OpenMode::Read);
+	source.Execute ("SELECT COUNT(*) FROM numbers");
+
+	// The open source can still be read, but not opened a second time
+	std::filesystem::remove (sourcePath);
+
+	int warningCount = 0;
+	kyla::Log log{ [&warningCount](kyla::LogLevel level, const char*,
+		const char*, const kyla::int64) -> void {
+		if (level == kyla::LogLevel::Warning) {
+			++warningCount;
+		}
+	} };
+
+	auto target = kyla::Sql::Database::Create ();
+	target.Attach ("source", source, log);
+
+	// The copy is made visibly
+	REQUIRE (warningCount == 1);
+
+	auto count = target.Prepare ("SELECT COUNT(*) FROM source.numbers");
+	REQUIRE (count.Step ());
+	REQUIRE (count.GetInt64 (0) == 100);
+}
+
+TEST_CASE ("DatabaseAttachCorruptFile", "[sql]")
+{
+	TemporaryDirectory directory{ DirectorySuffix };
+	const auto sourcePath = directory.path / "source.db";
+
+	{
+		std::ofstream file (sourcePath, std::ios::binary);
+		file << std::string (4096, 'x');
+	}
+
+	auto source = kyla::Sql::Database::Open (sourcePath, kyla::Sql::OpenMode::Read);
+	auto target = kyla::Sql::Database::Create ();
+
+	// Only a file which can't be opened is attached as a copy
+	kyla::Log log{ kyla::Log::LogCallback () };
+	REQUIRE_THROWS (target.Attach ("source", source, log));
+}
+
+TEST_CASE ("DatabaseAttachInMemory", "[sql]")
+{
+	auto source = kyla::Sql::Database::Create ();
+	source.Execute ("CREATE TABLE numbers (Value INTEGER);"
+		"INSERT INTO numbers (Value) VALUES (1), (2), (3);");
+
+	auto target = kyla::Sql::Database::Create ();
+	kyla::Log log{ kyla::Log::LogCallback () };
+	target.Attach ("source", source, log);
+
+	auto count = target.Prepare ("SELECT COUNT(*) FROM source.numbers");
+	REQUIRE (count.Step ());
+	REQUIRE (count.GetInt64 (0) == 3);
+}
@@ -0,0 +1,151 @@
+#include "FileIO.h"
+#include "TestHelpers.h"
+
+#include <Catch2/catch.hpp>
+
+#include <string>
+#include <vector>
+
+namespace {
+void WriteFile (const kyla::Path& path, const std::vector<kyla::byte>& contents)
+{
+	auto file = kyla::CreateFile (path);
+	file->Write (contents);
+}
+
+std::vector<kyla::byte> ReadFile (const kyla::Path& path)
+{
+	auto file = kyla::OpenFile (path, kyla::FileAccess::Read);
+	std::vector<kyla::byte> result (static_cast<size_t> (file->GetSize ()));
+	file->Read (result);
+
+	return result;
+}
+}
+
+TEST_CASE ("DuplicateFileCopies", "[fileio]")
+{
+	TemporaryDirectory directory;
+
+	// Larger than the fallback copy buffer
+	const auto contents = CreateContents (3 << 20);
+	WriteFile (directory.path / "source", contents);
+
+	const auto method = kyla::DuplicateFile (directory.path / "source",
+		directory.path / "target");
+
+	REQUIRE (method != kyla::DuplicateMethod::HardLink);
+	REQUIRE (ReadFile (directory.path / "target") == contents);
+
+	// The copy is independent of the source
+	WriteFile (directory.path / "source", CreateContents (16));
+	REQUIRE (ReadFile (directory.path / "target") == contents);
+}
+
+TEST_CASE ("DuplicateFileOverwrites", "[fileio]")
+{
+	TemporaryDirectory directory;
+
+	const auto contents = CreateContents (1024);
+	WriteFile (directory.path / "source", contents);
+	WriteFile (directory.path / "target", CreateContents (4096));
+
+	kyla::DuplicateFile (directory.path / "source", directory.path / "target");
+
+	REQUIRE (ReadFile (directory.path / "target") == contents);
+}
+
+TEST_CASE ("DuplicateFileEmpty", "[fileio]")
+{
+	TemporaryDirectory directory;
+
+	WriteFile (directory.path / "source", {});
+
+	kyla::DuplicateFile (directory.path / "source", directory.path / "target");
+
+	REQUIRE (std::filesystem::file_size (directory.path / "target") == 0);
+}
+
+TEST_CASE ("DuplicateFileHardLink", "[fileio]")
+{
+	TemporaryDirectory directory;
+
+	const auto contents = CreateContents (4096);
+	WriteFile (directory.path / "source", contents);
+
+	const auto method = kyla::DuplicateFile (directory.path / "source",
+		directory.path / "target", kyla::DuplicateMode::HardLink);
+
+	REQUIRE (ReadFile (directory.path / "target") == contents);
+
+	if (method == kyla::DuplicateMethod::HardLink) {
+		REQUIRE (std::filesystem::equivalent (directory.path / "source",
+			directory.path / "target"));
+	}
+}
+
+TEST_CASE ("DuplicateFileReplacesHardLink", "[fileio]")
+{
+	TemporaryDirectory directory;
+
+	const auto contents = CreateContents (4096);
+	WriteFile (directory.path / "source", contents);
+
+	kyla::DuplicateFile (directory.path / "source", directory.path / "target",
+		kyla::DuplicateMode::HardLink);
+	kyla::DuplicateFile (directory.path / "source", directory.path / "target");
+
+	REQUIRE (ReadFile (directory.path / "source") == contents);
+	REQUIRE (ReadFile (directory.path / "target") == contents);
+}
+
+TEST_CASE ("DuplicateFileMissingSource", "[fileio]")
+{
+	TemporaryDirectory directory;
+
+	REQUIRE_THROWS (kyla::DuplicateFile (directory.path / "source",
+		directory.path / "target"));
+}
+
+TEST_CASE ("DirectoryTreeCreatesAndRemovesFiles", "[fileio]")
+{
+	TemporaryDirectory directory;
+	kyla::DirectoryTree tree{ directory.path };
+
+	const auto contents = CreateContents (1024);
+
+	std::vector<kyla::Path> paths;
+	for (int i = 0; i < 1000; ++i) {
+		paths.emplace_back (kyla::Path{ "a" } / std::to_string (i % 7)
+			/ std::to_string (i));
+	}
+
+	for (const auto& path : paths) {
+		tree.CreateDirectories (path.parent_path ());
+		tree.CreateFile (path, kyla::FileAccess::Write)->Write (contents);
+	}
+
+	REQUIRE (ReadFile (directory.path / paths.front ()) == contents);
+	REQUIRE (ReadFile (directory.path / paths.back ()) == contents);
+
+	// Missing files and directories are skipped
+	paths.emplace_back ("a/0/missing");
+	paths.emplace_back ("missing/file");
+
+	tree.RemoveFiles (paths, 4);
+
+	for (const auto& path : paths) {
+		REQUIRE (!std::filesystem::exists (directory.path / path));
+	}
+
+	// The directories stay
+	REQUIRE (std::filesystem::is_directory (directory.path / "a" / "6"));
+}
+
+TEST_CASE ("DirectoryTreeMissingDirectory", "[fileio]")
+{
+	TemporaryDirectory directory;
+	kyla::DirectoryTree tree{ directory.path };
+
+	REQUIRE_THROWS (tree.CreateFile ("missing/file", kyla::FileAccess::Write));
+}
@@ -0,0 +1,138 @@
+#include "HttpByteRanges.h"
+
+#include <Catch2/catch.hpp>
+
+#include <map>
+
+namespace {
+const std::string MultipartBody =
+	"preamble\r\n"
+	"--THIS_STRING_SEPARATES\r\n"
+	"Content-Type: application/octet-stream\r\n"
+	"Content-Range: bytes 10-14/100\r\n"
+	"\r\n"
+	"hello\r\n"
+	"--THIS_STRING_SEPARATES\r\n"
+	"content-range: bytes 50-55/100\r\n"
+	"\r\n"
+	"world!\r\n"
+	"--THIS_STRING_SEPARATES--\r\n";
+
+std::map<kyla::int64, std::string> ParseInBlocks (const std::string& body,
+	const size_t blockSize, bool& complete)
+{
+	std::map<kyla::int64, std::string> result;
+
+	kyla::MultipartByteRangesParser parser{ "THIS_STRING_SEPARATES",
+		[&](const kyla::int64 offset, const kyla::ArrayRef<>& data) -> void {
+			result [offset] = std::string (
+				static_cast<const char*> (data.GetData ()), data.GetSize ());
+	} };
+
+	for (size_t i = 0; i < body.size (); i += blockSize) {
+		const auto block = body.substr (i, blockSize);
+		REQUIRE (parser.Feed (kyla::ArrayRef<> (block.data (),
+			static_cast<kyla::int64> (block.size ()))));
+	}
+
+	complete = parser.IsComplete ();
+
+	return result;
+}
+}
+
+TEST_CASE ("HttpContentRange", "[http]")
+{
+	kyla::int64 first = 0, last = 0;
+
+	REQUIRE (kyla::ParseHttpContentRange ("bytes 0-499/1234", first, last));
+	REQUIRE (first == 0);
+	REQUIRE (last == 499);
+
+	REQUIRE (kyla::ParseHttpContentRange (" bytes 500-999/*", first, last));
+	REQUIRE (first == 500);
+	REQUIRE (last == 999);
+
+	REQUIRE (!kyla::ParseHttpContentRange ("bytes */1234", first, last));
+	REQUIRE (!kyla::ParseHttpContentRange ("bytes 10-5/1234", first, last));
+
+	kyla::int64 total = 0;
+	REQUIRE (kyla::ParseHttpContentRange ("bytes 0-0/1234", first, last, total));
+	REQUIRE (total == 1234);
+	REQUIRE (!kyla::ParseHttpContentRange ("bytes 0-0/*", first, last, total));
+}
+
+TEST_CASE ("HttpMultipartBoundary", "[http]")
+{
+	std::string boundary;
+
+	REQUIRE (kyla::ParseMultipartBoundary (
+		"multipart/byteranges; boundary=3d6b6a416f9b5", boundary));
+	REQUIRE (boundary == "3d6b6a416f9b5");
+
+	REQUIRE (kyla::ParseMultipartBoundary (
+		"Multipart/Byteranges; BOUNDARY=\"AbC\"", boundary));
+	REQUIRE (boundary == "AbC");
+
+	REQUIRE (!kyla::ParseMultipartBoundary ("application/octet-stream", boundary));
+	REQUIRE (!kyla::ParseMultipartBoundary ("multipart/byteranges", boundary));
+}
+
+TEST_CASE ("HttpMultipartParse", "[http]")
+{
+	bool complete = false;
+	const auto parts = ParseInBlocks (MultipartBody, MultipartBody.size (), complete);
+
+	REQUIRE (complete);
+	REQUIRE (parts.size () == 2);
+	REQUIRE (parts.at (10) == "hello");
+	REQUIRE (parts.at (50) == "world!");
+}
+
+TEST_CASE ("HttpMultipartParseSplit", "[http]")
+{
+	// Every possible split of delimiters, headers and bodies
+	for (size_t blockSize = 1; blockSize < 16; ++blockSize) {
+		std::string hello, world;
+		kyla::MultipartByteRangesParser collectingParser{ "THIS_STRING_SEPARATES",
+			[&](const kyla::int64 offset, const kyla::ArrayRef<>& data) -> void {
+				const std::string s (static_cast<const char*> (data.GetData ()),
+					data.GetSize ());
+
+				if (offset >= 10 && offset < 15) {
+					hello += s;
+				} else if (offset >= 50 && offset < 56) {
+					world += s;
+				} else {
+					FAIL ("Unexpected offset");
+				}
+		} };
+
+		for (size_t i = 0; i < MultipartBody.size (); i += blockSize) {
+			const auto block = MultipartBody.substr (i, blockSize);
+			REQUIRE (collectingParser.Feed (kyla::ArrayRef<> (block.data (),
+				static_cast<kyla::int64> (block.size ()))));
+		}
+
+		REQUIRE (collectingParser.IsComplete ());
+		REQUIRE (hello == "hello");
+		REQUIRE (world == "world!");
+	}
+}
+
+TEST_CASE ("HttpMultipartMissingRange", "[http]")
+{
+	const std::string body =
+		"--sep\r\n"
+		"Content-Type: text/plain\r\n"
+		"\r\n"
+		"data\r\n"
+		"--sep--\r\n";
+
+	kyla::MultipartByteRangesParser parser{ "sep",
+		[](const kyla::int64, const kyla::ArrayRef<>&) -> void {} };
+
+	REQUIRE (!parser.Feed (kyla::ArrayRef<> (body.data (),
+		static_cast<kyla::int64> (body.size ()))));
+	REQUIRE (!parser.IsComplete ());
+}
@@ -0,0 +1,106 @@
+#include "MemoryBudget.h"
+
+#include <Catch2/catch.hpp>
+
+#include <thread>
+
+TEST_CASE ("MemoryBudgetReserveRelease", "[memory]")
+{
+	kyla::MemoryBudget budget{ 100 };
+
+	REQUIRE (budget.Reserve (60));
+	REQUIRE (!budget.TryReserve (60));
+	REQUIRE (budget.TryReserve (40));
+
+	budget.Release (60);
+	budget.Release (40);
+
+	REQUIRE (budget.GetUsage () == 0);
+	REQUIRE (budget.GetPeakUsage () == 100);
+}
+
+TEST_CASE ("MemoryBudgetOversizedReservation", "[memory]")
+{
+	kyla::MemoryBudget budget{ 100 };
+
+	// Must not block if nothing else is reserved
+	REQUIRE (budget.Reserve (250));
+	REQUIRE (budget.GetPeakUsage () == 250);
+	budget.Release (250);
+}
+
+TEST_CASE ("MemoryBudgetBlocksUntilReleased", "[memory]")
+{
+	kyla::MemoryBudget budget{ 100 };
+
+	kyla::MemoryReservation first{ budget, 80 };
+	REQUIRE (first.IsValid ());
+
+	std::thread releaseThread{ [&first]() {
+		std::this_thread::sleep_for (std::chrono::milliseconds (10));
+		first.Release ();
+	} };
+
+	kyla::MemoryReservation second{ budget, 80 };
+	releaseThread.join ();
+
+	REQUIRE (second.IsValid ());
+	REQUIRE (budget.GetUsage () == 80);
+	REQUIRE (budget.GetPeakUsage () == 80);
+}
+
+TEST_CASE ("MemoryBudgetCancel", "[memory]")
+{
+	kyla::MemoryBudget budget{ 100 };
+
+	kyla::MemoryReservation first{ budget, 100 };
+
+	std::thread cancelThread{ [&budget]() {
+		std::this_thread::sleep_for (std::chrono::milliseconds (10));
+		budget.Cancel ();
+	} };
+
+	kyla::MemoryReservation second{ budget, 50 };
+	cancelThread.join ();
+
+	REQUIRE (!second.IsValid ());
+}
+
+TEST_CASE ("MemoryReservationSplit", "[memory]")
+{
+	kyla::MemoryBudget budget{ 100 };
+
+	{
+		kyla::MemoryReservation batch{ budget, 100 };
+		auto part = batch.Split (30);
+
+		REQUIRE (part.GetSize () == 30);
+		REQUIRE (batch.GetSize () == 70);
+
+		batch.Release ();
+		REQUIRE (budget.GetUsage () == 30);
+
+		part.Shrink (10);
+		REQUIRE (budget.GetUsage () == 10);
+	}
+
+	REQUIRE (budget.GetUsage () == 0);
+}
+
+TEST_CASE ("MemoryReservationTryCreate", "[memory]")
+{
+	kyla::MemoryBudget budget{ 100 };
+
+	auto first = kyla::MemoryReservation::TryCreate (budget, 80);
+	REQUIRE (first.IsValid ());
+
+	auto second = kyla::MemoryReservation::TryCreate (budget, 40);
+	REQUIRE (!second.IsValid ());
+	REQUIRE (budget.GetUsage () == 80);
+
+	first.Release ();
+
+	second = kyla::MemoryReservation::TryCreate (budget, 40);
+	REQUIRE (second.IsValid ());
+	REQUIRE (budget.GetUsage () == 40);
+}
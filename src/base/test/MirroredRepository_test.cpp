@@ -0,0 +1,212 @@
+#include "MirroredRepository.h"
+#include "TestHelpers.h"
+
+#include <Catch2/catch.hpp>
+
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+namespace {
+struct FakeMirror
+{
+	const std::vector<kyla::byte>* contents = nullptr;
+	bool failing = false;
+	std::atomic<kyla::int64> bytesRead{ 0 };
+};
+
+struct FakePackageFile final : public kyla::PackedRepositoryBase::PackageFile
+{
+	FakePackageFile (FakeMirror& mirror)
+		: mirror_ (mirror)
+	{
+	}
+
+	bool Read (const kyla::int64 offset, const kyla::MutableArrayRef<>& buffer) override
+	{
+		if (mirror_.failing ||
+			offset + buffer.GetSize () > static_cast<kyla::int64> (mirror_.contents->size ())) {
+			return false;
+		}
+
+		::memcpy (buffer.GetData (), mirror_.contents->data () + offset,
+			buffer.GetSize ());
+		mirror_.bytesRead += buffer.GetSize ();
+
+		return true;
+	}
+
+	FakeMirror& mirror_;
+};
+
+std::unique_ptr<kyla::MirroredPackageFile> CreateMirroredFile (
+	std::vector<FakeMirror>& mirrors, kyla::MirrorStatistics& statistics)
+{
+	std::vector<kyla::MirroredPackageFile::OpenCallback> openCallbacks;
+
+	for (auto& mirror : mirrors) {
+		openCallbacks.push_back ([&mirror]() {
+			return std::make_unique<FakePackageFile> (mirror);
+		});
+	}
+
+	return std::make_unique<kyla::MirroredPackageFile> (std::move (openCallbacks),
+		statistics);
+}
+
+using ReadRange = kyla::PackedRepositoryBase::PackageFile::ReadRange;
+using ChunkHash = kyla::PackedRepositoryBase::PackageFile::ChunkHash;
+
+/**
+Read contents in rangeCount ranges. If checkChunks is set, every range
+consists of two chunks with the hashes of contents.
+*/
+bool ReadAll (kyla::MirroredPackageFile& file,
+	const std::vector<kyla::byte>& contents, const int rangeCount,
+	const bool checkChunks = false)
+{
+	const auto rangeSize = static_cast<kyla::int64> (contents.size ()) / rangeCount;
+
+	std::vector<kyla::byte> output (contents.size ());
+	std::vector<std::vector<ChunkHash>> chunkHashes (rangeCount);
+	std::vector<ReadRange> ranges;
+
+	for (int i = 0; i < rangeCount; ++i) {
+		const auto offset = static_cast<kyla::int64> (i * rangeSize);
+
+		if (checkChunks) {
+			const auto chunkSize = rangeSize / 2;
+
+			for (const auto chunkOffset : { offset, offset + chunkSize }) {
+				chunkHashes [i].push_back ({ chunkOffset, chunkSize,
+					kyla::ComputeSHA256 (kyla::ArrayRef<kyla::byte> {
+						contents.data () + chunkOffset, chunkSize }) });
+			}
+		}
+
+		ranges.push_back ({ offset,
+			kyla::MutableArrayRef<> { output.data () + offset, rangeSize },
+			false, chunkHashes [i] });
+	}
+
+	file.ReadRanges (ranges);
+
+	for (const auto& range : ranges) {
+		if (!range.succeeded) {
+			return false;
+		}
+	}
+
+	return output == contents;
+}
+}
+
+TEST_CASE ("MirroredPackageFileUsesAllMirrors", "[mirror]")
+{
+	const auto contents = CreateContents (64 << 10);
+
+	std::vector<FakeMirror> mirrors (2);
+	for (auto& mirror : mirrors) {
+		mirror.contents = &contents;
+	}
+
+	kyla::MirrorStatistics statistics{ 2 };
+	auto file = CreateMirroredFile (mirrors, statistics);
+
+	REQUIRE (ReadAll (*file, contents, 16));
+	REQUIRE (mirrors [0].bytesRead > 0);
+	REQUIRE (mirrors [1].bytesRead > 0);
+	REQUIRE (statistics.GetThroughput (0) > 0);
+	REQUIRE (statistics.GetThroughput (1) > 0);
+}
+
+TEST_CASE ("MirroredPackageFileFavorsFasterMirrors", "[mirror]")
+{
+	const auto contents = CreateContents (64 << 10);
+
+	std::vector<FakeMirror> mirrors (2);
+	for (auto& mirror : mirrors) {
+		mirror.contents = &contents;
+	}
+
+	kyla::MirrorStatistics statistics{ 2 };
+	statistics.RecordTransfer (0, 3 << 20, 1.0);
+	statistics.RecordTransfer (1, 1 << 20, 1.0);
+
+	auto file = CreateMirroredFile (mirrors, statistics);
+
+	REQUIRE (ReadAll (*file, contents, 16));
+	REQUIRE (mirrors [0].bytesRead == 48 << 10);
+	REQUIRE (mirrors [1].bytesRead == 16 << 10);
+}
+
+TEST_CASE ("MirroredPackageFileFailsOver", "[mirror]")
+{
+	const auto contents = CreateContents (64 << 10);
+
+	std::vector<FakeMirror> mirrors (3);
+	for (auto& mirror : mirrors) {
+		mirror.contents = &contents;
+	}
+
+	mirrors [1].failing = true;
+
+	kyla::MirrorStatistics statistics{ 3 };
+	auto file = CreateMirroredFile (mirrors, statistics);
+
+	for (int i = 0; i < kyla::MirrorStatistics::MaxFailures; ++i) {
+		REQUIRE (ReadAll (*file, contents, 16));
+	}
+
+	REQUIRE (mirrors [1].bytesRead == 0);
+	REQUIRE (statistics.GetFailureCount (1) == kyla::MirrorStatistics::MaxFailures);
+
+	// The failing mirror is no longer used
+	const auto bytesRead = mirrors [0].bytesRead + mirrors [2].bytesRead;
+	REQUIRE (ReadAll (*file, contents, 16));
+	REQUIRE (mirrors [0].bytesRead + mirrors [2].bytesRead == bytesRead + (64 << 10));
+	REQUIRE (statistics.GetFailureCount (1) == kyla::MirrorStatistics::MaxFailures);
+}
+
+TEST_CASE ("MirroredPackageFileRejectsBadChunks", "[mirror]")
+{
+	const auto contents = CreateContents (64 << 10);
+	const auto staleContents = CreateContents (64 << 10, 1);
+
+	std::vector<FakeMirror> mirrors (2);
+	mirrors [0].contents = &contents;
+	mirrors [1].contents = &staleContents;
+
+	kyla::MirrorStatistics statistics{ 2 };
+	auto file = CreateMirroredFile (mirrors, statistics);
+
+	// The ranges read from the stale mirror are read again from the other
+	// one, and count as a failure
+	REQUIRE (ReadAll (*file, contents, 16, true));
+	REQUIRE (mirrors [1].bytesRead > 0);
+	REQUIRE (statistics.GetFailureCount (1) == 1);
+	REQUIRE (statistics.GetFailureCount (0) == 0);
+
+	// Without a good mirror, the read fails
+	mirrors [0].contents = &staleContents;
+	REQUIRE (!ReadAll (*file, contents, 16, true));
+}
+
+TEST_CASE ("MirroredPackageFileAllMirrorsFail", "[mirror]")
+{
+	const auto contents = CreateContents (64 << 10);
+
+	std::vector<FakeMirror> mirrors (2);
+	for (auto& mirror : mirrors) {
+		mirror.contents = &contents;
+		mirror.failing = true;
+	}
+
+	kyla::MirrorStatistics statistics{ 2 };
+	auto file = CreateMirroredFile (mirrors, statistics);
+
+	REQUIRE (!ReadAll (*file, contents, 4));
+
+	std::vector<kyla::byte> buffer (16);
+	REQUIRE (!file->Read (0, buffer));
+}
@@ -0,0 +1,143 @@
+#include "sql/Database.h"
+#include "sql/RemoteFile.h"
+
+#include <Catch2/catch.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+namespace {
+/**
+Serves a database image from memory, and counts the reads.
+*/
+class MemoryFile final : public kyla::Sql::RemoteFile
+{
+public:
+	MemoryFile (std::vector<char>&& data, int& readCount)
+		: data_ (std::move (data))
+		, readCount_ (readCount)
+	{
+	}
+
+	kyla::int64 GetSize () override
+	{
+		return static_cast<kyla::int64> (data_.size ());
+	}
+
+	bool Read (const kyla::int64 offset, const kyla::MutableArrayRef<>& buffer) override
+	{
+		++readCount_;
+
+		if (offset + buffer.GetSize () > GetSize ()) {
+			return false;
+		}
+
+		::memcpy (buffer.GetData (), data_.data () + offset, buffer.GetSize ());
+		return true;
+	}
+
+private:
+	std::vector<char> data_;
+	int& readCount_;
+};
+
+std::vector<char> CreateDatabaseImage (const int rowCount)
+{
+	auto db = kyla::Sql::Database::Create ();
+	db.Execute ("CREATE TABLE numbers (Value INTEGER, Name TEXT);");
+
+	{
+		auto transaction = db.BeginTransaction ();
+		auto insert = db.Prepare ("INSERT INTO numbers (Value, Name) VALUES (?, ?)");
+		for (int i = 0; i < rowCount; ++i) {
+			insert.BindArguments (i, std::string (100, 'a' + (i % 26)));
+			insert.Step ();
+			insert.Reset ();
+		}
+		transaction.Commit ();
+	}
+
+	const auto path = kyla::GetTemporaryFilename ();
+	db.SaveCopyTo (path.string ().c_str ());
+
+	std::vector<char> result;
+
+	{
+		std::ifstream input (path, std::ios::binary);
+		result.assign (std::istreambuf_iterator<char> (input),
+			std::istreambuf_iterator<char> ());
+	}
+
+	std::filesystem::remove (path);
+
+	return result;
+}
+}
+
+TEST_CASE ("RemoteDatabaseQuery", "[sql]")
+{
+	const int rowCount = 20000;
+	int readCount = 0;
+
+	auto db = kyla::Sql::Database::OpenRemote (std::make_unique<MemoryFile> (
+		CreateDatabaseImage (rowCount), readCount));
+
+	auto count = db.Prepare ("SELECT COUNT(*), SUM(Value) FROM numbers");
+	REQUIRE (count.Step ());
+	REQUIRE (count.GetInt64 (0) == rowCount);
+	REQUIRE (count.GetInt64 (1) == static_cast<kyla::int64> (rowCount) * (rowCount - 1) / 2);
+
+	// A full table scan reads sequentially, so read-ahead keeps the number
+	// of reads well below one per block
+	REQUIRE (readCount > 0);
+	REQUIRE (readCount < 16);
+}
+
+TEST_CASE ("RemoteDatabaseCopy", "[sql]")
+{
+	int readCount = 0;
+
+	auto remote = kyla::Sql::Database::OpenRemote (std::make_unique<MemoryFile> (
+		CreateDatabaseImage (1000), readCount));
+
+	auto local = kyla::Sql::Database::Create ();
+	local.AttachTemporaryCopy ("source", remote);
+
+	auto count = local.Prepare ("SELECT COUNT(*) FROM source.numbers");
+	REQUIRE (count.Step ());
+	REQUIRE (count.GetInt64 (0) == 1000);
+}
+
+TEST_CASE ("RemoteDatabaseReadOnly", "[sql]")
+{
+	int readCount = 0;
+
+	auto db = kyla::Sql::Database::OpenRemote (std::make_unique<MemoryFile> (
+		CreateDatabaseImage (10), readCount));
+
+	REQUIRE_THROWS (db.Execute ("INSERT INTO numbers (Value, Name) VALUES (1, 'x')"));
+}
+
+TEST_CASE ("RemoteDatabaseTemporaryFiles", "[sql]")
+{
+	int readCount = 0;
+
+	auto db = kyla::Sql::Database::OpenRemote (std::make_unique<MemoryFile> (
+		CreateDatabaseImage (20000), readCount));
+
+	// Force the sorter to spill into temporary files, which go through the
+	// default VFS
+	db.Execute ("PRAGMA temp_store=FILE");
+	db.Execute ("PRAGMA cache_size=16");
+
+	auto sorted = db.Prepare ("SELECT Value FROM numbers ORDER BY Name DESC, Value");
+	REQUIRE (sorted.Step ());
+	REQUIRE (sorted.GetInt64 (0) == 25);
+
+	db.Execute ("CREATE TEMPORARY TABLE copy AS SELECT * FROM numbers");
+
+	auto count = db.Prepare ("SELECT COUNT(*) FROM temp.copy");
+	REQUIRE (count.Step ());
+	REQUIRE (count.GetInt64 (0) == 20000);
+}
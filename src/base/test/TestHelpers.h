@@ -0,0 +1,58 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_TEST_TESTHELPERS_H
+#define KYLA_CORE_TEST_TESTHELPERS_H
+
+#include "FileIO.h"
+#include "Types.h"
+
+#include <string>
+#include <system_error>
+#include <vector>
+
+/**
+Create size bytes of deterministic contents. Different seeds produce
+different contents.
+*/
+inline std::vector<kyla::byte> CreateContents (const size_t size, const int seed = 0)
+{
+	std::vector<kyla::byte> result (size);
+
+	for (size_t i = 0; i < size; ++i) {
+		result [i] = static_cast<kyla::byte> ((i * 31 + seed) & 0xFF);
+	}
+
+	return result;
+}
+
+/**
+Creates an empty directory, which is removed with everything in it once
+this goes out of scope. The suffix is appended to the directory name.
+*/
+struct TemporaryDirectory
+{
+	TemporaryDirectory (const std::string& suffix = std::string ())
+		: path (kyla::GetTemporaryFilename ().string () + suffix)
+	{
+		std::filesystem::create_directories (path);
+	}
+
+	~TemporaryDirectory ()
+	{
+		std::error_code error;
+		std::filesystem::remove_all (path, error);
+	}
+
+	TemporaryDirectory (const TemporaryDirectory&) = delete;
+	TemporaryDirectory& operator= (const TemporaryDirectory&) = delete;
+
+	kyla::Path path;
+};
+#endif
@@ -25,6 +25,8 @@ struct KylaBuildStatistics
 	double compressionTimeSeconds;
 	double hashTimeSeconds;
 	double encryptionTimeSeconds;
+
+	int64_t peakMemoryUsage;
 };
 
 struct KylaBuildSettings
@@ -37,6 +39,13 @@ struct KylaBuildSettings
 	KylaProgressCallback progressCallback;
 
 	KylaBuildStatistics* buildStatistics;
+
+	/**
+	Memory budget for all buffers used during the build, in bytes. If zero,
+	the default budget is used. The chunk size doesn't depend on the budget,
+	so builds of the same input produce the same packages.
+	*/
+	int64_t memoryLimit;
 };
 
 KYLA_EXPORT int kylaBuildRepository (
@@ -39,6 +39,7 @@ details.
 #include "Exception.h"
 
 #include "Compression.h"
+#include "MemoryBudget.h"
 
 #include <chrono>
 
@@ -84,6 +85,10 @@ public:
 		"INSERT INTO fs_chunk_hashes "
 		"(ChunkId, Hash) "
 		"VALUES (?, ?)"))
+		, chunkSourceHashesInsertQuery_ (db.Prepare (
+		"INSERT INTO fs_chunk_source_hashes "
+		"(ChunkId, Hash) "
+		"VALUES (?, ?)"))
 		, chunkCompressionInsertQuery_ (db.Prepare (
 		"INSERT INTO fs_chunk_compression "
 		"(ChunkId, Algorithm, InputSize, OutputSize) "
@@ -181,6 +186,15 @@ public:
 		return db_.GetLastRowId ();
 	}
 
+	int64 StoreChunkSourceHash (int64 chunkId, const SHA256Digest& hash)
+	{
+		chunkSourceHashesInsertQuery_.BindArguments (chunkId, hash);
+		chunkSourceHashesInsertQuery_.Step ();
+		chunkSourceHashesInsertQuery_.Reset ();
+
+		return db_.GetLastRowId ();
+	}
+
 	int64 StoreChunkCompression (int64 chunkId, CompressionAlgorithm algorithm, int64 inputSize, int64 outputSize)
 	{
 		chunkCompressionInsertQuery_.BindArguments (chunkId, IdFromCompressionAlgorithm (algorithm), inputSize, outputSize);
@@ -209,6 +223,7 @@ private:
 	Sql::Statement featureDependencyInsertStatement_;
 	Sql::Statement chunkInsertQuery_;
 	Sql::Statement chunkHashesInsertQuery_;
+	Sql::Statement chunkSourceHashesInsertQuery_;
 	Sql::Statement chunkCompressionInsertQuery_;
 	Sql::Statement chunkEncryptionInsertQuery_;
 };
@@ -221,6 +236,8 @@ struct BuildContext
 
 	BuildDatabase buildDatabase;
 	BuildStatistics statistics;
+
+	MemoryBudget& memoryBudget;
 };
 
 struct Reference
@@ -848,7 +865,8 @@ public:
 		const Package& package,
 		const Path& packagePath,
 		const std::string& encryptionKey,
-		BuildStatistics& statistics)
+		BuildStatistics& statistics,
+		MemoryBudget& memoryBudget)
 	{
 		///@TODO(minor) Support splitting packages for media limits
 		auto packageFile = CreateFile (packagePath / (package.name));
@@ -866,6 +884,15 @@ public:
 			encryptionContext = EVP_CIPHER_CTX_new ();
 		}
 
+		// We need one buffer for the input, one for the compressed data, and
+		// the encryption swaps those two. The chunk size is part of the
+		// repository layout, so it never depends on the budget. Chunks are
+		// processed one at a time, and the reservation waits until the budget
+		// can hold the buffers of one chunk, or nothing else is reserved
+		const auto chunkSize = chunkSize_;
+		MemoryReservation reservation{ memoryBudget,
+			chunkSize + compressor->GetCompressionBound (chunkSize) + 32 };
+
 		std::vector<byte> readBuffer, writeBuffer;
 
 		for (const auto& content : package.GetUniqueContents ()) {
@@ -875,7 +902,7 @@ public:
 			auto inputFile = OpenFile (content->sourceFile, FileAccess::Read);
 			const auto inputFileSize = inputFile->GetSize ();
 
-			assert (inputFileSize == content->size);
+			assert (inputFileSize == static_cast<int64> (content->size));
 
 			if (inputFileSize == 0) {
 				// If it's a null-byte file, we still store a storage mapping
@@ -889,13 +916,15 @@ public:
 					0 /* = uncompressed size */);
 			} else {
 				readBuffer.resize (std::min (
-					chunkSize_, inputFileSize));
+					chunkSize, inputFileSize));
 
 				int64 bytesRead = -1;
 				int64 readOffset = 0;
 				while ((bytesRead = inputFile->Read (readBuffer)) > 0) {
 					readBuffer.resize (bytesRead);
 
+					const auto sourceChunkHash = ComputeSHA256 (readBuffer);
+
 					TransformationResult compressionResult;
 					compressionResult = TransformCompress (readBuffer,
 						writeBuffer, compressor.get ());
@@ -936,6 +965,10 @@ public:
 						storageMappingId, compressedChunkHash
 					);
 
+					db.StoreChunkSourceHash (
+						storageMappingId, sourceChunkHash
+					);
+
 					// Store the compression data if not uncompressed
 					if (package.GetCompressionAlgorithm () != CompressionAlgorithm::Uncompressed) {
 						db.StoreChunkCompression (
@@ -994,7 +1027,7 @@ public:
 
 		for (auto& package : packages_) {
 			WritePackage (ctx.buildDatabase, *package, ctx.targetDirectory, 
-				encryptionKey_, ctx.statistics);
+				encryptionKey_, ctx.statistics, ctx.memoryBudget);
 		}
 	}
 
@@ -1081,13 +1114,16 @@ private:
 
 	void CreateFileContents (BuildContext& ctx)
 	{
-		static const int BufferSize = 16 << 20; /* 16 MiB */
-		std::unique_ptr<byte[]> buffer{ new byte[BufferSize] };
+		static const int64 MaxBufferSize = 16 << 20; /* 16 MiB */
+		const auto bufferSize = std::min (MaxBufferSize,
+			ctx.memoryBudget.GetLimit ());
+		MemoryReservation reservation{ ctx.memoryBudget, bufferSize };
+		std::unique_ptr<byte[]> buffer{ new byte[bufferSize] };
 
 		for (auto& file : files_) {
 			const auto filePath = file->source.is_absolute () ? file->source : ctx.sourceDirectory / file->source;
 			const auto hash = ComputeSHA256 (filePath,
-				MutableArrayRef<byte> {buffer.get (), BufferSize});
+				MutableArrayRef<byte> {buffer.get (), bufferSize});
 
 			auto it = fileContentMap_.find (hash);
 			if (it == fileContentMap_.end ()) {
@@ -1248,11 +1284,16 @@ void BuildRepository (const KylaBuildSettings* settings)
 			KYLA_FILE_LINE);
 	}
 
+	MemoryBudget memoryBudget{ settings->memoryLimit > 0
+		? settings->memoryLimit : MemoryBudget::DefaultLimit };
+
 	Repository repository;
 	std::unique_ptr<BuildContext> ctx (new BuildContext {
 		settings->sourceDirectory,
 		settings->targetDirectory,
-		db
+		db,
+		{},
+		memoryBudget
 	});
 	repository.CreateFeatures (doc, *ctx);
 
@@ -1279,6 +1320,8 @@ void BuildRepository (const KylaBuildSettings* settings)
 		settings->buildStatistics->encryptionTimeSeconds =
 			static_cast<double> (ctx->statistics.encryptionTime.count ())
 			/ 1000000000.0;
+		settings->buildStatistics->peakMemoryUsage =
+			memoryBudget.GetPeakUsage ();
 	}
 
 	ctx.reset ();
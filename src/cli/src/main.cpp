@@ -18,6 +18,7 @@ details.
 
 #include <chrono>
 #include <iomanip>
+#include <sstream>
 
 #include <cassert>
 
@@ -80,8 +81,151 @@ void StdoutProgress (const KylaProgress* progress, void* context)
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/**
+Installer variables which can be set from the command line.
+*/
+struct InstallerVariables
+{
+	std::string key;
+	int64_t memoryLimit = 0;
+	std::string deliveryOrder;
+	// Comma-separated list of feature ids
+	std::string priorityFeatures;
+	int samplePercentage = 0;
+	std::string cachePath;
+	int64_t cacheMaxSize = 0;
+	// Deployed repositories separated by '|'
+	std::string localRepositories;
+	bool hardLinks = false;
+	bool quickVerify = false;
+	int quickVerifySamplePercentage = 0;
+	bool stage = false;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+void SetInstallerVariables (KylaInstaller* installer,
+	const InstallerVariables& variables)
+{
+	if (! variables.key.empty ()) {
+		installer->SetVariable (
+			installer, "Encryption.Key",
+			variables.key.size () + 1,
+			variables.key.c_str ()
+		);
+	}
+
+	if (variables.memoryLimit > 0) {
+		installer->SetVariable (
+			installer, "Memory.Limit",
+			sizeof (variables.memoryLimit),
+			&variables.memoryLimit
+		);
+	}
+
+	if (! variables.deliveryOrder.empty ()) {
+		installer->SetVariable (
+			installer, "Delivery.Order",
+			variables.deliveryOrder.size () + 1,
+			variables.deliveryOrder.c_str ()
+		);
+	}
+
+	if (variables.samplePercentage > 0) {
+		installer->SetVariable (
+			installer, "Scrub.SamplePercentage",
+			sizeof (variables.samplePercentage),
+			&variables.samplePercentage
+		);
+	}
+
+	if (! variables.cachePath.empty ()) {
+		installer->SetVariable (
+			installer, "Cache.Path",
+			variables.cachePath.size () + 1,
+			variables.cachePath.c_str ()
+		);
+	}
+
+	if (variables.cacheMaxSize > 0) {
+		installer->SetVariable (
+			installer, "Cache.MaxSize",
+			sizeof (variables.cacheMaxSize),
+			&variables.cacheMaxSize
+		);
+	}
+
+	if (! variables.localRepositories.empty ()) {
+		installer->SetVariable (
+			installer, "Source.LocalRepositories",
+			variables.localRepositories.size () + 1,
+			variables.localRepositories.c_str ()
+		);
+	}
+
+	if (variables.hardLinks) {
+		const int hardLinks = 1;
+		installer->SetVariable (
+			installer, "Deploy.HardLinks",
+			sizeof (hardLinks),
+			&hardLinks
+		);
+	}
+
+	if (variables.quickVerify) {
+		installer->SetVariable (
+			installer, "Verify.Mode",
+			sizeof ("quick"),
+			"quick"
+		);
+	}
+
+	if (variables.quickVerifySamplePercentage > 0) {
+		installer->SetVariable (
+			installer, "Verify.SamplePercentage",
+			sizeof (variables.quickVerifySamplePercentage),
+			&variables.quickVerifySamplePercentage
+		);
+	}
+
+	if (variables.stage) {
+		installer->SetVariable (
+			installer, "Configure.Mode",
+			sizeof ("stage"),
+			"stage"
+		);
+	}
+
+	if (! variables.priorityFeatures.empty ()) {
+		std::vector<KylaUuid> featureIds;
+
+		std::stringstream stream{ variables.priorityFeatures };
+		std::string featureId;
+		while (std::getline (stream, featureId, ',')) {
+			const auto uuid = kyla::Uuid::Parse (featureId);
+
+			KylaUuid id;
+			::memcpy (id.bytes, uuid.GetData (), sizeof (id.bytes));
+			featureIds.push_back (id);
+		}
+
+		installer->SetVariable (
+			installer, "Delivery.FeaturePriority",
+			featureIds.size () * sizeof (KylaUuid),
+			featureIds.data ()
+		);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void StdoutFileDeployed (const KylaFileDeployed* file, void*)
+{
+	std::cout << "DEPLOYED " << file->path << "\n";
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 int Build (const bool showStatistics,
+	const int64_t memoryLimit,
 	const std::string& sourceDirectory,
 	const std::string& input,
 	const std::string& targetDirectory)
@@ -92,6 +236,7 @@ int Build (const bool showStatistics,
 	buildSettings.descriptorFile = input.c_str ();
 	buildSettings.sourceDirectory = sourceDirectory.c_str ();
 	buildSettings.targetDirectory = targetDirectory.c_str ();
+	buildSettings.memoryLimit = memoryLimit;
 
 	if (showStatistics) {
 		buildSettings.buildStatistics = &statistics;
@@ -106,6 +251,7 @@ int Build (const bool showStatistics,
 		std::cout << "Compression time:  " << statistics.compressionTimeSeconds << " (sec)" << std::endl;
 		std::cout << "Encryption time:   " << statistics.encryptionTimeSeconds << " (sec)" << std::endl;
 		std::cout << "Hash time:         " << statistics.hashTimeSeconds << " (sec)" << std::endl;
+		std::cout << "Peak memory:       " << (statistics.peakMemoryUsage >> 20) << " (MiB)" << std::endl;
 	}
 
 	return result;
@@ -115,7 +261,7 @@ int Build (const bool showStatistics,
 int Validate (const bool verbose,
 	const bool showSummary,
 	const bool log,
-	const std::string& key,
+	const InstallerVariables& variables,
 	const std::string& source,
 	const std::string& target)
 {
@@ -182,13 +328,7 @@ int Validate (const bool verbose,
 	KYLA_CHECKED_CALL (installer->OpenTargetRepository (installer,
 		target.c_str (), 0, &targetRepository));
 
-	if (! key.empty() ) {
-		installer->SetVariable (
-			installer, "Encryption.Key",
-			key.size () + 1,
-			key.c_str ()
-		);
-	}
+	SetInstallerVariables (installer, variables);
 
 	KYLA_CHECKED_CALL (installer->Execute (installer, kylaAction_Verify, 
 		targetRepository, sourceRepository, nullptr));
@@ -206,6 +346,7 @@ int Validate (const bool verbose,
 
 ///////////////////////////////////////////////////////////////////////////////
 int Repair (const bool showLog,
+	const InstallerVariables& variables,
 	const std::string& sourcePath,
 	const std::string& targetPath)
 {
@@ -226,6 +367,8 @@ int Repair (const bool showLog,
 	KYLA_CHECKED_CALL (installer->OpenTargetRepository (installer, 
 		targetPath.c_str (), 0, &target));
 
+	SetInstallerVariables (installer, variables);
+
 	const auto result = installer->Execute (installer, kylaAction_Repair, target, source,
 		nullptr);
 
@@ -338,7 +481,8 @@ int QueryFeature (const bool showLog,
 int ConfigureOrInstall (
 	const bool showLog,
 	const bool showProgress,
-	const std::string& key,
+	const bool showDeployed,
+	const InstallerVariables& variables,
 	const std::string& sourcePath,
 	const std::string& targetPath,
 	const std::string& cmd,
@@ -357,17 +501,15 @@ int ConfigureOrInstall (
 		installer->SetProgressCallback (installer, StdoutProgress, nullptr);
 	}
 
+	if (showDeployed) {
+		installer->SetFileDeployedCallback (installer, StdoutFileDeployed, nullptr);
+	}
+
 	KylaSourceRepository sourceRepository;
 	KYLA_CHECKED_CALL (installer->OpenSourceRepository (installer, 
 		sourcePath.c_str (), 0, &sourceRepository));
 
-	if (! key.empty()) {
-		installer->SetVariable (
-			installer, "Encryption.Key",
-			key.size () + 1,
-			key.c_str ()
-		);
-	}
+	SetInstallerVariables (installer, variables);
 
 	KylaTargetRepository targetRepository;
 	KYLA_CHECKED_CALL (installer->OpenTargetRepository (installer, 
@@ -419,6 +561,9 @@ int main (int argc, char* argv [])
 	bool verbose = false;
 	app.add_flag ("-v,--verbose", verbose, "Show verbose output");
 
+	int64_t memoryLimitMiB = 0;
+	app.add_option ("-m,--memory-limit", memoryLimitMiB, "Memory budget in MiB");
+
 	auto buildCmd = app.add_subcommand ("build");
 	bool showStatistics = false;
 	buildCmd->add_flag ("-s,--statistics", showStatistics, "Show statistics");
@@ -427,29 +572,52 @@ int main (int argc, char* argv [])
 	buildCmd->add_option ("INPUT", input, "Input file")->check (CLI::ExistingFile);
 	buildCmd->add_option ("TARGET_DIRECTORY", targetDirectory, "Target directory");
 	buildCmd->callback ([&] () -> void {
-		exit (Build (showStatistics, sourceDirectory, input, targetDirectory));
+		exit (Build (showStatistics, memoryLimitMiB << 20,
+			sourceDirectory, input, targetDirectory));
 	});
 
-	std::string key;
+	InstallerVariables variables;
 	std::string sourcePath, targetPath;
 
+	int64_t cacheMaxSizeMiB = 0;
+
 	auto validateCmd = app.add_subcommand ("validate");
 	bool showSummary = false;
 	validateCmd->add_flag ("-s,--summary", showSummary, "Show summary");
-	validateCmd->add_option ("-k,--key", key, "Encryption key");
+	validateCmd->add_option ("-k,--key", variables.key, "Encryption key");
+	validateCmd->add_option ("--sample", variables.samplePercentage,
+		"Percentage of chunks to check in a packed repository");
+	validateCmd->add_flag ("--quick", variables.quickVerify,
+		"Only hash deployed files which changed since they were deployed");
+	validateCmd->add_option ("--quick-sample", variables.quickVerifySamplePercentage,
+		"Percentage of unchanged files to hash anyway with --quick");
 	validateCmd->add_option ("SOURCE_REPOSITORY", sourcePath, "Source repository path");
 	validateCmd->add_option ("TARGET_REPOSITORY", targetPath, "Target repository path");
 
 	validateCmd->callback ([&] () -> void {
-		exit (Validate (verbose, showSummary, log, key, sourcePath, targetPath));
+		variables.memoryLimit = memoryLimitMiB << 20;
+		exit (Validate (verbose, showSummary, log, variables, sourcePath, targetPath));
 	});
 
 	auto repairCmd = app.add_subcommand ("repair");
+	repairCmd->add_option ("-k,--key", variables.key, "Encryption key");
+	repairCmd->add_option ("--cache", variables.cachePath,
+		"Chunk cache directory for web repositories");
+	repairCmd->add_option ("--cache-size", cacheMaxSizeMiB,
+		"Maximum size of the chunk cache in MiB");
+	repairCmd->add_option ("--local-repositories", variables.localRepositories,
+		"Deployed repositories to read existing content from, separated by '|'");
+	repairCmd->add_flag ("--quick", variables.quickVerify,
+		"Only hash deployed files which changed since they were deployed");
+	repairCmd->add_option ("--quick-sample", variables.quickVerifySamplePercentage,
+		"Percentage of unchanged files to hash anyway with --quick");
 	repairCmd->add_option ("SOURCE_REPOSITORY", sourcePath, "Source repository path");
 	repairCmd->add_option ("TARGET_REPOSITORY", targetPath, "Target repository path");
 
 	repairCmd->callback ([&]() -> void {
-		exit (Repair (log, sourcePath, targetPath));
+		variables.memoryLimit = memoryLimitMiB << 20;
+		variables.cacheMaxSize = cacheMaxSizeMiB << 20;
+		exit (Repair (log, variables, sourcePath, targetPath));
 	});
 
 	auto queryRepositoryCmd = app.add_subcommand ("query-repository");
@@ -475,25 +643,60 @@ int main (int argc, char* argv [])
 
 	auto installCmd = app.add_subcommand ("install");
 	std::vector<std::string> features;
-
-	installCmd->add_option ("-k,--key", key, "Encryption key");
+	bool showDeployed = false;
+
+	installCmd->add_option ("-k,--key", variables.key, "Encryption key");
+	installCmd->add_option ("--delivery-order", variables.deliveryOrder,
+		"Delivery order, either 'storage' or 'size'");
+	installCmd->add_option ("--priority-features", variables.priorityFeatures,
+		"Comma-separated list of features to deliver first");
+	installCmd->add_flag ("--show-deployed", showDeployed,
+		"Print every file once it has been deployed");
+	installCmd->add_option ("--cache", variables.cachePath,
+		"Chunk cache directory for web repositories");
+	installCmd->add_option ("--cache-size", cacheMaxSizeMiB,
+		"Maximum size of the chunk cache in MiB");
+	installCmd->add_option ("--local-repositories", variables.localRepositories,
+		"Deployed repositories to read existing content from, separated by '|'");
+	installCmd->add_flag ("--hard-links", variables.hardLinks,
+		"Hard link files with the same content instead of copying them");
 	installCmd->add_option ("SOURCE_REPOSITORY", sourcePath, "Source repository path");
 	installCmd->add_option ("TARGET_REPOSITORY", targetPath, "Target repository path");
 	installCmd->add_option ("FEATURES", features, "The features to install");
 	
 	installCmd->callback ([&]() -> void {
-		exit (ConfigureOrInstall (log, progress, key, sourcePath, targetPath, "install", features));
+		variables.memoryLimit = memoryLimitMiB << 20;
+		variables.cacheMaxSize = cacheMaxSizeMiB << 20;
+		exit (ConfigureOrInstall (log, progress, showDeployed, variables, sourcePath, targetPath, "install", features));
 		});
 
 	auto configureCmd = app.add_subcommand ("configure");
 
-	configureCmd->add_option ("-k,--key", key, "Encryption key");
+	configureCmd->add_option ("-k,--key", variables.key, "Encryption key");
+	configureCmd->add_option ("--delivery-order", variables.deliveryOrder,
+		"Delivery order, either 'storage' or 'size'");
+	configureCmd->add_option ("--priority-features", variables.priorityFeatures,
+		"Comma-separated list of features to deliver first");
+	configureCmd->add_flag ("--show-deployed", showDeployed,
+		"Print every file once it has been deployed");
+	configureCmd->add_option ("--cache", variables.cachePath,
+		"Chunk cache directory for web repositories");
+	configureCmd->add_option ("--cache-size", cacheMaxSizeMiB,
+		"Maximum size of the chunk cache in MiB");
+	configureCmd->add_option ("--local-repositories", variables.localRepositories,
+		"Deployed repositories to read existing content from, separated by '|'");
+	configureCmd->add_flag ("--hard-links", variables.hardLinks,
+		"Hard link files with the same content instead of copying them");
+	configureCmd->add_flag ("--stage", variables.stage,
+		"Only fetch the content into staging files, the next configure applies it");
 	configureCmd->add_option ("SOURCE_REPOSITORY", sourcePath, "Source repository path");
 	configureCmd->add_option ("TARGET_REPOSITORY", targetPath, "Target repository path");
 	configureCmd->add_option ("FEATURES", features, "The features to configure");
 
 	configureCmd->callback ([&]() -> void {
-		exit (ConfigureOrInstall (log, progress, key, sourcePath, targetPath, "configure", features));
+		variables.memoryLimit = memoryLimitMiB << 20;
+		variables.cacheMaxSize = cacheMaxSizeMiB << 20;
+		exit (ConfigureOrInstall (log, progress, showDeployed, variables, sourcePath, targetPath, "configure", features));
 		});
 
 	try {
@@ -96,6 +96,21 @@ struct KylaValidation
 typedef void (*KylaValidationCallback)(const struct KylaValidation* validation,
 	void* context);
 
+/**
+@since 3.0
+*/
+struct KylaFileDeployed
+{
+	/**
+	The path of the file, relative to the target repository.
+	*/
+	const char* path;
+	int64_t size;
+};
+
+typedef void (*KylaFileDeployedCallback)(const struct KylaFileDeployed* file,
+	void* context);
+
 typedef struct KylaRepositoryImpl* KylaSourceRepository;
 typedef struct KylaRepositoryImpl* KylaTargetRepository;
 typedef struct KylaRepositoryImpl* KylaRepository;
@@ -166,7 +181,159 @@ enum kylaInstallerVariable
 
 	@since 3.0
 	*/
-	kylaInstallerVariable_DecryptionKey
+	kylaInstallerVariable_DecryptionKey,
+
+	/**
+	The memory budget for all buffers used during an action, in bytes. The
+	variable name is "Memory.Limit", and the value must be an int64_t.
+
+	Reading, decompressing and writing data reserves against this budget, so
+	an action will slow down instead of using more memory. The default is
+	160 MiB.
+
+	@since 3.0
+	*/
+	kylaInstallerVariable_MemoryLimit,
+
+	/**
+	The peak memory usage of the last action, in bytes. The variable name is
+	"Memory.PeakUsage", and the value is an int64_t.
+
+	@since 3.0
+	*/
+	kylaInstallerVariable_PeakMemoryUsage,
+
+	/**
+	The order in which content is delivered during an installation. The
+	variable name is "Delivery.Order", and the value must be a null-terminated
+	string.
+
+	"storage" delivers content in the order it is stored in the source, which
+	results in the fewest reads and is the default. "size" delivers small
+	files first.
+
+	@since 3.0
+	*/
+	kylaInstallerVariable_DeliveryOrder,
+
+	/**
+	Features whose content should be delivered first. The variable name is
+	"Delivery.FeaturePriority", and the value is a tightly packed array of
+	KylaUuids, the most important feature first.
+
+	Use this to deliver required features before optional ones. Content which
+	doesn't belong to any listed feature is delivered last. This is combined
+	with kylaInstallerVariable_DeliveryOrder, which is used to order content
+	with the same feature priority.
+
+	@since 3.0
+	*/
+	kylaInstallerVariable_DeliveryFeaturePriority,
+
+	/**
+	The percentage of chunks to check when validating a packed repository.
+	The variable name is "Scrub.SamplePercentage", and the value must be an
+	int between 1 and 100.
+
+	Chunks are picked at random, so a low percentage can be used for quick
+	health checks of large repositories. The default is 100, which checks
+	every chunk.
+
+	@since 3.0
+	*/
+	kylaInstallerVariable_ScrubSamplePercentage,
+
+	/**
+	The directory of the chunk cache for web repositories. The variable name
+	is "Cache.Path", and the value must be a null-terminated UTF-8 string.
+
+	Chunks fetched from a web repository are stored in this directory, and
+	later installations and repairs read them from there instead of
+	downloading them again. Several processes can share a cache directory.
+	Encrypted chunks are never cached. If the variable is not set, no cache
+	is used.
+
+	@since 3.0
+	*/
+	kylaInstallerVariable_CachePath,
+
+	/**
+	The maximum size of the chunk cache in bytes. The variable name is
+	"Cache.MaxSize", and the value must be an int64_t. Once the cache grows
+	larger, the least recently used chunks are evicted. The default is 4 GiB.
+
+	@since 3.0
+	*/
+	kylaInstallerVariable_CacheMaxSize,
+
+	/**
+	Deployed repositories on this machine to read existing content from. The
+	variable name is "Source.LocalRepositories", and the value must be a
+	null-terminated UTF-8 string with the repository paths separated by '|'.
+
+	Content objects which are present in one of these repositories are read
+	from there instead of the source repository, which is useful if an older
+	version or a sibling product is already installed. Local files are
+	checked against their hash before they are used. Repositories which can't
+	be opened are skipped.
+
+	@since 3.0
+	*/
+	kylaInstallerVariable_LocalRepositories,
+
+	/**
+	Hard link files with the same content instead of copying them. The
+	variable name is "Deploy.HardLinks", and the value must be an int, where
+	any non-zero value enables hard links.
+
+	Linked files share their contents, so modifying one of them modifies all.
+	Only use this for deployments which are never modified in place. Where
+	hard links are not possible, files are copied. Copies share their data
+	with the original on file systems which support it, so this is often
+	not needed to save space.
+
+	@since 3.0
+	*/
+	kylaInstallerVariable_DeployHardLinks,
+
+	/**
+	How files are checked when validating or repairing a deployed
+	repository. The variable name is "Verify.Mode", and the value must be a
+	null-terminated string, either "full" or "quick".
+
+	"full" hashes every file, and is the default. "quick" only hashes files
+	whose size, modification time, change time or inode differ from the
+	values recorded when the file was deployed. Changes which preserve all
+	of these are not detected, see kylaInstallerVariable_VerifySamplePercentage.
+
+	@since 3.0
+	*/
+	kylaInstallerVariable_VerifyMode,
+
+	/**
+	The percentage of unchanged files to hash anyway in the "quick" verify
+	mode. The variable name is "Verify.SamplePercentage", and the value must
+	be an int between 0 and 100. Files are picked at random. The default is
+	0.
+
+	@since 3.0
+	*/
+	kylaInstallerVariable_VerifySamplePercentage,
+
+	/**
+	What a configure does. The variable name is "Configure.Mode", and the
+	value must be a null-terminated string, either "full" or "stage".
+
+	"full" updates the deployed repository, and is the default. "stage" only
+	fetches the content which is missing into staging files next to the
+	deployed repository, and leaves the deployed files and features alone.
+	The next "full" configure to the same features then uses the staged
+	content without fetching or hashing it again, so it only has to move
+	files into place and update the database.
+
+	@since 3.0
+	*/
+	kylaInstallerVariable_ConfigureMode
 };
 
 enum kylaFeatureProperty
@@ -243,6 +410,13 @@ struct KylaInstaller
 	combination of kylaRepositoryOption.
 
 	If the path starts with "http", the repository is opened via HTTP.
+
+	A repository which is available from several mirrors can be opened by
+	passing all locations separated by '|'. The mirrors must contain identical
+	packed or web repositories, otherwise opening the repository fails.
+	Content is read from all of them at once, and if a mirror fails or serves
+	data which doesn't match its hash, its requests are sent to the remaining
+	ones.
 	*/
 	int (*OpenSourceRepository)(KylaInstaller* installer, const char* path,
 		int options, KylaSourceRepository* repository);
@@ -339,6 +513,29 @@ struct KylaInstaller
 	int (*Execute)(KylaInstaller* installer, kylaAction action,
 		KylaTargetRepository target, KylaSourceRepository source,
 		const KylaDesiredState* desiredState);
+
+	/**
+	Set the file deployed callback. The callbackContext will be passed on into
+	the callback function.
+
+	The callback is invoked once a file has been completely written to its
+	final location during kylaAction_Install or kylaAction_Configure, so a
+	launcher can start as soon as the files it needs are present. It is
+	called once the file has been recorded in the target repository. Files
+	whose contents are fetched from the source are reported in the order
+	the contents are delivered.
+
+	The callback may be called from an internal thread instead of the one
+	which called Execute, for instance while reading from a packed or web
+	repository, but never concurrently. It must return quickly, as the
+	installation waits for it.
+
+	Setting a null callback disables it.
+
+	@since 3.0
+	*/
+	int (*SetFileDeployedCallback)(KylaInstaller* installer,
+		KylaFileDeployedCallback fileDeployedCallback, void* callbackContext);
 };
 
 #define KYLA_MAKE_API_VERSION(major,minor,patch) (major << 22 | minor << 12 | patch)
@@ -11,6 +11,7 @@ details.
 
 #include "Exception.h"
 
+#include "CompositeRepository.h"
 #include "Repository.h"
 
 #include "Log.h"
@@ -95,6 +96,9 @@ struct KylaInstaller_3_0
 	int (*Execute)(KylaInstaller* installer, kylaAction action,
 		KylaTargetRepository target, KylaSourceRepository source,
 		const KylaDesiredState* desiredState);
+
+	int (*SetFileDeployedCallback)(KylaInstaller* installer,
+		KylaFileDeployedCallback fileDeployedCallback, void* callbackContext);
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -324,9 +328,18 @@ int kylaExecute_2_0 (
 		}
 	}
 
+	auto& memoryBudget = internal->executionContext.GetMemoryBudget ();
+	memoryBudget.Reset ();
+
+	// Content which is already deployed elsewhere on this machine is read
+	// from there instead of the source
+	auto compositeSource = kyla::CreateCompositeRepository (
+		*sourceRepository->p, internal->executionContext);
+	auto& source = compositeSource ? *compositeSource : *sourceRepository->p;
+
 	switch (action) {
 	case kylaAction_Install:
-		targetRepository->p = kyla::DeployRepository (*sourceRepository->p,
+		targetRepository->p = kyla::DeployRepository (source,
 			targetRepository->path.string ().c_str (), featureIds,
 			internal->executionContext);
 		break;
@@ -338,7 +351,7 @@ int kylaExecute_2_0 (
 			return kylaResult_Error;
 		}
 		targetRepository->p->Configure (
-			*sourceRepository->p, featureIds, internal->executionContext);
+			source, featureIds, internal->executionContext);
 
 		break;
 
@@ -350,7 +363,7 @@ int kylaExecute_2_0 (
 		}
 
 		///@TODO(minor) Pass through the feature ids
-		targetRepository->p->Repair (*sourceRepository->p, internal->executionContext,
+		targetRepository->p->Repair (source, internal->executionContext,
 			[](const char* path, const kyla::RepairResult) -> void {},
 			true);
 
@@ -363,7 +376,7 @@ int kylaExecute_2_0 (
 
 		///@TODO(minor) Pass through the feature ids
 		targetRepository->p->Repair (
-			*sourceRepository->p, internal->executionContext,
+			source, internal->executionContext,
 			[&](const char* path, const kyla::RepairResult result) -> void {
 				const KylaValidationInfoFile info = { path };
 
@@ -387,6 +400,14 @@ int kylaExecute_2_0 (
 		return kylaResult_ErrorInvalidArgument;
 	}
 
+	const kyla::int64 peakMemoryUsage = memoryBudget.GetPeakUsage ();
+	internal->executionContext.variables [
+		kyla::Repository::ExecutionContext::PeakMemoryUsage].Set (
+			sizeof (peakMemoryUsage), &peakMemoryUsage);
+	internal->log->Info ("kylaExecute",
+		fmt::format ("Peak memory usage: {0:.1f} MiB of {1:.1f} MiB budget",
+			peakMemoryUsage / 1048576.0, memoryBudget.GetLimit () / 1048576.0));
+
 	return kylaResult_Ok;
 
 	KYLA_C_API_END ()
@@ -455,7 +476,7 @@ int KylaGet (const std::string& value,
 	size_t* pResultSize, void* pResult,
 	kyla::Log& log, const char* logSource)
 {
-	const auto resultSize = static_cast<int> (value.size ()) + 1;
+	const auto resultSize = value.size () + 1;
 
 	if (pResultSize && !pResult) {
 		*pResultSize = resultSize;
@@ -793,6 +814,37 @@ int kylaSetValidationCallback_2_0 (KylaInstaller* installer,
 
 	KYLA_C_API_END ()
 };
+
+///////////////////////////////////////////////////////////////////////////////
+int kylaSetFileDeployedCallback_3_0 (KylaInstaller* installer,
+	KylaFileDeployedCallback fileDeployedCallback, void* callbackContext)
+{
+	KYLA_C_API_BEGIN ()
+
+	if (installer == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	auto internal = GetInternalInstaller (installer);
+
+	if (fileDeployedCallback == nullptr) {
+		internal->executionContext.fileDeployed = nullptr;
+		return kylaResult_Ok;
+	}
+
+	internal->executionContext.fileDeployed = [=](
+		const char* path, const kyla::int64 size) -> void {
+		KylaFileDeployed file;
+		file.path = path;
+		file.size = size;
+
+		fileDeployedCallback (&file, callbackContext);
+	};
+
+	return kylaResult_Ok;
+
+	KYLA_C_API_END ()
+}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -835,6 +887,7 @@ int kylaCreateInstaller (int kylaApiVersion, KylaInstaller** pInstaller)
 		installer->SetValidationCallback = kylaSetValidationCallback_2_0;
 		installer->SetVariable = kylaSetVariable_3_0;
 		installer->GetVariable = kylaGetVariable_3_0;
+		installer->SetFileDeployedCallback = kylaSetFileDeployedCallback_3_0;
 
 		*reinterpret_cast<void**>(pInstaller) = installer;
 
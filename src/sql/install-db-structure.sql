@@ -105,6 +105,14 @@ CREATE TABLE fs_chunk_hashes (
 	FOREIGN KEY(ChunkId) REFERENCES fs_chunks(Id)
 );
 
+-- This table stores the hashes of the uncompressed data of each chunk, so
+-- deployed files can be checked chunk by chunk
+CREATE TABLE fs_chunk_source_hashes (
+	ChunkId INTEGER PRIMARY KEY NOT NULL,
+	Hash BLOB NOT NULL,
+	FOREIGN KEY(ChunkId) REFERENCES fs_chunks(Id)
+);
+
 -- If populated, this table stores the encryption data for chunks
 CREATE TABLE fs_chunk_encryption (
 	ChunkId INTEGER PRIMARY KEY NOT NULL,
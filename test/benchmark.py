@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+# [LICENSE BEGIN]
+# kyla Copyright (C) 2016 Matthäus G. Chajdas
+#
+# This file is distributed under the BSD 2-clause license. See LICENSE for
+# details.
+# [LICENSE END]
+
+"""Benchmark installs from a web repository.
+
+A repository with incompressible files is built and served using
+httpserver.py. It is then installed once per simulated round trip time, and
+the install throughput is reported for each. With --min-throughput, the
+benchmark fails if any install is slower than that, so regressions in the
+remote path show up in CI."""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+from testrunner import KylaRunner
+
+FeatureId = '6f1e2c3d-8a4b-4c5d-9e6f-0a1b2c3d4e5f'
+GroupId = '7a2f3d4e-9b5c-4d6e-8f7a-1b2c3d4e5f6a'
+
+def GenerateFiles (directory, totalSize, seed):
+    """Create a mix of small and large files with incompressible contents,
+    about totalSize bytes in total. Returns the file names."""
+    os.makedirs (directory, exist_ok=True)
+
+    rng = random.Random (seed)
+    sizes = []
+    remaining = totalSize
+    while remaining > 0:
+        # Three quarters of the files are small, but most of the data is in
+        # the large ones
+        if rng.random () < 0.75:
+            size = rng.randint (1 << 10, 256 << 10)
+        else:
+            size = rng.randint (1 << 20, 16 << 20)
+        size = min (size, remaining)
+        sizes.append (size)
+        remaining -= size
+
+    filenames = []
+    for i, size in enumerate (sizes):
+        filename = '{}.bin'.format (i)
+        with open (os.path.join (directory, filename), 'wb') as outputFile:
+            outputFile.write (rng.getrandbits (size * 8).to_bytes (size, 'little'))
+        filenames.append (filename)
+
+    return filenames
+
+def WriteRepositoryDescription (path, filenames):
+    with open (path, 'w') as description:
+        description.write ('<?xml version="1.0" ?>\n<Repository>\n')
+        description.write ('\t<Features>\n\t\t<Feature Id="{}">\n'.format (FeatureId))
+        description.write ('\t\t\t<Reference Id="{}"/>\n'.format (GroupId))
+        description.write ('\t\t</Feature>\n\t</Features>\n')
+        description.write ('\t<Files>\n\t\t<Group Id="{}">\n'.format (GroupId))
+        for filename in filenames:
+            description.write ('\t\t\t<File Source="{}"/>\n'.format (filename))
+        description.write ('\t\t</Group>\n\t</Files>\n</Repository>\n')
+
+def StartServer (directory, requestLog, rtt, bandwidth):
+    server = subprocess.Popen ([sys.executable,
+        os.path.join (os.path.dirname (os.path.abspath (__file__)), 'httpserver.py'),
+        directory,
+        '--delay', str (rtt / 1000),
+        '--bandwidth', str (bandwidth),
+        '--request-log', requestLog],
+        stdout=subprocess.PIPE)
+    url = server.stdout.readline ().decode ('utf-8').strip ()
+    return server, url
+
+def CountRequests (requestLog):
+    if not os.path.exists (requestLog):
+        return 0
+    with open (requestLog, 'r') as log:
+        return sum (1 for line in log if json.loads (line) ['path'].endswith ('.kypkg'))
+
+def Benchmark (kyla, workingDirectory, repository, rtt, bandwidth, runs):
+    """Install the repository runs times and return the best time and the
+    package requests of the last run."""
+    bestTime = None
+    requests = 0
+
+    for run in range (runs):
+        target = os.path.join (workingDirectory, 'deploy')
+        requestLog = os.path.join (workingDirectory, 'requests-{}-{}.log'.format (rtt, run))
+        server, url = StartServer (repository, requestLog, rtt, bandwidth)
+
+        try:
+            startTime = time.perf_counter ()
+            if not kyla.Install (url, target, [FeatureId]):
+                return None, 0
+            elapsed = time.perf_counter () - startTime
+        finally:
+            server.terminate ()
+            server.wait ()
+
+        shutil.rmtree (target)
+
+        if bestTime is None or elapsed < bestTime:
+            bestTime = elapsed
+        requests = CountRequests (requestLog)
+
+    return bestTime, requests
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser (description='Benchmark installs from a web repository.')
+    parser.add_argument ('binary', metavar='BINARY', type=str,
+        help='Path to kcl binary')
+    parser.add_argument ('--rtt', type=str, default='0,10,50,100',
+        help='Comma-separated list of round trip times in milliseconds')
+    parser.add_argument ('--bandwidth', type=float, default=0,
+        help='Bandwidth limit in bytes per second, 0 for unlimited')
+    parser.add_argument ('--size', type=int, default=64,
+        help='Repository size in MiB')
+    parser.add_argument ('--runs', type=int, default=1,
+        help='Installs per round trip time, the fastest one is reported')
+    parser.add_argument ('--seed', type=int, default=0,
+        help='Seed for the repository contents')
+    parser.add_argument ('--min-throughput', type=float, default=0,
+        help='Fail if any install is slower than this many MiB/s')
+    parser.add_argument ('--json', type=str, default=None,
+        help='Write the results to this file')
+    parser.add_argument ('-v', '--verbose', action='store_true',
+        default=False, help='Enable verbose output')
+
+    args = parser.parse_args ()
+    kyla = KylaRunner (os.path.abspath (args.binary), verbose=args.verbose)
+    totalSize = args.size << 20
+    rtts = [float (rtt) for rtt in args.rtt.split (',')]
+
+    results = []
+    failures = 0
+
+    with tempfile.TemporaryDirectory () as workingDirectory:
+        sourceDirectory = os.path.join (workingDirectory, 'files')
+        filenames = GenerateFiles (sourceDirectory, totalSize, args.seed)
+
+        description = os.path.join (workingDirectory, 'repository.xml')
+        WriteRepositoryDescription (description, filenames)
+
+        repository = os.path.join (workingDirectory, 'repository')
+        if not kyla.BuildRepository (description, repository,
+                sourceDirectory=sourceDirectory):
+            print ('Could not build the repository')
+            sys.exit (1)
+
+        print ('{} files, {} MiB'.format (len (filenames), args.size))
+        print ('{:>8} {:>10} {:>10} {:>10}'.format ('RTT ms', 'Time s', 'MiB/s', 'Requests'))
+
+        for rtt in rtts:
+            elapsed, requests = Benchmark (kyla, workingDirectory, repository,
+                rtt, args.bandwidth, args.runs)
+
+            if elapsed is None:
+                print ('{:>8} {:>10}'.format (rtt, 'FAIL'))
+                failures += 1
+                continue
+
+            throughput = args.size / elapsed
+            print ('{:>8} {:>10.3f} {:>10.1f} {:>10}'.format (rtt, elapsed,
+                throughput, requests))
+
+            results.append ({'rtt' : rtt, 'time' : elapsed,
+                'throughput' : throughput, 'requests' : requests})
+
+            if throughput < args.min_throughput:
+                failures += 1
+
+    if args.json:
+        with open (args.json, 'w') as output:
+            json.dump ({'size' : totalSize, 'bandwidth' : args.bandwidth,
+                'results' : results}, output, indent=4)
+
+    sys.exit (failures)
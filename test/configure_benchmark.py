@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+# [LICENSE BEGIN]
+# kyla Copyright (C) 2016 Matthäus G. Chajdas
+#
+# This file is distributed under the BSD 2-clause license. See LICENSE for
+# details.
+# [LICENSE END]
+
+"""Benchmark configure on repositories with many files.
+
+Two versions of a repository with many small files are built. The second
+version changes, removes and adds a small fraction of the files. The first
+version is installed, configured again without any changes, and then updated
+to the second version, and the time of each step is reported. With
+--max-time, the benchmark fails if any step takes longer than that, so
+regressions which make configure scale badly show up in CI.
+
+With --files 500000 --file-size 1024, the benchmark measures the file system
+metadata overhead of deployments with many small files."""
+
+import argparse
+import json
+import os
+import sys
+import tempfile
+import time
+
+from testrunner import KylaRunner
+
+FeatureId = '3c9d5e7f-1a2b-4c3d-8e4f-5a6b7c8d9e0f'
+GroupId = '4d0e6f8a-2b3c-4d4e-9f5a-6b7c8d9e0f1a'
+
+# Files per directory, so directories don't get too large
+DirectorySize = 1000
+
+def GetFilename (index):
+    return os.path.join ('{}'.format (index // DirectorySize), '{}.txt'.format (index))
+
+def WriteFile (path, contents, fileSize):
+    # Padding keeps the contents unique
+    if len (contents) < fileSize:
+        contents += '.' * (fileSize - len (contents) - 1) + '\n'
+    with open (path, 'w') as outputFile:
+        outputFile.write (contents)
+
+def GenerateFiles (directory, fileCount, changedFraction, fileSize):
+    """Create the files for both versions. Returns the file names of the first
+    and the second version."""
+    changeInterval = max (int (1 / changedFraction), 1) if changedFraction > 0 else 0
+
+    firstVersion = []
+    secondVersion = []
+
+    for i in range (fileCount):
+        filename = GetFilename (i)
+        firstVersion.append (filename)
+
+        if changeInterval and i % changeInterval == 1:
+            # Removed in the second version
+            continue
+
+        if changeInterval and i % changeInterval == 0:
+            # Changed in the second version
+            secondFilename = os.path.join ('v2', filename)
+            os.makedirs (os.path.join (directory, os.path.dirname (secondFilename)),
+                exist_ok=True)
+            WriteFile (os.path.join (directory, secondFilename),
+                'File {} in the second version\n'.format (i), fileSize)
+            secondVersion.append ((filename, secondFilename))
+        else:
+            secondVersion.append ((filename, filename))
+
+    for i in range (fileCount):
+        filename = GetFilename (i)
+        os.makedirs (os.path.join (directory, os.path.dirname (filename)), exist_ok=True)
+        WriteFile (os.path.join (directory, filename),
+            'File {}\n'.format (i), fileSize)
+
+    # Added in the second version
+    if changeInterval:
+        for i in range (fileCount, fileCount + fileCount // changeInterval):
+            filename = GetFilename (i)
+            os.makedirs (os.path.join (directory, os.path.dirname (filename)), exist_ok=True)
+            WriteFile (os.path.join (directory, filename),
+                'File {}\n'.format (i), fileSize)
+            secondVersion.append ((filename, filename))
+
+    return [(f, f) for f in firstVersion], secondVersion
+
+def WriteRepositoryDescription (path, files):
+    with open (path, 'w') as description:
+        description.write ('<?xml version="1.0" ?>\n<Repository>\n')
+        description.write ('\t<Features>\n\t\t<Feature Id="{}">\n'.format (FeatureId))
+        description.write ('\t\t\t<Reference Id="{}"/>\n'.format (GroupId))
+        description.write ('\t\t</Feature>\n\t</Features>\n')
+        description.write ('\t<Files>\n\t\t<Group Id="{}">\n'.format (GroupId))
+        for target, source in files:
+            description.write ('\t\t\t<File Source="{}" Target="{}"/>\n'.format (
+                source, target))
+        description.write ('\t\t</Group>\n\t</Files>\n</Repository>\n')
+
+def Measure (function):
+    startTime = time.perf_counter ()
+    if not function ():
+        return None
+    return time.perf_counter () - startTime
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser (description='Benchmark configure on repositories with many files.')
+    parser.add_argument ('binary', metavar='BINARY', type=str,
+        help='Path to kcl binary')
+    parser.add_argument ('--files', type=int, default=1000000,
+        help='Number of files in the repository')
+    parser.add_argument ('--changed', type=float, default=0.01,
+        help='Fraction of files which are changed, removed and added in the second version')
+    parser.add_argument ('--file-size', type=int, default=0,
+        help='Pad every file to this many bytes')
+    parser.add_argument ('--max-time', type=float, default=0,
+        help='Fail if any step takes longer than this many seconds')
+    parser.add_argument ('--json', type=str, default=None,
+        help='Write the results to this file')
+    parser.add_argument ('-v', '--verbose', action='store_true',
+        default=False, help='Enable verbose output')
+
+    args = parser.parse_args ()
+    kyla = KylaRunner (os.path.abspath (args.binary), verbose=args.verbose)
+
+    results = []
+    failures = 0
+
+    with tempfile.TemporaryDirectory () as workingDirectory:
+        sourceDirectory = os.path.join (workingDirectory, 'files')
+        firstVersion, secondVersion = GenerateFiles (sourceDirectory,
+            args.files, args.changed, args.file_size)
+
+        repositories = []
+        for i, files in enumerate ([firstVersion, secondVersion]):
+            description = os.path.join (workingDirectory, 'repository-{}.xml'.format (i))
+            WriteRepositoryDescription (description, files)
+
+            repository = os.path.join (workingDirectory, 'repository-{}'.format (i))
+            if not kyla.BuildRepository (description, repository,
+                    sourceDirectory=sourceDirectory):
+                print ('Could not build the repository')
+                sys.exit (1)
+            repositories.append (repository)
+
+        target = os.path.join (workingDirectory, 'deploy')
+
+        steps = [
+            ('install', lambda: kyla.Install (repositories [0], target, [FeatureId])),
+            ('reconfigure', lambda: kyla.Configure (repositories [0], target, [FeatureId])),
+            ('update', lambda: kyla.Configure (repositories [1], target, [FeatureId]))
+        ]
+
+        print ('{} files, {} changed, {} bytes'.format (args.files, args.changed,
+            args.file_size))
+        print ('{:>12} {:>10}'.format ('Step', 'Time s'))
+
+        for name, step in steps:
+            elapsed = Measure (step)
+
+            if elapsed is None:
+                print ('{:>12} {:>10}'.format (name, 'FAIL'))
+                failures += 1
+                break
+
+            print ('{:>12} {:>10.3f}'.format (name, elapsed))
+            results.append ({'step' : name, 'time' : elapsed})
+
+            if args.max_time > 0 and elapsed > args.max_time:
+                failures += 1
+
+    if args.json:
+        with open (args.json, 'w') as output:
+            json.dump ({'files' : args.files, 'changed' : args.changed,
+                'fileSize' : args.file_size, 'results' : results}, output, indent=4)
+
+    sys.exit (failures)
@@ -0,0 +1,259 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+# [LICENSE BEGIN]
+# kyla Copyright (C) 2016 Matthäus G. Chajdas
+#
+# This file is distributed under the BSD 2-clause license. See LICENSE for
+# details.
+# [LICENSE END]
+
+"""Minimal HTTP server with range support, used as a stand-in for a web
+repository in tests and benchmarks.
+
+Requests for several ranges are answered according to --multi-range:
+'multipart' sends a multipart/byteranges response, 'first' only sends the
+first range, and 'full' ignores the ranges and sends the whole file. The
+latter two behave like servers without multipart support.
+
+Network conditions can be simulated: --delay adds latency to every request,
+--bandwidth limits the total throughput of all connections, and
+--failure-rate/--fail-after make package requests fail, either with an error
+status, by dropping the connection halfway through the body, or by sending
+more bytes than requested for a single range. Failures only affect packages,
+so the repository can still be opened."""
+
+import argparse
+import http.server
+import json
+import os
+import random
+import re
+import socket
+import sys
+import threading
+import time
+import uuid
+
+def ParseRanges (header, size):
+    """Parse a Range header into a list of inclusive (first, last) tuples.
+    Returns None if the header is invalid."""
+    if not header.startswith ('bytes='):
+        return None
+
+    ranges = []
+    for spec in header [len ('bytes='):].split (','):
+        m = re.match (r'^\s*(\d*)-(\d*)\s*$', spec)
+        if not m or (not m.group (1) and not m.group (2)):
+            return None
+        if m.group (1):
+            first = int (m.group (1))
+            last = int (m.group (2)) if m.group (2) else size - 1
+        else:
+            # Suffix range, i.e. the last n bytes
+            first = max (0, size - int (m.group (2)))
+            last = size - 1
+        if first >= size or last < first:
+            continue
+        ranges.append ((first, min (last, size - 1)))
+    return ranges
+
+class RangeRequestHandler (http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message (self, format, *args):
+        pass
+
+    def _LogRequest (self, rangeCount, size=0):
+        if not self.server.requestLog:
+            return
+        with self.server.logLock:
+            with open (self.server.requestLog, 'a') as log:
+                log.write (json.dumps ({'path' : self.path,
+                    'ranges' : rangeCount, 'bytes' : size}) + '\n')
+
+    def _SendBody (self, status, headers, body, disconnect=False):
+        self.send_response (status)
+        for k, v in headers:
+            self.send_header (k, v)
+        self.send_header ('Content-Length', str (len (body)))
+        self.end_headers ()
+        if self.command == 'HEAD':
+            return
+
+        if disconnect:
+            # Send half of the body, then drop the connection
+            self._Write (body [:len (body) // 2])
+            self.wfile.flush ()
+            self.connection.shutdown (socket.SHUT_RDWR)
+            self.close_connection = True
+            return
+
+        self._Write (body)
+
+    def _Write (self, data):
+        if not self.server.bandwidth:
+            self.wfile.write (data)
+            return
+
+        # All connections share the bandwidth, so every block gets a slot
+        # after the previously scheduled one
+        blockSize = 16 << 10
+        for offset in range (0, len (data), blockSize):
+            block = data [offset:offset + blockSize]
+            with self.server.bandwidthLock:
+                start = max (time.monotonic (), self.server.nextSendTime)
+                self.server.nextSendTime = start + len (block) / self.server.bandwidth
+            delay = self.server.nextSendTime - time.monotonic ()
+            if delay > 0:
+                time.sleep (delay)
+            self.wfile.write (block)
+
+    def _ShouldFail (self):
+        if not self.path.endswith ('.kypkg'):
+            return False
+
+        with self.server.logLock:
+            if self.server.failAfter is not None:
+                self.server.failAfter -= 1
+                if self.server.failAfter < 0:
+                    return True
+            return self.server.random.random () < self.server.failureRate
+
+    def do_HEAD (self):
+        self.do_GET ()
+
+    def do_GET (self):
+        if self.server.delay:
+            time.sleep (self.server.delay)
+
+        disconnect = False
+        excess = False
+        if self._ShouldFail ():
+            if self.server.failureMode == 'status':
+                self._LogRequest (0)
+                self._SendBody (503, [], b'')
+                return
+            elif self.server.failureMode == 'excess':
+                excess = True
+            else:
+                disconnect = True
+
+        path = os.path.join (self.server.directory,
+            self.path.split ('?') [0].lstrip ('/'))
+
+        if not os.path.isfile (path):
+            self._LogRequest (0)
+            self._SendBody (404, [], b'')
+            return
+
+        with open (path, 'rb') as f:
+            data = f.read ()
+
+        rangeHeader = self.headers.get ('Range')
+        if not rangeHeader:
+            self._LogRequest (0, len (data))
+            self._SendBody (200, [('Content-Type', 'application/octet-stream')],
+                data, disconnect)
+            return
+
+        ranges = ParseRanges (rangeHeader, len (data))
+        if ranges is None:
+            self._LogRequest (0, len (data))
+        else:
+            self._LogRequest (len (ranges),
+                sum (last - first + 1 for first, last in ranges))
+
+        if ranges is None:
+            self._SendBody (200, [('Content-Type', 'application/octet-stream')],
+                data, disconnect)
+            return
+
+        if not ranges:
+            self._SendBody (416, [('Content-Range', 'bytes */{}'.format (len (data)))], b'')
+            return
+
+        if len (ranges) > 1:
+            if self.server.multiRange == 'full':
+                self._SendBody (200, [('Content-Type', 'application/octet-stream')],
+                    data, disconnect)
+                return
+            elif self.server.multiRange == 'first':
+                ranges = ranges [:1]
+
+        if len (ranges) == 1:
+            first, last = ranges [0]
+            body = data [first:last + 1]
+            if excess:
+                body += b'\0' * 16
+            self._SendBody (206, [
+                ('Content-Type', 'application/octet-stream'),
+                ('Content-Range', 'bytes {}-{}/{}'.format (first, last, len (data)))],
+                body, disconnect)
+            return
+
+        boundary = uuid.uuid4 ().hex
+        body = b''
+        for first, last in ranges:
+            body += '--{}\r\nContent-Type: application/octet-stream\r\nContent-Range: bytes {}-{}/{}\r\n\r\n'.format (
+                boundary, first, last, len (data)).encode ('ascii')
+            body += data [first:last + 1] + b'\r\n'
+        body += '--{}--\r\n'.format (boundary).encode ('ascii')
+
+        self._SendBody (206, [('Content-Type',
+            'multipart/byteranges; boundary={}'.format (boundary))], body,
+            disconnect)
+
+class RangeServer (http.server.ThreadingHTTPServer):
+    daemon_threads = True
+
+    def handle_error (self, request, client_address):
+        # Clients abort transfers once they have all data they need
+        if isinstance (sys.exc_info () [1], ConnectionError):
+            return
+        super ().handle_error (request, client_address)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser (description='Serve a directory with HTTP range support.')
+    parser.add_argument ('directory', metavar='DIRECTORY', type=str)
+    parser.add_argument ('-p', '--port', type=int, default=0,
+        help='Port to listen on, 0 picks a free port')
+    parser.add_argument ('--multi-range', choices=['multipart', 'first', 'full'],
+        default='multipart', help='How to answer requests for several ranges')
+    parser.add_argument ('--delay', type=float, default=0,
+        help='Delay in seconds before answering a request, to simulate latency')
+    parser.add_argument ('--bandwidth', type=float, default=0,
+        help='Limit the total throughput to this many bytes per second')
+    parser.add_argument ('--fail-after', type=int, default=None,
+        help='Fail all package requests after this many, to simulate a network failure')
+    parser.add_argument ('--failure-rate', type=float, default=0,
+        help='Probability of a package request failing')
+    parser.add_argument ('--failure-mode', choices=['status', 'disconnect', 'excess'],
+        default='status', help='Fail by answering with 503, by dropping the connection, or by sending too many bytes')
+    parser.add_argument ('--seed', type=int, default=None,
+        help='Seed for the failure injection')
+    parser.add_argument ('--request-log', type=str, default=None,
+        help='Append one JSON line per request to this file')
+
+    args = parser.parse_args ()
+
+    server = RangeServer (('127.0.0.1', args.port), RangeRequestHandler)
+    server.directory = os.path.abspath (args.directory)
+    server.multiRange = args.multi_range
+    server.delay = args.delay
+    server.bandwidth = args.bandwidth
+    server.bandwidthLock = threading.Lock ()
+    server.nextSendTime = 0
+    server.failAfter = args.fail_after
+    server.failureRate = args.failure_rate
+    server.failureMode = args.failure_mode
+    server.random = random.Random (args.seed)
+    server.requestLog = args.request_log
+    server.logLock = threading.Lock ()
+
+    # The first line tells the caller where to connect
+    print ('http://127.0.0.1:{}/'.format (server.server_address [1]), flush=True)
+
+    try:
+        server.serve_forever ()
+    except KeyboardInterrupt:
+        pass
@@ -51,23 +51,29 @@ class KylaRunner:
             PrintOutput (result)
         return result.returncode == 0
 
-    def Install(self, source, target, features=[], key=None):
-        return self._ExecuteAction ('install', source, target, features, key)
+    def Install(self, source, target, features=[], key=None, options=[]):
+        return self._ExecuteAction ('install', source, target, features, key, options)
 
-    def Configure(self, source, target, features=[], key=None):
-        return self._ExecuteAction ('configure', source, target, features, key)
+    def Configure(self, source, target, features=[], key=None, options=[]):
+        return self._ExecuteAction ('configure', source, target, features, key, options)
 
-    def Validate(self, source, target, features=[], key=None):
-        return self._ExecuteAction ('validate', source, target, features, key)
+    def Validate(self, source, target, features=[], key=None, options=[]):
+        return self._ExecuteAction ('validate', source, target, features, key, options)
+
+    def Repair(self, source, target, key=None, options=[]):
+        return self._ExecuteAction ('repair', source, target, [], key, options)
 
     def Query (self, path, query, queryArgs = [], key=None):
         return self._ExecuteQuery (query, queryArgs, path)
 
-    def _ExecuteAction(self, action, source, target, features, key):
+    def _ExecuteAction(self, action, source, target, features, key, options=[]):
+        self.lastOutput = []
         args = [self._kcl, action]
         if key:
             args += ['--key', key]
 
+        args += options
+
         args +=  [source, target]
         
         if action == 'validate':
@@ -83,6 +89,7 @@ class KylaRunner:
             if self._verbose:
                 print ('Result:', result.returncode)
                 PrintOutput (result)
+            self.lastOutput = result.stdout.decode ('utf-8').splitlines ()
             return result.returncode == 0
         except:
             if self._verbose:
@@ -118,10 +125,37 @@ class TestEnvironment:
         self.kyla = kyla
         self.workingDirectory = os.path.abspath ('.')
         self._errorLog = io.StringIO()
+        self.servers = []
+        self.serverUrls = []
+        self.requestLogs = []
 
     def LogError (self, *args):
         self._errorLog.write (' '.join (map (str, args)) + '\n')
 
+    def GetRepositoryPath (self, path):
+        """Resolve a repository path. '$server' refers to the repository
+        served by the last started HTTP server, '$server0' to the one served
+        by the first server and so on. Mirrors are separated by '|'."""
+        if '|' in path:
+            return '|'.join ([self.GetRepositoryPath (p) for p in path.split ('|')])
+        if path == '$server':
+            return self.serverUrls [-1]
+        if path.startswith ('$server'):
+            return self.serverUrls [int (path [len ('$server'):])]
+        return os.path.join (self.testDirectory, path)
+
+    def GetOptions (self, args):
+        """Get the command line options of an action. '$test' is replaced
+        with the test directory."""
+        return [option.replace ('$test', self.testDirectory)
+            for option in args.get ('options', [])]
+
+    def StopServers (self):
+        for server in self.servers:
+            server.terminate ()
+            server.wait ()
+        self.servers = []
+
 class TestAction:
     def Execute (self, env : TestEnvironment, args):
         pass
@@ -134,13 +168,15 @@ class GenerateRepositoryAction (TestAction):
 
         if sourceDirectory:
             sourceDirectory = os.path.join (env.workingDirectory, 'tests', sourceDirectory)
+        elif 'generated-source-directory' in args:
+            sourceDirectory = os.path.join (env.testDirectory, args ['generated-source-directory'])
 
         return env.kyla.BuildRepository (source,
             target, sourceDirectory = sourceDirectory)
 
 class CheckRepositoryFeaturesPresentAction (TestAction):
     def Execute(self, env : TestEnvironment, args):
-        path = os.path.join (env.testDirectory, args ['path'])
+        path = env.GetRepositoryPath (args ['path'])
         
         ok, features = env.kyla.Query (path, 'query-repository', ['features'])
 
@@ -151,7 +187,7 @@ class CheckRepositoryFeaturesPresentAction (TestAction):
 
 class CheckSubfeaturesFeaturesPresentAction (TestAction):
     def Execute(self, env : TestEnvironment, args):
-        path = os.path.join (env.testDirectory, args ['path'])
+        path = env.GetRepositoryPath (args ['path'])
         
         ok, features = env.kyla.Query (path, 'query-feature', 
             ['subfeatures', args ['id']])
@@ -161,34 +197,58 @@ class CheckSubfeaturesFeaturesPresentAction (TestAction):
         else:
             return set (args ['subfeatures']) == set (features)
 
+def CheckDeployedOrder (env : TestEnvironment, args):
+    """If 'deployed-order' is set, check the files were reported as deployed
+    in exactly this order."""
+    if 'deployed-order' not in args:
+        return True
+
+    deployed = [line [len ('DEPLOYED '):] for line in env.kyla.lastOutput
+        if line.startswith ('DEPLOYED ')]
+    if deployed != args ['deployed-order']:
+        env.LogError ('Wrong deploy order', deployed)
+        return False
+    return True
+
 class InstallAction (TestAction):
     def Execute(self, env : TestEnvironment, args):
-        source = os.path.join (env.testDirectory, args ['source'])
+        source = env.GetRepositoryPath (args ['source'])
         target = os.path.join (env.testDirectory, args ['target'])
         features = args ['features']
 
-        return env.kyla.Install (source, target, features, args.get ('key', None))
+        return env.kyla.Install (source, target, features, args.get ('key', None),
+            env.GetOptions (args)) and CheckDeployedOrder (env, args)
 
 class ConfigureAction (TestAction):
     def Execute(self, env : TestEnvironment, args):
-        source = os.path.join (env.testDirectory, args ['source'])
+        source = env.GetRepositoryPath (args ['source'])
         target = os.path.join (env.testDirectory, args ['target'])
         features = args ['features']
 
-        return env.kyla.Configure (source, target, features, args.get ('key', None))
+        return env.kyla.Configure (source, target, features, args.get ('key', None),
+            env.GetOptions (args)) and CheckDeployedOrder (env, args)
 
 class ValidateAction (TestAction):
     def Execute(self, env : TestEnvironment, args):
-        source = os.path.join (env.testDirectory, args ['source'])
-        target = os.path.join (env.testDirectory, args ['target'])
+        source = env.GetRepositoryPath (args ['source'])
+        target = env.GetRepositoryPath (args ['target'])
         features = args ['features']
 
-        result = env.kyla.Validate (source, target, features, args.get ('key', None))
+        result = env.kyla.Validate (source, target, features, args.get ('key', None),
+            env.GetOptions (args))
         if args.get ('result', 'pass') == 'pass':
             return result
         else:
             return not result
 
+class RepairAction (TestAction):
+    def Execute(self, env : TestEnvironment, args):
+        source = env.GetRepositoryPath (args ['source'])
+        target = os.path.join (env.testDirectory, args ['target'])
+
+        return env.kyla.Repair (source, target, args.get ('key', None),
+            env.GetOptions (args))
+
 class ZeroFileAction (TestAction):
     def Execute (self, env : TestEnvironment, args):
         blockSize = 1 << 20 # 1 MiB sized blocks
@@ -263,17 +323,128 @@ class TruncateFileAction (TestAction):
 
         return True
 
+class GenerateFilesAction (TestAction):
+    """Create files with deterministic, incompressible contents."""
+    def Execute (self, env : TestEnvironment, args):
+        directory = os.path.join (env.testDirectory, args ['directory'])
+        os.makedirs (directory, exist_ok=True)
+
+        for filename, size in args ['files'].items ():
+            blocks = []
+            for i in range ((size + 31) // 32):
+                blocks.append (hashlib.sha256 ('{}:{}'.format (filename, i).encode ('utf-8')).digest ())
+            with open (os.path.join (directory, filename), 'wb') as outputFile:
+                outputFile.write (b''.join (blocks) [:size])
+
+        return True
+
+class CheckFingerprintsAction (TestAction):
+    """Check that the fingerprints recorded in a deployed repository match
+    the deployed files, so a quick validation doesn't need to hash them.
+    Change times and inodes recorded as 0 are not checked."""
+    def Execute (self, env : TestEnvironment, args):
+        import sqlite3
+        directory = os.path.join (env.testDirectory, args ['directory'])
+        db = sqlite3.connect (os.path.join (directory, 'k.db'))
+        fingerprints = db.execute ('SELECT Path, Size, ModificationTime, '
+            'ChangeTime, Inode FROM fs_file_fingerprints').fetchall ()
+        db.close ()
+
+        if not fingerprints:
+            env.LogError ('No fingerprints recorded')
+            return False
+
+        for path, size, modificationTime, changeTime, inode in fingerprints:
+            stat = os.stat (os.path.join (directory, path))
+            if stat.st_size != size or stat.st_mtime_ns != modificationTime \
+                or (changeTime != 0 and stat.st_ctime_ns != changeTime) \
+                or (inode != 0 and stat.st_ino != inode):
+                env.LogError ('Outdated fingerprint for', path)
+                return False
+
+        return True
+
+class StartHttpServerAction (TestAction):
+    """Serve a directory using httpserver.py. The repository can then be
+    accessed using '$server' as the path. Latency, bandwidth limits and
+    failures can be set using the httpserver.py options."""
+    def Execute (self, env : TestEnvironment, args):
+        directory = os.path.join (env.testDirectory, args ['directory'])
+        requestLog = os.path.join (env.testDirectory,
+            'requests-{}.log'.format (len (env.servers)))
+        env.requestLogs.append (requestLog)
+
+        serverArgs = [sys.executable,
+            os.path.join (env.workingDirectory, 'httpserver.py'),
+            directory,
+            '--multi-range', args.get ('multi-range', 'multipart'),
+            '--request-log', requestLog]
+
+        # Network conditions are passed through as is
+        for option in ['delay', 'bandwidth', 'fail-after', 'failure-rate',
+                'failure-mode', 'seed']:
+            if option in args:
+                serverArgs += ['--' + option, str (args [option])]
+
+        server = subprocess.Popen (serverArgs, stdout=subprocess.PIPE)
+        env.servers.append (server)
+        env.serverUrls.append (server.stdout.readline ().decode ('utf-8').strip ())
+
+        return env.serverUrls [-1].startswith ('http://')
+
+class CheckHttpRequestsAction (TestAction):
+    """Check the requests made to an HTTP server, by default the last
+    started one."""
+    def Execute (self, env : TestEnvironment, args):
+        requestLog = env.requestLogs [args.get ('server', -1)]
+        requests = []
+        if os.path.exists (requestLog):
+            with open (requestLog, 'r') as log:
+                requests = [json.loads (line) for line in log]
+        requests = [r for r in requests if r ['path'] == args ['path']]
+
+        if 'min-ranges' in args:
+            maxRanges = max ([r ['ranges'] for r in requests], default=0)
+            if maxRanges < args ['min-ranges']:
+                env.LogError ('Expected a request with at least',
+                    args ['min-ranges'], 'ranges, got', maxRanges)
+                return False
+
+        if 'min-requests' in args and len (requests) < args ['min-requests']:
+            env.LogError ('Expected at least', args ['min-requests'],
+                'requests, got', len (requests))
+            return False
+
+        if 'max-requests' in args and len (requests) > args ['max-requests']:
+            env.LogError ('Expected at most', args ['max-requests'],
+                'requests, got', len (requests))
+            return False
+
+        # The requested bytes, the server may send more
+        requestedBytes = sum ([r ['bytes'] for r in requests])
+        if 'max-bytes' in args and requestedBytes > args ['max-bytes']:
+            env.LogError ('Expected at most', args ['max-bytes'],
+                'bytes to be requested, got', requestedBytes)
+            return False
+
+        return True
+
 actions = {
     'generate-repository' : GenerateRepositoryAction,
     'install' : InstallAction,
     'configure' : ConfigureAction,
     'validate' : ValidateAction,
+    'repair' : RepairAction,
     'check-hash' : CheckHashAction,
     'check-not-existant' : CheckNotExistantAction,
     'check-existant' : CheckExistantAction,
     'zero-file' : ZeroFileAction,
     'damage-file' : DamageFileAction,
     'truncate-file' : TruncateFileAction,
+    'generate-files' : GenerateFilesAction,
+    'start-http-server' : StartHttpServerAction,
+    'check-http-requests' : CheckHttpRequestsAction,
+    'check-fingerprints' : CheckFingerprintsAction,
     'check-features-present' : CheckRepositoryFeaturesPresentAction,
     'check-subfeatures-present' : CheckSubfeaturesFeaturesPresentAction
 }
@@ -294,6 +465,12 @@ class Test:
 
     def __Execute (self, tempDir):
         env = TestEnvironment (self.__kyla, tempDir)
+        try:
+            return self.__ExecuteActions (env)
+        finally:
+            env.StopServers ()
+
+    def __ExecuteActions (self, env):
         for action in self.__test ['actions']:
             a = actions [action ['name']] ()
             args = action ['args']